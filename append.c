@@ -1,5 +1,284 @@
 #include "weekly.h"
 
+const char *FMT_HEADER = "## date:   %s\n"
+                         "## time:   %s\n"
+                         "## author: %s\n"
+                         "## host:   %s\n";
+
+// Format of records written to new (empty) files. Existing files keep the
+// format of their first record.
+int record_format = RECORD_FORMAT_V1;
+
+#define APPEND_PARTS_MAX 8
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+// Split a record into the pieces written for the given format. "frame"
+// receives the version 2 length prefix. Returns the number of parts, or -1
+// (EFBIG) when a length does not fit the prefix.
+static int append_parts(int format, const char *header, const char *data, size_t data_len,
+                        unsigned char *frame, const char **parts, size_t *lengths) {
+    size_t header_len;
+    int n;
+
+    n = 0;
+    header_len = strlen(header);
+    if (format == RECORD_FORMAT_V2) {
+        if ((uint64_t) header_len > UINT32_MAX || (uint64_t) data_len > UINT32_MAX) {
+            errno = EFBIG;
+            return -1;
+        }
+        memcpy(frame, RECORD_V2_MAGIC, RECORD_V2_MAGIC_SIZE);
+        put_u32(frame + 4, (uint32_t) header_len);
+        put_u32(frame + 8, (uint32_t) data_len);
+        parts[n] = (const char *) frame; lengths[n++] = RECORD_V2_FRAME_SIZE;
+        parts[n] = header; lengths[n++] = header_len;
+        parts[n] = data; lengths[n++] = data_len;
+        return n;
+    }
+
+    // Each block is followed by a line feed
+    parts[n] = RECORD_SOH; lengths[n++] = 3;
+    parts[n] = header; lengths[n++] = header_len;
+    parts[n] = RECORD_SOT "\n"; lengths[n++] = 4;
+    parts[n] = data; lengths[n++] = data_len;
+    parts[n] = "\n" RECORD_EOT "\n"; lengths[n++] = 5;
+    return n;
+}
+
+// Determine the format of the records in an open journal file
+static int append_format(int fd) {
+    char magic[RECORD_V2_MAGIC_SIZE];
+    off_t size;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        return record_format;
+    }
+    if (lseek(fd, 0, SEEK_SET) < 0 || read(fd, magic, sizeof(magic)) != (ssize_t) sizeof(magic)) {
+        return RECORD_FORMAT_V1;
+    }
+    return memcmp(magic, RECORD_V2_MAGIC, RECORD_V2_MAGIC_SIZE) ? RECORD_FORMAT_V1 : RECORD_FORMAT_V2;
+}
+
+int append_encode(struct Buffer *buffer, int format, const char *header, const char *data, size_t data_len) {
+    unsigned char frame[RECORD_V2_FRAME_SIZE];
+    const char *parts[APPEND_PARTS_MAX];
+    size_t lengths[APPEND_PARTS_MAX];
+    int nparts;
+
+    nparts = append_parts(format, header, data, data_len, frame, parts, lengths);
+    if (nparts < 0) {
+        return -1;
+    }
+    for (int i = 0; i < nparts; i++) {
+        if (buffer_append(buffer, parts[i], lengths[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Report where a record of "total" bytes that was just written through an
+// O_APPEND descriptor starts
+static int append_offset(int fd, ssize_t written, size_t total, uint64_t *offset) {
+    off_t end;
+
+    if (written < 0 || (size_t) written != total) {
+        if (written >= 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    // With O_APPEND the file offset now points at the end of the record
+    end = lseek(fd, 0, SEEK_CUR);
+    if (end < 0) {
+        return -1;
+    }
+    if (offset) {
+        *offset = (uint64_t) end - total;
+    }
+    return 0;
+}
+
+int append_write(int fd, const char *data, size_t len, uint64_t *offset) {
+    ssize_t written;
+
+    written = write(fd, data, (unsigned int) len);
+    return append_offset(fd, written, len, offset);
+}
+
+int append_record(const char *filename, const char *header, const char *data, size_t data_len, uint64_t *offset) {
+    int fd;
+
+    fd = open(filename, O_RDWR | O_APPEND | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    return append_record_fd(fd, header, data, data_len, offset);
+}
+
+// Append a record to an O_APPEND descriptor, which is closed afterwards
+int append_record_fd(int fd, const char *header, const char *data, size_t data_len, uint64_t *offset) {
+    unsigned char frame[RECORD_V2_FRAME_SIZE];
+    const char *parts[APPEND_PARTS_MAX];
+    size_t lengths[APPEND_PARTS_MAX];
+    int nparts;
+    size_t total;
+    ssize_t written;
+    int status;
+
+    nparts = append_parts(append_format(fd), header, data, data_len, frame, parts, lengths);
+    if (nparts < 0) {
+        close(fd);
+        errno = EFBIG;
+        return -1;
+    }
+    total = 0;
+    for (int i = 0; i < nparts; i++) {
+        total += lengths[i];
+    }
+
+#if HAVE_WINDOWS
+    char *buf;
+    size_t pos;
+
+    buf = malloc(total);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+    pos = 0;
+    for (int i = 0; i < nparts; i++) {
+        memcpy(buf + pos, parts[i], lengths[i]);
+        pos += lengths[i];
+    }
+    written = write(fd, buf, (unsigned int) total);
+    free(buf);
+#else
+    struct iovec iov[APPEND_PARTS_MAX];
+
+    for (int i = 0; i < nparts; i++) {
+        iov[i].iov_base = (void *) parts[i];
+        iov[i].iov_len = lengths[i];
+    }
+    // O_APPEND places the whole record at the end of the file in one step,
+    // so records from concurrent writers never interleave
+    written = writev(fd, iov, nparts);
+#endif
+
+    status = append_offset(fd, written, total, offset);
+    if (close(fd) < 0) {
+        status = -1;
+    }
+    return status;
+}
+
+void append_cache_init(struct AppendCache *cache, const char *root) {
+    memset(cache, 0, sizeof(*cache));
+    path_cache_init(&cache->paths, root);
+    for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+        cache->entries[i].fd = -1;
+        cache->locks[i].fd = -1;
+    }
+}
+
+// Close every cached descriptor and release the locks of their years
+static int append_cache_release(struct AppendCache *cache) {
+    int status;
+
+    status = 0;
+    for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+        if (cache->entries[i].fd >= 0 && close(cache->entries[i].fd) < 0) {
+            status = -1;
+        }
+        file_unlock(cache->locks[i].fd);
+    }
+    path_cache_close(&cache->paths);
+    append_cache_init(cache, cache->paths.root);
+    return status;
+}
+
+// Hold the shared lock of a year for as long as descriptors of its files
+// are cached, restoring the week first when it was compacted. That needs
+// the exclusive lock, so every descriptor and lock is released beforehand.
+static int append_cache_lock(struct AppendCache *cache, int year, int week) {
+    char path[PATH_MAX] = {0};
+    int slot;
+
+    slot = -1;
+    for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+        if (cache->locks[i].fd >= 0 && cache->locks[i].year == year) {
+            segment_path(path, cache->paths.root, year, week);
+            if (access(path, F_OK) < 0) {
+                return 0;
+            }
+            break;
+        }
+        if (slot < 0 && cache->locks[i].fd < 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        if (append_cache_release(cache) < 0) {
+            return -1;
+        }
+        slot = 0;
+    }
+    if ((cache->locks[slot].fd = segment_lock_week(cache->paths.root, year, week)) < 0) {
+        return -1;
+    }
+    cache->locks[slot].year = year;
+    return 0;
+}
+
+// Return an O_APPEND descriptor for a day file, opening it when it is not
+// cached. Missing directories are created when "create" is set, and a
+// compacted week is restored. The descriptor remains owned by the cache.
+int append_cache_open(struct AppendCache *cache, int year, int week, int day, int create, int *format) {
+    int slot;
+
+    slot = 0;
+    for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+        if (cache->entries[i].fd >= 0 && cache->entries[i].year == year
+            && cache->entries[i].week == week && cache->entries[i].day == day) {
+            cache->entries[i].used = ++cache->clock;
+            *format = cache->entries[i].format;
+            return cache->entries[i].fd;
+        }
+        if (cache->entries[i].used < cache->entries[slot].used) {
+            slot = i;
+        }
+    }
+
+    if (append_cache_lock(cache, year, week) < 0) {
+        return -1;
+    }
+    if (cache->entries[slot].fd >= 0 && close(cache->entries[slot].fd) < 0) {
+        return -1;
+    }
+    cache->entries[slot].fd = path_cache_open(&cache->paths, year, week, day, O_RDWR | O_APPEND | O_CREAT | O_BINARY, 0644, create);
+    if (cache->entries[slot].fd < 0) {
+        cache->entries[slot].used = 0;
+        return -1;
+    }
+    cache->entries[slot].year = year;
+    cache->entries[slot].week = week;
+    cache->entries[slot].day = day;
+    cache->entries[slot].format = append_format(cache->entries[slot].fd);
+    *format = cache->entries[slot].format;
+    cache->entries[slot].used = ++cache->clock;
+    return cache->entries[slot].fd;
+}
+
+int append_cache_close(struct AppendCache *cache) {
+    return append_cache_release(cache);
+}
+
 int append_stdin(const char *filename) {
     FILE *fp;
     size_t bufsz;
@@ -34,6 +313,7 @@ int append_stdin(const char *filename) {
 
 int append_contents(const char *dest, const char *src) {
     char buf[BUFSIZ] = {0};
+    size_t count;
     FILE *fpi, *fpo;
 
     fpi = fopen(src, "rb+");
@@ -49,9 +329,9 @@ int append_contents(const char *dest, const char *src) {
         return -1;
     }
 
-    // Append source file to destination file
-    while (fread(buf, sizeof(char), sizeof(buf), fpi) > 0) {
-        fwrite(buf, sizeof(char), strlen(buf), fpo);
+    // Append source file to destination file (the data may contain NUL bytes)
+    while ((count = fread(buf, sizeof(char), sizeof(buf), fpi)) > 0) {
+        fwrite(buf, sizeof(char), count, fpo);
     }
     buf[0] = '\n';
     fwrite(buf, sizeof(char), 1, fpo);
@@ -0,0 +1,156 @@
+#include "bench.h"
+
+static const char *WORDS[] = {
+    "the", "build", "release", "review", "meeting", "fixed", "a", "regression", "in",
+    "pipeline", "notes", "with", "team", "deployed", "tested", "and", "documented",
+    "investigated", "failure", "on", "cluster", "updated", "dependencies", "for",
+    "customer", "report", "wrote", "tests", "refactored", "parser", "benchmark", "to",
+};
+
+static unsigned long bench_seed = 1;
+
+double bench_now(void) {
+#if HAVE_WINDOWS
+    return (double) clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#endif
+}
+
+// Repeatable pseudo-random numbers, so runs can be compared
+unsigned long bench_rand(void) {
+    bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return bench_seed >> 33;
+}
+
+// Compose a message of common words. Sizes are skewed: most messages are
+// shorter than "mean" and about one in twenty is several times longer.
+void bench_message(struct Buffer *message, size_t mean) {
+    size_t size;
+    size_t column;
+
+    if (bench_rand() % 20 == 0) {
+        size = mean * (2 + bench_rand() % 6);
+    } else {
+        size = mean / 4 + bench_rand() % (mean + 1);
+    }
+
+    message->len = 0;
+    column = 0;
+    while (message->len < size) {
+        const char *word = WORDS[bench_rand() % (sizeof(WORDS) / sizeof(*WORDS))];
+        if (message->len) {
+            buffer_append(message, column > 72 ? "\n" : " ", 1);
+            column = column > 72 ? 0 : column + 1;
+        }
+        buffer_append(message, word, strlen(word));
+        column += strlen(word);
+    }
+}
+
+// Write the journal one day file at a time. The day's records are spread
+// over working hours, weeks are numbered per ISO 8601, and the indexes are
+// rebuilt at the end.
+void bench_generate(struct BenchJournal *journal) {
+    struct Buffer header;
+    struct Buffer message;
+    struct Buffer day;
+    char path[PATH_MAX];
+
+    buffer_init(&header);
+    buffer_init(&message);
+    buffer_init(&day);
+    make_path(journal->root);
+    calendar_mark(journal->root);
+
+    for (int y = journal->first_year; y < journal->first_year + journal->years; y++) {
+        struct tm start;
+        time_t t;
+
+        memset(&start, 0, sizeof(start));
+        start.tm_year = y - 1900;
+        start.tm_mday = 1;
+        start.tm_hour = 12;
+        start.tm_isdst = -1;
+        for (t = mktime(&start); t != (time_t) -1; t = calendar_next_day(t)) {
+            char datestamp[255] = {0};
+            struct tm *tm_;
+            int year, week, day_of_week;
+            FILE *fp;
+
+            tm_ = localtime(&t);
+            if (tm_->tm_year + 1900 != y) {
+                break;
+            }
+            strftime(datestamp, sizeof(datestamp) - 1, "%m/%d/%Y", tm_);
+            calendar_locate(t, &year, &week, &day_of_week);
+
+            day.len = 0;
+            for (int i = 0; i < journal->entries; i++) {
+                char timestamp[32];
+                char author[32];
+                char host[64];
+                int seconds = 8 * 3600 + (int) ((long) i * 10 * 3600 / journal->entries);
+                int user = (int) (bench_rand() % (unsigned long) journal->users);
+
+                sprintf(timestamp, "%02d:%02d:%02d", seconds / 3600, seconds / 60 % 60, seconds % 60);
+                sprintf(author, "user%d", user);
+                sprintf(host, "host%d.example.com", user);
+                header.len = 0;
+                buffer_printf(&header, FMT_HEADER, datestamp, timestamp, author, host);
+                (journal->message ? journal->message : bench_message)(&message, journal->message_size);
+                append_encode(&day, journal->format, header.data, message.data, message.len);
+            }
+
+            make_output_path(journal->root, path, year, week, day_of_week);
+            fp = fopen(path, "ab");
+            if (!fp || fwrite(day.data, 1, day.len, fp) != day.len || fclose(fp) != 0) {
+                perror(path);
+                exit(1);
+            }
+            journal->records += (size_t) journal->entries;
+            journal->bytes += day.len;
+            if (year == journal->first_year + journal->years - 1 && week == journal->week) {
+                journal->week_records += (size_t) journal->entries;
+                journal->week_bytes += day.len;
+            }
+        }
+    }
+    index_rebuild_all(journal->root);
+
+    buffer_free(&header);
+    buffer_free(&message);
+    buffer_free(&day);
+}
+
+// Remove a generated journal (left in place on Windows)
+void bench_remove_tree(const char *path) {
+#if HAVE_WINDOWS
+    fprintf(stderr, "Journal left in %s\n", path);
+#else
+    struct dirent *dp;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (dir) {
+        while ((dp = readdir(dir)) != NULL) {
+            char child[PATH_MAX];
+            struct stat st;
+
+            if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+                continue;
+            }
+            snprintf(child, sizeof(child), "%s%c%s", path, DIRSEP_C, dp->d_name);
+            if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+                bench_remove_tree(child);
+            } else {
+                unlink(child);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+#endif
+}
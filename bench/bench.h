@@ -0,0 +1,31 @@
+// Helpers shared by the benchmark programs
+#ifndef WEEKLY_BENCH_H
+#define WEEKLY_BENCH_H
+#include "weekly.h"
+
+// A synthetic journal written by bench_generate()
+struct BenchJournal {
+    char root[PATH_MAX];
+    int first_year;
+    int years;                  // every day of years first_year and later
+    int entries;                // records per day
+    int users;                  // authors, each on their own host
+    int format;                 // RECORD_FORMAT_*
+    size_t message_size;        // mean message size
+    // Compose a message (default: bench_message())
+    void (*message)(struct Buffer *message, size_t mean);
+    int week;                   // week of the last year to measure (0: none)
+    // Filled in by bench_generate()
+    size_t records;
+    size_t bytes;
+    size_t week_records;
+    size_t week_bytes;
+};
+
+double bench_now(void);
+unsigned long bench_rand(void);
+void bench_message(struct Buffer *message, size_t mean);
+void bench_generate(struct BenchJournal *journal);
+void bench_remove_tree(const char *path);
+
+#endif // WEEKLY_BENCH_H
@@ -0,0 +1,128 @@
+// Check the calendar tables against the C library for every day from
+// FIRST to LAST (years), under both week numberings, then time day to
+// week lookups against going through localtime()
+//
+// usage: bench_calendar [FIRST] [LAST]
+#include "bench.h"
+
+// Fill in a UTC date the way the C library sees it
+static int library_date(long days, struct tm *tm_) {
+    time_t t = (time_t) days * 86400;
+#if HAVE_WINDOWS
+    return gmtime_s(tm_, &t) == 0 ? 0 : -1;
+#else
+    return gmtime_r(&t, tm_) ? 0 : -1;
+#endif
+}
+
+static long failures;
+
+static void check(int ok, const char *what, long days) {
+    if (!ok && failures++ < 10) {
+        int year, month, mday;
+        calendar_date(days, &year, &month, &mday);
+        fprintf(stderr, "%04d-%02d-%02d: %s\n", year, month, mday, what);
+    }
+}
+
+static void verify_day(long days) {
+    struct tm tm_;
+    char expect[32];
+    int year, month, mday;
+    int y, w, d;
+    int y2, w2, weekday;
+    long found;
+
+    if (library_date(days, &tm_) < 0) {
+        check(0, "gmtime() failed", days);
+        return;
+    }
+    calendar_date(days, &year, &month, &mday);
+    check(year == tm_.tm_year + 1900 && month == tm_.tm_mon + 1 && mday == tm_.tm_mday, "date", days);
+    check(calendar_days(year, month, mday) == days, "days", days);
+
+    // ISO 8601: %G %V %u is the ISO year, week and weekday (Monday = 1)
+    calendar_scheme = CALENDAR_ISO;
+    calendar_locate_days(days, &y, &w, &d);
+    strftime(expect, sizeof(expect), "%G %V %u", &tm_);
+    check(sscanf(expect, "%d %d %d", &y2, &w2, &weekday) == 3 && y == y2 && w == w2 && d + 1 == weekday, "ISO week", days);
+    check(calendar_find(y, w, d, &found) == 0 && found == days, "ISO find", days);
+    if (d == 0) {
+        y2 = y;
+        w2 = w;
+        calendar_week_add(&y2, &w2, -1);
+        calendar_locate_days(days - 7, &y, &w, &d);
+        check(y2 == y && w2 == w, "ISO previous week", days);
+    }
+
+    // The numbering journals were written with before ISO weeks
+    calendar_scheme = CALENDAR_LEGACY;
+    calendar_locate_days(days, &y, &w, &d);
+    check(y == tm_.tm_year + 1900 && w == (tm_.tm_yday + 8 - tm_.tm_wday) / 7 && d == tm_.tm_wday, "legacy week", days);
+    check(calendar_find(y, w, d, &found) == 0 && found == days, "legacy find", days);
+    if (d == 0 || tm_.tm_yday == 0) {
+        // The day before starts the previous week (or the last one of the
+        // previous year)
+        y2 = y;
+        w2 = w;
+        calendar_week_add(&y2, &w2, -1);
+        calendar_locate_days(days - 1, &y, &w, &d);
+        check(y2 == y && w2 == w, "legacy previous week", days);
+        calendar_week_add(&y2, &w2, 1);
+        calendar_locate_days(days, &y, &w, &d);
+        check(y2 == y && w2 == w, "legacy next week", days);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int first, last;
+    long start, end;
+    long count;
+    double t, elapsed_table, elapsed_library;
+    volatile int sink;
+
+    first = argc > 1 ? atoi(argv[1]) : 1600;
+    last = argc > 2 ? atoi(argv[2]) : 2400;
+    if (first > last) {
+        fprintf(stderr, "FIRST must not be later than LAST\n");
+        return 1;
+    }
+    start = calendar_days(first, 1, 1);
+    end = calendar_days(last, 12, 31);
+
+    for (long days = start; days <= end; days++) {
+        verify_day(days);
+    }
+    count = end - start + 1;
+    printf("verified %ld days (%d-%d): %ld failure%s\n", count, first, last, failures, failures == 1 ? "" : "s");
+
+    // Lookups for the days journals are actually read for
+    calendar_scheme = CALENDAR_ISO;
+    start = calendar_days(1990, 1, 1);
+    end = calendar_days(2040, 1, 1);
+    sink = 0;
+    t = bench_now();
+    for (int pass = 0; pass < 20; pass++) {
+        for (long days = start; days < end; days++) {
+            int y, w, d;
+            calendar_locate_days(days, &y, &w, &d);
+            sink += w;
+        }
+    }
+    elapsed_table = bench_now() - t;
+    t = bench_now();
+    for (int pass = 0; pass < 20; pass++) {
+        for (long days = start; days < end; days++) {
+            int y, w, d;
+            calendar_locate((time_t) days * 86400 + 43200, &y, &w, &d);
+            sink += w;
+        }
+    }
+    elapsed_library = bench_now() - t;
+    (void) sink;
+    count = 20 * (end - start);
+    printf("%-24s %14s %12s\n", "lookup", "lookups/s", "ns/lookup");
+    printf("%-24s %14.0f %12.1f\n", "calendar_locate_days", count / elapsed_table, elapsed_table / count * 1e9);
+    printf("%-24s %14.0f %12.1f\n", "calendar_locate", count / elapsed_library, elapsed_library / count * 1e9);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+// Compare dump throughput across worker thread counts
+//
+// usage: bench_dump [ROOT [YEAR]]
+//
+// Without ROOT a synthetic journal is generated in a temporary directory.
+// With ROOT (e.g. a journal on a network file system) all of YEAR is dumped.
+#include "bench.h"
+
+#define BENCH_YEAR 2022
+#define BENCH_RECORDS_PER_DAY 20
+#define BENCH_MESSAGE_SIZE 64
+
+int main(int argc, char *argv[]) {
+    struct BenchJournal journal;
+    char root[PATH_MAX] = {0};
+    const char *tmpdir;
+    int synthetic;
+    int year;
+    int max_threads;
+    double baseline;
+
+    year = BENCH_YEAR;
+    synthetic = argc < 2;
+    if (synthetic) {
+        tmpdir = getenv("TMPDIR");
+        if (!tmpdir) {
+            tmpdir = HAVE_WINDOWS ? "." : "/tmp";
+        }
+        sprintf(root, "%s%cbench_dump.%d", tmpdir, DIRSEP_C, (int) time(NULL));
+        memset(&journal, 0, sizeof(journal));
+        strcpy(journal.root, root);
+        journal.first_year = year;
+        journal.years = 1;
+        journal.entries = BENCH_RECORDS_PER_DAY;
+        journal.users = 1;
+        journal.format = RECORD_FORMAT_V1;
+        journal.message_size = BENCH_MESSAGE_SIZE;
+        bench_generate(&journal);
+    } else {
+        strcpy(root, argv[1]);
+        if (argc > 2) {
+            year = (int) strtol(argv[2], NULL, 10);
+        }
+    }
+
+    // Output is discarded. Results are written to stderr.
+    if (!freopen(HAVE_WINDOWS ? "NUL" : "/dev/null", "w", stdout)) {
+        perror("Unable to redirect stdout");
+        return 1;
+    }
+
+    max_threads = cpu_count() * 4;
+    if (max_threads < 8) {
+        max_threads = 8;
+    }
+
+    baseline = 0;
+    fprintf(stderr, "%8s %12s %9s\n", "threads", "seconds", "speedup");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        struct Writer out;
+        double t, elapsed;
+
+        dump_jobs = threads;
+        t = bench_now();
+        writer_init(&out, stdout, RECORD_STYLE_LONG);
+        dump_year(root, year, 0, &out);
+        writer_close(&out);
+        elapsed = bench_now() - t;
+        if (threads == 1) {
+            baseline = elapsed;
+        }
+        fprintf(stderr, "%8d %12.6f %8.2fx\n", threads, elapsed, baseline / elapsed);
+    }
+
+    if (synthetic) {
+        bench_remove_tree(root);
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+// Compare indexed --grep lookups against a brute-force scan
+//
+// usage: bench_grep [YEARS] [RECORDS_PER_DAY]
+#include "bench.h"
+
+#define BENCH_FIRST_YEAR 2020
+#define BENCH_VOCABULARY 5000
+
+// Words from a large vocabulary, with a rare word in roughly one of every
+// thousand records
+static void bench_grep_message(struct Buffer *message, size_t mean) {
+    int words = 8 + (int) (bench_rand() % 24);
+
+    (void) mean;
+    message->len = 0;
+    for (int w = 0; w < words; w++) {
+        buffer_printf(message, "%sw%lu", w ? " " : "", bench_rand() % BENCH_VOCABULARY);
+    }
+    if (bench_rand() % 1000 == 0) {
+        buffer_printf(message, " needle");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *patterns[] = {"needle", "w42", "w42 w4242", "w1 w2 w3"};
+    struct BenchJournal journal;
+    char root[PATH_MAX] = {0};
+    const char *tmpdir;
+    int years;
+    int records;
+
+    years = argc > 1 ? (int) strtol(argv[1], NULL, 10) : 3;
+    records = argc > 2 ? (int) strtol(argv[2], NULL, 10) : 10;
+
+    tmpdir = getenv("TMPDIR");
+    if (!tmpdir) {
+        tmpdir = HAVE_WINDOWS ? "." : "/tmp";
+    }
+    sprintf(root, "%s%cbench_grep.%d", tmpdir, DIRSEP_C, (int) time(NULL));
+    memset(&journal, 0, sizeof(journal));
+    strcpy(journal.root, root);
+    journal.first_year = BENCH_FIRST_YEAR;
+    journal.years = years;
+    journal.entries = records;
+    journal.users = 1;
+    journal.format = RECORD_FORMAT_V1;
+    journal.message = bench_grep_message;
+    bench_generate(&journal);
+
+    // Output is discarded. Results are written to stderr.
+    if (!freopen(HAVE_WINDOWS ? "NUL" : "/dev/null", "w", stdout)) {
+        perror("Unable to redirect stdout");
+        return 1;
+    }
+
+    fprintf(stderr, "%d years, %d records per day\n", years, records);
+    fprintf(stderr, "%-12s %12s %12s %9s\n", "pattern", "indexed (s)", "scan (s)", "speedup");
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(*patterns); i++) {
+        struct Writer out;
+        double t, indexed, scan;
+
+        t = bench_now();
+        writer_init(&out, stdout, RECORD_STYLE_LONG);
+        search_grep(root, patterns[i], NULL, 1, &out);
+        writer_close(&out);
+        indexed = bench_now() - t;
+
+        t = bench_now();
+        writer_init(&out, stdout, RECORD_STYLE_LONG);
+        search_grep(root, patterns[i], NULL, 0, &out);
+        writer_close(&out);
+        scan = bench_now() - t;
+
+        fprintf(stderr, "%-12s %12.6f %12.6f %8.2fx\n", patterns[i], indexed, scan, scan / indexed);
+    }
+
+    bench_remove_tree(root);
+    return 0;
+}
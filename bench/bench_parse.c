@@ -0,0 +1,175 @@
+// Compare the sscanf() header parser against the single-pass header lexer
+// on records with large headers full of custom keys
+//
+// usage: bench_parse [RECORDS]
+#include "bench.h"
+
+static const char *WORDS[] = {
+    "release", "pipeline", "cluster", "customer", "review", "nightly", "export", "regression",
+};
+
+// The parser as it existed before the lexer: a copy of the record split
+// with strtok() and every header line run through sscanf()
+static struct Record *legacy_record_parse(const char *content) {
+    char *next;
+    struct Record *result;
+
+    result = calloc(1, sizeof(*result));
+    if (!result) {
+        perror("Unable to allocate record");
+        return NULL;
+    }
+
+    char *p = strdup(content);
+    next = strtok(p, "\n");
+    while (next != NULL) {
+        char key[10] = {0};
+        char value[255] = {0};
+
+        sscanf(next, "## %9[^: ]:%254s[^\n]", key, value);
+        if (strncmp(next, "## ", 3) != 0) {
+            break;
+        }
+        if (!strcmp(key, "date"))
+            result->date = strdup(value);
+        else if (!strcmp(key, "time"))
+            result->time = strdup(value);
+        else if (!strcmp(key, "author"))
+            result->user = strdup(value);
+        else if (!strcmp(key, "host"))
+            result->host = strdup(value);
+
+        next = strtok(NULL, "\n");
+    }
+
+    if (next != NULL) {
+        if (memcmp(next, "\x02\x02\x02", 3) == 0) {
+            next += 4;
+        }
+        result->data = strdup(next);
+    } else {
+        record_free(result);
+        result = NULL;
+    }
+
+    free(p);
+    return result;
+}
+
+// Records as NUL terminated strings ("header RECORD_SOT \n text") stored
+// back to back
+struct Corpus {
+    struct Buffer data;
+    size_t *offsets;
+    size_t *header_lens;
+    size_t count;
+};
+
+static void corpus_init(struct Corpus *corpus, size_t records, int keys) {
+    buffer_init(&corpus->data);
+    corpus->offsets = malloc(records * sizeof(*corpus->offsets));
+    corpus->header_lens = malloc(records * sizeof(*corpus->header_lens));
+    if (!corpus->offsets || !corpus->header_lens) {
+        perror("Unable to allocate corpus");
+        exit(1);
+    }
+    corpus->count = records;
+    for (size_t i = 0; i < records; i++) {
+        corpus->offsets[i] = corpus->data.len;
+        buffer_printf(&corpus->data, "## date:   01/18/2022\n## time:   15:16:%02d\n"
+                                     "## author: Example User\n## host:   build host %02d.example.com\n",
+                      (int) (i % 60), (int) (i % 100));
+        for (int k = 0; k < keys; k++) {
+            int words = 4 + (int) (bench_rand() % 16);
+            buffer_printf(&corpus->data, "## key%02d:", k);
+            for (int w = 0; w < words; w++) {
+                buffer_printf(&corpus->data, " %s", WORDS[bench_rand() % (sizeof(WORDS) / sizeof(*WORDS))]);
+            }
+            buffer_append(&corpus->data, "\n", 1);
+        }
+        corpus->header_lens[i] = corpus->data.len - corpus->offsets[i];
+        buffer_printf(&corpus->data, RECORD_SOT "\nRecord %zu. This is you typing out a message to yourself.\n", i);
+        buffer_append(&corpus->data, "", 1);
+    }
+}
+
+static void corpus_free(struct Corpus *corpus) {
+    buffer_free(&corpus->data);
+    free(corpus->offsets);
+    free(corpus->header_lens);
+}
+
+static double run_legacy(const struct Corpus *corpus) {
+    double t = bench_now();
+    for (size_t i = 0; i < corpus->count; i++) {
+        record_free(legacy_record_parse(corpus->data.data + corpus->offsets[i]));
+    }
+    return bench_now() - t;
+}
+
+static double run_parse(const struct Corpus *corpus) {
+    double t = bench_now();
+    for (size_t i = 0; i < corpus->count; i++) {
+        record_free(record_parse(corpus->data.data + corpus->offsets[i]));
+    }
+    return bench_now() - t;
+}
+
+static double run_view(const struct Corpus *corpus, size_t *fields) {
+    struct RecordView view;
+    double t = bench_now();
+
+    *fields = 0;
+    for (size_t i = 0; i < corpus->count; i++) {
+        const char *header = corpus->data.data + corpus->offsets[i];
+        const char *text = header + corpus->header_lens[i] + 4;
+        record_view_parse(&view, header, corpus->header_lens[i], text, strlen(text));
+        *fields += view.nfields;
+    }
+    return bench_now() - t;
+}
+
+int main(int argc, char *argv[]) {
+    const int keys[] = {0, 4, 16, 64};
+    size_t records;
+
+    records = argc > 1 ? (size_t) strtoull(argv[1], NULL, 10) : 100000;
+    if (!records) {
+        fprintf(stderr, "RECORDS must be at least 1\n");
+        return 1;
+    }
+
+    printf("%6s %12s %12s %12s %12s %12s %12s %9s\n",
+           "keys", "bytes", "legacy (s)", "parse (s)", "view (s)", "view MB/s", "view rec/s", "speedup");
+    for (size_t k = 0; k < sizeof(keys) / sizeof(*keys); k++) {
+        struct Corpus corpus;
+        struct Record *record;
+        double legacy, parse, view;
+        size_t fields;
+
+        corpus_init(&corpus, records, keys[k]);
+
+        // Multi-word values must survive intact
+        record = record_parse(corpus.data.data);
+        if (!record || strcmp(record->host, "build host 00.example.com") != 0 || strcmp(record->user, "Example User") != 0) {
+            fprintf(stderr, "record_parse() lost a header value\n");
+            return 1;
+        }
+        record_free(record);
+
+        legacy = run_legacy(&corpus);
+        parse = run_parse(&corpus);
+        view = run_view(&corpus, &fields);
+        if (fields != records * (size_t) (keys[k] < RECORD_FIELDS_MAX ? keys[k] : RECORD_FIELDS_MAX)) {
+            fprintf(stderr, "record_view_parse() lost custom keys\n");
+            return 1;
+        }
+
+        printf("%6d %12zu %12.6f %12.6f %12.6f %12.2f %12.0f %8.2fx\n",
+               keys[k], corpus.data.len, legacy, parse, view,
+               (double) corpus.data.len / (1024.0 * 1024.0) / view, (double) records / view, legacy / parse);
+        fflush(stdout);
+        corpus_free(&corpus);
+    }
+    return 0;
+}
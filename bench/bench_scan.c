@@ -0,0 +1,231 @@
+// Compare the byte-at-a-time record reader against the block scanner, and
+// control code (version 1) records against length prefixed (version 2) ones
+//
+// usage: bench_scan [MAX_BYTES] [WORK_DIR]
+#include "bench.h"
+
+static const char *RECORD_FMT = "\x01\x01\x01## date:   01/18/2022\n"
+                                "## time:   15:16:%02d\n"
+                                "## author: example\n"
+                                "## host:   mycomputer.lan\n"
+                                "\x02\x02\x02\n"
+                                "Record %zu. This is you typing out a message to yourself. "
+                                "It can be whatever you want.\n\n"
+                                "\x03\x03\x03\n";
+
+// The reader as it existed before the block scanner: one fread() per byte,
+// an ftell() at every marker, then a seek back to re-read the record.
+static struct Record *legacy_record_read(FILE **fp) {
+    long soh, sot, eot;
+    size_t record_size;
+    char task[2] = {0};
+    char *buf;
+
+    soh = 0;
+    sot = 0;
+    eot = 0;
+
+    while (fread(task, sizeof(char), 1, *fp) > 0) {
+        if (task[0] == '\x01' && fread(task, sizeof(char), 2, *fp) > 0) {
+            if (memcmp(task, "\x01\x01", 2) == 0) {
+                soh = ftell(*fp);
+            }
+        } else if (task[0] == '\x02' && fread(task, sizeof(char), 2, *fp) > 0) {
+            if (memcmp(task, "\x02\x02", 2) == 0) {
+                sot = ftell(*fp);
+            }
+        } else if (task[0] == '\x03' && fread(task, sizeof(char), 2, *fp) > 0) {
+            if (memcmp(task, "\x03\x03", 2) == 0) {
+                eot = ftell(*fp);
+                break;
+            }
+        } else {
+            continue;
+        }
+        memset(task, '\0', sizeof(task));
+    }
+
+    if (eot <= soh || !sot) {
+        return NULL;
+    }
+    record_size = (size_t) (eot - soh);
+
+    buf = calloc(record_size + 1, sizeof(char));
+    if (!buf) {
+        return NULL;
+    }
+    fseek(*fp, soh, SEEK_SET);
+    fread(buf, sizeof(char), record_size, *fp);
+    memset(buf + (record_size - 4), '\0', 4);
+    buf[strlen(buf) - 1] = '\0';
+
+    struct Record *result;
+    result = record_parse(buf);
+    free(buf);
+    return result;
+}
+
+static size_t generate(const char *filename, size_t size) {
+    FILE *fp;
+    size_t written;
+    size_t count;
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        perror(filename);
+        exit(1);
+    }
+    written = 0;
+    count = 0;
+    while (written < size) {
+        int len;
+        len = fprintf(fp, RECORD_FMT, (int) (count % 60), count);
+        if (len < 0) {
+            perror(filename);
+            exit(1);
+        }
+        written += (size_t) len;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+// The same records in the length prefixed format
+static size_t generate_v2(const char *filename, size_t size) {
+    struct Buffer header;
+    struct Buffer record;
+    char data[255];
+    FILE *fp;
+    size_t written;
+    size_t count;
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        perror(filename);
+        exit(1);
+    }
+    buffer_init(&header);
+    buffer_init(&record);
+    written = 0;
+    count = 0;
+    while (written < size) {
+        header.len = 0;
+        record.len = 0;
+        buffer_printf(&header, "## date:   01/18/2022\n## time:   15:16:%02d\n## author: example\n## host:   mycomputer.lan\n",
+                      (int) (count % 60));
+        sprintf(data, "Record %zu. This is you typing out a message to yourself. It can be whatever you want.\n", count);
+        if (append_encode(&record, RECORD_FORMAT_V2, header.data, data, strlen(data)) < 0
+            || fwrite(record.data, sizeof(char), record.len, fp) != record.len) {
+            perror(filename);
+            exit(1);
+        }
+        written += record.len;
+        count++;
+    }
+    buffer_free(&header);
+    buffer_free(&record);
+    fclose(fp);
+    return count;
+}
+
+static size_t run_legacy(const char *filename) {
+    FILE *fp;
+    struct Record *record;
+    size_t count;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        perror(filename);
+        exit(1);
+    }
+    count = 0;
+    while ((record = legacy_record_read(&fp)) != NULL) {
+        record_free(record);
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static size_t run_scanner(const char *filename) {
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    size_t count;
+
+    if (scanner_open(&scanner, filename) < 0) {
+        perror(filename);
+        exit(1);
+    }
+    count = 0;
+    while (scanner_next(&scanner, &span) > 0) {
+        if (record_view_from_span(&view, &span) == 0) {
+            count++;
+        }
+    }
+    scanner_close(&scanner);
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_size;
+    const char *workdir;
+    char filename[PATH_MAX] = {0};
+
+    max_size = 100 * 1024 * 1024;
+    if (argc > 1) {
+        max_size = (size_t) strtoull(argv[1], NULL, 10);
+    }
+    workdir = argc > 2 ? argv[2] : getenv("TMPDIR");
+    if (!workdir) {
+        workdir = HAVE_WINDOWS ? "." : "/tmp";
+    }
+    sprintf(filename, "%s%cbench_scan.%d", workdir, DIRSEP_C, (int) time(NULL));
+
+    printf("%12s %10s %12s %12s %12s %9s %12s\n", "bytes", "records", "legacy (s)", "scanner (s)", "scanner MB/s", "speedup", "v2 (s)");
+    for (size_t size = 1024; size <= max_size; size *= 10) {
+        size_t records;
+        size_t rounds;
+        double legacy, scanner, v2, t;
+
+        records = generate(filename, size);
+        // Repeat small files so the timings are measurable
+        rounds = size < 1024 * 1024 ? (1024 * 1024) / size : 1;
+
+        t = bench_now();
+        for (size_t i = 0; i < rounds; i++) {
+            if (run_legacy(filename) != records) {
+                fprintf(stderr, "legacy reader record count mismatch\n");
+                return 1;
+            }
+        }
+        legacy = (bench_now() - t) / (double) rounds;
+
+        t = bench_now();
+        for (size_t i = 0; i < rounds; i++) {
+            if (run_scanner(filename) != records) {
+                fprintf(stderr, "scanner record count mismatch\n");
+                return 1;
+            }
+        }
+        scanner = (bench_now() - t) / (double) rounds;
+
+        records = generate_v2(filename, size);
+        t = bench_now();
+        for (size_t i = 0; i < rounds; i++) {
+            if (run_scanner(filename) != records) {
+                fprintf(stderr, "scanner record count mismatch (v2)\n");
+                return 1;
+            }
+        }
+        v2 = (bench_now() - t) / (double) rounds;
+
+        printf("%12zu %10zu %12.6f %12.6f %12.2f %8.2fx %12.6f\n",
+               size, records, legacy, scanner,
+               (double) size / (1024.0 * 1024.0) / scanner, legacy / scanner, v2);
+        fflush(stdout);
+    }
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,113 @@
+// Measure how long weekly takes to start, do a little work and exit for a
+// read-only command (-V), a dump of the current week (-d) and a write
+// (a record read from stdin), in a temporary journal
+//
+// usage: bench_startup [WEEKLY] [RUNS]
+#include "bench.h"
+#if !HAVE_WINDOWS
+#include <sys/wait.h>
+#endif
+
+#if HAVE_WINDOWS
+int main(void) {
+    fprintf(stderr, "bench_startup requires fork()\n");
+    return 1;
+}
+#else
+// Run the program once with "input" (or /dev/null) as stdin. Returns the
+// elapsed time, or a negative value when it failed.
+static double run(char *const argv[], const char *input) {
+    double t;
+    pid_t pid;
+    int status;
+
+    t = bench_now();
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int in = open(input ? input : "/dev/null", O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || dup2(in, 0) < 0 || dup2(out, 1) < 0) {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return bench_now() - t;
+}
+
+int main(int argc, char *argv[]) {
+    char root[PATH_MAX];
+    char input[PATH_MAX];
+    char *program;
+    const char *tmpdir;
+    int runs;
+    FILE *fp;
+    struct {
+        const char *name;
+        char *argv[4];
+        int stdin_;
+    } commands[] = {
+        {"-V", {NULL, "-V", NULL}, 0},
+        {"write", {NULL, "-", NULL}, 1},
+        {"-d", {NULL, "-d", NULL}, 0},
+    };
+
+    program = argc > 1 ? argv[1] : "./weekly";
+    runs = argc > 2 ? atoi(argv[2]) : 200;
+    if (runs < 1) {
+        fprintf(stderr, "RUNS must be at least 1\n");
+        return 1;
+    }
+    if (access(program, X_OK) < 0) {
+        fprintf(stderr, "Unable to run %s: %s\n", program, strerror(errno));
+        return 1;
+    }
+
+    tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    sprintf(root, "%s%cbench_startup.XXXXXX", tmpdir, DIRSEP_C);
+    if (!mkdtemp(root)) {
+        perror(root);
+        return 1;
+    }
+    sprintf(input, "%s%cmessage", root, DIRSEP_C);
+    if (!(fp = fopen(input, "w")) || fputs("Startup benchmark record\n", fp) < 0 || fclose(fp) != 0) {
+        perror(input);
+        return 1;
+    }
+    // Keep the journal out of the rest of the temporary directory
+    strcat(root, DIRSEP_S "journal");
+    setenv("WEEKLY_JOURNAL_ROOT", root, 1);
+
+    printf("%-8s %8s %12s %12s %12s\n", "command", "runs", "mean (ms)", "min (ms)", "runs/s");
+    for (size_t c = 0; c < sizeof(commands) / sizeof(*commands); c++) {
+        double total, best;
+
+        commands[c].argv[0] = program;
+        total = 0;
+        best = 0;
+        for (int i = 0; i < runs; i++) {
+            double t = run(commands[c].argv, commands[c].stdin_ ? input : NULL);
+            if (t < 0) {
+                fprintf(stderr, "%s %s failed\n", program, commands[c].argv[1]);
+                return 1;
+            }
+            total += t;
+            if (!i || t < best) {
+                best = t;
+            }
+        }
+        printf("%-8s %8d %12.3f %12.3f %12.0f\n", commands[c].name, runs,
+               total / runs * 1000.0, best * 1000.0, runs / total);
+        fflush(stdout);
+    }
+    printf("journal: %s\n", root);
+    return 0;
+}
+#endif
@@ -0,0 +1,245 @@
+// Stress concurrent writers: WRITERS processes append RECORDS records each
+// to the same day file (and year index) while some of them leave torn
+// records behind, as if killed mid-write. Every record must be read back
+// exactly once, the index must hold one header and one entry per record,
+// and --fsck must leave a file that reads back the same without damage.
+//
+// usage: bench_writers [WRITERS] [RECORDS] [FORMAT]
+#include "bench.h"
+#if !HAVE_WINDOWS
+#include <sys/wait.h>
+#endif
+
+#define BENCH_YEAR 2024
+#define BENCH_WEEK 10
+#define BENCH_DAY 2
+#define BENCH_TORN_EVERY 50     // about one torn record per this many records
+
+#if HAVE_WINDOWS
+int main(void) {
+    fprintf(stderr, "bench_writers requires fork()\n");
+    return 1;
+}
+#else
+static void journal_paths(const char *root, char *year, char *week, char *day, char *index) {
+    sprintf(year, "%s%c%d", root, DIRSEP_C, BENCH_YEAR);
+    sprintf(week, "%s%c%d", year, DIRSEP_C, BENCH_WEEK);
+    sprintf(day, "%s%c%d", week, DIRSEP_C, BENCH_DAY);
+    sprintf(index, "%s%c%s", year, DIRSEP_C, INDEX_FILENAME);
+}
+
+static int writer_run(const char *root, const char *path, int writer, int records) {
+    unsigned long seed = (unsigned long) writer * 2654435761UL + 1;
+    struct Buffer header;
+    struct Buffer message;
+    struct Buffer torn;
+
+    buffer_init(&header);
+    buffer_init(&message);
+    buffer_init(&torn);
+    for (int i = 0; i < records; i++) {
+        struct IndexEntry entry;
+        uint64_t offset;
+
+        header.len = 0;
+        message.len = 0;
+        buffer_printf(&header, "## date:   03/05/2024\n## time:   10:%02d:%02d\n## author: writer%d\n## host:   bench\n",
+                      (i / 60) % 60, i % 60, writer);
+        buffer_printf(&message, "writer %d record %d", writer, i);
+
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        if ((seed >> 33) % BENCH_TORN_EVERY == 0) {
+            int fd;
+
+            // A writer killed part way through its record
+            torn.len = 0;
+            append_encode(&torn, record_format, header.data, "torn", 4);
+            fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+            if (fd < 0 || write(fd, torn.data, torn.len / 2) != (ssize_t) (torn.len / 2)) {
+                perror("Unable to write a torn record");
+                return 1;
+            }
+            close(fd);
+        }
+
+        if (append_record(path, header.data, message.data, message.len, &offset) < 0) {
+            perror("Unable to append a record");
+            return 1;
+        }
+        memset(&entry, 0, sizeof(entry));
+        entry.week = BENCH_WEEK;
+        entry.day = BENCH_DAY;
+        entry.offset = offset;
+        entry.length = (uint32_t) (header.len + message.len);
+        sprintf(entry.author, "writer%d", writer);
+        if (index_append(root, BENCH_YEAR, &entry, 1) < 0) {
+            perror("Unable to append an index entry");
+            return 1;
+        }
+    }
+    buffer_free(&header);
+    buffer_free(&message);
+    buffer_free(&torn);
+    return 0;
+}
+
+// Count how often each record of each writer is read back. Returns the
+// number of records read, or -1 when one is unexpected.
+static long verify(const char *path, int writers, int records, unsigned char *seen) {
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    long count;
+
+    memset(seen, 0, (size_t) writers * (size_t) records);
+    if (scanner_open(&scanner, path) < 0) {
+        perror(path);
+        return -1;
+    }
+    // Torn records are expected here
+    free(scanner.name);
+    scanner.name = NULL;
+
+    count = 0;
+    while (scanner_next(&scanner, &span) > 0) {
+        char text[64];
+        int writer, record;
+
+        if (record_view_from_span(&view, &span) < 0 || view.data.len >= sizeof(text)) {
+            fprintf(stderr, "Unexpected record at offset %ld\n", span.offset);
+            count = -1;
+            break;
+        }
+        memcpy(text, view.data.ptr, view.data.len);
+        text[view.data.len] = '\0';
+        if (sscanf(text, "writer %d record %d", &writer, &record) != 2
+            || writer < 0 || writer >= writers || record < 0 || record >= records) {
+            fprintf(stderr, "Unexpected record at offset %ld: %s\n", span.offset, text);
+            count = -1;
+            break;
+        }
+        seen[(size_t) writer * (size_t) records + (size_t) record]++;
+        count++;
+    }
+    scanner_close(&scanner);
+    if (count < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < (size_t) writers * (size_t) records; i++) {
+        if (seen[i] != 1) {
+            fprintf(stderr, "Record %zu of writer %zu was read %d times\n",
+                    i % (size_t) records, i / (size_t) records, seen[i]);
+            return -1;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    char root[PATH_MAX];
+    char path_year[PATH_MAX];
+    char path_week[PATH_MAX];
+    char path_day[PATH_MAX];
+    char path_index[PATH_MAX];
+    const char *tmpdir;
+    unsigned char *seen;
+    int writers, records;
+    ssize_t index_size;
+    double t;
+    int failed;
+    int repaired;
+
+    writers = argc > 1 ? atoi(argv[1]) : 8;
+    records = argc > 2 ? atoi(argv[2]) : 2000;
+    record_format = argc > 3 ? atoi(argv[3]) : RECORD_FORMAT_V1;
+    if (writers < 1 || records < 1) {
+        fprintf(stderr, "WRITERS and RECORDS must be at least 1\n");
+        return 1;
+    }
+    if (record_format != RECORD_FORMAT_V1 && record_format != RECORD_FORMAT_V2) {
+        fprintf(stderr, "FORMAT must be 1 or 2\n");
+        return 1;
+    }
+
+    tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    sprintf(root, "%s%cbench_writers.XXXXXX", tmpdir, DIRSEP_C);
+    if (!mkdtemp(root)) {
+        perror(root);
+        return 1;
+    }
+    journal_paths(root, path_year, path_week, path_day, path_index);
+    if (mkdir(path_year, 0755) < 0 || mkdir(path_week, 0755) < 0) {
+        perror(path_week);
+        return 1;
+    }
+    seen = malloc((size_t) writers * (size_t) records);
+    if (!seen) {
+        perror("Unable to allocate");
+        return 1;
+    }
+
+    t = bench_now();
+    for (int i = 0; i < writers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            _exit(writer_run(root, path_day, i, records));
+        }
+    }
+    failed = 0;
+    for (int i = 0; i < writers; i++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    t = bench_now() - t;
+    if (failed) {
+        fprintf(stderr, "A writer failed\n");
+        return 1;
+    }
+
+    printf("%8s %8s %7s %12s %12s %12s\n", "writers", "records", "format", "seconds", "records/s", "file bytes");
+    printf("%8d %8d %7d %12.6f %12.0f %12zd\n", writers, records, record_format, t,
+           (double) writers * records / t, get_file_size(path_day));
+
+    // Records are read back intact around the torn ones
+    if (verify(path_day, writers, records, seen) < 0) {
+        return 1;
+    }
+    // Concurrent writers created the index with a single header
+    index_size = get_file_size(path_index);
+    if (index_size != 8 + (ssize_t) writers * records * 56) {
+        fprintf(stderr, "Index holds %zd bytes, expected %zd\n", index_size, 8 + (ssize_t) writers * records * 56);
+        return 1;
+    }
+
+    // Repairing drops only the torn records, and only once
+    repaired = fsck_run(root, BENCH_YEAR);
+    if (repaired < 0 || verify(path_day, writers, records, seen) < 0) {
+        return 1;
+    }
+    if (fsck_run(root, BENCH_YEAR) != 0) {
+        fprintf(stderr, "Damage remains after repair\n");
+        return 1;
+    }
+    printf("ok: %ld records read back, %d file%s repaired\n", (long) writers * records, repaired, repaired == 1 ? "" : "s");
+
+    remove(path_day);
+    remove(path_index);
+    for (size_t i = 0; i < 3; i++) {
+        const char *names[] = {META_FILENAME, TERMS_FILENAME, TERMS_LOG_FILENAME};
+        char path[PATH_MAX];
+        sprintf(path, "%s%c%s", path_year, DIRSEP_C, names[i]);
+        remove(path);
+    }
+    rmdir(path_week);
+    rmdir(path_year);
+    rmdir(root);
+    free(seen);
+    return 0;
+}
+#endif
@@ -0,0 +1,397 @@
+// Time the write, dump and parse paths against a synthetic journal
+//
+// usage: weekly_bench [-y YEARS] [-e ENTRIES_PER_DAY] [-m MESSAGE_SIZE]
+//                     [-u USERS] [-f FORMAT] [-j JOBS] [-r ROOT] [-k]
+//
+// A journal covering every day of YEARS years is generated below ROOT
+// (default: a new directory in TMPDIR), written by USERS authors on as many
+// hosts. Message sizes are skewed: most messages are shorter than
+// MESSAGE_SIZE and about one in twenty is several times longer. The
+// journal is removed afterwards unless -k is given.
+//
+// Results are written to stdout as a single JSON object so runs can be
+// compared across releases.
+#include "bench.h"
+
+#define BENCH_FIRST_YEAR 2020
+#define BENCH_WEEK 26
+#define BENCH_WRITES 200
+#define BENCH_DUMP_WEEK_RUNS 20
+#define BENCH_DUMP_ALL_RUNS 3
+#define BENCH_PARSE_RUNS 3
+
+// Print a timing as a JSON member. Throughput is omitted when there is
+// nothing to divide.
+static void report(const char *name, int runs, double seconds, size_t records, size_t bytes, int last) {
+    printf("  \"%s\": {\"runs\": %d, \"seconds\": %.6f", name, runs, seconds);
+    if (records) {
+        printf(", \"records\": %lu, \"bytes\": %lu, \"records_per_s\": %.1f, \"mb_per_s\": %.2f",
+               (unsigned long) records, (unsigned long) bytes,
+               (double) records / seconds, (double) bytes / seconds / 1e6);
+    }
+    printf("}%s\n", last ? "" : ",");
+}
+
+static double bench_dump_week(struct BenchJournal *bench, FILE *sink) {
+    double best = 0;
+
+    for (int run = 0; run < BENCH_DUMP_WEEK_RUNS; run++) {
+        struct Writer out;
+        double t = bench_now();
+        writer_init(&out, sink, RECORD_STYLE_LONG);
+        dump_week(bench->root, BENCH_FIRST_YEAR + bench->years - 1, BENCH_WEEK, &out);
+        writer_close(&out);
+        t = bench_now() - t;
+        best = run && best < t ? best : t;
+    }
+    return best;
+}
+
+static double bench_dump_all(struct BenchJournal *bench, FILE *sink) {
+    double best = 0;
+
+    for (int run = 0; run < BENCH_DUMP_ALL_RUNS; run++) {
+        struct Writer out;
+        double t = bench_now();
+        writer_init(&out, sink, RECORD_STYLE_LONG);
+        for (int year = BENCH_FIRST_YEAR; year < BENCH_FIRST_YEAR + bench->years; year++) {
+            dump_year(bench->root, year, 0, &out);
+        }
+        writer_close(&out);
+        t = bench_now() - t;
+        best = run && best < t ? best : t;
+    }
+    return best;
+}
+
+// Write the journal to a columnar export, then dump it back
+static double bench_export(struct BenchJournal *bench, FILE *sink, double *dumped) {
+    char path[PATH_MAX];
+    struct Writer out;
+    double t;
+
+    sprintf(path, "%s%cexport.col", bench->root, DIRSEP_C);
+    t = bench_now();
+    if (export_write(bench->root, path) < 0) {
+        exit(1);
+    }
+    t = bench_now() - t;
+
+    *dumped = 0;
+    for (int run = 0; run < BENCH_DUMP_ALL_RUNS; run++) {
+        double d = bench_now();
+        writer_init(&out, sink, RECORD_STYLE_LONG);
+        export_dump(path, NULL, NULL, &out);
+        writer_close(&out);
+        d = bench_now() - d;
+        *dumped = run && *dumped < d ? *dumped : d;
+    }
+    remove(path);
+    return t;
+}
+
+// Summarize every year of the journal (from the indexes alone when
+// "index_only" is set)
+static double bench_stats_report(struct BenchJournal *bench, FILE *sink, int index_only) {
+    struct DumpFilter filter;
+    double best = 0;
+
+    calendar_year_range(BENCH_FIRST_YEAR, &filter.since, &filter.until);
+    calendar_year_range(BENCH_FIRST_YEAR + bench->years - 1, &filter.until, &filter.until);
+    for (int run = 0; run < BENCH_DUMP_ALL_RUNS; run++) {
+        struct Writer out;
+        double t = bench_now();
+        writer_init(&out, sink, RECORD_STYLE_LONG);
+        report_run(bench->root, &filter, index_only, &out);
+        writer_close(&out);
+        t = bench_now() - t;
+        best = run && best < t ? best : t;
+    }
+    return best;
+}
+
+// Visit every day file of the journal
+static int day_path(struct BenchJournal *bench, size_t i, char *path) {
+    size_t per_year = (size_t) WEEK_MAX * 7;
+    int year = BENCH_FIRST_YEAR + (int) (i / per_year);
+    int week = (int) (i % per_year / 7);
+    int day = (int) (i % 7);
+
+    if (year >= BENCH_FIRST_YEAR + bench->years) {
+        return 0;
+    }
+    sprintf(path, "%s%c%d%c%d%c%d", bench->root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+    return 1;
+}
+
+// record_read() over every day file
+static double bench_record_read(struct BenchJournal *bench, size_t *records) {
+    char path[PATH_MAX];
+    double best = 0;
+
+    for (int run = 0; run < BENCH_PARSE_RUNS; run++) {
+        double t = bench_now();
+        *records = 0;
+        for (size_t i = 0; day_path(bench, i, path); i++) {
+            struct Record *record;
+            FILE *fp;
+
+            if (!(fp = fopen(path, "rb"))) {
+                continue;
+            }
+            while ((record = record_read(&fp)) != NULL) {
+                (*records)++;
+                record_free(record);
+            }
+            fclose(fp);
+        }
+        t = bench_now() - t;
+        best = run && best < t ? best : t;
+    }
+    return best;
+}
+
+// Scanner and record views (no copies) over every day file
+static double bench_scan(struct BenchJournal *bench, size_t *records) {
+    char path[PATH_MAX];
+    double best = 0;
+
+    for (int run = 0; run < BENCH_PARSE_RUNS; run++) {
+        double t = bench_now();
+        *records = 0;
+        for (size_t i = 0; day_path(bench, i, path); i++) {
+            struct RecordScanner scanner;
+            struct RecordSpan span;
+            struct RecordView view;
+
+            if (scanner_open(&scanner, path) < 0) {
+                continue;
+            }
+            while (scanner_next(&scanner, &span) > 0) {
+                *records += record_view_from_span(&view, &span) == 0;
+            }
+            scanner_close(&scanner);
+        }
+        t = bench_now() - t;
+        best = run && best < t ? best : t;
+    }
+    return best;
+}
+
+// record_parse() over records already in memory. It only understands the
+// control code format, so version 2 journals are converted first.
+static double bench_record_parse(struct BenchJournal *bench, size_t *records, size_t *bytes) {
+    struct Buffer contents;
+    char path[PATH_MAX];
+    size_t *offsets;
+    size_t count;
+    size_t size;
+    double best = 0;
+
+    buffer_init(&contents);
+    offsets = NULL;
+    count = 0;
+    size = 0;
+    for (size_t i = 0; day_path(bench, i, path); i++) {
+        struct RecordScanner scanner;
+        struct RecordSpan span;
+
+        if (scanner_open(&scanner, path) < 0) {
+            continue;
+        }
+        while (scanner_next(&scanner, &span) > 0) {
+            if (!span.text) {
+                continue;
+            }
+            if (count == size) {
+                size = size ? size * 2 : 1024;
+                if (!(offsets = realloc(offsets, size * sizeof(*offsets)))) {
+                    perror("Unable to allocate offsets");
+                    exit(1);
+                }
+            }
+            offsets[count++] = contents.len;
+            buffer_append(&contents, span.header, span.header_len);
+            buffer_append(&contents, RECORD_SOT "\n", strlen(RECORD_SOT "\n"));
+            buffer_append(&contents, span.text, span.text_len);
+            buffer_append(&contents, "", 1);
+        }
+        scanner_close(&scanner);
+    }
+    *bytes = contents.len;
+
+    for (int run = 0; run < BENCH_PARSE_RUNS; run++) {
+        double t = bench_now();
+        *records = 0;
+        for (size_t i = 0; i < count; i++) {
+            struct Record *record = record_parse(contents.data + offsets[i]);
+            *records += record != NULL;
+            record_free(record);
+        }
+        t = bench_now() - t;
+        best = run && best < t ? best : t;
+    }
+
+    free(offsets);
+    buffer_free(&contents);
+    return best;
+}
+
+// Append single entries the way "weekly -" does
+static double bench_write(struct BenchJournal *bench) {
+    char path[PATH_MAX];
+    char header[1024];
+    const char *message = "Wrote one more entry for the benchmark.";
+    int year = BENCH_FIRST_YEAR + bench->years - 1;
+    double t;
+
+    snprintf(header, sizeof(header), FMT_HEADER, "06/24/2020", "17:00:00", "user0", "host0.example.com");
+    t = bench_now();
+    for (int i = 0; i < BENCH_WRITES; i++) {
+        uint64_t offset;
+        int lock;
+
+        if (!make_output_path(bench->root, path, year, BENCH_WEEK, 3)
+            || (lock = segment_lock_week(bench->root, year, BENCH_WEEK)) < 0) {
+            perror("Unable to write entry");
+            exit(1);
+        }
+        if (append_record(path, header, message, strlen(message), &offset) < 0) {
+            perror("Unable to write entry");
+            exit(1);
+        }
+        file_unlock(lock);
+        if (index_add_record(bench->root, year, BENCH_WEEK, 3, path, offset) < 0) {
+            perror("Unable to write entry");
+            exit(1);
+        }
+    }
+    return bench_now() - t;
+}
+
+int main(int argc, char *argv[]) {
+    struct BenchJournal bench;
+    const char *tmpdir;
+    double generated;
+    double elapsed;
+    double dumped;
+    size_t records;
+    size_t bytes;
+    FILE *sink;
+    int keep;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.first_year = BENCH_FIRST_YEAR;
+    bench.week = BENCH_WEEK;
+    bench.years = 2;
+    bench.entries = 10;
+    bench.message_size = 256;
+    bench.users = 8;
+    bench.format = RECORD_FORMAT_V1;
+    keep = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(argv[i], "-k")) {
+            keep = 1;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "%s requires a value\n", argv[i]);
+            return 1;
+        }
+        if (!strcmp(argv[i], "-y")) {
+            bench.years = atoi(value);
+        } else if (!strcmp(argv[i], "-e")) {
+            bench.entries = atoi(value);
+        } else if (!strcmp(argv[i], "-m")) {
+            bench.message_size = (size_t) strtoul(value, NULL, 10);
+        } else if (!strcmp(argv[i], "-u")) {
+            bench.users = atoi(value);
+        } else if (!strcmp(argv[i], "-f")) {
+            bench.format = atoi(value);
+        } else if (!strcmp(argv[i], "-j")) {
+            dump_jobs = atoi(value);
+        } else if (!strcmp(argv[i], "-r")) {
+            snprintf(bench.root, sizeof(bench.root), "%s", value);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+    if (bench.years < 1 || bench.entries < 1 || bench.message_size < 1 || bench.users < 1
+        || (bench.format != RECORD_FORMAT_V1 && bench.format != RECORD_FORMAT_V2) || dump_jobs < 0) {
+        fprintf(stderr, "Invalid benchmark parameters\n");
+        return 1;
+    }
+    record_format = bench.format;
+
+    if (!*bench.root) {
+        tmpdir = getenv("TMPDIR");
+        if (!tmpdir) {
+            tmpdir = HAVE_WINDOWS ? "." : "/tmp";
+        }
+        sprintf(bench.root, "%s%cweekly_bench.%d", tmpdir, DIRSEP_C, (int) time(NULL));
+    }
+    if (access(bench.root, F_OK) == 0) {
+        fprintf(stderr, "%s already exists\n", bench.root);
+        return 1;
+    }
+
+    // Dumped records are discarded
+    sink = fopen(HAVE_WINDOWS ? "NUL" : "/dev/null", "wb");
+    if (!sink) {
+        perror("Unable to open null device");
+        return 1;
+    }
+
+    generated = bench_now();
+    bench_generate(&bench);
+    generated = bench_now() - generated;
+
+    printf("{\n");
+    printf("  \"config\": {\"years\": %d, \"entries_per_day\": %d, \"message_size\": %lu, \"users\": %d, "
+           "\"format\": %d, \"jobs\": %d},\n",
+           bench.years, bench.entries, (unsigned long) bench.message_size, bench.users, bench.format, dump_jobs);
+    report("generate", 1, generated, bench.records, bench.bytes, 0);
+
+    elapsed = bench_dump_week(&bench, sink);
+    report("dump_week", BENCH_DUMP_WEEK_RUNS, elapsed, bench.week_records, bench.week_bytes, 0);
+    elapsed = bench_dump_all(&bench, sink);
+    report("dump_all", BENCH_DUMP_ALL_RUNS, elapsed, bench.records, bench.bytes, 0);
+    // The same dumps without memory mapped files
+    scanner_mmap = 0;
+    elapsed = bench_dump_week(&bench, sink);
+    report("dump_week_stdio", BENCH_DUMP_WEEK_RUNS, elapsed, bench.week_records, bench.week_bytes, 0);
+    elapsed = bench_dump_all(&bench, sink);
+    report("dump_all_stdio", BENCH_DUMP_ALL_RUNS, elapsed, bench.records, bench.bytes, 0);
+    scanner_mmap = 1;
+    elapsed = bench_export(&bench, sink, &dumped);
+    report("export_write", 1, elapsed, bench.records, bench.bytes, 0);
+    report("dump_all_export", BENCH_DUMP_ALL_RUNS, dumped, bench.records, bench.bytes, 0);
+    elapsed = bench_stats_report(&bench, sink, 0);
+    report("stats_report", BENCH_DUMP_ALL_RUNS, elapsed, bench.records, bench.bytes, 0);
+    elapsed = bench_stats_report(&bench, sink, 1);
+    report("stats_report_index", BENCH_DUMP_ALL_RUNS, elapsed, bench.records, bench.bytes, 0);
+    elapsed = bench_record_read(&bench, &records);
+    report("parse_record_read", BENCH_PARSE_RUNS, elapsed, records, bench.bytes, 0);
+    elapsed = bench_scan(&bench, &records);
+    report("parse_scan", BENCH_PARSE_RUNS, elapsed, records, bench.bytes, 0);
+    elapsed = bench_record_parse(&bench, &records, &bytes);
+    report("parse_record_parse", BENCH_PARSE_RUNS, elapsed, records, bytes, 0);
+
+    // Last, because it adds to the journal
+    elapsed = bench_write(&bench);
+    printf("  \"write_one_entry\": {\"runs\": %d, \"seconds\": %.6f, \"us_per_entry\": %.2f}\n",
+           BENCH_WRITES, elapsed, elapsed / BENCH_WRITES * 1e6);
+    printf("}\n");
+
+    fclose(sink);
+    if (keep) {
+        fprintf(stderr, "Journal kept in %s\n", bench.root);
+    } else {
+        bench_remove_tree(bench.root);
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include "weekly.h"
+#include <stdarg.h>
+
+void buffer_init(struct Buffer *buffer) {
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->size = 0;
+}
+
+void buffer_free(struct Buffer *buffer) {
+    free(buffer->data);
+    buffer_init(buffer);
+}
+
+int buffer_reserve(struct Buffer *buffer, size_t len) {
+    size_t size;
+    char *data;
+
+    if (buffer->len + len + 1 <= buffer->size) {
+        return 0;
+    }
+    size = buffer->size ? buffer->size : BUFSIZ;
+    while (size < buffer->len + len + 1) {
+        size *= 2;
+    }
+    data = realloc(buffer->data, size);
+    if (!data) {
+        perror("Unable to allocate output buffer");
+        return -1;
+    }
+    STATS_ADD(STAT_ALLOCATIONS, 1);
+    buffer->data = data;
+    buffer->size = size;
+    return 0;
+}
+
+int buffer_append(struct Buffer *buffer, const char *data, size_t len) {
+    if (buffer_reserve(buffer, len) < 0) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return 0;
+}
+
+int buffer_read(struct Buffer *buffer, FILE *fp) {
+    size_t count;
+
+    do {
+        if (buffer_reserve(buffer, BUFSIZ) < 0) {
+            return -1;
+        }
+        count = fread(buffer->data + buffer->len, sizeof(char), buffer->size - buffer->len - 1, fp);
+        buffer->len += count;
+        buffer->data[buffer->len] = '\0';
+    } while (count > 0);
+    return ferror(fp) ? -1 : 0;
+}
+
+// Append one line (including its line feed) to the buffer. Returns the number
+// of bytes read, 0 at end of file, or -1 on error.
+int buffer_read_line(struct Buffer *buffer, FILE *fp) {
+    size_t start;
+    size_t len;
+
+    start = buffer->len;
+    do {
+        if (buffer_reserve(buffer, BUFSIZ) < 0) {
+            return -1;
+        }
+        if (!fgets(buffer->data + buffer->len, (int) (buffer->size - buffer->len), fp)) {
+            break;
+        }
+        len = strlen(buffer->data + buffer->len);
+        buffer->len += len;
+    } while (len && buffer->data[buffer->len - 1] != '\n');
+
+    if (ferror(fp)) {
+        return -1;
+    }
+    if (buffer->data) {
+        buffer->data[buffer->len] = '\0';
+    }
+    return (int) (buffer->len - start);
+}
+
+int buffer_printf(struct Buffer *buffer, const char *fmt, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0 || buffer_reserve(buffer, (size_t) len) < 0) {
+        return -1;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(buffer->data + buffer->len, (size_t) len + 1, fmt, args);
+    va_end(args);
+    buffer->len += (size_t) len;
+    return len;
+}
+
+int buffer_append_csv(struct Buffer *buffer, const char *data, size_t len, int quote) {
+    size_t run;
+
+    // Quote fields containing separators, quotes or line breaks
+    if (!quote) {
+        for (size_t i = 0; i < len && !quote; i++) {
+            quote = data[i] == ',' || data[i] == '"' || data[i] == '\n' || data[i] == '\r';
+        }
+    }
+    if (!quote) {
+        return buffer_append(buffer, data, len);
+    }
+
+    if (buffer_reserve(buffer, len + 2) < 0) {
+        return -1;
+    }
+    buffer->data[buffer->len++] = '"';
+    run = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '"') {
+            continue;
+        }
+        // Copy through the quote, then double it
+        if (buffer_append(buffer, data + run, i + 1 - run) < 0 || buffer_append(buffer, "\"", 1) < 0) {
+            return -1;
+        }
+        run = i + 1;
+    }
+    if (buffer_append(buffer, data + run, len - run) < 0) {
+        return -1;
+    }
+    return buffer_append(buffer, "\"", 1);
+}
+
+int buffer_append_json(struct Buffer *buffer, const char *data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run;
+
+    if (buffer_append(buffer, "\"", 1) < 0) {
+        return -1;
+    }
+    run = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) data[i];
+        char escape[7];
+        size_t escape_len;
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        escape[0] = '\\';
+        escape_len = 2;
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            default:
+                memcpy(escape + 1, "u00", 3);
+                escape[4] = hex[c >> 4];
+                escape[5] = hex[c & 0xf];
+                escape_len = 6;
+                break;
+        }
+        // Copy the run of plain characters, then the escape sequence
+        if (buffer_append(buffer, data + run, i - run) < 0 || buffer_append(buffer, escape, escape_len) < 0) {
+            return -1;
+        }
+        run = i + 1;
+    }
+    if (buffer_append(buffer, data + run, len - run) < 0) {
+        return -1;
+    }
+    return buffer_append(buffer, "\"", 1);
+}
@@ -0,0 +1,426 @@
+#include "weekly.h"
+
+// Days are counted from 1970-01-01. The Gregorian calendar repeats every
+// 400 years (146097 days, a whole number of weeks), so one cycle of
+// precomputed year starts places any day in O(1).
+#define CALENDAR_CYCLE_DAYS 146097
+#define CALENDAR_DAYS_2000 10957        // 1970-01-01 to 2000-01-01
+
+int calendar_scheme = CALENDAR_ISO;
+
+// Days from 2000-01-01 to the first day of each year of the cycle starting
+// in 2000, and to the Monday of its ISO week 1
+static const int32_t calendar_years[401] = {
+    0, 366, 731, 1096, 1461, 1827, 2192, 2557, 2922, 3288,
+    3653, 4018, 4383, 4749, 5114, 5479, 5844, 6210, 6575, 6940,
+    7305, 7671, 8036, 8401, 8766, 9132, 9497, 9862, 10227, 10593,
+    10958, 11323, 11688, 12054, 12419, 12784, 13149, 13515, 13880, 14245,
+    14610, 14976, 15341, 15706, 16071, 16437, 16802, 17167, 17532, 17898,
+    18263, 18628, 18993, 19359, 19724, 20089, 20454, 20820, 21185, 21550,
+    21915, 22281, 22646, 23011, 23376, 23742, 24107, 24472, 24837, 25203,
+    25568, 25933, 26298, 26664, 27029, 27394, 27759, 28125, 28490, 28855,
+    29220, 29586, 29951, 30316, 30681, 31047, 31412, 31777, 32142, 32508,
+    32873, 33238, 33603, 33969, 34334, 34699, 35064, 35430, 35795, 36160,
+    36525, 36890, 37255, 37620, 37985, 38351, 38716, 39081, 39446, 39812,
+    40177, 40542, 40907, 41273, 41638, 42003, 42368, 42734, 43099, 43464,
+    43829, 44195, 44560, 44925, 45290, 45656, 46021, 46386, 46751, 47117,
+    47482, 47847, 48212, 48578, 48943, 49308, 49673, 50039, 50404, 50769,
+    51134, 51500, 51865, 52230, 52595, 52961, 53326, 53691, 54056, 54422,
+    54787, 55152, 55517, 55883, 56248, 56613, 56978, 57344, 57709, 58074,
+    58439, 58805, 59170, 59535, 59900, 60266, 60631, 60996, 61361, 61727,
+    62092, 62457, 62822, 63188, 63553, 63918, 64283, 64649, 65014, 65379,
+    65744, 66110, 66475, 66840, 67205, 67571, 67936, 68301, 68666, 69032,
+    69397, 69762, 70127, 70493, 70858, 71223, 71588, 71954, 72319, 72684,
+    73049, 73414, 73779, 74144, 74509, 74875, 75240, 75605, 75970, 76336,
+    76701, 77066, 77431, 77797, 78162, 78527, 78892, 79258, 79623, 79988,
+    80353, 80719, 81084, 81449, 81814, 82180, 82545, 82910, 83275, 83641,
+    84006, 84371, 84736, 85102, 85467, 85832, 86197, 86563, 86928, 87293,
+    87658, 88024, 88389, 88754, 89119, 89485, 89850, 90215, 90580, 90946,
+    91311, 91676, 92041, 92407, 92772, 93137, 93502, 93868, 94233, 94598,
+    94963, 95329, 95694, 96059, 96424, 96790, 97155, 97520, 97885, 98251,
+    98616, 98981, 99346, 99712, 100077, 100442, 100807, 101173, 101538, 101903,
+    102268, 102634, 102999, 103364, 103729, 104095, 104460, 104825, 105190, 105556,
+    105921, 106286, 106651, 107017, 107382, 107747, 108112, 108478, 108843, 109208,
+    109573, 109938, 110303, 110668, 111033, 111399, 111764, 112129, 112494, 112860,
+    113225, 113590, 113955, 114321, 114686, 115051, 115416, 115782, 116147, 116512,
+    116877, 117243, 117608, 117973, 118338, 118704, 119069, 119434, 119799, 120165,
+    120530, 120895, 121260, 121626, 121991, 122356, 122721, 123087, 123452, 123817,
+    124182, 124548, 124913, 125278, 125643, 126009, 126374, 126739, 127104, 127470,
+    127835, 128200, 128565, 128931, 129296, 129661, 130026, 130392, 130757, 131122,
+    131487, 131853, 132218, 132583, 132948, 133314, 133679, 134044, 134409, 134775,
+    135140, 135505, 135870, 136236, 136601, 136966, 137331, 137697, 138062, 138427,
+    138792, 139158, 139523, 139888, 140253, 140619, 140984, 141349, 141714, 142080,
+    142445, 142810, 143175, 143541, 143906, 144271, 144636, 145002, 145367, 145732,
+    146097,
+};
+
+static const int32_t calendar_iso_years[401] = {
+    2, 366, 730, 1094, 1458, 1829, 2193, 2557, 2921, 3285,
+    3656, 4020, 4384, 4748, 5112, 5476, 5847, 6211, 6575, 6939,
+    7303, 7674, 8038, 8402, 8766, 9130, 9494, 9865, 10229, 10593,
+    10957, 11321, 11685, 12056, 12420, 12784, 13148, 13512, 13883, 14247,
+    14611, 14975, 15339, 15703, 16074, 16438, 16802, 17166, 17530, 17901,
+    18265, 18629, 18993, 19357, 19721, 20092, 20456, 20820, 21184, 21548,
+    21912, 22283, 22647, 23011, 23375, 23739, 24110, 24474, 24838, 25202,
+    25566, 25930, 26301, 26665, 27029, 27393, 27757, 28128, 28492, 28856,
+    29220, 29584, 29948, 30319, 30683, 31047, 31411, 31775, 32139, 32510,
+    32874, 33238, 33602, 33966, 34337, 34701, 35065, 35429, 35793, 36157,
+    36528, 36892, 37256, 37620, 37984, 38348, 38719, 39083, 39447, 39811,
+    40175, 40539, 40910, 41274, 41638, 42002, 42366, 42737, 43101, 43465,
+    43829, 44193, 44557, 44928, 45292, 45656, 46020, 46384, 46748, 47119,
+    47483, 47847, 48211, 48575, 48946, 49310, 49674, 50038, 50402, 50766,
+    51137, 51501, 51865, 52229, 52593, 52964, 53328, 53692, 54056, 54420,
+    54784, 55155, 55519, 55883, 56247, 56611, 56975, 57346, 57710, 58074,
+    58438, 58802, 59173, 59537, 59901, 60265, 60629, 60993, 61364, 61728,
+    62092, 62456, 62820, 63191, 63555, 63919, 64283, 64647, 65011, 65382,
+    65746, 66110, 66474, 66838, 67202, 67573, 67937, 68301, 68665, 69029,
+    69400, 69764, 70128, 70492, 70856, 71220, 71591, 71955, 72319, 72683,
+    73047, 73411, 73782, 74146, 74510, 74874, 75238, 75602, 75973, 76337,
+    76701, 77065, 77429, 77800, 78164, 78528, 78892, 79256, 79620, 79991,
+    80355, 80719, 81083, 81447, 81811, 82182, 82546, 82910, 83274, 83638,
+    84009, 84373, 84737, 85101, 85465, 85829, 86200, 86564, 86928, 87292,
+    87656, 88027, 88391, 88755, 89119, 89483, 89847, 90218, 90582, 90946,
+    91310, 91674, 92038, 92409, 92773, 93137, 93501, 93865, 94236, 94600,
+    94964, 95328, 95692, 96056, 96427, 96791, 97155, 97519, 97883, 98254,
+    98618, 98982, 99346, 99710, 100074, 100445, 100809, 101173, 101537, 101901,
+    102265, 102636, 103000, 103364, 103728, 104092, 104463, 104827, 105191, 105555,
+    105919, 106283, 106654, 107018, 107382, 107746, 108110, 108481, 108845, 109209,
+    109573, 109937, 110301, 110665, 111036, 111400, 111764, 112128, 112492, 112863,
+    113227, 113591, 113955, 114319, 114683, 115054, 115418, 115782, 116146, 116510,
+    116874, 117245, 117609, 117973, 118337, 118701, 119072, 119436, 119800, 120164,
+    120528, 120892, 121263, 121627, 121991, 122355, 122719, 123090, 123454, 123818,
+    124182, 124546, 124910, 125281, 125645, 126009, 126373, 126737, 127101, 127472,
+    127836, 128200, 128564, 128928, 129299, 129663, 130027, 130391, 130755, 131119,
+    131490, 131854, 132218, 132582, 132946, 133317, 133681, 134045, 134409, 134773,
+    135137, 135508, 135872, 136236, 136600, 136964, 137328, 137699, 138063, 138427,
+    138791, 139155, 139526, 139890, 140254, 140618, 140982, 141346, 141717, 142081,
+    142445, 142809, 143173, 143544, 143908, 144272, 144636, 145000, 145364, 145735,
+    146099,
+};
+
+static const int calendar_months[2][13] = {
+    {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365},
+    {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366},
+};
+
+static long floor_div(long a, long b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static int calendar_leap(int year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// The first day of the 400 year cycle holding a year, and the year's
+// position in it
+static long calendar_cycle(int year, int *i) {
+    long cycle = floor_div(year - 2000, 400);
+    *i = (int) (year - 2000 - cycle * 400);
+    return CALENDAR_DAYS_2000 + cycle * CALENDAR_CYCLE_DAYS;
+}
+
+// First day of a year (January 1st)
+static long calendar_year_start(int year) {
+    int i;
+    long base = calendar_cycle(year, &i);
+    return base + calendar_years[i];
+}
+
+// First day of an ISO year (the Monday of week 1)
+static long calendar_iso_start(int year) {
+    int i;
+    long base = calendar_cycle(year, &i);
+    return base + calendar_iso_years[i];
+}
+
+// 0 (Sunday) to 6 (Saturday). 1970-01-01 was a Thursday.
+static int calendar_wday(long days) {
+    return (int) (((days + 4) % 7 + 7) % 7);
+}
+
+// The year holding a day, and the day's offset in it
+static int calendar_year_of(long days, int *yday) {
+    long cycle;
+    long r;
+    int i;
+
+    r = days - CALENDAR_DAYS_2000;
+    cycle = floor_div(r, CALENDAR_CYCLE_DAYS);
+    r -= cycle * CALENDAR_CYCLE_DAYS;
+    // Years have at most 366 days, so this is never past the right year
+    i = (int) (r / 366);
+    while (calendar_years[i + 1] <= r) {
+        i++;
+    }
+    *yday = (int) (r - calendar_years[i]);
+    return (int) (2000 + cycle * 400 + i);
+}
+
+long calendar_days(int year, int month, int mday) {
+    return calendar_year_start(year) + calendar_months[calendar_leap(year)][month - 1] + mday - 1;
+}
+
+void calendar_date(long days, int *year, int *month, int *mday) {
+    const int *months;
+    int yday;
+
+    *year = calendar_year_of(days, &yday);
+    months = calendar_months[calendar_leap(*year)];
+    for (*month = 1; yday >= months[*month]; (*month)++);
+    *mday = yday - months[*month - 1] + 1;
+}
+
+// Journal location of a day. ISO 8601 weeks start on Monday (day 0) and
+// week 1 holds the year's first Thursday, so a few days around New Year
+// belong to the neighbouring year. Legacy weeks start on Sunday (day 0) and
+// are cut at the end of the calendar year.
+int calendar_locate_days(long days, int *year, int *week, int *day) {
+    long offset;
+    int yday;
+
+    *year = calendar_year_of(days, &yday);
+    if (calendar_scheme == CALENDAR_LEGACY) {
+        *day = calendar_wday(days);
+        *week = (yday + 8 - *day) / 7;
+        return 0;
+    }
+    if (days < calendar_iso_start(*year)) {
+        (*year)--;
+    } else if (days >= calendar_iso_start(*year + 1)) {
+        (*year)++;
+    }
+    offset = days - calendar_iso_start(*year);
+    *week = (int) (offset / 7) + 1;
+    *day = (int) (offset % 7);
+    return 0;
+}
+
+// The day at a journal location. Returns -1 when there is no such day.
+int calendar_find(int year, int week, int day, long *days) {
+    if (day < 0 || day > 6) {
+        return -1;
+    }
+    if (calendar_scheme == CALENDAR_LEGACY) {
+        long start = calendar_year_start(year);
+        int wday = calendar_wday(start);
+        long yday = -wday + 7L * (week - (8 - wday) / 7) + day;
+
+        if (yday < 0 || yday >= 365 + calendar_leap(year)) {
+            return -1;
+        }
+        *days = start + yday;
+        return 0;
+    }
+    if (week < 1 || calendar_iso_start(year) + 7L * week > calendar_iso_start(year + 1)) {
+        return -1;
+    }
+    *days = calendar_iso_start(year) + 7L * (week - 1) + day;
+    return 0;
+}
+
+int calendar_locate_tm(const struct tm *tm_, int *year, int *week, int *day) {
+    return calendar_locate_days(calendar_days(tm_->tm_year + 1900, tm_->tm_mon + 1, tm_->tm_mday), year, week, day);
+}
+
+// Local midnight at the start of a day
+static time_t calendar_time(long days) {
+    struct tm tm_;
+    int year, month, mday;
+
+    calendar_date(days, &year, &month, &mday);
+    memset(&tm_, 0, sizeof(tm_));
+    tm_.tm_year = year - 1900;
+    tm_.tm_mon = month - 1;
+    tm_.tm_mday = mday;
+    tm_.tm_isdst = -1;
+    return mktime(&tm_);
+}
+
+// Move a week forward (or back, for negative "weeks"), into the
+// neighbouring years when needed
+int calendar_week_add(int *year, int *week, int weeks) {
+    long days;
+    int day;
+
+    if (calendar_scheme == CALENDAR_ISO) {
+        if (calendar_find(*year, *week, 0, &days) < 0) {
+            return -1;
+        }
+        return calendar_locate_days(days + 7L * weeks, year, week, &day);
+    }
+    // Legacy weeks are cut at New Year, so the week either side of it is
+    // counted in both years
+    for (; weeks < 0; weeks++) {
+        int y, first;
+        calendar_locate_days(calendar_year_start(*year), &y, &first, &day);
+        if (*week > first) {
+            (*week)--;
+        } else {
+            calendar_locate_days(calendar_year_start(*year) - 1, year, week, &day);
+        }
+    }
+    for (; weeks > 0; weeks--) {
+        int y, last;
+        calendar_locate_days(calendar_year_start(*year + 1) - 1, &y, &last, &day);
+        if (*week < last) {
+            (*week)++;
+        } else {
+            calendar_locate_days(calendar_year_start(*year + 1), year, week, &day);
+        }
+    }
+    return 0;
+}
+
+// Read exactly "width" digits
+static const char *parse_digits(const char *s, int width, int *value) {
+    *value = 0;
+    for (int i = 0; i < width; i++) {
+        if (!isdigit((unsigned char) s[i])) {
+            return NULL;
+        }
+        *value = *value * 10 + (s[i] - '0');
+    }
+    return s + width;
+}
+
+int calendar_parse(const char *s, time_t *result, int end_of_day) {
+    struct tm tm_;
+    const char *p;
+    int year, month, day;
+    int hour, minute, second;
+
+    // YYYY-MM-DD or MM/DD/YYYY (the record header format)
+    if ((p = parse_digits(s, 4, &year)) && *p == '-'
+        && (p = parse_digits(p + 1, 2, &month)) && *p == '-'
+        && (p = parse_digits(p + 1, 2, &day))) {
+        // ok
+    } else if ((p = parse_digits(s, 2, &month)) && *p == '/'
+               && (p = parse_digits(p + 1, 2, &day)) && *p == '/'
+               && (p = parse_digits(p + 1, 4, &year))) {
+        // ok
+    } else {
+        return -1;
+    }
+
+    // Optional time of day: [T| ]HH:MM[:SS]
+    if (end_of_day) {
+        hour = 23;
+        minute = 59;
+        second = 59;
+    } else {
+        hour = minute = second = 0;
+    }
+    if (*p == 'T' || *p == ' ') {
+        second = 0;
+        if (!(p = parse_digits(p + 1, 2, &hour)) || *p != ':' || !(p = parse_digits(p + 1, 2, &minute))) {
+            return -1;
+        }
+        if (*p == ':' && !(p = parse_digits(p + 1, 2, &second))) {
+            return -1;
+        }
+    }
+    if (*p != '\0' || month < 1 || month > 12 || day < 1 || day > 31
+        || hour > 23 || minute > 59 || second > 60) {
+        return -1;
+    }
+
+    memset(&tm_, 0, sizeof(tm_));
+    tm_.tm_year = year - 1900;
+    tm_.tm_mon = month - 1;
+    tm_.tm_mday = day;
+    tm_.tm_hour = hour;
+    tm_.tm_min = minute;
+    tm_.tm_sec = second;
+    tm_.tm_isdst = -1;
+    *result = mktime(&tm_);
+    return *result == (time_t) -1 ? -1 : 0;
+}
+
+int calendar_locate(time_t t, int *year, int *week, int *day_of_week) {
+    struct tm *tm_;
+
+    tm_ = localtime(&t);
+    if (!tm_) {
+        return -1;
+    }
+    return calendar_locate_tm(tm_, year, week, day_of_week);
+}
+
+time_t calendar_next_day(time_t t) {
+    struct tm tm_;
+    struct tm *now;
+
+    now = localtime(&t);
+    if (!now) {
+        return (time_t) -1;
+    }
+    tm_ = *now;
+    tm_.tm_mday++;
+    tm_.tm_hour = 0;
+    tm_.tm_min = 0;
+    tm_.tm_sec = 0;
+    tm_.tm_isdst = -1;
+    return mktime(&tm_);
+}
+
+// The first and last second of a journal week
+int calendar_week_range(int year, int week, time_t *since, time_t *until) {
+    long first, last;
+    long days;
+
+    first = last = -1;
+    for (int day = 0; day < 7; day++) {
+        if (calendar_find(year, week, day, &days) == 0) {
+            if (first < 0) {
+                first = days;
+            }
+            last = days;
+        }
+    }
+    if (first < 0) {
+        return -1;
+    }
+    *since = calendar_time(first);
+    *until = calendar_time(last + 1) - 1;
+    return 0;
+}
+
+// The first and last second of a journal year
+int calendar_year_range(int year, time_t *since, time_t *until) {
+    long first, next;
+
+    if (calendar_scheme == CALENDAR_LEGACY) {
+        first = calendar_year_start(year);
+        next = calendar_year_start(year + 1);
+    } else {
+        first = calendar_iso_start(year);
+        next = calendar_iso_start(year + 1);
+    }
+    *since = calendar_time(first);
+    *until = calendar_time(next);
+    if (*since == (time_t) -1 || *until == (time_t) -1) {
+        return -1;
+    }
+    (*until)--;
+    return 0;
+}
+
+// Journals record that they use ISO 8601 weeks with a marker file in the
+// root. A journal holding years without one was written with legacy weeks.
+int calendar_detect(const char *root) {
+    char path[PATH_MAX];
+    int years[1];
+
+    sprintf(path, "%s%c%s", root, DIRSEP_C, CALENDAR_FILENAME);
+    if (access(path, F_OK) == 0) {
+        return CALENDAR_ISO;
+    }
+    return dir_list_numeric(root, years, 1) > 0 ? CALENDAR_LEGACY : CALENDAR_ISO;
+}
+
+int calendar_mark(const char *root) {
+    char path[PATH_MAX];
+
+    sprintf(path, "%s%c%s", root, DIRSEP_C, CALENDAR_FILENAME);
+    return file_create(path, CALENDAR_MARKER, strlen(CALENDAR_MARKER));
+}
@@ -1,37 +1,574 @@
 #include "weekly.h"
 
-int dump_file(const char *filename, int style) {
-    FILE *fp;
-    fp = fopen(filename, "rb+");
-    if (!fp) {
+// Number of files dumped concurrently (0: one per processor)
+int dump_jobs = 0;
+
+static void dump_scanner(struct RecordScanner *scanner, struct Writer *out) {
+    struct RecordSpan span;
+    struct RecordView view;
+
+    while (scanner_next(scanner, &span) > 0) {
+        if (record_view_from_span(&view, &span) < 0) {
+            continue;
+        }
+        writer_record(out, &view);
+    }
+}
+
+int dump_file(const char *filename, struct Writer *out) {
+    struct RecordScanner scanner;
+
+    if (scanner_open(&scanner, filename) < 0) {
+        return -1;
+    }
+    dump_scanner(&scanner, out);
+    scanner_close(&scanner);
+    return 0;
+}
+
+static int dump_threads(void) {
+    return dump_jobs > 0 ? dump_jobs : cpu_count();
+}
+
+int dump_filter_match(const struct DumpFilter *filter, const struct RecordView *view) {
+    time_t t;
+
+    if (!filter) {
+        return 1;
+    }
+    t = record_view_timestamp(view);
+    if (t == (time_t) -1) {
+        return 0;
+    }
+    return t >= filter->since && t <= filter->until;
+}
+
+// Dump every day of a week segment with one open. Records go to "out" when
+// given, otherwise they are rendered into "output".
+static int dump_segment(const char *filename, int style, const struct DumpFilter *filter, struct Buffer *output, struct Writer *out) {
+    struct Segment segment;
+    struct Buffer block;
+    int status;
+
+    if (segment_open(&segment, filename) < 0) {
         return -1;
     }
-    struct Record *record;
-    while ((record = record_read(&fp)) != NULL) {
-        record_show(record, style);
-        record_free(record);
-        puts("");
+    buffer_init(&block);
+    status = 0;
+    for (int day = 0; day < 7 && status == 0; day++) {
+        struct RecordScanner scanner;
+        struct RecordSpan span;
+        struct RecordView view;
+
+        block.len = 0;
+        if ((status = segment_read(&segment, day, &block)) < 0 || !block.len) {
+            continue;
+        }
+        scanner_open_memory(&scanner, block.data, block.len);
+        while (scanner_next(&scanner, &span) > 0) {
+            if (record_view_from_span(&view, &span) < 0 || !dump_filter_match(filter, &view)) {
+                continue;
+            }
+            if (out) {
+                writer_record(out, &view);
+            } else {
+                record_view_format(output, &view, style);
+            }
+        }
+        scanner_close(&scanner);
     }
-    fclose(fp);
+    buffer_free(&block);
+    segment_close(&segment);
+    return status;
+}
+
+static int is_segment(const char *filename) {
+    size_t len = strlen(filename);
+    size_t suffix = strlen(SEGMENT_SUFFIX);
+    return len > suffix && !strcmp(filename + len - suffix, SEGMENT_SUFFIX);
+}
+
+int dump_file_buffer(const char *filename, int style, const struct DumpFilter *filter, struct Buffer *output) {
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+
+    if (is_segment(filename)) {
+        return dump_segment(filename, style, filter, output, NULL);
+    }
+    if (scanner_open(&scanner, filename) < 0) {
+        return -1;
+    }
+    while (scanner_next(&scanner, &span) > 0) {
+        if (record_view_from_span(&view, &span) < 0 || !dump_filter_match(filter, &view)) {
+            continue;
+        }
+        record_view_format(output, &view, style);
+    }
+    scanner_close(&scanner);
     return 0;
 }
 
-int dump_week(const char *root, int year, int week, int style) {
-    char path_week[PATH_MAX] = {0};
-    char path_year[PATH_MAX] = {0};
-    const int max_days = 7;
+static int compare_entry(const void *a, const void *b) {
+    const struct IndexEntry *x = a;
+    const struct IndexEntry *y = b;
+
+    if (x->week != y->week)
+        return x->week - y->week;
+    if (x->day != y->day)
+        return x->day - y->day;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Indexed records that follow each other are read together, up to this
+// many bytes at a time
+#define DUMP_READ_MAX (1 << 20)
+
+static int dump_entry_match(const struct DumpFilter *filter, const struct IndexEntry *entry) {
+    return !filter || (entry->timestamp >= filter->since && entry->timestamp <= filter->until);
+}
+
+// Dump the records of a day file at the offsets its (sorted) index entries
+// give, reading only the bytes they occupy. Records outside the filter are
+// not read at all. Records go to "out" when given, otherwise they are
+// rendered into "output". Returns -1, before anything is written, when the
+// file holds more than the indexed records.
+static int dump_day_indexed(const char *filename, const struct IndexEntry *entries, size_t count, int style,
+                            const struct DumpFilter *filter, struct Buffer *output, struct Writer *out) {
+    struct Buffer data;
+    struct stat st;
+    uint64_t end;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY | O_BINARY)) < 0) {
+        return -1;
+    }
+    // Records follow each other, allowing for the line feed that terminates
+    // a record, and the last one ends the file
+    end = 0;
+    for (size_t i = 0; i < count && end != (uint64_t) -1; i++) {
+        end = entries[i].offset >= end && entries[i].offset - end <= 1 ? entries[i].offset + entries[i].length : (uint64_t) -1;
+    }
+    if (end == (uint64_t) -1 || fstat(fd, &st) < 0 || ((uint64_t) st.st_size != end && (uint64_t) st.st_size != end + 1)) {
+        close(fd);
+        return -1;
+    }
+
+    buffer_init(&data);
+    for (size_t i = 0; i < count; ) {
+        uint64_t start;
+        uint64_t stop;
+        size_t j;
+
+        if (!dump_entry_match(filter, &entries[i])) {
+            i++;
+            continue;
+        }
+        start = entries[i].offset;
+        stop = start + entries[i].length;
+        for (j = i + 1; j < count && dump_entry_match(filter, &entries[j]); j++) {
+            if (entries[j].offset + entries[j].length - start > DUMP_READ_MAX) {
+                break;
+            }
+            stop = entries[j].offset + entries[j].length;
+        }
+        if (buffer_reserve(&data, (size_t) (stop - start)) < 0
+            || file_pread(fd, data.data, (size_t) (stop - start), start) < 0) {
+            fprintf(stderr, "Unable to read %s: %s\n", filename, strerror(errno));
+            break;
+        }
+
+        for (; i < j; i++) {
+            struct RecordScanner scanner;
+            struct RecordSpan span;
+            struct RecordView view;
+
+            // Damage is reported at its offset in the day file. A record
+            // torn within its indexed bytes ends the scan instead of being
+            // skipped, so it is reported here.
+            scanner_open_memory(&scanner, data.data + (entries[i].offset - start), entries[i].length);
+            scanner.name = strdup(filename);
+            scanner.base = (long) entries[i].offset;
+            if (scanner_next(&scanner, &span) <= 0) {
+                scanner_damaged(&scanner, 0);
+            } else if (span.offset == scanner.base && record_view_from_span(&view, &span) == 0
+                       && dump_filter_match(filter, &view)) {
+                if (out) {
+                    writer_record(out, &view);
+                } else {
+                    record_view_format(output, &view, style);
+                }
+            }
+            scanner_close(&scanner);
+        }
+    }
+    buffer_free(&data);
+    close(fd);
+    return 0;
+}
+
+// A day file that changed since it was indexed is read whole
+int dump_indexed_buffer(const char *filename, const struct IndexEntry *entries, size_t count, int style, const struct DumpFilter *filter, struct Buffer *output) {
+    if (dump_day_indexed(filename, entries, count, style, filter, output, NULL) == 0) {
+        return 0;
+    }
+    return dump_file_buffer(filename, style, filter, output);
+}
+
+static struct DumpJob *dump_job_add(struct DumpJob **jobs, size_t *count, size_t *size) {
+    struct DumpJob *job;
+
+    if (*count == *size) {
+        struct DumpJob *tmp;
+        *size = *size ? *size * 2 : 64;
+        tmp = realloc(*jobs, *size * sizeof(**jobs));
+        if (!tmp) {
+            perror("Unable to allocate dump jobs");
+            return NULL;
+        }
+        *jobs = tmp;
+    }
+    job = &(*jobs)[(*count)++];
+    memset(job, 0, sizeof(*job));
+    buffer_init(&job->output);
+    return job;
+}
+
+// Add the job dumping one day of a year: a compacted week is read from its
+// segment, a day file the index covers at the indexed offsets, and any
+// other day file as a whole. "next" walks the year's sorted index entries.
+static struct DumpJob *dump_job_day(struct DumpJob **jobs, size_t *count, size_t *size, const char *root, int year, int week, int day,
+                                    const struct IndexCoverage *coverage, const struct IndexEntry *entries, size_t nentries, size_t *next) {
+    struct DumpJob *job;
+    size_t i;
+
+    if (!(job = dump_job_add(jobs, count, size))) {
+        return NULL;
+    }
+    if (coverage->compacted[week]) {
+        segment_path(job->path, root, year, week);
+        return job;
+    }
+    sprintf(job->path, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+    if (!(coverage->covered[week] & (1 << day))) {
+        return job;
+    }
+    for (i = *next; i < nentries && (entries[i].week < week || (entries[i].week == week && entries[i].day < day)); i++);
+    for (*next = i; *next < nentries && entries[*next].week == week && entries[*next].day == day; (*next)++);
+    if (*next > i) {
+        job->entries = &entries[i];
+        job->nentries = *next - i;
+    }
+    return job;
+}
 
-    sprintf(path_year, "%s%c%d", root, DIRSEP_C, year);
-    sprintf(path_week, "%s%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week);
+// Dump weeks first through last of a year. Only the files holding data are
+// touched, by a pool of worker threads. The index names the files and the
+// records to read, and directories are only listed when they changed since
+// the index was written. Returns -1 when none of the weeks holds data.
+static int dump_weeks(const char *root, int year, int first, int last, struct Writer *out) {
+    struct IndexCoverage coverage;
+    struct IndexEntry *entries;
+    struct DumpJob *jobs;
+    size_t count;
+    size_t njobs;
+    size_t size;
+    size_t next;
+    int found;
+    int status;
 
-    if (!dir_empty(path_year)) {
+    entries = NULL;
+    count = 0;
+    if (index_load(root, year, &entries, &count) == 0) {
+        qsort(entries, count, sizeof(*entries), compare_entry);
+    }
+    if (index_coverage(root, year, first, last, entries, count, 0, &coverage) < 0) {
+        free(entries);
         return -1;
     }
+    found = 0;
+    for (int week = first; week <= last && week <= WEEK_MAX; week++) {
+        found |= coverage.present[week];
+    }
+    if (!found) {
+        free(entries);
+        return -1;
+    }
+
+    jobs = NULL;
+    njobs = 0;
+    size = 0;
+    next = 0;
+    status = 0;
+    for (int week = first; week <= last && week <= WEEK_MAX && status == 0; week++) {
+        for (int day = 0; day < 7; day++) {
+            if (!(coverage.present[week] & (1 << day))) {
+                continue;
+            }
+            if (!dump_job_day(&jobs, &njobs, &size, root, year, week, day, &coverage, entries, count, &next)) {
+                status = -1;
+                break;
+            }
+            // A segment holds the whole week
+            if (coverage.compacted[week]) {
+                break;
+            }
+        }
+    }
+
+    engine_dump(jobs, njobs, dump_threads(), out);
+    free(jobs);
+    free(entries);
+    return 0;
+}
+
+int dump_week(const char *root, int year, int week, struct Writer *out) {
+    return dump_weeks(root, year, week, week, out);
+}
+
+int dump_year(const char *root, int year, int week, struct Writer *out) {
+    return dump_weeks(root, year, week, WEEK_MAX - 1, out);
+}
+
+int dump_range(const char *root, const struct DumpFilter *filter, struct Writer *out) {
+    struct IndexCoverage coverage;
+    struct IndexEntry **indexes;
+    struct IndexEntry *entries;
+    struct DumpJob *jobs;
+    struct DumpJob *job;
+    size_t nindexes;
+    size_t count;
+    size_t njobs;
+    size_t size;
+    size_t next;
+    int current_year;
+    int have_year;
+
+    jobs = NULL;
+    njobs = 0;
+    size = 0;
+    indexes = NULL;
+    nindexes = 0;
+    entries = NULL;
+    count = 0;
+    next = 0;
+    current_year = -1;
+    have_year = 0;
+
+    // Visit each calendar day in the range once. A day maps to exactly one
+    // YEAR/WEEK/DAY file, and only the files holding data are opened. A
+    // compacted week is read from its segment once, when its first day in
+    // the range is reached.
+    for (time_t t = filter->since; t != (time_t) -1 && t <= filter->until; t = calendar_next_day(t)) {
+        int year, week, day;
+
+        if (calendar_locate(t, &year, &week, &day) < 0) {
+            break;
+        }
+
+        if (year != current_year) {
+            struct IndexEntry **tmp;
+
+            current_year = year;
+            entries = NULL;
+            count = 0;
+            next = 0;
+            // The entries are kept until the jobs pointing into them are done
+            if (index_load(root, year, &entries, &count) == 0) {
+                if (!(tmp = realloc(indexes, (nindexes + 1) * sizeof(*indexes)))) {
+                    perror("Unable to allocate dump jobs");
+                    free(entries);
+                    break;
+                }
+                indexes = tmp;
+                indexes[nindexes++] = entries;
+                qsort(entries, count, sizeof(*entries), compare_entry);
+            }
+            have_year = index_coverage(root, year, 0, WEEK_MAX, entries, count, 0, &coverage) == 0;
+        }
+        if (!have_year || week > WEEK_MAX || !(coverage.present[week] & (1 << day))) {
+            continue;
+        }
+        if (!(job = dump_job_day(&jobs, &njobs, &size, root, year, week, day, &coverage, entries, count, &next))) {
+            break;
+        }
+        job->filter = filter;
+        if (coverage.compacted[week]) {
+            coverage.present[week] = 0;
+        }
+    }
 
-    for (int i = 0; i < max_days; i++) {
-        char tmp[PATH_MAX];
-        sprintf(tmp, "%s%c%d", path_week, DIRSEP_C, i);
-        dump_file(tmp, style);
+    engine_dump(jobs, njobs, dump_threads(), out);
+    free(jobs);
+    for (size_t i = 0; i < nindexes; i++) {
+        free(indexes[i]);
     }
+    free(indexes);
     return 0;
 }
+
+int dump_query(const char *root, const struct DumpQuery *query, struct Writer *out) {
+    if (query->pattern) {
+        return search_grep(root, query->pattern, query->filter, 1, out);
+    }
+    if (query->filter) {
+        return dump_range(root, query->filter, out);
+    }
+    if (query->all) {
+        return dump_year(root, query->year, query->week, out);
+    }
+    return dump_week(root, query->year, query->week, out);
+}
+
+// Collect the records of one journal as length prefixed records
+static int dump_aggregate_job(struct DumpJob *job, int style) {
+    struct DumpQuery query;
+    struct DumpFilter filter;
+    struct Writer collect;
+
+    // A range without a start begins with the journal's first year
+    query = *(const struct DumpQuery *) job->context;
+    if (query.filter && query.filter->since == 0) {
+        int years[DIR_LIST_MAX];
+        char first[255];
+
+        if (dir_list_numeric(job->path, years, DIR_LIST_MAX) <= 0) {
+            return 0;
+        }
+        filter = *query.filter;
+        sprintf(first, "%04d-01-01", years[0]);
+        calendar_parse(first, &filter.since, 0);
+        query.filter = &filter;
+    }
+
+    writer_init(&collect, NULL, style);
+    dump_query(job->path, &query, &collect);
+    job->output = collect.buffer;
+    return 0;
+}
+
+struct AggregateRecord {
+    int64_t timestamp;
+    size_t sequence;
+    struct RecordView view;
+};
+
+static int aggregate_group;
+
+static int compare_slice(const struct Slice *a, const struct Slice *b) {
+    int cmp;
+
+    cmp = memcmp(a->ptr, b->ptr, a->len < b->len ? a->len : b->len);
+    if (cmp) {
+        return cmp;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+static int compare_aggregate(const void *a, const void *b) {
+    const struct AggregateRecord *x = a;
+    const struct AggregateRecord *y = b;
+    int cmp;
+
+    if (aggregate_group == DUMP_GROUP_AUTHOR && (cmp = compare_slice(&x->view.user, &y->view.user)) != 0)
+        return cmp;
+    if (aggregate_group == DUMP_GROUP_HOST && (cmp = compare_slice(&x->view.host, &y->view.host)) != 0)
+        return cmp;
+    if (x->timestamp != y->timestamp)
+        return (x->timestamp > y->timestamp) - (x->timestamp < y->timestamp);
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+// Dump the same records from every journal below "parent" (i.e. the
+// per-user directories of a shared root) as one stream ordered by time,
+// optionally grouped by author or host. Journals are read concurrently.
+// Returns the number of records written.
+long dump_aggregate(const char *parent, const struct DumpQuery *query, int group, struct Writer *out) {
+    struct AggregateRecord *records;
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct Writer collect;
+    struct DumpJob *jobs;
+    struct DumpJob *job;
+    char **names;
+    size_t nnames;
+    size_t njobs;
+    size_t size;
+    size_t count;
+    int threads;
+    int saved;
+
+    names = dir_list_names(parent, &nnames);
+    if (!names) {
+        return -1;
+    }
+
+    // A journal is a directory holding year directories
+    jobs = NULL;
+    njobs = 0;
+    size = 0;
+    for (size_t i = 0; i < nnames; i++) {
+        char path[PATH_MAX];
+        int year;
+
+        if (strlen(parent) + strlen(names[i]) + 2 > sizeof(path)) {
+            continue;
+        }
+        sprintf(path, "%s%c%s", parent, DIRSEP_C, names[i]);
+        if (dir_list_numeric(path, &year, 1) <= 0) {
+            continue;
+        }
+        if (!(job = dump_job_add(&jobs, &njobs, &size))) {
+            break;
+        }
+        strcpy(job->path, path);
+        job->run = dump_aggregate_job;
+        job->context = query;
+    }
+    dir_list_names_free(names, nnames);
+
+    // Each journal is dumped by a single thread
+    threads = dump_threads();
+    saved = dump_jobs;
+    dump_jobs = 1;
+    writer_init(&collect, NULL, RECORD_STYLE_RECORD);
+    engine_dump(jobs, njobs, threads, &collect);
+    dump_jobs = saved;
+    free(jobs);
+
+    records = NULL;
+    count = 0;
+    size = 0;
+    scanner_open_memory(&scanner, collect.buffer.data, collect.buffer.len);
+    while (scanner_next(&scanner, &span) > 0) {
+        struct AggregateRecord *record;
+
+        if (count == size) {
+            struct AggregateRecord *tmp;
+            size = size ? size * 2 : 256;
+            tmp = realloc(records, size * sizeof(*records));
+            if (!tmp) {
+                perror("Unable to allocate records");
+                break;
+            }
+            records = tmp;
+        }
+        record = &records[count];
+        if (record_view_from_span(&record->view, &span) < 0) {
+            continue;
+        }
+        record->timestamp = (int64_t) record_view_timestamp(&record->view);
+        record->sequence = count++;
+    }
+    scanner_close(&scanner);
+
+    aggregate_group = group;
+    qsort(records, count, sizeof(*records), compare_aggregate);
+    for (size_t i = 0; i < count; i++) {
+        writer_record(out, &records[i].view);
+    }
+
+    free(records);
+    buffer_free(&collect.buffer);
+    return (long) count;
+}
@@ -0,0 +1,138 @@
+#include "weekly.h"
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+// Render a job and store the result in its output buffer
+static void engine_run_job(struct DumpJob *job, int style) {
+    if (job->run) {
+        job->status = job->run(job, style);
+        return;
+    }
+    if (job->entries) {
+        job->status = dump_indexed_buffer(job->path, job->entries, job->nentries, style, job->filter, &job->output);
+        return;
+    }
+    job->status = dump_file_buffer(job->path, style, job->filter, &job->output);
+}
+
+// Write a finished job to the output stream and release its buffer
+static void engine_emit_job(struct DumpJob *job, struct Writer *out) {
+    writer_write(out, job->output.data, job->output.len);
+    buffer_free(&job->output);
+}
+
+#if HAVE_PTHREAD
+struct Engine {
+    struct DumpJob *jobs;
+    size_t count;
+    size_t next;                // next job to be claimed by a worker
+    size_t emitted;             // jobs written to the output stream
+    size_t window;              // maximum number of jobs buffered ahead of output
+    int style;
+    pthread_mutex_t lock;
+    pthread_cond_t claimable;   // signaled when output advances
+    pthread_cond_t finished;    // signaled when a job completes
+};
+
+static void *engine_worker(void *arg) {
+    struct Engine *engine = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&engine->lock);
+        while (engine->next < engine->count && engine->next >= engine->emitted + engine->window) {
+            pthread_cond_wait(&engine->claimable, &engine->lock);
+        }
+        if (engine->next >= engine->count) {
+            pthread_mutex_unlock(&engine->lock);
+            break;
+        }
+        i = engine->next++;
+        pthread_mutex_unlock(&engine->lock);
+
+        engine_run_job(&engine->jobs[i], engine->style);
+
+        pthread_mutex_lock(&engine->lock);
+        engine->jobs[i].done = 1;
+        pthread_cond_broadcast(&engine->finished);
+        pthread_mutex_unlock(&engine->lock);
+    }
+    return NULL;
+}
+#endif
+
+int engine_dump(struct DumpJob *jobs, size_t count, int threads, struct Writer *out) {
+    int style = out->style;
+#if HAVE_PTHREAD
+    struct Engine engine;
+    pthread_t *workers;
+    int started;
+
+    if (threads > (int) count) {
+        threads = (int) count;
+    }
+
+    workers = NULL;
+    started = 0;
+    if (threads > 1) {
+        memset(&engine, 0, sizeof(engine));
+        engine.jobs = jobs;
+        engine.count = count;
+        engine.window = (size_t) threads * 4;
+        engine.style = style;
+        pthread_mutex_init(&engine.lock, NULL);
+        pthread_cond_init(&engine.claimable, NULL);
+        pthread_cond_init(&engine.finished, NULL);
+
+        workers = calloc((size_t) threads, sizeof(*workers));
+        for (int i = 0; workers && i < threads; i++) {
+            if (pthread_create(&workers[i], NULL, engine_worker, &engine) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+
+    if (started) {
+        // Reorder stage: emit jobs strictly in the order they were given
+        for (size_t i = 0; i < count; i++) {
+            pthread_mutex_lock(&engine.lock);
+            while (!jobs[i].done) {
+                pthread_cond_wait(&engine.finished, &engine.lock);
+            }
+            pthread_mutex_unlock(&engine.lock);
+
+            engine_emit_job(&jobs[i], out);
+
+            pthread_mutex_lock(&engine.lock);
+            engine.emitted++;
+            pthread_cond_broadcast(&engine.claimable);
+            pthread_mutex_unlock(&engine.lock);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+
+    if (threads > 1) {
+        pthread_cond_destroy(&engine.finished);
+        pthread_cond_destroy(&engine.claimable);
+        pthread_mutex_destroy(&engine.lock);
+    }
+    free(workers);
+    if (started) {
+        return 0;
+    }
+#else
+    (void) threads;
+#endif
+
+    // Sequential fallback
+    for (size_t i = 0; i < count; i++) {
+        engine_run_job(&jobs[i], style);
+        engine_emit_job(&jobs[i], out);
+    }
+    return 0;
+}
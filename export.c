@@ -0,0 +1,663 @@
+#include "weekly.h"
+
+#define EXPORT_HEADER_SIZE 8
+#define EXPORT_CHUNK_HEADER_SIZE (24 + 8 * EXPORT_COLUMNS)
+
+// On-disk layout (little endian):
+//   char magic[6], u16 version
+//   chunks of up to EXPORT_CHUNK_RECORDS records:
+//     u32 count, u32 reserved, u64 first, u64 last, u64 column sizes[EXPORT_COLUMNS]
+//     columns, in EXPORT_* order
+//   an empty chunk (count 0) marks the end of the file
+//
+// "first" and "last" are the smallest and largest YYYYMMDDHHMMSS stamps in
+// the chunk. Columns:
+//   date, time        u32 per record: YYYYMMDD, HHMMSS (0: not recorded)
+//   author, host      u32 n, u32 offsets[n + 1], strings, u32 ids[count]
+//   message           u32 offsets[count + 1], messages
+
+// The distinct values of a dictionary encoded column in the chunk being
+// written
+struct ExportDict {
+    struct Buffer offsets;      // u32 start of each value in "values"
+    struct Buffer values;
+    struct Buffer ids;          // u32 per record
+    uint32_t count;
+    uint32_t last;              // most recent id (records of a day tend to repeat it)
+};
+
+struct ExportChunk {
+    size_t count;
+    uint64_t first;
+    uint64_t last;
+    struct Buffer dates;
+    struct Buffer times;
+    struct ExportDict authors;
+    struct ExportDict hosts;
+    struct Buffer offsets;      // u32 end of each message in "messages"
+    struct Buffer messages;
+};
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static int buffer_append_u32(struct Buffer *buffer, uint32_t value) {
+    unsigned char raw[4];
+
+    put_u32(raw, value);
+    return buffer_append(buffer, (const char *) raw, sizeof(raw));
+}
+
+// Parse "n" decimal digits (-1 when any is missing)
+static long export_digits(const char *s, int n) {
+    long value = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!isdigit((unsigned char) s[i])) {
+            return -1;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
+
+// date: MM/DD/YYYY -> YYYYMMDD
+static uint32_t export_date_encode(const struct Slice *date) {
+    long month, day, year;
+
+    if (date->len != 10 || (month = export_digits(date->ptr, 2)) < 0
+        || (day = export_digits(date->ptr + 3, 2)) < 0 || (year = export_digits(date->ptr + 6, 4)) < 0) {
+        return 0;
+    }
+    return (uint32_t) (year * 10000 + month * 100 + day);
+}
+
+// time: HH:MM:SS -> HHMMSS
+static uint32_t export_time_encode(const struct Slice *time_) {
+    long hour, minute, second;
+
+    if (time_->len != 8 || (hour = export_digits(time_->ptr, 2)) < 0
+        || (minute = export_digits(time_->ptr + 3, 2)) < 0 || (second = export_digits(time_->ptr + 6, 2)) < 0) {
+        return 0;
+    }
+    return (uint32_t) (hour * 10000 + minute * 100 + second);
+}
+
+static uint64_t export_stamp(uint32_t date, uint32_t time_) {
+    return (uint64_t) date * 1000000 + time_;
+}
+
+static uint64_t export_stamp_of(time_t t) {
+    struct tm *tm_;
+
+    if (!(tm_ = localtime(&t))) {
+        return 0;
+    }
+    return export_stamp((uint32_t) ((tm_->tm_year + 1900) * 10000 + (tm_->tm_mon + 1) * 100 + tm_->tm_mday),
+                        (uint32_t) (tm_->tm_hour * 10000 + tm_->tm_min * 100 + tm_->tm_sec));
+}
+
+static int export_dict_add(struct ExportDict *dict, const struct Slice *value) {
+    uint32_t id;
+
+    // Try the previous value first, then the rest
+    id = dict->count;
+    if (dict->count) {
+        for (uint32_t n = 0; n < dict->count; n++) {
+            uint32_t i = (dict->last + n) % dict->count;
+            uint32_t start = get_u32((const unsigned char *) dict->offsets.data + i * 4);
+            uint32_t end = i + 1 < dict->count ? get_u32((const unsigned char *) dict->offsets.data + (i + 1) * 4) : (uint32_t) dict->values.len;
+            if (end - start == value->len && !memcmp(dict->values.data + start, value->ptr, value->len)) {
+                id = i;
+                break;
+            }
+        }
+    }
+    if (id == dict->count) {
+        if (buffer_append_u32(&dict->offsets, (uint32_t) dict->values.len) < 0
+            || buffer_append(&dict->values, value->ptr, value->len) < 0) {
+            return -1;
+        }
+        dict->count++;
+    }
+    dict->last = id;
+    return buffer_append_u32(&dict->ids, id);
+}
+
+static void export_dict_reset(struct ExportDict *dict) {
+    dict->offsets.len = 0;
+    dict->values.len = 0;
+    dict->ids.len = 0;
+    dict->count = 0;
+    dict->last = 0;
+}
+
+static void export_dict_free(struct ExportDict *dict) {
+    buffer_free(&dict->offsets);
+    buffer_free(&dict->values);
+    buffer_free(&dict->ids);
+    export_dict_reset(dict);
+}
+
+static size_t export_dict_size(const struct ExportDict *dict) {
+    return 4 + 4 * ((size_t) dict->count + 1) + dict->values.len + dict->ids.len;
+}
+
+static int export_dict_write(const struct ExportDict *dict, FILE *fp) {
+    unsigned char raw[4];
+
+    put_u32(raw, dict->count);
+    if (fwrite(raw, sizeof(char), sizeof(raw), fp) != sizeof(raw)
+        || fwrite(dict->offsets.data, sizeof(char), dict->offsets.len, fp) != dict->offsets.len) {
+        return -1;
+    }
+    put_u32(raw, (uint32_t) dict->values.len);
+    if (fwrite(raw, sizeof(char), sizeof(raw), fp) != sizeof(raw)
+        || fwrite(dict->values.data, sizeof(char), dict->values.len, fp) != dict->values.len
+        || fwrite(dict->ids.data, sizeof(char), dict->ids.len, fp) != dict->ids.len) {
+        return -1;
+    }
+    return 0;
+}
+
+static void export_chunk_reset(struct ExportChunk *chunk) {
+    chunk->count = 0;
+    chunk->first = 0;
+    chunk->last = 0;
+    chunk->dates.len = 0;
+    chunk->times.len = 0;
+    chunk->offsets.len = 0;
+    chunk->messages.len = 0;
+    export_dict_reset(&chunk->authors);
+    export_dict_reset(&chunk->hosts);
+}
+
+static void export_chunk_free(struct ExportChunk *chunk) {
+    export_chunk_reset(chunk);
+    export_dict_free(&chunk->authors);
+    export_dict_free(&chunk->hosts);
+    buffer_free(&chunk->dates);
+    buffer_free(&chunk->times);
+    buffer_free(&chunk->offsets);
+    buffer_free(&chunk->messages);
+}
+
+// Write the chunk (an empty chunk ends the file)
+static int export_chunk_write(struct ExportChunk *chunk, FILE *fp) {
+    unsigned char raw[EXPORT_CHUNK_HEADER_SIZE];
+    unsigned char zero[4] = {0};
+
+    memset(raw, 0, sizeof(raw));
+    put_u32(raw, (uint32_t) chunk->count);
+    put_u64(raw + 8, chunk->first);
+    put_u64(raw + 16, chunk->last);
+    if (chunk->count) {
+        put_u64(raw + 24 + 8 * EXPORT_DATE, chunk->dates.len);
+        put_u64(raw + 24 + 8 * EXPORT_TIME, chunk->times.len);
+        put_u64(raw + 24 + 8 * EXPORT_AUTHOR, export_dict_size(&chunk->authors));
+        put_u64(raw + 24 + 8 * EXPORT_HOST, export_dict_size(&chunk->hosts));
+        put_u64(raw + 24 + 8 * EXPORT_MESSAGE, 4 + chunk->offsets.len + chunk->messages.len);
+    }
+    if (fwrite(raw, sizeof(char), sizeof(raw), fp) != sizeof(raw)) {
+        return -1;
+    }
+    if (!chunk->count) {
+        return 0;
+    }
+    if (fwrite(chunk->dates.data, sizeof(char), chunk->dates.len, fp) != chunk->dates.len
+        || fwrite(chunk->times.data, sizeof(char), chunk->times.len, fp) != chunk->times.len
+        || export_dict_write(&chunk->authors, fp) < 0
+        || export_dict_write(&chunk->hosts, fp) < 0
+        || fwrite(zero, sizeof(char), sizeof(zero), fp) != sizeof(zero)
+        || fwrite(chunk->offsets.data, sizeof(char), chunk->offsets.len, fp) != chunk->offsets.len
+        || fwrite(chunk->messages.data, sizeof(char), chunk->messages.len, fp) != chunk->messages.len) {
+        return -1;
+    }
+    STATS_ADD(STAT_BYTES_WRITTEN, sizeof(raw) + chunk->dates.len + chunk->times.len
+              + export_dict_size(&chunk->authors) + export_dict_size(&chunk->hosts)
+              + 4 + chunk->offsets.len + chunk->messages.len);
+    export_chunk_reset(chunk);
+    return 0;
+}
+
+static int export_chunk_add(struct ExportChunk *chunk, const struct RecordView *view, FILE *fp) {
+    uint32_t date, time_;
+    uint64_t stamp;
+
+    // Messages are addressed by u32 offsets, so a chunk holds at most
+    // EXPORT_CHUNK_BYTES of them (or one larger message)
+    if (chunk->count == EXPORT_CHUNK_RECORDS
+        || (chunk->count && chunk->messages.len + view->data.len > EXPORT_CHUNK_BYTES)) {
+        if (export_chunk_write(chunk, fp) < 0) {
+            return -1;
+        }
+    }
+
+    date = export_date_encode(&view->date);
+    time_ = export_time_encode(&view->time);
+    if (date) {
+        stamp = export_stamp(date, time_);
+        if (!chunk->first || stamp < chunk->first) {
+            chunk->first = stamp;
+        }
+        if (stamp > chunk->last) {
+            chunk->last = stamp;
+        }
+    }
+    if (buffer_append_u32(&chunk->dates, date) < 0
+        || buffer_append_u32(&chunk->times, time_) < 0
+        || export_dict_add(&chunk->authors, &view->user) < 0
+        || export_dict_add(&chunk->hosts, &view->host) < 0
+        || buffer_append(&chunk->messages, view->data.ptr, view->data.len) < 0
+        || buffer_append_u32(&chunk->offsets, (uint32_t) chunk->messages.len) < 0) {
+        return -1;
+    }
+    chunk->count++;
+    return 0;
+}
+
+static int export_file(struct ExportChunk *chunk, const char *filename, int compacted, FILE *fp, size_t *count) {
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    int status;
+
+    if (scanner_open_day(&scanner, filename, compacted) < 0) {
+        return 0;
+    }
+    status = 0;
+    while (status == 0 && scanner_next(&scanner, &span) > 0) {
+        if (record_view_from_span(&view, &span) < 0) {
+            continue;
+        }
+        status = export_chunk_add(chunk, &view, fp);
+        (*count)++;
+    }
+    scanner_close(&scanner);
+    return status;
+}
+
+// Write every record of the journal to a columnar file in one pass. At most
+// one chunk of records is held in memory. Returns the number of records
+// exported, or -1 on error.
+long export_write(const char *root, const char *filename) {
+    char path_tmp[PATH_MAX] = {0};
+    unsigned char raw[EXPORT_HEADER_SIZE];
+    struct ExportChunk chunk;
+    int years[DIR_LIST_MAX];
+    size_t count;
+    int nyears;
+    int status;
+    FILE *fp;
+
+    if (strlen(filename) + 5 > sizeof(path_tmp)) {
+        fprintf(stderr, "Export path is too long: %s\n", filename);
+        return -1;
+    }
+    nyears = dir_list_numeric(root, years, DIR_LIST_MAX);
+    if (nyears < 0) {
+        return -1;
+    }
+    sprintf(path_tmp, "%s.tmp", filename);
+    if (!(fp = fopen(path_tmp, "wb"))) {
+        fprintf(stderr, "Unable to write %s: %s\n", path_tmp, strerror(errno));
+        return -1;
+    }
+    memcpy(raw, EXPORT_MAGIC, 6);
+    raw[6] = (unsigned char) (EXPORT_VERSION & 0xff);
+    raw[7] = (unsigned char) (EXPORT_VERSION >> 8);
+    status = fwrite(raw, sizeof(char), sizeof(raw), fp) == sizeof(raw) ? 0 : -1;
+
+    memset(&chunk, 0, sizeof(chunk));
+    count = 0;
+    for (int i = 0; i < nyears && status == 0; i++) {
+        for (int week = 0; week <= WEEK_MAX && status == 0; week++) {
+            // Compacted weeks are read from their segments
+            int compacted = segment_exists(root, years[i], week);
+            for (int day = 0; day < 7 && status == 0; day++) {
+                char path[PATH_MAX];
+                sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, years[i], DIRSEP_C, week, DIRSEP_C, day);
+                status = export_file(&chunk, path, compacted, fp, &count);
+            }
+        }
+    }
+    if (status == 0 && chunk.count) {
+        status = export_chunk_write(&chunk, fp);
+    }
+    // The empty chunk ending the file
+    if (status == 0) {
+        status = export_chunk_write(&chunk, fp);
+    }
+    export_chunk_free(&chunk);
+    if (fclose(fp) != 0) {
+        status = -1;
+    }
+    if (status < 0 || rename(path_tmp, filename) < 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", filename, strerror(errno));
+        remove(path_tmp);
+        return -1;
+    }
+    return (long) count;
+}
+
+int export_open(struct ExportReader *reader, const char *filename) {
+    unsigned char raw[EXPORT_HEADER_SIZE];
+
+    memset(reader, 0, sizeof(*reader));
+    if (!(reader->fp = fopen(filename, "rb"))) {
+        return -1;
+    }
+    if (fread(raw, sizeof(char), sizeof(raw), reader->fp) != sizeof(raw)
+        || memcmp(raw, EXPORT_MAGIC, 6) != 0 || (raw[6] | (raw[7] << 8)) != EXPORT_VERSION) {
+        fprintf(stderr, "Invalid export file: %s\n", filename);
+        export_close(reader);
+        errno = EINVAL;
+        return -1;
+    }
+    reader->next = EXPORT_HEADER_SIZE;
+    return 0;
+}
+
+void export_close(struct ExportReader *reader) {
+    if (reader->fp) {
+        fclose(reader->fp);
+    }
+    for (int i = 0; i < EXPORT_COLUMNS; i++) {
+        buffer_free(&reader->columns[i]);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+// Move to the next chunk without reading any of its columns. Returns 1 on
+// success, 0 at the end of the file and -1 on error.
+int export_next(struct ExportReader *reader) {
+    unsigned char raw[EXPORT_CHUNK_HEADER_SIZE];
+    uint64_t offset;
+
+    if (fseek(reader->fp, reader->next, SEEK_SET) < 0
+        || fread(raw, sizeof(char), sizeof(raw), reader->fp) != sizeof(raw)) {
+        fprintf(stderr, "Export file is truncated\n");
+        return -1;
+    }
+    reader->count = get_u32(raw);
+    reader->first = get_u64(raw + 8);
+    reader->last = get_u64(raw + 16);
+    reader->loaded = 0;
+    if (!reader->count) {
+        return 0;
+    }
+    offset = (uint64_t) reader->next + sizeof(raw);
+    for (int i = 0; i < EXPORT_COLUMNS; i++) {
+        reader->sizes[i] = get_u64(raw + 24 + 8 * i);
+        reader->offsets[i] = (long) offset;
+        offset += reader->sizes[i];
+    }
+    reader->next = (long) offset;
+    return 1;
+}
+
+// Check that a column can be decoded without reading out of bounds
+static int export_column_valid(const struct ExportReader *reader, int column) {
+    const unsigned char *p = (const unsigned char *) reader->columns[column].data;
+    uint64_t size = reader->sizes[column];
+    uint64_t count = reader->count;
+    uint64_t n, len, previous;
+
+    switch (column) {
+    case EXPORT_DATE:
+    case EXPORT_TIME:
+        return size == 4 * count;
+    case EXPORT_AUTHOR:
+    case EXPORT_HOST:
+        if (size < 8 || (n = get_u32(p)) > count || size < 4 + 4 * (n + 1)) {
+            return 0;
+        }
+        len = get_u32(p + 4 + 4 * n);
+        if (size != 4 + 4 * (n + 1) + len + 4 * count) {
+            return 0;
+        }
+        previous = 0;
+        for (uint64_t i = 0; i <= n; i++) {
+            uint64_t offset = get_u32(p + 4 + 4 * i);
+            if (offset < previous || offset > len) {
+                return 0;
+            }
+            previous = offset;
+        }
+        p += 4 + 4 * (n + 1) + len;
+        for (uint64_t i = 0; i < count; i++) {
+            if (get_u32(p + 4 * i) >= n) {
+                return 0;
+            }
+        }
+        return 1;
+    case EXPORT_MESSAGE:
+        if (size < 4 * (count + 1)) {
+            return 0;
+        }
+        previous = 0;
+        len = size - 4 * (count + 1);
+        for (uint64_t i = 0; i <= count; i++) {
+            uint64_t offset = get_u32(p + 4 * i);
+            if (offset < previous || offset > len) {
+                return 0;
+            }
+            previous = offset;
+        }
+        return previous == len;
+    }
+    return 0;
+}
+
+// Read the given columns (1 << EXPORT_*) of the current chunk. Columns that
+// were read already are kept, and the others are not touched.
+int export_load(struct ExportReader *reader, unsigned columns) {
+    for (int i = 0; i < EXPORT_COLUMNS; i++) {
+        struct Buffer *column = &reader->columns[i];
+
+        if (!(columns & (1u << i)) || (reader->loaded & (1u << i))) {
+            continue;
+        }
+        STATS_START(started);
+        column->len = 0;
+        if (reader->sizes[i] > (uint64_t) LONG_MAX || buffer_reserve(column, (size_t) reader->sizes[i]) < 0
+            || fseek(reader->fp, reader->offsets[i], SEEK_SET) < 0
+            || fread(column->data, sizeof(char), (size_t) reader->sizes[i], reader->fp) != reader->sizes[i]) {
+            fprintf(stderr, "Unable to read export file: %s\n", ferror(reader->fp) ? strerror(errno) : "truncated");
+            return -1;
+        }
+        column->len = (size_t) reader->sizes[i];
+        STATS_ADD(STAT_BYTES_READ, column->len);
+        STATS_STOP(STAT_TIME_READ, started);
+        if (!export_column_valid(reader, i)) {
+            fprintf(stderr, "Invalid export file: bad column %d\n", i);
+            errno = EINVAL;
+            return -1;
+        }
+        reader->loaded |= 1u << i;
+    }
+    return 0;
+}
+
+static uint32_t export_u32(const struct ExportReader *reader, int column, size_t row) {
+    return get_u32((const unsigned char *) reader->columns[column].data + 4 * row);
+}
+
+static struct Slice export_dict_value(const struct ExportReader *reader, int column, size_t row) {
+    const unsigned char *p = (const unsigned char *) reader->columns[column].data;
+    struct Slice value;
+    uint32_t n, id, len;
+
+    n = get_u32(p);
+    len = get_u32(p + 4 + 4 * n);
+    id = get_u32(p + 4 + 4 * ((size_t) n + 1) + len + 4 * row);
+    value.ptr = (const char *) p + 4 + 4 * ((size_t) n + 1) + get_u32(p + 4 + 4 * (size_t) id);
+    value.len = get_u32(p + 4 + 4 * ((size_t) id + 1)) - get_u32(p + 4 + 4 * (size_t) id);
+    return value;
+}
+
+static struct Slice export_message(const struct ExportReader *reader, size_t row) {
+    const unsigned char *p = (const unsigned char *) reader->columns[EXPORT_MESSAGE].data;
+    struct Slice value;
+    uint32_t start;
+
+    start = get_u32(p + 4 * row);
+    value.ptr = (const char *) p + 4 * (reader->count + 1) + start;
+    value.len = get_u32(p + 4 * (row + 1)) - start;
+    return value;
+}
+
+// Fill a record view with the loaded columns of a row. Columns that were not
+// loaded are left empty. "date" and "time" receive the formatted date
+// (11 bytes) and time (9 bytes).
+void export_view(const struct ExportReader *reader, size_t row, struct RecordView *view, char *date, char *time_) {
+    memset(view, 0, sizeof(*view));
+    view->date.ptr = view->time.ptr = view->user.ptr = view->host.ptr = view->data.ptr = "";
+    if (reader->loaded & (1u << EXPORT_DATE)) {
+        uint32_t value = export_u32(reader, EXPORT_DATE, row);
+        if (value) {
+            sprintf(date, "%02u/%02u/%04u", (unsigned) (value / 100 % 100), (unsigned) (value % 100), (unsigned) (value / 10000 % 10000));
+            view->date.ptr = date;
+            view->date.len = 10;
+        }
+    }
+    if (reader->loaded & (1u << EXPORT_TIME)) {
+        uint32_t value = export_u32(reader, EXPORT_TIME, row);
+        sprintf(time_, "%02u:%02u:%02u", (unsigned) (value / 10000 % 100), (unsigned) (value / 100 % 100), (unsigned) (value % 100));
+        view->time.ptr = time_;
+        view->time.len = 8;
+    }
+    if (reader->loaded & (1u << EXPORT_AUTHOR)) {
+        view->user = export_dict_value(reader, EXPORT_AUTHOR, row);
+    }
+    if (reader->loaded & (1u << EXPORT_HOST)) {
+        view->host = export_dict_value(reader, EXPORT_HOST, row);
+    }
+    if (reader->loaded & (1u << EXPORT_MESSAGE)) {
+        view->data = export_message(reader, row);
+    }
+}
+
+// Dump the records of an export file, optionally limited to a time range
+// and to messages containing every word of "pattern". Only the columns a
+// condition needs are read until a chunk is known to hold a match, and
+// chunks outside the time range are skipped unread. Returns the number of
+// records written, or -1 on error.
+long export_dump(const char *filename, const struct DumpFilter *filter, const char *pattern, struct Writer *out) {
+    struct ExportReader reader;
+    struct Term terms[SEARCH_TERMS_MAX];
+    unsigned char *selected;
+    uint64_t since, until;
+    size_t nterms;
+    long count;
+    int status;
+
+    nterms = 0;
+    if (pattern && search_terms(pattern, terms, &nterms) < 0) {
+        return -1;
+    }
+    since = until = 0;
+    if (filter) {
+        since = export_stamp_of(filter->since);
+        until = export_stamp_of(filter->until);
+    }
+    if (export_open(&reader, filename) < 0) {
+        if (errno != EINVAL) {
+            fprintf(stderr, "Unable to read %s: %s\n", filename, strerror(errno));
+        }
+        return -1;
+    }
+    if (!(selected = malloc(EXPORT_CHUNK_RECORDS))) {
+        perror("Unable to allocate export selection");
+        export_close(&reader);
+        return -1;
+    }
+
+    count = 0;
+    while ((status = export_next(&reader)) > 0) {
+        char date[16];
+        char time_[16];
+        struct RecordView view;
+        size_t nselected;
+
+        if (reader.count > EXPORT_CHUNK_RECORDS) {
+            fprintf(stderr, "Invalid export file: %s\n", filename);
+            status = -1;
+            break;
+        }
+        if (filter && (!reader.first || reader.last < since || reader.first > until)) {
+            continue;
+        }
+        memset(selected, 1, reader.count);
+        nselected = reader.count;
+        if (filter) {
+            if (export_load(&reader, (1u << EXPORT_DATE) | (1u << EXPORT_TIME)) < 0) {
+                status = -1;
+                break;
+            }
+            for (size_t row = 0; row < reader.count; row++) {
+                uint32_t day = export_u32(&reader, EXPORT_DATE, row);
+                uint64_t stamp = export_stamp(day, export_u32(&reader, EXPORT_TIME, row));
+                if (!day || stamp < since || stamp > until) {
+                    selected[row] = 0;
+                    nselected--;
+                }
+            }
+        }
+        if (nterms && nselected) {
+            if (export_load(&reader, 1u << EXPORT_MESSAGE) < 0) {
+                status = -1;
+                break;
+            }
+            for (size_t row = 0; row < reader.count; row++) {
+                struct Slice message;
+                if (!selected[row]) {
+                    continue;
+                }
+                message = export_message(&reader, row);
+                if (!search_match(&message, terms, nterms)) {
+                    selected[row] = 0;
+                    nselected--;
+                }
+            }
+        }
+        if (!nselected) {
+            continue;
+        }
+        if (export_load(&reader, EXPORT_ALL) < 0) {
+            status = -1;
+            break;
+        }
+        for (size_t row = 0; row < reader.count; row++) {
+            if (selected[row]) {
+                export_view(&reader, row, &view, date, time_);
+                writer_record(out, &view);
+                count++;
+            }
+        }
+    }
+    free(selected);
+    export_close(&reader);
+    return status < 0 ? -1 : count;
+}
@@ -0,0 +1,391 @@
+#include "weekly.h"
+
+// A journal being followed: the day file being read and how much of it
+// has been consumed
+struct FollowJournal {
+    char root[PATH_MAX];
+    time_t day;             // start of the day being read
+    uint64_t offset;        // end of the last record consumed
+};
+
+struct Follower {
+    const char *root;
+    int shared;             // root is a directory of journals
+    struct FollowJournal *journals;
+    size_t count;
+    size_t size;
+    int notify;             // inotify descriptor (-1: polling)
+};
+
+static volatile sig_atomic_t follow_stop;
+
+static void follow_signal(int sig) {
+    (void) sig;
+    follow_stop = 1;
+}
+
+static time_t follow_day_start(time_t t) {
+    struct tm tm_;
+    struct tm *now;
+
+    now = localtime(&t);
+    if (!now) {
+        return (time_t) -1;
+    }
+    tm_ = *now;
+    tm_.tm_hour = 0;
+    tm_.tm_min = 0;
+    tm_.tm_sec = 0;
+    tm_.tm_isdst = -1;
+    return mktime(&tm_);
+}
+
+// The day file records of "day" are written to (see make_output_path())
+static int follow_path(const struct FollowJournal *journal, char *path) {
+    int year, week, day;
+
+    if (calendar_locate(journal->day, &year, &week, &day) < 0) {
+        return -1;
+    }
+    sprintf(path, "%s%c%d%c%d%c%d", journal->root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+    return 0;
+}
+
+static struct FollowJournal *follow_find(struct Follower *follower, const char *root) {
+    for (size_t i = 0; i < follower->count; i++) {
+        if (!strcmp(follower->journals[i].root, root)) {
+            return &follower->journals[i];
+        }
+    }
+    return NULL;
+}
+
+static struct FollowJournal *follow_add(struct Follower *follower, const char *root, time_t day, uint64_t offset) {
+    struct FollowJournal *journal;
+
+    if (strlen(root) >= sizeof(journal->root)) {
+        fprintf(stderr, "Journal path is too long: %s\n", root);
+        return NULL;
+    }
+    if (follower->count == follower->size) {
+        struct FollowJournal *tmp;
+        follower->size = follower->size ? follower->size * 2 : 16;
+        tmp = realloc(follower->journals, follower->size * sizeof(*tmp));
+        if (!tmp) {
+            perror("Unable to allocate journals");
+            return NULL;
+        }
+        follower->journals = tmp;
+    }
+    journal = &follower->journals[follower->count++];
+    strcpy(journal->root, root);
+    journal->day = day;
+    journal->offset = offset;
+    return journal;
+}
+
+// Start following a journal. Journals present at startup are followed
+// from the end of today's file, like "tail -f". Journals that appear later
+// are read from the start of the day.
+static void follow_start(struct Follower *follower, const char *root, time_t today, int startup) {
+    struct FollowJournal *journal;
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (follow_find(follower, root) || !(journal = follow_add(follower, root, today, 0))) {
+        return;
+    }
+    if (startup && follow_path(journal, path) == 0 && stat(path, &st) == 0) {
+        journal->offset = (uint64_t) st.st_size;
+    }
+}
+
+// Pick up journals created under a shared root since the last check
+static void follow_discover(struct Follower *follower, time_t today, int startup) {
+    char **names;
+    size_t nnames;
+
+    if (!follower->shared) {
+        follow_start(follower, follower->root, today, startup);
+        return;
+    }
+    if (!(names = dir_list_names(follower->root, &nnames))) {
+        return;
+    }
+    for (size_t i = 0; i < nnames; i++) {
+        char path[PATH_MAX];
+        int year;
+
+        if (strlen(follower->root) + strlen(names[i]) + 2 > sizeof(path)) {
+            continue;
+        }
+        sprintf(path, "%s%c%s", follower->root, DIRSEP_C, names[i]);
+        if (dir_list_numeric(path, &year, 1) > 0) {
+            follow_start(follower, path, today, startup);
+        }
+    }
+    dir_list_names_free(names, nnames);
+}
+
+// Write the records appended to a journal's day file since the last call.
+// A record still being written is left for the next call.
+static long follow_drain(struct FollowJournal *journal, struct Writer *out) {
+    char path[PATH_MAX];
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    struct stat st;
+    long count;
+    FILE *fp;
+
+    if (follow_path(journal, path) < 0) {
+        return -1;
+    }
+    if (!(fp = fopen(path, "rb"))) {
+        // A finished week may have been compacted in the meantime
+        if (errno != ENOENT || scanner_open_day(&scanner, path, 1) < 0) {
+            return 0;
+        }
+    } else {
+        if (fstat(fileno(fp), &st) < 0 || (uint64_t) st.st_size == journal->offset) {
+            fclose(fp);
+            return 0;
+        }
+        // The file was replaced by a shorter one
+        if ((uint64_t) st.st_size < journal->offset) {
+            journal->offset = 0;
+        }
+        if (fseek(fp, (long) journal->offset, SEEK_SET) < 0 || scanner_attach(&scanner, fp) < 0) {
+            fclose(fp);
+            return -1;
+        }
+        scanner.owner = 1;
+        scanner.name = strdup(path);
+    }
+
+    count = 0;
+    while (scanner_next(&scanner, &span) > 0) {
+        if ((uint64_t) span.offset < journal->offset) {
+            continue;
+        }
+        if (record_view_from_span(&view, &span) == 0) {
+            writer_record(out, &view);
+            count++;
+        }
+        journal->offset = (uint64_t) span.offset + span.length;
+    }
+    scanner_close(&scanner);
+    return count;
+}
+
+// Read the rest of every day from the one being followed up to today
+static long follow_catch_up(struct FollowJournal *journal, time_t today, struct Writer *out) {
+    long total;
+    long count;
+
+    total = 0;
+    for (;;) {
+        if ((count = follow_drain(journal, out)) > 0) {
+            total += count;
+        }
+        if (journal->day >= today) {
+            break;
+        }
+        journal->day = calendar_next_day(journal->day);
+        journal->offset = 0;
+        if (journal->day == (time_t) -1) {
+            journal->day = today;
+        }
+    }
+    return total;
+}
+
+// A checkpoint holds one line per journal: "DAY OFFSET ROOT"
+static int follow_load(struct Follower *follower, const char *checkpoint) {
+    struct Buffer line;
+    FILE *fp;
+
+    if (!(fp = fopen(checkpoint, "r"))) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Unable to read checkpoint %s: %s\n", checkpoint, strerror(errno));
+        return -1;
+    }
+    buffer_init(&line);
+    for (line.len = 0; buffer_read_line(&line, fp) > 0; line.len = 0) {
+        long long day;
+        unsigned long long offset;
+        int consumed;
+
+        while (line.len && (line.data[line.len - 1] == '\n' || line.data[line.len - 1] == '\r')) {
+            line.data[--line.len] = '\0';
+        }
+        if (sscanf(line.data, "%lld %llu %n", &day, &offset, &consumed) < 2 || !line.data[consumed]) {
+            fprintf(stderr, "Invalid checkpoint line: %s\n", line.data);
+            continue;
+        }
+        if (!follow_find(follower, line.data + consumed)) {
+            follow_add(follower, line.data + consumed, (time_t) day, (uint64_t) offset);
+        }
+    }
+    buffer_free(&line);
+    fclose(fp);
+    return 0;
+}
+
+static int follow_save(const struct Follower *follower, const char *checkpoint) {
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int status;
+
+    if (strlen(checkpoint) + 5 > sizeof(tmp)) {
+        fprintf(stderr, "Checkpoint path is too long: %s\n", checkpoint);
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", checkpoint);
+    if (!(fp = fopen(tmp, "w"))) {
+        fprintf(stderr, "Unable to write checkpoint %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < follower->count; i++) {
+        const struct FollowJournal *journal = &follower->journals[i];
+        fprintf(fp, "%lld %llu %s\n", (long long) journal->day, (unsigned long long) journal->offset, journal->root);
+    }
+    status = fclose(fp) == 0 ? 0 : -1;
+    if (status < 0 || rename(tmp, checkpoint) < 0) {
+        fprintf(stderr, "Unable to write checkpoint %s: %s\n", checkpoint, strerror(errno));
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Watch the directories new records will show up in. The nearest existing
+// parent is watched when a week (or year) has not been created yet.
+static void follow_watch(struct Follower *follower) {
+#if HAVE_INOTIFY
+    const uint32_t events = IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE;
+
+    if (follower->notify < 0) {
+        return;
+    }
+    if (follower->shared) {
+        inotify_add_watch(follower->notify, follower->root, IN_CREATE | IN_MOVED_TO);
+    }
+    for (size_t i = 0; i < follower->count; i++) {
+        char path[PATH_MAX];
+        char *sep;
+
+        if (follow_path(&follower->journals[i], path) < 0) {
+            continue;
+        }
+        while ((sep = strrchr(path, DIRSEP_C)) != NULL && sep > path) {
+            *sep = '\0';
+            if (inotify_add_watch(follower->notify, path, events) >= 0 || strlen(path) <= strlen(follower->journals[i].root)) {
+                break;
+            }
+        }
+    }
+#else
+    (void) follower;
+#endif
+}
+
+// Sleep until a watched directory changes, or FOLLOW_INTERVAL seconds pass
+static void follow_wait(struct Follower *follower) {
+#if HAVE_INOTIFY
+    if (follower->notify >= 0) {
+        struct pollfd pfd;
+        char events[4096];
+
+        pfd.fd = follower->notify;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, FOLLOW_INTERVAL * 1000) > 0) {
+            while (read(follower->notify, events, sizeof(events)) > 0);
+        }
+        return;
+    }
+#else
+    (void) follower;
+#endif
+#if HAVE_WINDOWS
+    Sleep(FOLLOW_INTERVAL * 1000);
+#else
+    sleep(FOLLOW_INTERVAL);
+#endif
+}
+
+// Stream records as they are appended to today's day file of a journal
+// (or of every journal under a shared root) until interrupted
+int follow_run(const char *root, int shared, const char *checkpoint, int style) {
+    struct Follower follower;
+    struct Writer out;
+    time_t today;
+    int status;
+
+    memset(&follower, 0, sizeof(follower));
+    follower.root = root;
+    follower.shared = shared;
+    follower.notify = -1;
+    if (checkpoint && follow_load(&follower, checkpoint) < 0) {
+        return -1;
+    }
+    today = follow_day_start(time(NULL));
+    follow_discover(&follower, today, 1);
+#if HAVE_INOTIFY
+    follower.notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+#if HAVE_WINDOWS
+    signal(SIGINT, follow_signal);
+    signal(SIGTERM, follow_signal);
+#else
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = follow_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
+#endif
+
+    writer_init(&out, stdout, style);
+    status = 0;
+    while (!follow_stop) {
+        int changed = 0;
+
+        today = follow_day_start(time(NULL));
+        follow_discover(&follower, today, 0);
+        for (size_t i = 0; i < follower.count; i++) {
+            struct FollowJournal *journal = &follower.journals[i];
+            time_t day = journal->day;
+            uint64_t offset = journal->offset;
+
+            follow_catch_up(journal, today, &out);
+            changed |= journal->day != day || journal->offset != offset;
+        }
+        // The checkpoint only covers records the reader was given
+        if (writer_flush(&out) < 0) {
+            perror("Unable to write output");
+            status = -1;
+            break;
+        }
+        if (changed && checkpoint) {
+            follow_save(&follower, checkpoint);
+        }
+        follow_watch(&follower);
+        follow_wait(&follower);
+    }
+
+    buffer_free(&out.buffer);
+#if HAVE_INOTIFY
+    if (follower.notify >= 0) {
+        close(follower.notify);
+    }
+#endif
+    free(follower.journals);
+    return status;
+}
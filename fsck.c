@@ -0,0 +1,210 @@
+#include "weekly.h"
+
+// Bytes between records are expected to be line feeds. Anything else is
+// what is left of a torn, interleaved or truncated write.
+static int fsck_gap_damaged(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copy the intact records of a day to "out". Returns the number of damaged
+// regions left out, or -1 on error.
+static long fsck_salvage(char *data, size_t len, struct Buffer *out) {
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    long damaged;
+    size_t pos;
+
+    damaged = 0;
+    pos = 0;
+    scanner_open_memory(&scanner, data, len);
+    scanner.repair = 1;
+    while (scanner_next(&scanner, &span) > 0) {
+        size_t start = (size_t) span.offset;
+
+        if (fsck_gap_damaged(data + pos, start - pos)) {
+            damaged++;
+        } else if (buffer_append(out, data + pos, start - pos) < 0) {
+            damaged = -1;
+            break;
+        }
+        if (buffer_append(out, data + start, span.length) < 0) {
+            damaged = -1;
+            break;
+        }
+        pos = start + span.length;
+    }
+    scanner_close(&scanner);
+    if (damaged >= 0 && fsck_gap_damaged(data + pos, len - pos)) {
+        damaged++;
+    }
+    return damaged;
+}
+
+// Read a day file and salvage its intact records into "clean". Returns the
+// number of damaged regions, 0 when the file does not exist, or -1.
+static long fsck_read(const char *path, struct Buffer *data, struct Buffer *clean) {
+    FILE *fp;
+    int status;
+
+    data->len = 0;
+    clean->len = 0;
+    if (!(fp = fopen(path, "rb"))) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    status = buffer_read(data, fp);
+    fclose(fp);
+    if (status < 0) {
+        return -1;
+    }
+    return fsck_salvage(data->data, data->len, clean);
+}
+
+// Rewrite a day file without its damaged regions. Returns 1 when the file
+// was repaired, 0 when it was intact, or -1 on error.
+static int fsck_day(const char *root, int year, const char *path) {
+    char path_tmp[PATH_MAX];
+    struct Buffer data;
+    struct Buffer clean;
+    long damaged;
+    FILE *fp;
+    int status;
+    int lock;
+
+    buffer_init(&data);
+    buffer_init(&clean);
+    if ((damaged = fsck_read(path, &data, &clean)) <= 0) {
+        buffer_free(&data);
+        buffer_free(&clean);
+        return (int) damaged;
+    }
+
+    // Writers hold the year's lock while appending, so with it held
+    // exclusively no record can land between the read and the rename
+    if ((lock = segment_lock(root, year, 1)) < 0) {
+        fprintf(stderr, "Unable to lock %s: %s\n", path, strerror(errno));
+        buffer_free(&data);
+        buffer_free(&clean);
+        return -1;
+    }
+    status = -1;
+    if ((damaged = fsck_read(path, &data, &clean)) > 0) {
+        sprintf(path_tmp, "%s.tmp", path);
+        if ((fp = fopen(path_tmp, "wb")) != NULL) {
+            status = fwrite(clean.data, sizeof(char), clean.len, fp) == clean.len ? 0 : -1;
+            if (fclose(fp) != 0) {
+                status = -1;
+            }
+        }
+        if (status == 0 && rename(path_tmp, path) < 0) {
+            status = -1;
+        }
+        if (status < 0) {
+            fprintf(stderr, "Unable to repair %s: %s\n", path, strerror(errno));
+            remove(path_tmp);
+        } else {
+            printf("%s: removed %ld damaged region%s (%zu bytes)\n",
+                   path, damaged, damaged == 1 ? "" : "s", data.len - clean.len);
+        }
+    } else if (damaged == 0) {
+        status = 0;
+    } else {
+        fprintf(stderr, "Unable to read %s: %s\n", path, strerror(errno));
+    }
+    file_unlock(lock);
+    buffer_free(&data);
+    buffer_free(&clean);
+    return status < 0 ? -1 : damaged > 0;
+}
+
+// Damaged days of a compacted week are repaired in their day files
+static int fsck_segment(const char *root, int year, int week) {
+    char path[PATH_MAX];
+    struct Segment segment;
+    struct Buffer block;
+    struct Buffer clean;
+    int damaged;
+
+    segment_path(path, root, year, week);
+    if (access(path, F_OK) < 0) {
+        return 0;
+    }
+    if (segment_open(&segment, path) < 0) {
+        return -1;
+    }
+    buffer_init(&block);
+    buffer_init(&clean);
+    damaged = 0;
+    for (int day = 0; day < 7 && !damaged; day++) {
+        block.len = 0;
+        clean.len = 0;
+        if (segment_read(&segment, day, &block) < 0) {
+            fprintf(stderr, "%s: unable to read day %d\n", path, day);
+            break;
+        }
+        damaged = fsck_salvage(block.data, block.len, &clean) != 0;
+    }
+    segment_close(&segment);
+    buffer_free(&block);
+    buffer_free(&clean);
+
+    if (damaged) {
+        printf("%s: expanding damaged segment\n", path);
+        if (segment_expand(root, year, week) < 0) {
+            fprintf(stderr, "Unable to expand %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Remove the damaged regions left by torn writes from every day file of a
+// journal (or of one year), then rebuild the indexes of the years that
+// changed. Returns the number of files repaired, or -1 on error.
+int fsck_run(const char *root, int only_year) {
+    int years[DIR_LIST_MAX];
+    int count;
+    int repaired;
+    int status;
+
+    if (only_year >= 0) {
+        years[0] = only_year;
+        count = 1;
+    } else if ((count = dir_list_numeric(root, years, DIR_LIST_MAX)) < 0) {
+        fprintf(stderr, "Unable to read %s: %s\n", root, strerror(errno));
+        return -1;
+    }
+
+    repaired = 0;
+    status = 0;
+    for (int i = 0; i < count; i++) {
+        int year_repaired = 0;
+
+        for (int week = 0; week <= WEEK_MAX; week++) {
+            if (fsck_segment(root, years[i], week) < 0) {
+                status = -1;
+            }
+            for (int day = 0; day < 7; day++) {
+                char path[PATH_MAX];
+                int result;
+
+                sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, years[i], DIRSEP_C, week, DIRSEP_C, day);
+                if ((result = fsck_day(root, years[i], path)) < 0) {
+                    status = -1;
+                } else {
+                    year_repaired += result;
+                }
+            }
+        }
+        if (year_repaired && index_rebuild(root, years[i]) < 0) {
+            fprintf(stderr, "Unable to rebuild index for %d: %s\n", years[i], strerror(errno));
+            status = -1;
+        }
+        repaired += year_repaired;
+    }
+    return status < 0 ? -1 : repaired;
+}
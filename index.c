@@ -0,0 +1,519 @@
+#include "weekly.h"
+
+#define INDEX_HEADER_SIZE 8
+#define INDEX_ENTRY_SIZE 56
+
+static void put_u16(unsigned char *p, uint16_t value) {
+    p[0] = (unsigned char) (value & 0xff);
+    p[1] = (unsigned char) (value >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// On-disk layout (little endian):
+//   u16 week, u8 day, u8 reserved, u32 length, u64 offset, i64 timestamp, char author[32]
+static void index_encode(unsigned char *p, const struct IndexEntry *entry) {
+    memset(p, 0, INDEX_ENTRY_SIZE);
+    put_u16(p, (uint16_t) entry->week);
+    p[2] = (unsigned char) entry->day;
+    put_u32(p + 4, entry->length);
+    put_u64(p + 8, entry->offset);
+    put_u64(p + 16, (uint64_t) entry->timestamp);
+    memcpy(p + 24, entry->author, INDEX_AUTHOR_MAX);
+}
+
+static void index_decode(const unsigned char *p, struct IndexEntry *entry) {
+    entry->week = get_u16(p);
+    entry->day = p[2];
+    entry->length = get_u32(p + 4);
+    entry->offset = get_u64(p + 8);
+    entry->timestamp = (int64_t) get_u64(p + 16);
+    memcpy(entry->author, p + 24, INDEX_AUTHOR_MAX);
+    entry->author[INDEX_AUTHOR_MAX - 1] = '\0';
+}
+
+static void index_header(unsigned char *p) {
+    memcpy(p, INDEX_MAGIC, 6);
+    put_u16(p + 6, INDEX_VERSION);
+}
+
+static void index_path(char *path, const char *root, int year) {
+    sprintf(path, "%s%c%d%c%s", root, DIRSEP_C, year, DIRSEP_C, INDEX_FILENAME);
+}
+
+void index_entry_init(struct IndexEntry *entry, int week, int day, const struct RecordSpan *span, const struct RecordView *view) {
+    size_t len;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->week = week;
+    entry->day = day;
+    entry->offset = (uint64_t) span->offset;
+    entry->length = (uint32_t) span->length;
+    entry->timestamp = (int64_t) record_view_timestamp(view);
+    len = view->user.len < INDEX_AUTHOR_MAX - 1 ? view->user.len : INDEX_AUTHOR_MAX - 1;
+    memcpy(entry->author, view->user.ptr, len);
+}
+
+int index_load(const char *root, int year, struct IndexEntry **entries, size_t *count) {
+    char path[PATH_MAX] = {0};
+    unsigned char header[INDEX_HEADER_SIZE];
+    unsigned char expect[INDEX_HEADER_SIZE];
+    unsigned char raw[INDEX_ENTRY_SIZE];
+    struct IndexEntry *result;
+    size_t size;
+    size_t i;
+    long end;
+    FILE *fp;
+
+    *entries = NULL;
+    *count = 0;
+
+    index_path(path, root, year);
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+
+    index_header(expect);
+    if (fread(header, sizeof(char), sizeof(header), fp) != sizeof(header)
+        || memcmp(header, expect, sizeof(header)) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    end = ftell(fp);
+    fseek(fp, INDEX_HEADER_SIZE, SEEK_SET);
+    size = (size_t) (end - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE;
+
+    result = calloc(size ? size : 1, sizeof(*result));
+    if (!result) {
+        perror("Unable to allocate index");
+        fclose(fp);
+        return -1;
+    }
+
+    // A partially written trailing entry is ignored
+    for (i = 0; i < size && fread(raw, sizeof(char), sizeof(raw), fp) == sizeof(raw); i++) {
+        index_decode(raw, &result[i]);
+    }
+    fclose(fp);
+
+    *entries = result;
+    *count = i;
+    return 0;
+}
+
+static void index_cover(struct IndexCoverage *coverage, int week, int day, uint64_t size, uint64_t end) {
+    if (!size) {
+        return;
+    }
+    coverage->present[week] |= (unsigned char) (1 << day);
+    // Allowing for the line feed that terminates a record
+    if (end && (size == end || size == end + 1)) {
+        coverage->covered[week] |= (unsigned char) (1 << day);
+    }
+}
+
+// Whether a directory changed after the index was last written. Without
+// sub-second timestamps a change within the same second counts.
+static int index_stale(const struct stat *dir, const struct stat *index) {
+#if HAVE_WINDOWS
+    return dir->st_mtime >= index->st_mtime;
+#elif defined(__APPLE__)
+    return dir->st_mtimespec.tv_sec != index->st_mtimespec.tv_sec
+           ? dir->st_mtimespec.tv_sec > index->st_mtimespec.tv_sec
+           : dir->st_mtimespec.tv_nsec >= index->st_mtimespec.tv_nsec;
+#else
+    return dir->st_mtim.tv_sec != index->st_mtim.tv_sec
+           ? dir->st_mtim.tv_sec > index->st_mtim.tv_sec
+           : dir->st_mtim.tv_nsec >= index->st_mtim.tv_nsec;
+#endif
+}
+
+static void index_cover_segment(const char *root, int year, int week, const uint64_t *end, struct IndexCoverage *coverage) {
+    char path[PATH_MAX] = {0};
+    struct Segment segment;
+
+    segment_path(path, root, year, week);
+    if (segment_open(&segment, path) < 0) {
+        return;
+    }
+    coverage->present[week] = 0;
+    coverage->covered[week] = 0;
+    coverage->compacted[week] = 1;
+    for (int day = 0; day < 7; day++) {
+        index_cover(coverage, week, day, segment.blocks[day].length, end[day]);
+    }
+    segment_close(&segment);
+}
+
+// "named" holds the days the index has records of. When the week directory
+// is older than the index no other day file can have appeared, so only
+// those are looked at (or, without "verify", taken as covered and left for
+// the reader to check).
+static void index_cover_week(const char *root, int year, int week, const uint64_t *end, unsigned char named,
+                             const struct stat *index, int verify, struct IndexCoverage *coverage) {
+    char path[PATH_MAX] = {0};
+    struct stat st;
+    int fresh;
+
+    sprintf(path, "%s%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week);
+    if (stat(path, &st) < 0) {
+        return;
+    }
+    fresh = named && index && !index_stale(&st, index);
+    for (int day = 0; day < 7; day++) {
+        if (fresh && !(named & (1 << day))) {
+            continue;
+        }
+        if (fresh && !verify) {
+            coverage->present[week] |= (unsigned char) (1 << day);
+            coverage->covered[week] |= (unsigned char) (1 << day);
+            continue;
+        }
+        sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+        if (stat(path, &st) == 0) {
+            index_cover(coverage, week, day, (uint64_t) st.st_size, end[day]);
+        }
+    }
+}
+
+// Find the day files of weeks first through last that hold data, and which
+// of them the index covers. A file the index does not cover (written by
+// hand, by an older version, or when updating the index failed) has to be
+// read instead. The year directory is listed, but the day files of a week
+// directory older than the index are the ones it names. With "verify"
+// their sizes are checked against the index, otherwise the reader checks
+// them when it opens the files. Returns -1 when the year does not exist.
+int index_coverage(const char *root, int year, int first, int last, const struct IndexEntry *entries, size_t count, int verify, struct IndexCoverage *coverage) {
+    char path[PATH_MAX] = {0};
+    uint64_t end[WEEK_MAX + 1][7];
+    uint64_t used[WEEK_MAX + 1][7];
+    uint32_t records[WEEK_MAX + 1][7];
+    unsigned char named[WEEK_MAX + 1];
+    struct stat st_index;
+    char **names;
+    size_t nnames;
+    int have_index;
+
+    memset(coverage, 0, sizeof(*coverage));
+    sprintf(path, "%s%c%d", root, DIRSEP_C, year);
+    if (!(names = dir_list_names(path, &nnames))) {
+        return -1;
+    }
+
+    memset(end, 0, sizeof(end));
+    memset(used, 0, sizeof(used));
+    memset(records, 0, sizeof(records));
+    memset(named, 0, sizeof(named));
+    for (size_t i = 0; i < count; i++) {
+        const struct IndexEntry *entry = &entries[i];
+        if (entry->week < 0 || entry->week > WEEK_MAX || entry->day < 0 || entry->day > 6) {
+            continue;
+        }
+        named[entry->week] |= (unsigned char) (1 << entry->day);
+        used[entry->week][entry->day] += entry->length;
+        records[entry->week][entry->day]++;
+        if (entry->offset + entry->length > end[entry->week][entry->day]) {
+            end[entry->week][entry->day] = entry->offset + entry->length;
+        }
+    }
+    // Records follow each other with at most a line feed in between. More
+    // room than that holds records the index does not know about.
+    for (int week = 0; week <= WEEK_MAX; week++) {
+        for (int day = 0; day < 7; day++) {
+            if (used[week][day] > end[week][day] || end[week][day] - used[week][day] > records[week][day]) {
+                end[week][day] = 0;
+            }
+        }
+    }
+    index_path(path, root, year);
+    have_index = count && stat(path, &st_index) == 0;
+
+    // Names sort a week directory before its segment, which takes precedence
+    for (size_t i = 0; i < nnames; i++) {
+        char *stop;
+        long week;
+
+        week = strtol(names[i], &stop, 10);
+        if (stop == names[i] || week < first || week > last || week < 0 || week > WEEK_MAX) {
+            continue;
+        }
+        if (!strcmp(stop, SEGMENT_SUFFIX)) {
+            index_cover_segment(root, year, (int) week, end[week], coverage);
+        } else if (!*stop) {
+            index_cover_week(root, year, (int) week, end[week], named[week], have_index ? &st_index : NULL, verify, coverage);
+        }
+    }
+    dir_list_names_free(names, nnames);
+    return 0;
+}
+
+// Write the index of a year from its files. The caller holds the year's
+// exclusive lock.
+static int index_write(const char *root, int year) {
+    char path[PATH_MAX] = {0};
+    char path_tmp[PATH_MAX] = {0};
+    unsigned char raw[INDEX_ENTRY_SIZE];
+    struct Buffer meta;
+    FILE *fp;
+
+    index_path(path, root, year);
+    sprintf(path_tmp, "%s.XXXXXX", path);
+    fp = file_temp(path_tmp);
+    if (!fp) {
+        return -1;
+    }
+
+    index_header(raw);
+    fwrite(raw, sizeof(char), INDEX_HEADER_SIZE, fp);
+
+    buffer_init(&meta);
+    for (int week = 0; week <= WEEK_MAX; week++) {
+        int compacted = segment_exists(root, year, week);
+        for (int day = 0; day < 7; day++) {
+            struct RecordScanner scanner;
+            struct RecordSpan span;
+            struct RecordView view;
+            char filename[PATH_MAX];
+
+            sprintf(filename, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+            if (scanner_open_day(&scanner, filename, compacted) < 0) {
+                continue;
+            }
+            while (scanner_next(&scanner, &span) > 0) {
+                struct IndexEntry entry;
+                if (record_view_from_span(&view, &span) < 0) {
+                    continue;
+                }
+                index_entry_init(&entry, week, day, &span, &view);
+                index_encode(raw, &entry);
+                fwrite(raw, sizeof(char), sizeof(raw), fp);
+                meta_encode(&meta, week, day, &span, &view);
+            }
+            scanner_close(&scanner);
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        unlink(path_tmp);
+        buffer_free(&meta);
+        return -1;
+    }
+#if HAVE_WINDOWS
+    unlink(path);
+#endif
+    if (rename(path_tmp, path) < 0 || meta_write(root, year, meta.data, meta.len) < 0) {
+        unlink(path_tmp);
+        buffer_free(&meta);
+        return -1;
+    }
+    buffer_free(&meta);
+    return search_rebuild(root, year);
+}
+
+// Rebuild the indexes of a year while holding its exclusive lock. Writers
+// add entries under the shared lock, so none are lost to the rename.
+int index_rebuild(const char *root, int year) {
+    int lock;
+    int status;
+    int saved;
+
+    if ((lock = segment_lock(root, year, 1)) < 0) {
+        return -1;
+    }
+    status = index_write(root, year);
+    saved = errno;
+    file_unlock(lock);
+    errno = saved;
+    return status;
+}
+
+int index_rebuild_all(const char *root) {
+    int years[DIR_LIST_MAX];
+    int count;
+    int status;
+
+    count = dir_list_numeric(root, years, DIR_LIST_MAX);
+    if (count < 0) {
+        return -1;
+    }
+
+    status = 0;
+    for (int i = 0; i < count; i++) {
+        if (index_rebuild(root, years[i]) < 0) {
+            fprintf(stderr, "Unable to rebuild index for %d: %s\n", years[i], strerror(errno));
+            status = -1;
+        }
+    }
+    return status;
+}
+
+int index_append(const char *root, int year, const struct IndexEntry *entries, size_t count) {
+    char path[PATH_MAX] = {0};
+    unsigned char header[INDEX_HEADER_SIZE];
+    unsigned char *raw;
+    size_t len;
+    FILE *fp;
+    int status;
+
+    index_path(path, root, year);
+    index_header(header);
+    if (file_create(path, (const char *) header, sizeof(header)) < 0) {
+        return -1;
+    }
+    fp = fopen(path, "ab");
+    if (!fp) {
+        return -1;
+    }
+    raw = malloc(count * INDEX_ENTRY_SIZE + 1);
+    if (!raw) {
+        fclose(fp);
+        return -1;
+    }
+
+    len = 0;
+    for (size_t i = 0; i < count; i++) {
+        index_encode(raw + len, &entries[i]);
+        len += INDEX_ENTRY_SIZE;
+    }
+
+    // Emit the entries with a single write so concurrent appends don't interleave
+    setvbuf(fp, NULL, _IONBF, 0);
+    status = fwrite(raw, sizeof(char), len, fp) == len ? 0 : -1;
+    free(raw);
+    if (fclose(fp) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+void index_batch_init(struct IndexBatch *batch, int year) {
+    memset(batch, 0, sizeof(*batch));
+    batch->year = year;
+}
+
+int index_batch_add(struct IndexBatch *batch, int week, int day, const struct RecordSpan *span, const struct RecordView *view) {
+    if (batch->count == batch->size) {
+        struct IndexEntry *tmp;
+        batch->size = batch->size ? batch->size * 2 : 64;
+        tmp = realloc(batch->entries, batch->size * sizeof(*batch->entries));
+        if (!tmp) {
+            perror("Unable to allocate index entries");
+            return -1;
+        }
+        batch->entries = tmp;
+    }
+    index_entry_init(&batch->entries[batch->count++], week, day, span, view);
+    if (meta_encode(&batch->meta, week, day, span, view) < 0) {
+        return -1;
+    }
+    return search_postings_add(&batch->postings, &batch->npostings, &batch->psize, week, day, span, view);
+}
+
+// Write the batched entries and postings with one append per file, holding
+// the year's shared lock so a rebuild cannot rename over them. The records
+// must already be on disk: a year without an index is rebuilt from its
+// files instead.
+int index_batch_commit(const char *root, struct IndexBatch *batch) {
+    char path[PATH_MAX] = {0};
+    int status;
+    int lock;
+
+    if (!batch->count) {
+        return 0;
+    }
+
+    // The index may have been created or rebuilt while waiting for the lock
+    if ((lock = segment_lock(root, batch->year, 0)) < 0) {
+        return -1;
+    }
+    index_path(path, root, batch->year);
+    if (access(path, F_OK) < 0) {
+        // Without an index the year may hold records written by older
+        // versions. Index all of them, including the ones just appended.
+        file_unlock(lock);
+        return index_rebuild(root, batch->year);
+    }
+
+    status = index_append(root, batch->year, batch->entries, batch->count);
+    if (search_index_add(root, batch->year, batch->postings, batch->npostings) < 0
+        || meta_append(root, batch->year, batch->meta.data, batch->meta.len) < 0) {
+        status = -1;
+    }
+    file_unlock(lock);
+    return status;
+}
+
+void index_batch_free(struct IndexBatch *batch) {
+    free(batch->entries);
+    free(batch->postings);
+    buffer_free(&batch->meta);
+    index_batch_init(batch, batch->year);
+}
+
+int index_add_record(const char *root, int year, int week, int day, const char *filename, uint64_t offset) {
+    char path[PATH_MAX] = {0};
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    struct IndexBatch batch;
+    FILE *fp;
+    int status;
+
+    index_path(path, root, year);
+    if (access(path, F_OK) < 0) {
+        return index_rebuild(root, year);
+    }
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        return -1;
+    }
+    if (fseek(fp, (long) offset, SEEK_SET) < 0 || scanner_attach(&scanner, fp) < 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    status = -1;
+    index_batch_init(&batch, year);
+    if (scanner_next(&scanner, &span) > 0 && record_view_from_span(&view, &span) == 0
+        && index_batch_add(&batch, week, day, &span, &view) == 0) {
+        status = index_batch_commit(root, &batch);
+    }
+    index_batch_free(&batch);
+    scanner_close(&scanner);
+    fclose(fp);
+    return status;
+}
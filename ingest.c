@@ -0,0 +1,371 @@
+#include "weekly.h"
+
+// Index updates are written after this many records per year
+#define INGEST_COMMIT_RECORDS 4096
+
+struct Ingest {
+    const char *root;
+    const char *author;
+    const char *host;
+    const struct RecordField *fields;   // added to every record (-m)
+    size_t nfields;
+    struct AppendCache cache;
+    struct IndexBatch *batches;     // one per year
+    size_t nbatches;
+    struct Buffer header;
+    struct Buffer record;
+    size_t written;
+    int status;
+};
+
+static int ingest_commit(struct Ingest *ingest, struct IndexBatch *batch) {
+    int status;
+
+    status = index_batch_commit(ingest->root, batch);
+    if (status < 0) {
+        fprintf(stderr, "Unable to update index for %d (%s)\n", batch->year, strerror(errno));
+    }
+    index_batch_free(batch);
+    return status;
+}
+
+static struct IndexBatch *ingest_batch(struct Ingest *ingest, int year) {
+    struct IndexBatch *tmp;
+
+    for (size_t i = 0; i < ingest->nbatches; i++) {
+        if (ingest->batches[i].year == year) {
+            return &ingest->batches[i];
+        }
+    }
+    tmp = realloc(ingest->batches, (ingest->nbatches + 1) * sizeof(*ingest->batches));
+    if (!tmp) {
+        perror("Unable to allocate index batch");
+        return NULL;
+    }
+    ingest->batches = tmp;
+    index_batch_init(&ingest->batches[ingest->nbatches], year);
+    return &ingest->batches[ingest->nbatches++];
+}
+
+// Header values occupy a single line
+static int ingest_valid_field(const char *s) {
+    for (; *s; s++) {
+        if ((unsigned char) *s < 0x20) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Append one record to the day file of time t and queue its index entries
+static int ingest_record(struct Ingest *ingest, time_t t, const char *author, const char *host,
+                         const struct RecordField *fields, size_t nfields, const char *data, size_t len) {
+    char path[PATH_MAX] = {0};
+    char datestamp[255] = {0};
+    char timestamp[255] = {0};
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    struct IndexBatch *batch;
+    struct tm *tm_;
+    uint64_t offset;
+    int year, week, day_of_week;
+    int format;
+    int status;
+    int fd;
+
+    tm_ = localtime(&t);
+    if (!tm_) {
+        return -1;
+    }
+    calendar_locate_tm(tm_, &year, &week, &day_of_week);
+    strftime(datestamp, sizeof(datestamp) - 1, "%m/%d/%Y", tm_);
+    strftime(timestamp, sizeof(timestamp) - 1, "%H:%M:%S", tm_);
+
+    sprintf(path, "%s%c%d%c%d%c%d", ingest->root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day_of_week);
+    // Writing to a compacted week restores its day files first
+    fd = append_cache_open(&ingest->cache, year, week, day_of_week, 1, &format);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open '%s' (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Assemble the record so it is appended with a single write
+    ingest->header.len = 0;
+    ingest->record.len = 0;
+    if (buffer_printf(&ingest->header, FMT_HEADER, datestamp, timestamp, author, host) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < ingest->nfields; i++) {
+        if (meta_header_add(&ingest->header, &ingest->fields[i]) < 0) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < nfields; i++) {
+        if (meta_header_add(&ingest->header, &fields[i]) < 0) {
+            return -1;
+        }
+    }
+    if (append_encode(&ingest->record, format, ingest->header.data, data, len) < 0) {
+        fprintf(stderr, "Unable to append record to '%s' (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (append_write(fd, ingest->record.data, ingest->record.len, &offset) < 0) {
+        fprintf(stderr, "Unable to append record to '%s' (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    ingest->written++;
+
+    // Index the record from memory rather than reading it back
+    if (!(batch = ingest_batch(ingest, year))) {
+        return -1;
+    }
+    status = 0;
+    scanner_open_memory(&scanner, ingest->record.data, ingest->record.len);
+    if (scanner_next(&scanner, &span) > 0 && record_view_from_span(&view, &span) == 0) {
+        span.offset += (long) offset;
+        status = index_batch_add(batch, week, day_of_week, &span, &view);
+    }
+    scanner_close(&scanner);
+    if (status == 0 && batch->count >= INGEST_COMMIT_RECORDS) {
+        // A year without an index is rebuilt under its exclusive lock, which
+        // the cached descriptors' shared locks would never let go of
+        if (append_cache_close(&ingest->cache) < 0) {
+            perror("Unable to close journal file");
+            return -1;
+        }
+        status = ingest_commit(ingest, batch);
+    }
+    return status;
+}
+
+static int ingest_blank(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!isspace((unsigned char) data[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Records are separated by lines holding only INGEST_DELIMITER
+static void ingest_text(struct Ingest *ingest, FILE *fp) {
+    struct Buffer line;
+    struct Buffer message;
+    int done;
+
+    buffer_init(&line);
+    buffer_init(&message);
+    done = 0;
+    while (!done) {
+        size_t len;
+        int n;
+
+        line.len = 0;
+        if ((n = buffer_read_line(&line, fp)) < 0) {
+            perror("Unable to read records");
+            ingest->status = -1;
+            break;
+        }
+        done = n == 0;
+
+        len = line.len;
+        while (len && (line.data[len - 1] == '\n' || line.data[len - 1] == '\r')) {
+            len--;
+        }
+        if (!done && !(len == strlen(INGEST_DELIMITER) && !memcmp(line.data, INGEST_DELIMITER, len))) {
+            buffer_append(&message, line.data, line.len);
+            continue;
+        }
+
+        if (message.len && message.data[message.len - 1] == '\n') {
+            message.len--;
+        }
+        if (!ingest_blank(message.data, message.len)
+            && ingest_record(ingest, time(NULL), ingest->author, ingest->host, NULL, 0, message.data, message.len) < 0) {
+            ingest->status = -1;
+        }
+        message.len = 0;
+    }
+    buffer_free(&line);
+    buffer_free(&message);
+}
+
+// Copy a string member of a JSON object. Returns 0 when it is absent.
+static int ingest_json_string(const struct JsonField *fields, size_t count, const char *key, char *dest, size_t size) {
+    const struct JsonField *field;
+
+    if (!(field = json_field(fields, count, key))) {
+        return 0;
+    }
+    if (!field->is_string || field->value.len >= size) {
+        return -1;
+    }
+    memcpy(dest, field->value.ptr, field->value.len);
+    dest[field->value.len] = '\0';
+    return 1;
+}
+
+// Members other than the standard ones become metadata fields of the record
+static int ingest_json_metadata(const struct Ingest *ingest, const struct JsonField *fields, size_t count,
+                                struct RecordField *metadata, size_t *nmetadata) {
+    static const char *standard[] = {"data", "date", "time", "author", "host"};
+
+    *nmetadata = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct RecordField *field;
+        size_t j;
+
+        for (j = 0; j < sizeof(standard) / sizeof(*standard); j++) {
+            if (fields[i].key.len == strlen(standard[j]) && !memcmp(fields[i].key.ptr, standard[j], fields[i].key.len)) {
+                break;
+            }
+        }
+        if (j < sizeof(standard) / sizeof(*standard)) {
+            continue;
+        }
+        // Objects and arrays are not flattened
+        if (ingest->nfields + *nmetadata == RECORD_FIELDS_MAX
+            || (!fields[i].is_string && (*fields[i].value.ptr == '{' || *fields[i].value.ptr == '['))) {
+            return -1;
+        }
+        field = &metadata[(*nmetadata)++];
+        field->key = fields[i].key;
+        field->value = fields[i].value;
+        if (!meta_field_valid(field)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// One JSON object per line:
+//   {"data": "...", "date": "YYYY-MM-DD", "time": "HH:MM:SS", "author": "...", "host": "..."}
+// Only "data" is required. Any other string or number member is stored as
+// a metadata field (e.g. "project": "foo", "hours": 3).
+static void ingest_jsonl(struct Ingest *ingest, FILE *fp) {
+    struct JsonField fields[INGEST_FIELDS_MAX];
+    struct Buffer line;
+    unsigned long lineno;
+    int n;
+
+    buffer_init(&line);
+    lineno = 0;
+    while (1) {
+        struct RecordField metadata[RECORD_FIELDS_MAX];
+        const struct JsonField *data;
+        char date[255] = {0};
+        char clock[255] = {0};
+        char author[255] = {0};
+        char host[255] = {0};
+        size_t count;
+        size_t nmetadata;
+        time_t t;
+        int have_date;
+        int have_time;
+
+        line.len = 0;
+        if ((n = buffer_read_line(&line, fp)) <= 0) {
+            break;
+        }
+        lineno++;
+        if (ingest_blank(line.data, line.len)) {
+            continue;
+        }
+
+        if (json_parse_object(line.data, line.len, fields, INGEST_FIELDS_MAX, &count) < 0) {
+            fprintf(stderr, "line %lu: invalid JSON object\n", lineno);
+            ingest->status = -1;
+            continue;
+        }
+        data = json_field(fields, count, "data");
+        if (!data || !data->is_string) {
+            fprintf(stderr, "line %lu: missing \"data\" string\n", lineno);
+            ingest->status = -1;
+            continue;
+        }
+
+        have_date = ingest_json_string(fields, count, "date", date, sizeof(date) - 10);
+        have_time = ingest_json_string(fields, count, "time", clock, sizeof(clock));
+        if (have_date < 0 || have_time < 0
+            || ingest_json_string(fields, count, "author", author, sizeof(author)) < 0
+            || ingest_json_string(fields, count, "host", host, sizeof(host)) < 0
+            || !ingest_valid_field(author) || !ingest_valid_field(host)) {
+            fprintf(stderr, "line %lu: invalid date, time, author or host\n", lineno);
+            ingest->status = -1;
+            continue;
+        }
+        if (ingest_json_metadata(ingest, fields, count, metadata, &nmetadata) < 0) {
+            fprintf(stderr, "line %lu: invalid metadata (at most %d fields of strings or numbers)\n",
+                    lineno, RECORD_FIELDS_MAX);
+            ingest->status = -1;
+            continue;
+        }
+
+        t = time(NULL);
+        if (have_date) {
+            if (have_time) {
+                strcat(date, "T");
+                strncat(date, clock, 8);
+            }
+            if (calendar_parse(date, &t, 0) < 0) {
+                fprintf(stderr, "line %lu: invalid date: %s\n", lineno, date);
+                ingest->status = -1;
+                continue;
+            }
+        } else if (have_time) {
+            fprintf(stderr, "line %lu: \"time\" requires \"date\"\n", lineno);
+            ingest->status = -1;
+            continue;
+        }
+
+        if (ingest_record(ingest, t, *author ? author : ingest->author, *host ? host : ingest->host,
+                          metadata, nmetadata, data->value.ptr, data->value.len) < 0) {
+            ingest->status = -1;
+        }
+    }
+    if (n < 0) {
+        perror("Unable to read records");
+        ingest->status = -1;
+    }
+    buffer_free(&line);
+}
+
+// Append every record of a stream to the journal. Each record is routed to
+// the day file of its date, descriptors stay open across records, and the
+// indexes are updated once per year rather than once per record.
+int ingest_stream(const char *root, FILE *fp, int format, const char *author, const char *host,
+                  const struct RecordField *fields, size_t nfields, size_t *written) {
+    struct Ingest ingest;
+
+    memset(&ingest, 0, sizeof(ingest));
+    ingest.root = root;
+    ingest.author = author;
+    ingest.host = host;
+    ingest.fields = fields;
+    ingest.nfields = nfields;
+    append_cache_init(&ingest.cache, root);
+    buffer_init(&ingest.header);
+    buffer_init(&ingest.record);
+
+    if (format == INGEST_FORMAT_JSONL) {
+        ingest_jsonl(&ingest, fp);
+    } else {
+        ingest_text(&ingest, fp);
+    }
+
+    if (append_cache_close(&ingest.cache) < 0) {
+        perror("Unable to close journal file");
+        ingest.status = -1;
+    }
+    for (size_t i = 0; i < ingest.nbatches; i++) {
+        if (ingest_commit(&ingest, &ingest.batches[i]) < 0) {
+            ingest.status = -1;
+        }
+    }
+    free(ingest.batches);
+    buffer_free(&ingest.header);
+    buffer_free(&ingest.record);
+    *written = ingest.written;
+    return ingest.status;
+}
@@ -0,0 +1,206 @@
+#include "weekly.h"
+
+static const char *json_skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static int json_hex(const char *p, const char *end, unsigned *value) {
+    *value = 0;
+    if (end - p < 4) {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        int c = (unsigned char) p[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9')
+            *value |= (unsigned) (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            *value |= (unsigned) (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            *value |= (unsigned) (c - 'A' + 10);
+        else
+            return -1;
+    }
+    return 0;
+}
+
+static char *json_put_utf8(char *out, unsigned cp) {
+    if (cp < 0x80) {
+        *out++ = (char) cp;
+    } else if (cp < 0x800) {
+        *out++ = (char) (0xc0 | (cp >> 6));
+        *out++ = (char) (0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        *out++ = (char) (0xe0 | (cp >> 12));
+        *out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char) (0x80 | (cp & 0x3f));
+    } else {
+        *out++ = (char) (0xf0 | (cp >> 18));
+        *out++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+        *out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char) (0x80 | (cp & 0x3f));
+    }
+    return out;
+}
+
+// Decode the string starting at the opening quote in place. An escaped
+// string never grows, so the result overwrites the input.
+static char *json_string(char *p, const char *end, struct Slice *result) {
+    char *out;
+
+    p++;
+    out = p;
+    result->ptr = out;
+    while (p < end && *p != '"') {
+        if ((unsigned char) *p < 0x20) {
+            return NULL;
+        }
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        if (++p >= end) {
+            return NULL;
+        }
+        switch (*p++) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                unsigned cp, low;
+                if (json_hex(p, end, &cp) < 0) {
+                    return NULL;
+                }
+                p += 4;
+                // Surrogate pair
+                if (cp >= 0xd800 && cp <= 0xdbff && end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                    && json_hex(p + 2, end, &low) == 0 && low >= 0xdc00 && low <= 0xdfff) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                }
+                out = json_put_utf8(out, cp);
+                break;
+            }
+            default:
+                return NULL;
+        }
+    }
+    if (p >= end) {
+        return NULL;
+    }
+    result->len = (size_t) (out - result->ptr);
+    return p + 1;
+}
+
+// Skip a number, literal, object or array
+static char *json_skip_value(char *p, const char *end) {
+    int depth;
+
+    if (*p != '{' && *p != '[') {
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && !isspace((unsigned char) *p)) {
+            p++;
+        }
+        return p;
+    }
+
+    depth = 0;
+    while (p < end) {
+        if (*p == '"') {
+            // Skip over strings without decoding them
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') {
+                    p++;
+                }
+            }
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth == 0) {
+                return p + 1;
+            }
+        }
+        p++;
+    }
+    return NULL;
+}
+
+int json_parse_object(char *data, size_t len, struct JsonField *fields, size_t max, size_t *count) {
+    const char *end;
+    char *p;
+
+    *count = 0;
+    end = data + len;
+    p = (char *) json_skip_space(data, end);
+    if (p >= end || *p != '{') {
+        return -1;
+    }
+    p = (char *) json_skip_space(p + 1, end);
+    if (p < end && *p == '}') {
+        return 0;
+    }
+
+    while (p < end) {
+        struct JsonField field;
+
+        memset(&field, 0, sizeof(field));
+        if (*p != '"' || !(p = json_string(p, end, &field.key))) {
+            return -1;
+        }
+        p = (char *) json_skip_space(p, end);
+        if (p >= end || *p != ':') {
+            return -1;
+        }
+        p = (char *) json_skip_space(p + 1, end);
+        if (p >= end) {
+            return -1;
+        }
+
+        if (*p == '"') {
+            field.is_string = 1;
+            if (!(p = json_string(p, end, &field.value))) {
+                return -1;
+            }
+        } else {
+            char *start = p;
+            if (!(p = json_skip_value(p, end)) || p == start) {
+                return -1;
+            }
+            field.value.ptr = start;
+            field.value.len = (size_t) (p - start);
+        }
+        if (*count < max) {
+            fields[(*count)++] = field;
+        }
+
+        p = (char *) json_skip_space(p, end);
+        if (p < end && *p == ',') {
+            p = (char *) json_skip_space(p + 1, end);
+            continue;
+        }
+        if (p < end && *p == '}') {
+            return 0;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+const struct JsonField *json_field(const struct JsonField *fields, size_t count, const char *key) {
+    size_t len;
+
+    len = strlen(key);
+    for (size_t i = 0; i < count; i++) {
+        if (fields[i].key.len == len && !memcmp(fields[i].key.ptr, key, len)) {
+            return &fields[i];
+        }
+    }
+    return NULL;
+}
@@ -5,28 +5,83 @@ char *homedir;
 char journalroot[PATH_MAX] = {0};
 char intermediates[PATH_MAX] = {0};
 const char *VERSION = "1.0.0";
-const char *FMT_HEADER = "\x01\x01\x01## date:   %s\n"
-                         "## time:   %s\n"
-                         "## author: %s\n"
-                         "## host:   %s\n\x02\x02\x02";
-const char *FMT_FOOTER = "\x03\x03\x03";
 const char *USAGE_STATEMENT = \
     "usage: %s [-h] [-V] [-dDys] [-]\n\n"
     "Weekly Report Generator v%s\n\n"
     "Environment Variables:\n"
     "WEEKLY_JOURNAL_ROOT          Override journal destination\n"
-    "                               (e.g., /shared/weeklies/$USER)\n\n"
-    "Options:\n"
+    "                               (e.g., /shared/weeklies/$USER)\n"
+    "WEEKLY_RECORD_FORMAT         Record format of new journal files (1 or 2)\n\n"
+    "Options (long options also take --option=VALUE):\n"
     "--help             -h        Show this usage statement\n"
+    "--meta             -m        Add metadata KEY=VALUE to the new record\n"
+    "                               (e.g., -m project=weekly -m hours=3)\n"
     "--all              -a        Dump all records\n"
     "--dump-relative    -d        Dump records relative to current week\n"
     "--dump-absolute    -D        Dump records by week value\n"
     "--dump-year        -y        Set dump-[relative|absolute] year\n"
+    "--since                      Dump records written on or after DATE\n"
+    "--until                      Dump records written on or before DATE\n"
+    "                               (YYYY-MM-DD or MM/DD/YYYY, with optional\n"
+    "                               time of day: YYYY-MM-DDTHH:MM[:SS])\n"
     "--dump-style       -s        Set output style:\n"
     "                               long (default)\n"
     "                               short\n"
     "                               csv\n"
     "                               dict\n"
+    "                               jsonl (one JSON object per line)\n"
+    "                               json (JSON array)\n"
+    "--jobs             -j        Number of files to dump concurrently\n"
+    "                               (default: one per processor)\n"
+    "--no-mmap                    Read journal files with stdio instead of mapping\n"
+    "                               them into memory\n"
+    "--grep                       Search all records for words in PATTERN\n"
+    "--aggregate                  Dump records from every journal in PARENT\n"
+    "                               (e.g., /shared/weeklies), ordered by time\n"
+    "--group-by                   Group aggregated records by author or host, or\n"
+    "                               --sum totals by a metadata KEY\n"
+    "--where                      Dump records with metadata KEY=VALUE\n"
+    "                               (repeat to require several fields)\n"
+    "--sum                        Total the numeric metadata field KEY of the\n"
+    "                               selected records\n"
+    "--stats-report               Summarize the selected week(s) or --since and\n"
+    "                               --until range: records per day and week,\n"
+    "                               words and characters per author and host,\n"
+    "                               busiest hours (-s csv or json for machine\n"
+    "                               readable output)\n"
+    "--stats-report=index         Count records per day, week, author and hour\n"
+    "                               from the indexes\n"
+    "--reindex                    Rebuild record indexes (all years, or -y)\n"
+    "--serve                      Answer dump queries from a cache of parsed\n"
+    "                               weeks until interrupted\n"
+    "--no-serve                   Read journal files even when a server is\n"
+    "                               running\n"
+    "--follow                     Print records as they are written to today's\n"
+    "                               journal file (or every journal in\n"
+    "                               --aggregate PARENT) until interrupted\n"
+    "--checkpoint                 Resume --follow from FILE and record progress\n"
+    "                               in it\n"
+    "--compact                    Fold each finished week into a single segment\n"
+    "                               file (all years, or -y)\n"
+    "--fsck                       Remove torn and interleaved records left by\n"
+    "                               interrupted writes (all years, or -y)\n"
+    "--migrate                    Move day files written with the legacy week\n"
+    "                               numbering to ISO 8601 weeks\n"
+    "--export                     Write every record to FILE in a columnar\n"
+    "                               format for analytics tools\n"
+    "--from                       Dump records from an --export FILE (all, or\n"
+    "                               with --since, --until and --grep)\n"
+    "--batch                      Append records read from stdin, separated by\n"
+    "                               lines containing only \"%%%%\"\n"
+    "--batch-jsonl                Append records read from stdin as JSON Lines\n"
+    "                               ({\"data\": ..., \"date\": ..., \"time\": ...,\n"
+    "                               \"author\": ..., \"host\": ...})\n"
+    "--record-format              Record format of new journal files:\n"
+    "                               1 (control codes, default)\n"
+    "                               2 (length prefixed, binary-safe)\n"
+    "--stats                      Print counters and stage timings to stderr\n"
+    "--stats=json                 Print counters and stage timings as JSON\n"
+    "                               (requires a build with WEEKLY_STATS)\n"
     "--version          -V        Show version\n";
 
 void usage() {
@@ -41,35 +96,152 @@ void usage() {
     printf(USAGE_STATEMENT, is_base ? name + 1 : program_name, VERSION);
 }
 
+// Options are matched against this table. Values follow the option as the
+// next argument or after "=" (--since=2024-01-01).
+#define OPT_FLAG 0          // takes no value
+#define OPT_VALUE 1         // requires a value
+#define OPT_OPTIONAL 2      // takes "=VALUE" or a following integer
+#define OPT_EQUALS 3        // takes "=VALUE" only
+
+enum {
+    OPT_HELP,
+    OPT_VERSION,
+    OPT_STDIN,
+    OPT_ALL,
+    OPT_JOBS,
+    OPT_NO_MMAP,
+    OPT_SINCE,
+    OPT_UNTIL,
+    OPT_GREP,
+    OPT_AGGREGATE,
+    OPT_GROUP_BY,
+    OPT_META,
+    OPT_WHERE,
+    OPT_SUM,
+    OPT_STATS,
+    OPT_STATS_REPORT,
+    OPT_REINDEX,
+    OPT_SERVE,
+    OPT_NO_SERVE,
+    OPT_FOLLOW,
+    OPT_CHECKPOINT,
+    OPT_COMPACT,
+    OPT_FSCK,
+    OPT_MIGRATE,
+    OPT_EXPORT,
+    OPT_FROM,
+    OPT_RECORD_FORMAT,
+    OPT_BATCH,
+    OPT_BATCH_JSONL,
+    OPT_DUMP_RELATIVE,
+    OPT_DUMP_ABSOLUTE,
+    OPT_DUMP_YEAR,
+    OPT_DUMP_STYLE,
+};
+
+struct Option {
+    const char *name;
+    const char *alias;      // short form (NULL: none)
+    int id;
+    int value;              // OPT_FLAG, OPT_VALUE, OPT_OPTIONAL or OPT_EQUALS
+    const char *error;      // printed when the value is missing or invalid
+};
+
+static const struct Option options[] = {
+    {"--help", "-h", OPT_HELP, OPT_FLAG, NULL},
+    {"--version", "-V", OPT_VERSION, OPT_FLAG, NULL},
+    {"-", NULL, OPT_STDIN, OPT_FLAG, NULL},
+    {"--all", "-a", OPT_ALL, OPT_FLAG, NULL},
+    {"--jobs", "-j", OPT_JOBS, OPT_VALUE, "--jobs (-j) requires an integer"},
+    {"--no-mmap", NULL, OPT_NO_MMAP, OPT_FLAG, NULL},
+    {"--since", NULL, OPT_SINCE, OPT_VALUE, "--since requires a date (YYYY-MM-DD or MM/DD/YYYY)"},
+    {"--until", NULL, OPT_UNTIL, OPT_VALUE, "--until requires a date (YYYY-MM-DD or MM/DD/YYYY)"},
+    {"--grep", NULL, OPT_GREP, OPT_VALUE, "--grep requires a search pattern"},
+    {"--aggregate", NULL, OPT_AGGREGATE, OPT_VALUE, "--aggregate requires a directory of journals"},
+    {"--group-by", NULL, OPT_GROUP_BY, OPT_VALUE, "--group-by requires a field (i.e. author, host, or a metadata key)"},
+    {"--meta", "-m", OPT_META, OPT_VALUE, "--meta (-m) requires KEY=VALUE"},
+    {"--where", NULL, OPT_WHERE, OPT_VALUE, "--where requires KEY=VALUE"},
+    {"--sum", NULL, OPT_SUM, OPT_VALUE, "--sum requires a metadata key"},
+    {"--stats", NULL, OPT_STATS, OPT_EQUALS, "--stats takes no value or =json"},
+    {"--stats-report", NULL, OPT_STATS_REPORT, OPT_EQUALS, "--stats-report takes no value or =index"},
+    {"--reindex", NULL, OPT_REINDEX, OPT_FLAG, NULL},
+    {"--serve", NULL, OPT_SERVE, OPT_FLAG, NULL},
+    {"--no-serve", NULL, OPT_NO_SERVE, OPT_FLAG, NULL},
+    {"--follow", NULL, OPT_FOLLOW, OPT_FLAG, NULL},
+    {"--checkpoint", NULL, OPT_CHECKPOINT, OPT_VALUE, "--checkpoint requires a file name"},
+    {"--compact", NULL, OPT_COMPACT, OPT_FLAG, NULL},
+    {"--fsck", NULL, OPT_FSCK, OPT_FLAG, NULL},
+    {"--migrate", NULL, OPT_MIGRATE, OPT_FLAG, NULL},
+    {"--export", NULL, OPT_EXPORT, OPT_VALUE, "--export requires a file name"},
+    {"--from", NULL, OPT_FROM, OPT_VALUE, "--from requires an export file"},
+    {"--record-format", NULL, OPT_RECORD_FORMAT, OPT_VALUE, "--record-format requires a format version (1 or 2)"},
+    {"--batch", NULL, OPT_BATCH, OPT_FLAG, NULL},
+    {"--batch-jsonl", NULL, OPT_BATCH_JSONL, OPT_FLAG, NULL},
+    {"--dump-relative", "-d", OPT_DUMP_RELATIVE, OPT_OPTIONAL, "Invalid integer"},
+    {"--dump-absolute", "-D", OPT_DUMP_ABSOLUTE, OPT_OPTIONAL, "Invalid integer"},
+    {"--dump-year", "-y", OPT_DUMP_YEAR, OPT_VALUE, "--dump-year (-y) requires an integer year"},
+    {"--dump-style", "-s", OPT_DUMP_STYLE, OPT_VALUE, "--dump-style (-s) requires a style argument (i.e. short, long, csv, dict, jsonl, json)"},
+};
+
+// Find the option named by "arg". A long option may carry its value after
+// "=", which is returned in "value".
+static const struct Option *option_find(const char *arg, const char **value) {
+    const char *eq;
+    size_t len;
+
+    *value = NULL;
+    len = strlen(arg);
+    if (!strncmp(arg, "--", 2) && (eq = strchr(arg, '=')) != NULL) {
+        len = (size_t) (eq - arg);
+        *value = eq + 1;
+    }
+    for (size_t i = 0; i < sizeof(options) / sizeof(*options); i++) {
+        const struct Option *opt = &options[i];
+        if ((strlen(opt->name) == len && !strncmp(arg, opt->name, len))
+            || (opt->alias && !*value && !strcmp(arg, opt->alias))) {
+            return opt;
+        }
+    }
+    return NULL;
+}
+
+static int option_integer(const char *value, int *result) {
+    char *end;
+    long number;
+
+    if (!value || !*value) {
+        return -1;
+    }
+    number = strtol(value, &end, 10);
+    if (*end != '\0' || number < INT_MIN || number > INT_MAX) {
+        return -1;
+    }
+    *result = (int) number;
+    return 0;
+}
+
+static void option_error(const struct Option *opt) {
+    fprintf(stderr, "%s\n", opt->error);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
     // System info
     char sysname[255] = {0};
     char username[255] = {0};
-#if HAVE_WINDOWS
-    DWORD usernamesz;
-    usernamesz = sizeof(username);
-    DWORD sysnamesz;
-    sysnamesz = sizeof(sysname);
-    homedir = getenv("USERPROFILE");
-#else
-    struct passwd *user;
-    homedir = getenv("HOME");
-#endif
 
     // Time and datestamp
     time_t t;
-    struct tm *tm_;
+    struct tm now;
     int year, week, day_of_week;
     char datestamp[255] = {0};
     char timestamp[255] = {0};
 
     // Path and data buffers
-    char *headerfile;
     char *tempfile;
-    char *footerfile;
+    struct Buffer message;
     char journalfile[PATH_MAX] = {0};
-    char header[255];
-    char footer[255];
+    struct Buffer header;
 
     // Argument triggers
     int do_stdin;
@@ -77,68 +249,61 @@ int main(int argc, char *argv[]) {
     int do_year;
     int do_style;
     int do_all;
+    int do_reindex;
+    int do_report;
+    int do_serve;
+    int do_follow;
+    const char *checkpoint;
+    int do_batch;
+    int do_compact;
+    int do_fsck;
+    int do_migrate;
+    const char *export_file;
+    const char *from_file;
+    int batch_format;
+    int do_since;
+    int do_until;
+    const char *grep_pattern;
+    const char *aggregate_root;
+    const char *group_by;
+    int group;
+    struct MetaQuery meta_query;
+    struct RecordField metadata[RECORD_FIELDS_MAX];
+    size_t nmetadata;
+    struct DumpFilter filter;
+    struct DumpQuery query;
     int user_year;
-    char *user_year_error;
     int user_week;
-    char *user_week_error;
+    int week_absolute;
+    int week_relative;
+    char *user_format;
     int style;
+    struct Writer out;
+    int status;
     char *user_journalroot;
 
     // Set program name
     program_name = argv[0];
-    // Get current time
-    t = time(NULL);
-    // Populate tm struct
-    tm_ = localtime(&t);
-    // Time data fix ups
-    year = tm_->tm_year + 1900;
-    week = (tm_->tm_yday + 7 - (tm_->tm_wday + 1 ? (tm_->tm_wday - 1) : 6)) / 7;
-    day_of_week = tm_->tm_wday;
     // Set default output style
     style = RECORD_STYLE_LONG;
 
+    // Populate path(s)
 #if HAVE_WINDOWS
-    // Get system name
-    if(!GetComputerName(sysname, &sysnamesz)) {
-        perror("Unable to get system host name");
-        strcpy(sysname, "unknown");
-    }
-    // Get user information
-    if(!GetUserName(username, &usernamesz)) {
-        perror("Unable to read account information");
-        strcpy(username, "unknown");
-    }
+    homedir = getenv("USERPROFILE");
 #else
-    // Get system name
-    if (gethostname(sysname, sizeof(sysname) - 1) < 0) {
-        perror("Unable to get system host name");
-        strcpy(sysname, "unknown");
-    }
-
-    // Get user information
-    user = getpwuid(getuid());
-    if (user == NULL) {
-        perror("Unable to read account information");
-        strcpy(username, "unknown");
-    } else {
-        strcpy(username, user->pw_name);
-    }
+    homedir = getenv("HOME");
 #endif
-    // Get date and time
-    strftime(datestamp, sizeof(datestamp) - 1, "%m/%d/%Y", tm_);
-    strftime(timestamp, sizeof(timestamp) - 1, "%H:%M:%S", tm_);
-
-    // Populate header string
-    sprintf(header, FMT_HEADER, datestamp, timestamp, username, sysname);
-    // Populate footer string
-    strcpy(footer, FMT_FOOTER);
-    // Populate path(s)
     if ((user_journalroot = getenv("WEEKLY_JOURNAL_ROOT")) != NULL) {
         strcpy(journalroot, user_journalroot);
     } else {
         sprintf(journalroot, "%s%c.weekly", homedir, DIRSEP_C);
     }
     sprintf(intermediates, "%s%ctmp", journalroot, DIRSEP_C);
+    if ((user_format = getenv("WEEKLY_RECORD_FORMAT")) != NULL && *user_format
+        && option_integer(user_format, &record_format) < 0) {
+        fprintf(stderr, "Invalid WEEKLY_RECORD_FORMAT: %s (expected 1 or 2)\n", user_format);
+        exit(1);
+    }
 
     // Prime argument triggers
     do_stdin = 0;
@@ -146,197 +311,673 @@ int main(int argc, char *argv[]) {
     do_year = 0;
     do_style = 0;
     do_all = 0;
+    do_reindex = 0;
+    do_report = 0;
+    do_serve = 0;
+    do_follow = 0;
+    checkpoint = NULL;
+    do_batch = 0;
+    do_compact = 0;
+    do_fsck = 0;
+    do_migrate = 0;
+    export_file = NULL;
+    from_file = NULL;
+    batch_format = INGEST_FORMAT_TEXT;
+    do_since = 0;
+    do_until = 0;
+    grep_pattern = NULL;
+    aggregate_root = NULL;
+    group_by = NULL;
+    group = DUMP_GROUP_NONE;
+    memset(&meta_query, 0, sizeof(meta_query));
+    nmetadata = 0;
+    user_year = 0;
+    week_absolute = -1;
+    week_relative = 0;
 
     // Parse user arguments
     for (int i = 1; i < argc; i++) {
-        if (ARG("-h") || ARG("--help")) {
+        const struct Option *opt;
+        const char *value;
+        int number;
+
+        if (!(opt = option_find(argv[i], &value))) {
+            fprintf(stderr, "Unknown option: %s (see --help)\n", argv[i]);
+            exit(1);
+        }
+        if (opt->value == OPT_FLAG && value) {
+            fprintf(stderr, "Option %s does not take a value\n", opt->name);
+            exit(1);
+        }
+        if (opt->value == OPT_VALUE && !value) {
+            if (i + 1 >= argc) {
+                option_error(opt);
+            }
+            value = argv[++i];
+        }
+        if (opt->value == OPT_OPTIONAL && !value && i + 1 < argc && option_integer(argv[i + 1], &number) == 0) {
+            value = argv[++i];
+        }
+
+        switch (opt->id) {
+        case OPT_HELP:
             usage();
             exit(0);
-        }
-        if (ARG("-V") || ARG("--version")) {
+        case OPT_VERSION:
             puts(VERSION);
             exit(0);
-        }
-        if (ARG("-")) {
+        case OPT_STDIN:
             do_stdin = 1;
-        }
-        if (ARG("-a") || ARG("--all")) {
+            break;
+        case OPT_ALL:
             do_all = 1;
             do_dump = 1;
-        }
-        if (ARG("-d") || ARG("--dump-relative")) {
-            if (ARG_NEXT_EXISTS) {
-                user_week = (int) strtol(ARG_NEXT, &user_week_error, 10);
-                if (*user_week_error != '\0') {
-                    fprintf(stderr, "Invalid integer\n");
-                    exit(1);
-                }
-                week -= user_week;
+            break;
+        case OPT_JOBS:
+            if (option_integer(value, &dump_jobs) < 0 || dump_jobs < 1) {
+                fprintf(stderr, "Invalid integer\n");
+                exit(1);
             }
+            break;
+        case OPT_NO_MMAP:
+            scanner_mmap = 0;
+            break;
+        case OPT_SINCE:
+            if (calendar_parse(value, &filter.since, 0) < 0) {
+                option_error(opt);
+            }
+            do_since = 1;
             do_dump = 1;
-        }
-        if (ARG("-D") || ARG("--dump-absolute")) {
-            if (ARG_NEXT_EXISTS) {
-                user_week = (int) strtol(ARG_NEXT, &user_week_error, 10);
-                if (*user_week_error != '\0') {
-                    fprintf(stderr, "Invalid integer\n");
-                    exit(1);
-                }
-                week = user_week;
+            break;
+        case OPT_UNTIL:
+            if (calendar_parse(value, &filter.until, 1) < 0) {
+                option_error(opt);
             }
+            do_until = 1;
             do_dump = 1;
-        }
-        if (ARG("-y") || ARG("--dump-year")) {
-            if (!ARG_NEXT_EXISTS) {
-                fprintf(stderr, "--dump-year (-y) requires an integer year\n");
+            break;
+        case OPT_GREP:
+            grep_pattern = value;
+            do_dump = 1;
+            break;
+        case OPT_AGGREGATE:
+            aggregate_root = value;
+            do_dump = 1;
+            break;
+        case OPT_GROUP_BY:
+            group_by = value;
+            break;
+        case OPT_META:
+            if (nmetadata == RECORD_FIELDS_MAX) {
+                fprintf(stderr, "Too many metadata fields (maximum: %d)\n", RECORD_FIELDS_MAX);
                 exit(1);
             }
-            user_year = (int) strtol(ARG_NEXT, &user_year_error, 10);
-            if (*user_year_error != '\0') {
-                fprintf(stderr, "Invalid integer\n");
+            if (meta_field_parse(&metadata[nmetadata++], value) < 0) {
+                option_error(opt);
+            }
+            break;
+        case OPT_WHERE:
+            if (meta_query.nwhere == RECORD_FIELDS_MAX) {
+                fprintf(stderr, "Too many --where fields (maximum: %d)\n", RECORD_FIELDS_MAX);
                 exit(1);
             }
-            year = user_year;
-            do_year = 1;
+            if (meta_field_parse(&meta_query.where[meta_query.nwhere++], value) < 0) {
+                option_error(opt);
+            }
+            do_dump = 1;
+            break;
+        case OPT_SUM: {
+            struct RecordField field;
+            field.key.ptr = value;
+            field.key.len = strlen(value);
+            field.value.ptr = "";
+            field.value.len = 0;
+            if (!meta_field_valid(&field)) {
+                fprintf(stderr, "Invalid metadata key: %s\n", value);
+                exit(1);
+            }
+            meta_query.sum = value;
+            do_dump = 1;
+            break;
         }
-        if (ARG("-s") || ARG("--dump-style")) {
-            if (!ARG_NEXT_EXISTS) {
-                fprintf(stderr, "--dump-style (-s) requires a style argument (i.e. short, long, csv, dict)\n");
+        case OPT_STATS:
+            if (value && strcmp(value, "json") != 0) {
+                option_error(opt);
+            }
+            stats_begin(value != NULL);
+            break;
+        case OPT_STATS_REPORT:
+            if (value && strcmp(value, "index") != 0) {
+                option_error(opt);
+            }
+            do_report = value ? 2 : 1;
+            do_dump = 1;
+            break;
+        case OPT_REINDEX:
+            do_reindex = 1;
+            break;
+        case OPT_SERVE:
+            do_serve = 1;
+            break;
+        case OPT_NO_SERVE:
+            serve_client = 0;
+            break;
+        case OPT_FOLLOW:
+            do_follow = 1;
+            break;
+        case OPT_CHECKPOINT:
+            checkpoint = value;
+            break;
+        case OPT_COMPACT:
+            do_compact = 1;
+            break;
+        case OPT_FSCK:
+            do_fsck = 1;
+            break;
+        case OPT_MIGRATE:
+            do_migrate = 1;
+            break;
+        case OPT_EXPORT:
+            export_file = value;
+            break;
+        case OPT_FROM:
+            from_file = value;
+            break;
+        case OPT_RECORD_FORMAT:
+            if (option_integer(value, &record_format) < 0) {
+                fprintf(stderr, "Invalid record format: %s (expected 1 or 2)\n", value);
                 exit(1);
             }
-            if (!strcmp(ARG_NEXT, "short")) {
+            break;
+        case OPT_BATCH:
+            do_batch = 1;
+            batch_format = INGEST_FORMAT_TEXT;
+            break;
+        case OPT_BATCH_JSONL:
+            do_batch = 1;
+            batch_format = INGEST_FORMAT_JSONL;
+            break;
+        case OPT_DUMP_RELATIVE:
+            // Weeks before the current one (or the one given with -D)
+            if (value) {
+                if (option_integer(value, &user_week) < 0) {
+                    option_error(opt);
+                }
+                week_relative += user_week;
+            }
+            do_dump = 1;
+            break;
+        case OPT_DUMP_ABSOLUTE:
+            if (value) {
+                if (option_integer(value, &user_week) < 0) {
+                    option_error(opt);
+                }
+                week_absolute = user_week;
+                week_relative = 0;
+            }
+            do_dump = 1;
+            break;
+        case OPT_DUMP_YEAR:
+            if (option_integer(value, &user_year) < 0) {
+                fprintf(stderr, "Invalid integer\n");
+                exit(1);
+            }
+            do_year = 1;
+            break;
+        case OPT_DUMP_STYLE:
+            if (!strcmp(value, "short")) {
                 style = RECORD_STYLE_SHORT;
-            } else if (!strcmp(ARG_NEXT, "long")) {
+            } else if (!strcmp(value, "long")) {
                 style = RECORD_STYLE_LONG;
-            } else if (!strcmp(ARG_NEXT, "csv")) {
+            } else if (!strcmp(value, "csv")) {
                 style = RECORD_STYLE_CSV;
-            } else if (!strcmp(ARG_NEXT, "dict")) {
+            } else if (!strcmp(value, "dict")) {
                 style = RECORD_STYLE_DICT;
+            } else if (!strcmp(value, "jsonl")) {
+                style = RECORD_STYLE_JSONL;
+            } else if (!strcmp(value, "json")) {
+                style = RECORD_STYLE_JSON;
+            } else {
+                fprintf(stderr, "Unknown output style: %s\n", value);
+                exit(1);
             }
             do_style = 1;
+            break;
         }
     }
 
-    if (do_year && !do_dump) {
-        fprintf(stderr, "Option --dump-year (-y) requires options -d or -D\n");
+    // Get current time. The author, host and header of a new record are
+    // looked up on the write path alone.
+    t = time(NULL);
+    now = *localtime(&t);
+    calendar_scheme = calendar_detect(journalroot);
+    calendar_locate_tm(&now, &year, &week, &day_of_week);
+    if (do_year) {
+        year = user_year;
+    }
+    if (week_absolute >= 0) {
+        week = week_absolute;
+    }
+    // -d counts back across New Year
+    if (week_relative && calendar_week_add(&year, &week, -week_relative) < 0) {
+        fprintf(stderr, "No entries found for week %d of %d\n", week, year);
         exit(1);
     }
 
-    if (do_style && !do_dump) {
-        fprintf(stderr, "Option --dump-style (-s) requires options -d or -D\n");
+    if (record_format != RECORD_FORMAT_V1 && record_format != RECORD_FORMAT_V2) {
+        fprintf(stderr, "Unknown record format: %d (expected 1 or 2)\n", record_format);
         exit(1);
     }
 
-    if (do_dump) {
-        if (week < 1) {
-            week = 1;
+    if (do_serve) {
+        if (access(journalroot, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", journalroot, strerror(errno));
+            exit(1);
         }
+        exit(serve_run(journalroot) < 0);
+    }
+
+    if (do_reindex) {
         if (access(journalroot, F_OK) < 0) {
             fprintf(stderr, "Unable to access %s: %s\n", journalroot, strerror(errno));
             exit(1);
         }
-        if (do_all) {
-            for (int w = week; w < WEEK_MAX; w++) {
-                dump_week(journalroot, year, w, style);
-            }
-        } else {
-            if (dump_week(journalroot, year, week, style) < 0) {
-                fprintf(stderr, "No entries found for week %d of %d\n", week, year);
+        if (do_year) {
+            if (index_rebuild(journalroot, year) < 0) {
+                fprintf(stderr, "Unable to rebuild index for %d: %s\n", year, strerror(errno));
                 exit(1);
             }
+        } else if (index_rebuild_all(journalroot) < 0) {
+            exit(1);
         }
         exit(0);
     }
 
-    // Create weekly root directory
-    make_path(journalroot);
+    if (do_compact) {
+        int compacted;
+        int this_year, this_week, this_day;
+
+        if (access(journalroot, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", journalroot, strerror(errno));
+            exit(1);
+        }
+        // Only weeks before the current one are finished
+        calendar_locate(t, &this_year, &this_week, &this_day);
+        compacted = segment_compact(journalroot, do_year ? year : -1, this_year, this_week, HAVE_ZLIB);
+        if (compacted < 0) {
+            exit(1);
+        }
+        printf("Compacted %d week%s\n", compacted, compacted == 1 ? "" : "s");
+        exit(0);
+    }
 
-    // Write header string to temporary file
-    make_path(intermediates);
+    if (do_fsck) {
+        int repaired;
 
-    if ((headerfile = init_tempfile(intermediates, "header", header)) == NULL) {
-        perror("Unable to create temporary header file");
+        if (access(journalroot, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", journalroot, strerror(errno));
+            exit(1);
+        }
+        repaired = fsck_run(journalroot, do_year ? year : -1);
+        if (repaired < 0) {
+            exit(1);
+        }
+        printf("Repaired %d file%s\n", repaired, repaired == 1 ? "" : "s");
+        exit(0);
+    }
+
+    if (do_migrate) {
+        int moved;
+
+        if (access(journalroot, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", journalroot, strerror(errno));
+            exit(1);
+        }
+        moved = migrate_run(journalroot);
+        if (moved < 0) {
+            exit(1);
+        }
+        printf("Moved %d day file%s to ISO 8601 weeks\n", moved, moved == 1 ? "" : "s");
+        exit(0);
+    }
+
+    if (export_file) {
+        long exported;
+
+        if (access(journalroot, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", journalroot, strerror(errno));
+            exit(1);
+        }
+        exported = export_write(journalroot, export_file);
+        if (exported < 0) {
+            exit(1);
+        }
+        printf("%ld record%s exported to: %s\n", exported, exported == 1 ? "" : "s", export_file);
+        exit(0);
+    }
+
+    if (from_file) {
+        long count;
+
+        if (meta_query.nwhere || meta_query.sum || aggregate_root || do_year) {
+            fprintf(stderr, "Option --from can only be combined with --since, --until, --grep and --dump-style\n");
+            exit(1);
+        }
+        if (do_since || do_until) {
+            if (!do_since) {
+                filter.since = 0;
+            }
+            if (!do_until) {
+                filter.until = t;
+            }
+            if (filter.since > filter.until) {
+                fprintf(stderr, "Option --since must not be later than --until\n");
+                exit(1);
+            }
+        }
+        writer_init(&out, stdout, style);
+        count = export_dump(from_file, do_since || do_until ? &filter : NULL, grep_pattern, &out);
+        status = count <= 0;
+        if (count == 0) {
+            fprintf(stderr, "No entries found in %s\n", from_file);
+        }
+        if (writer_close(&out) < 0) {
+            perror("Unable to write output");
+            status = 1;
+        }
+        exit(status);
+    }
+
+    if (do_year && !do_dump) {
+        fprintf(stderr, "Option --dump-year (-y) requires options -d or -D\n");
+        exit(1);
+    }
+
+    if (do_style && !do_dump && !do_follow) {
+        fprintf(stderr, "Option --dump-style (-s) requires options -d or -D\n");
+        exit(1);
+    }
+
+    if (checkpoint && !do_follow) {
+        fprintf(stderr, "Option --checkpoint requires option --follow\n");
+        exit(1);
+    }
+
+    if (do_follow) {
+        const char *root = aggregate_root ? aggregate_root : journalroot;
+        if (style == RECORD_STYLE_JSON) {
+            fprintf(stderr, "Option --follow streams records: use --dump-style jsonl\n");
+            exit(1);
+        }
+        if (access(root, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", root, strerror(errno));
+            exit(1);
+        }
+        exit(follow_run(root, aggregate_root != NULL, checkpoint, style) < 0);
+    }
+
+    if (group_by && aggregate_root) {
+        if (!strcmp(group_by, "author")) {
+            group = DUMP_GROUP_AUTHOR;
+        } else if (!strcmp(group_by, "host")) {
+            group = DUMP_GROUP_HOST;
+        } else {
+            fprintf(stderr, "Unknown group: %s\n", group_by);
+            exit(1);
+        }
+    } else if (group_by && meta_query.sum) {
+        struct RecordField field;
+        field.key.ptr = group_by;
+        field.key.len = strlen(group_by);
+        field.value.ptr = "";
+        field.value.len = 0;
+        if (!meta_field_valid(&field)) {
+            fprintf(stderr, "Option --sum groups by a metadata key: %s\n", group_by);
+            exit(1);
+        }
+        meta_query.group = group_by;
+    } else if (group_by) {
+        fprintf(stderr, "Option --group-by requires option --aggregate or --sum\n");
         exit(1);
     }
 
-    char nothing[1] = {0};
-    if ((tempfile = init_tempfile(intermediates, "tempfile", nothing)) == NULL) {
-        perror("Unable to create temporary file");
+    if ((meta_query.nwhere || meta_query.sum) && (aggregate_root || grep_pattern)) {
+        fprintf(stderr, "Options --where and --sum cannot be combined with --aggregate or --grep\n");
         exit(1);
     }
 
-    if ((footerfile = init_tempfile(intermediates, "footer", footer)) == NULL) {
-        perror("Unable to create footer file");
+    if (do_report && (meta_query.nwhere || meta_query.sum || aggregate_root || grep_pattern)) {
+        fprintf(stderr, "Option --stats-report cannot be combined with --where, --sum, --aggregate or --grep\n");
         exit(1);
     }
 
+    if (do_dump) {
+        const char *root;
+        int served;
+
+        root = aggregate_root ? aggregate_root : journalroot;
+        if (access(root, F_OK) < 0) {
+            fprintf(stderr, "Unable to access %s: %s\n", root, strerror(errno));
+            exit(1);
+        }
+        if (do_since || do_until || grep_pattern) {
+            if (!do_until) {
+                filter.until = t;
+            }
+            if (!do_since && aggregate_root) {
+                // Each journal starts from its own first year
+                filter.since = 0;
+            } else if (!do_since) {
+                // Start from the first year in the journal
+                int years[DIR_LIST_MAX];
+                time_t last;
+                if (dir_list_numeric(journalroot, years, DIR_LIST_MAX) <= 0) {
+                    fprintf(stderr, "No entries found in %s\n", journalroot);
+                    exit(1);
+                }
+                calendar_year_range(years[0], &filter.since, &last);
+            }
+            if (filter.since > filter.until) {
+                fprintf(stderr, "Option --since must not be later than --until\n");
+                exit(1);
+            }
+        }
+
+        query.year = year;
+        query.week = week;
+        query.all = do_all;
+        query.pattern = grep_pattern;
+        query.filter = do_since || do_until ? &filter : NULL;
+
+        // Metadata queries and reports select a time range: the dumped
+        // week(s) unless --since or --until is given
+        if ((meta_query.nwhere || meta_query.sum || do_report) && !do_since && !do_until) {
+            time_t first;
+            if (calendar_week_range(year, week, &filter.since, &filter.until) < 0) {
+                fprintf(stderr, "No entries found for week %d of %d\n", week, year);
+                exit(1);
+            }
+            if (do_all) {
+                calendar_year_range(year, &first, &filter.until);
+            }
+        }
+
+        status = 0;
+        writer_init(&out, stdout, style);
+        if (do_report) {
+            long count = report_run(journalroot, &filter, do_report == 2, &out);
+            if (count < 0) {
+                status = 1;
+            } else if (count == 0) {
+                fprintf(stderr, "No entries found\n");
+                status = 1;
+            }
+        } else if (meta_query.nwhere || meta_query.sum) {
+            long count;
+            if (meta_query.sum) {
+                count = meta_sum(journalroot, &meta_query, &filter, &out);
+            } else {
+                count = meta_where(journalroot, &meta_query, &filter, &out);
+            }
+            if (count < 0) {
+                status = 1;
+            } else if (count == 0) {
+                fprintf(stderr, "No entries found\n");
+                status = 1;
+            }
+        } else if (aggregate_root) {
+            long count = dump_aggregate(aggregate_root, &query, group, &out);
+            if (count < 0) {
+                status = 1;
+            } else if (count == 0) {
+                fprintf(stderr, "No entries found in %s\n", aggregate_root);
+                status = 1;
+            }
+        } else if (grep_pattern) {
+            status = search_grep(journalroot, grep_pattern, do_since || do_until ? &filter : NULL, 1, &out);
+            status = status < 0 ? 1 : status;
+        } else if ((served = serve_dump(journalroot, &query, &out)) != SERVE_UNAVAILABLE) {
+            if (served == SERVE_FAILED) {
+                status = 1;
+            } else if (served < 0 && !do_all && !do_since && !do_until) {
+                fprintf(stderr, "No entries found for week %d of %d\n", week, year);
+                status = 1;
+            }
+        } else if (do_since || do_until) {
+            dump_range(journalroot, &filter, &out);
+        } else if (do_all) {
+            dump_year(journalroot, year, week, &out);
+        } else if (dump_week(journalroot, year, week, &out) < 0) {
+            fprintf(stderr, "No entries found for week %d of %d\n", week, year);
+            status = 1;
+        }
+        if (writer_close(&out) < 0) {
+            perror("Unable to write output");
+            status = 1;
+        }
+        exit(status);
+    }
+
+    // A new journal remembers that its weeks are ISO 8601 weeks. The marker
+    // goes in before the first year directory, or the journal would be
+    // read with legacy weeks from then on.
+    if (calendar_scheme == CALENDAR_ISO
+        && (make_path(journalroot) < 0 || calendar_mark(journalroot) < 0)) {
+        fprintf(stderr, "Unable to write %s%c%s (%s)\n", journalroot, DIRSEP_C, CALENDAR_FILENAME, strerror(errno));
+        exit(1);
+    }
+
+    if (do_batch) {
+        size_t written;
+
+        get_username(username, sizeof(username));
+        get_hostname(sysname, sizeof(sysname));
+        status = ingest_stream(journalroot, stdin, batch_format, username, sysname, metadata, nmetadata, &written) < 0;
+        printf("%lu record%s written to: %s\n", (unsigned long) written, written == 1 ? "" : "s", journalroot);
+        exit(status);
+    }
+
     // Create new weekly journalfile path
     if (!make_output_path(journalroot, journalfile, year, week, day_of_week)) {
         fprintf(stderr, "Unable to create output path: %s (%s)\n", journalfile, strerror(errno));
-        perror(journalfile);
-        unlink(headerfile);
-        unlink(tempfile);
-        unlink(footerfile);
         exit(1);
     }
 
-    // Get original size of the temporary file
-    ssize_t tempfile_size;
-    tempfile_size = get_file_size(tempfile);
-
+    // Read the message into memory
+    buffer_init(&message);
+    tempfile = NULL;
     if (do_stdin) {
-        if (append_stdin(tempfile) < 0) {
+        if (buffer_read(&message, stdin) < 0) {
             fprintf(stderr, "Failed to read from stdin\n");
             exit(1);
         }
     } else {
+        FILE *fp;
+
+        if (make_path(intermediates) < 0) {
+            fprintf(stderr, "Unable to create %s (%s)\n", intermediates, strerror(errno));
+            exit(1);
+        }
+        char nothing[1] = {0};
+        if ((tempfile = init_tempfile(intermediates, "tempfile", nothing)) == NULL) {
+            perror("Unable to create temporary file");
+            exit(1);
+        }
+
         // Open the temporary file with an editor so the user can write their notes
         if (edit_file(tempfile) != 0) {
             fprintf(stderr, "Non-zero exit status from editor. Aborting.\n");
             fprintf(stderr, "Dead entry file: %s\n", tempfile);
             exit(1);
         }
+
+        fp = fopen(tempfile, "rb");
+        if (!fp || buffer_read(&message, fp) < 0) {
+            fprintf(stderr, "Unable to read temporary file: %s (%s)\n", tempfile, strerror(errno));
+            exit(1);
+        }
+        fclose(fp);
     }
 
-    // Test whether temporary file size increased. If not, die.
-    ssize_t tempfile_newsize;
-    tempfile_newsize = get_file_size(tempfile);
-    if (tempfile_newsize <= tempfile_size) {
+    // The line feed ending the last line belongs to the record format, not
+    // the message (length prefixed records store the message verbatim)
+    if (message.len && message.data[message.len - 1] == '\n') {
+        message.len--;
+    }
+
+    // Test whether a message was written. If not, die.
+    if (!message.len) {
         fprintf(stderr, "Empty message, aborting.\n");
-        unlink(headerfile);
-        unlink(tempfile);
-        unlink(footerfile);
+        if (tempfile) {
+            unlink(tempfile);
+        }
         exit(1);
     }
 
-    // Copy data from the header file to the weekly journal path
-    if (append_contents(journalfile, headerfile) < 0) {
-        fprintf(stderr, "Unable to append contents of '%s' to '%s' (%s)\n", headerfile, journalfile, strerror(errno));
-        exit(1);
+    // Populate header string
+    get_username(username, sizeof(username));
+    get_hostname(sysname, sizeof(sysname));
+    strftime(datestamp, sizeof(datestamp) - 1, "%m/%d/%Y", &now);
+    strftime(timestamp, sizeof(timestamp) - 1, "%H:%M:%S", &now);
+    buffer_init(&header);
+    buffer_printf(&header, FMT_HEADER, datestamp, timestamp, username, sysname);
+    for (size_t i = 0; i < nmetadata; i++) {
+        meta_header_add(&header, &metadata[i]);
     }
 
-    // Copy data from the temporary file to the weekly journal path
-    if (append_contents(journalfile, tempfile) < 0) {
-        fprintf(stderr, "Unable to append contents of '%s' to '%s' (%s)\n", tempfile, journalfile, strerror(errno));
+    // Keep the week from being compacted while the record is written. Writing
+    // to a compacted week restores its day files first.
+    int lock;
+    if ((lock = segment_lock_week(journalroot, year, week)) < 0) {
+        fprintf(stderr, "Unable to lock week %d of %d (%s)\n", week, year, strerror(errno));
+        if (tempfile) {
+            fprintf(stderr, "Dead entry file: %s\n", tempfile);
+        }
         exit(1);
     }
 
-    // Copy data from the footer file to the weekly journal path
-    if (append_contents(journalfile, footerfile) < 0) {
-        fprintf(stderr, "Unable to append contents of '%s' to '%s' (%s)\n", footerfile, journalfile, strerror(errno));
+    // Commit the header and message to the weekly journal path with a single append
+    uint64_t offset;
+    if (append_record(journalfile, header.data, message.data, message.len, &offset) < 0) {
+        fprintf(stderr, "Unable to append record to '%s' (%s)\n", journalfile, strerror(errno));
+        if (tempfile) {
+            fprintf(stderr, "Dead entry file: %s\n", tempfile);
+        }
         exit(1);
     }
+    file_unlock(lock);
+    buffer_free(&message);
+    buffer_free(&header);
 
-    // Nuke the temporary files (report on error, but keep going)
-    if (access(headerfile, F_OK) == 0 && unlink(headerfile) < 0) {
-        fprintf(stderr, "Unable to remove header file: %s (%s)\n", headerfile, strerror(errno));
+    // Record the new entry in the year's indexes (report on error, but keep going)
+    if (index_add_record(journalroot, year, week, day_of_week, journalfile, offset) < 0) {
+        fprintf(stderr, "Unable to update index for %d (%s)\n", year, strerror(errno));
     }
-    if (access(tempfile, F_OK) == 0 && unlink(tempfile) < 0) {
+
+    // Nuke the temporary file (report on error, but keep going)
+    if (tempfile && access(tempfile, F_OK) == 0 && unlink(tempfile) < 0) {
         fprintf(stderr, "Unable to remove temporary file: %s (%s)\n", tempfile, strerror(errno));
     }
-    if (access(footerfile, F_OK) == 0 && unlink(footerfile) < 0) {
-        fprintf(stderr, "Unable to remove footer file: %s (%s)\n", footerfile, strerror(errno));
-    }
 
     // Inform the user
     printf("Message written to: %s\n", journalfile);
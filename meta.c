@@ -0,0 +1,638 @@
+#include "weekly.h"
+
+#define META_HEADER_SIZE 8
+#define META_ENTRY_SIZE 28
+
+// The location of a record carrying metadata fields
+struct MetaRecord {
+    int week;
+    int day;
+    uint32_t length;
+    uint64_t offset;
+    int64_t timestamp;
+};
+
+// Running total of one --group-by value
+struct MetaGroup {
+    char *name;
+    double total;
+    size_t records;
+};
+
+static void put_uint(unsigned char *p, uint64_t value, int width) {
+    for (int i = 0; i < width; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static uint64_t get_uint(const unsigned char *p, int width) {
+    uint64_t value = 0;
+    for (int i = width - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void meta_header(unsigned char *p) {
+    memcpy(p, META_MAGIC, 6);
+    put_uint(p + 6, META_VERSION, 2);
+}
+
+static void meta_path(char *path, const char *root, int year) {
+    sprintf(path, "%s%c%d%c%s", root, DIRSEP_C, year, DIRSEP_C, META_FILENAME);
+}
+
+static int slice_equal(const struct Slice *a, const char *b, size_t len) {
+    return a->len == len && !memcmp(a->ptr, b, len);
+}
+
+// Keys are made of letters, digits, '_', '-' and '.'. The keys of the
+// standard header lines are reserved. Values occupy a single line.
+int meta_field_valid(const struct RecordField *field) {
+    static const char *reserved[] = {"date", "time", "author", "host"};
+
+    if (!field->key.len || field->key.len > 0xffff || field->value.len > 0xffff) {
+        return 0;
+    }
+    for (size_t i = 0; i < field->key.len; i++) {
+        unsigned char c = (unsigned char) field->key.ptr[i];
+        if (!isalnum(c) && c != '_' && c != '-' && c != '.') {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(*reserved); i++) {
+        if (slice_equal(&field->key, reserved[i], strlen(reserved[i]))) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < field->value.len; i++) {
+        if ((unsigned char) field->value.ptr[i] < 0x20) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Split "KEY=VALUE". The field refers to the argument.
+int meta_field_parse(struct RecordField *field, const char *assignment) {
+    const char *eq;
+    const char *end;
+
+    eq = strchr(assignment, '=');
+    if (!eq) {
+        fprintf(stderr, "Invalid metadata (expected KEY=VALUE): %s\n", assignment);
+        return -1;
+    }
+    field->key.ptr = assignment;
+    field->key.len = (size_t) (eq - assignment);
+
+    // Surrounding white space is not kept by the header lexer either
+    field->value.ptr = eq + 1;
+    while (*field->value.ptr == ' ' || *field->value.ptr == '\t') {
+        field->value.ptr++;
+    }
+    end = field->value.ptr + strlen(field->value.ptr);
+    while (end > field->value.ptr && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    field->value.len = (size_t) (end - field->value.ptr);
+
+    if (!meta_field_valid(field)) {
+        fprintf(stderr, "Invalid metadata: %s\n", assignment);
+        return -1;
+    }
+    return 0;
+}
+
+int meta_header_add(struct Buffer *header, const struct RecordField *field) {
+    return buffer_printf(header, "## %.*s: %.*s\n", (int) field->key.len, field->key.ptr,
+                         (int) field->value.len, field->value.ptr) < 0 ? -1 : 0;
+}
+
+// On-disk layout (little endian), one entry per field of a record:
+//   u16 week, u8 day, u8 reserved, u32 length, u64 offset, i64 timestamp,
+//   u16 key_len, u16 value_len, key, value
+// The entries of one record are stored together.
+int meta_encode(struct Buffer *out, int week, int day, const struct RecordSpan *span, const struct RecordView *view) {
+    int64_t timestamp;
+
+    if (!view->nfields) {
+        return 0;
+    }
+    timestamp = (int64_t) record_view_timestamp(view);
+    for (size_t i = 0; i < view->nfields; i++) {
+        const struct RecordField *field = &view->fields[i];
+        unsigned char *p;
+        size_t len;
+
+        if (field->key.len > 0xffff || field->value.len > 0xffff) {
+            continue;
+        }
+        len = META_ENTRY_SIZE + field->key.len + field->value.len;
+        if (buffer_reserve(out, len) < 0) {
+            return -1;
+        }
+        p = (unsigned char *) out->data + out->len;
+        memset(p, 0, META_ENTRY_SIZE);
+        put_uint(p, (uint64_t) week, 2);
+        p[2] = (unsigned char) day;
+        put_uint(p + 4, span->length, 4);
+        put_uint(p + 8, (uint64_t) span->offset, 8);
+        put_uint(p + 16, (uint64_t) timestamp, 8);
+        put_uint(p + 24, field->key.len, 2);
+        put_uint(p + 26, field->value.len, 2);
+        memcpy(p + META_ENTRY_SIZE, field->key.ptr, field->key.len);
+        memcpy(p + META_ENTRY_SIZE + field->key.len, field->value.ptr, field->value.len);
+        out->len += len;
+    }
+    return 0;
+}
+
+// Append encoded entries to the year's metadata index, creating it when
+// needed (even without entries, so the year counts as indexed)
+int meta_append(const char *root, int year, const char *data, size_t len) {
+    char path[PATH_MAX] = {0};
+    unsigned char header[META_HEADER_SIZE];
+    FILE *fp;
+    int status;
+
+    meta_path(path, root, year);
+    meta_header(header);
+    if (file_create(path, (const char *) header, sizeof(header)) < 0) {
+        return -1;
+    }
+    if (!len) {
+        return 0;
+    }
+    fp = fopen(path, "ab");
+    if (!fp) {
+        return -1;
+    }
+
+    // Emit the entries with a single write so concurrent appends don't interleave
+    setvbuf(fp, NULL, _IONBF, 0);
+    status = fwrite(data, sizeof(char), len, fp) == len ? 0 : -1;
+    if (fclose(fp) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+// Replace the year's metadata index
+int meta_write(const char *root, int year, const char *data, size_t len) {
+    char path[PATH_MAX] = {0};
+    char path_tmp[PATH_MAX] = {0};
+    unsigned char header[META_HEADER_SIZE];
+    FILE *fp;
+
+    meta_path(path, root, year);
+    sprintf(path_tmp, "%s.tmp", path);
+    fp = fopen(path_tmp, "wb");
+    if (!fp) {
+        return -1;
+    }
+    meta_header(header);
+    fwrite(header, sizeof(char), sizeof(header), fp);
+    if (len) {
+        fwrite(data, sizeof(char), len, fp);
+    }
+    if (fclose(fp) != 0) {
+        unlink(path_tmp);
+        return -1;
+    }
+#if HAVE_WINDOWS
+    unlink(path);
+#endif
+    if (rename(path_tmp, path) < 0) {
+        unlink(path_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the year's metadata index. Returns -1 when there is none.
+static int meta_load(const char *root, int year, struct Buffer *out) {
+    char path[PATH_MAX] = {0};
+    unsigned char expect[META_HEADER_SIZE];
+    FILE *fp;
+    int status;
+
+    meta_path(path, root, year);
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    status = buffer_read(out, fp);
+    fclose(fp);
+
+    meta_header(expect);
+    if (status < 0 || out->len < META_HEADER_SIZE || memcmp(out->data, expect, META_HEADER_SIZE) != 0) {
+        out->len = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Without an index the entries are produced by reading every record
+static void meta_scan_year(const char *root, int year, struct Buffer *out) {
+    unsigned char header[META_HEADER_SIZE];
+
+    meta_header(header);
+    buffer_append(out, (const char *) header, sizeof(header));
+    for (int week = 0; week <= WEEK_MAX; week++) {
+        int compacted = segment_exists(root, year, week);
+        for (int day = 0; day < 7; day++) {
+            struct RecordScanner scanner;
+            struct RecordSpan span;
+            struct RecordView view;
+            char filename[PATH_MAX];
+
+            sprintf(filename, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+            if (scanner_open_day(&scanner, filename, compacted) < 0) {
+                continue;
+            }
+            while (scanner_next(&scanner, &span) > 0) {
+                if (record_view_from_span(&view, &span) == 0) {
+                    meta_encode(out, week, day, &span, &view);
+                }
+            }
+            scanner_close(&scanner);
+        }
+    }
+}
+
+// Decode the entries of the next record. Returns NULL at the end.
+static const unsigned char *meta_next(const unsigned char *p, const unsigned char *end,
+                                      struct MetaRecord *record, struct RecordField *fields, size_t *nfields) {
+    *nfields = 0;
+    while (end - p >= META_ENTRY_SIZE) {
+        int week = (int) get_uint(p, 2);
+        int day = p[2];
+        uint64_t offset = get_uint(p + 8, 8);
+        size_t key_len = (size_t) get_uint(p + 24, 2);
+        size_t value_len = (size_t) get_uint(p + 26, 2);
+
+        if ((size_t) (end - p) < META_ENTRY_SIZE + key_len + value_len) {
+            break;
+        }
+        if (*nfields && (week != record->week || day != record->day || offset != record->offset)) {
+            return p;
+        }
+        if (!*nfields) {
+            record->week = week;
+            record->day = day;
+            record->length = (uint32_t) get_uint(p + 4, 4);
+            record->offset = offset;
+            record->timestamp = (int64_t) get_uint(p + 16, 8);
+        }
+        if (*nfields < RECORD_FIELDS_MAX) {
+            fields[*nfields].key.ptr = (const char *) p + META_ENTRY_SIZE;
+            fields[*nfields].key.len = key_len;
+            fields[*nfields].value.ptr = (const char *) p + META_ENTRY_SIZE + key_len;
+            fields[*nfields].value.len = value_len;
+            (*nfields)++;
+        }
+        p += META_ENTRY_SIZE + key_len + value_len;
+    }
+    return *nfields ? end : NULL;
+}
+
+static const struct Slice *meta_find(const struct RecordField *fields, size_t nfields, const char *key, size_t len) {
+    for (size_t i = 0; i < nfields; i++) {
+        if (slice_equal(&fields[i].key, key, len)) {
+            return &fields[i].value;
+        }
+    }
+    return NULL;
+}
+
+static int meta_match(const struct MetaQuery *query, const struct DumpFilter *filter, const struct MetaRecord *record,
+                      const struct RecordField *fields, size_t nfields) {
+    if (record->timestamp < (int64_t) filter->since || record->timestamp > (int64_t) filter->until) {
+        return 0;
+    }
+    for (size_t i = 0; i < query->nwhere; i++) {
+        const struct Slice *value;
+        value = meta_find(fields, nfields, query->where[i].key.ptr, query->where[i].key.len);
+        if (!value || !slice_equal(value, query->where[i].value.ptr, query->where[i].value.len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int compare_location(const void *a, const void *b) {
+    const struct MetaRecord *x = a;
+    const struct MetaRecord *y = b;
+
+    if (x->week != y->week)
+        return x->week - y->week;
+    if (x->day != y->day)
+        return x->day - y->day;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// The years of the journal inside the filter's range
+static int meta_years(const char *root, const struct DumpFilter *filter, int *years) {
+    int first, last;
+    int week, day;
+    int count, n;
+
+    count = dir_list_numeric(root, years, DIR_LIST_MAX);
+    // The journal year of a day, which differs from its calendar year
+    // around New Year when weeks are ISO weeks
+    if (calendar_locate(filter->since, &first, &week, &day) < 0) {
+        first = 0;
+    }
+    if (calendar_locate(filter->until, &last, &week, &day) < 0) {
+        last = 0;
+    }
+    n = 0;
+    for (int i = 0; i < count; i++) {
+        if (years[i] >= first && years[i] <= last) {
+            years[n++] = years[i];
+        }
+    }
+    return n;
+}
+
+// Read the selected records of one year, in file order
+static void meta_show_year(const char *root, int year, struct MetaRecord *records, size_t count, struct Writer *out) {
+    char path[PATH_MAX];
+    struct Buffer block;
+    char *buf;
+    size_t bufsz;
+    FILE *fp;
+    int week, day;
+
+    qsort(records, count, sizeof(*records), compare_location);
+    fp = NULL;
+    week = day = -1;
+    buf = NULL;
+    bufsz = 0;
+    buffer_init(&block);
+    for (size_t i = 0; i < count; i++) {
+        const struct MetaRecord *record = &records[i];
+        struct RecordScanner scanner;
+        struct RecordSpan span;
+        struct RecordView view;
+        char *data;
+
+        if (record->week != week || record->day != day) {
+            if (fp) {
+                fclose(fp);
+            }
+            week = record->week;
+            day = record->day;
+            block.len = 0;
+            sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+            // A compacted day is read from its week's segment
+            if (!(fp = fopen(path, "rb")) && segment_load(path, &block) <= 0) {
+                continue;
+            }
+        }
+
+        if (!fp) {
+            if (record->offset + record->length > block.len) {
+                continue;
+            }
+            data = block.data + record->offset;
+        } else {
+            if (record->length + 1 > bufsz) {
+                char *tmp;
+                bufsz = record->length + 1;
+                if (!(tmp = realloc(buf, bufsz))) {
+                    perror("Unable to allocate record");
+                    break;
+                }
+                buf = tmp;
+            }
+            if (fseek(fp, (long) record->offset, SEEK_SET) < 0
+                || fread(buf, sizeof(char), record->length, fp) != record->length) {
+                continue;
+            }
+            data = buf;
+        }
+
+        scanner_open_memory(&scanner, data, record->length);
+        if (scanner_next(&scanner, &span) > 0 && span.offset == 0 && record_view_from_span(&view, &span) == 0) {
+            writer_record(out, &view);
+        }
+        scanner_close(&scanner);
+    }
+
+    buffer_free(&block);
+    if (fp) {
+        fclose(fp);
+    }
+    free(buf);
+}
+
+// Dump the records whose metadata matches every --where field. Only the
+// metadata index is searched; the matching records are the only ones read.
+// Returns the number of records written.
+long meta_where(const char *root, const struct MetaQuery *query, const struct DumpFilter *filter, struct Writer *out) {
+    int years[DIR_LIST_MAX];
+    struct Buffer meta;
+    struct MetaRecord *records;
+    size_t size;
+    long total;
+    int nyears;
+
+    nyears = meta_years(root, filter, years);
+    buffer_init(&meta);
+    records = NULL;
+    size = 0;
+    total = 0;
+    for (int y = 0; y < nyears; y++) {
+        struct RecordField fields[RECORD_FIELDS_MAX];
+        struct MetaRecord record;
+        const unsigned char *p, *end;
+        size_t nfields;
+        size_t count;
+
+        meta.len = 0;
+        if (meta_load(root, years[y], &meta) < 0) {
+            meta_scan_year(root, years[y], &meta);
+        }
+        count = 0;
+        p = (const unsigned char *) meta.data + META_HEADER_SIZE;
+        end = (const unsigned char *) meta.data + meta.len;
+        while ((p = meta_next(p, end, &record, fields, &nfields)) != NULL) {
+            if (!meta_match(query, filter, &record, fields, nfields)) {
+                continue;
+            }
+            if (count == size) {
+                struct MetaRecord *tmp;
+                size = size ? size * 2 : 64;
+                if (!(tmp = realloc(records, size * sizeof(*records)))) {
+                    perror("Unable to allocate records");
+                    free(records);
+                    buffer_free(&meta);
+                    return -1;
+                }
+                records = tmp;
+            }
+            records[count++] = record;
+        }
+        meta_show_year(root, years[y], records, count, out);
+        total += (long) count;
+    }
+    free(records);
+    buffer_free(&meta);
+    return total;
+}
+
+static int compare_group(const void *a, const void *b) {
+    return strcmp(((const struct MetaGroup *) a)->name, ((const struct MetaGroup *) b)->name);
+}
+
+static struct MetaGroup *meta_group(struct MetaGroup **groups, size_t *count, const struct Slice *name) {
+    struct MetaGroup *tmp;
+    struct MetaGroup *group;
+
+    for (size_t i = 0; i < *count; i++) {
+        if (slice_equal(name, (*groups)[i].name, strlen((*groups)[i].name))) {
+            return &(*groups)[i];
+        }
+    }
+    if (!(tmp = realloc(*groups, (*count + 1) * sizeof(**groups)))) {
+        perror("Unable to allocate groups");
+        return NULL;
+    }
+    *groups = tmp;
+    group = &(*groups)[*count];
+    if (!(group->name = malloc(name->len + 1))) {
+        perror("Unable to allocate groups");
+        return NULL;
+    }
+    memcpy(group->name, name->ptr, name->len);
+    group->name[name->len] = '\0';
+    group->total = 0;
+    group->records = 0;
+    (*count)++;
+    return group;
+}
+
+static void meta_show_sums(const struct MetaQuery *query, const struct MetaGroup *groups, size_t count, struct Writer *out) {
+    struct Buffer line;
+    const char *group;
+
+    buffer_init(&line);
+    group = query->group ? query->group : "";
+    for (size_t i = 0; i < count; i++) {
+        char total[64];
+
+        snprintf(total, sizeof(total), "%.15g", groups[i].total);
+        line.len = 0;
+        switch (out->style) {
+            case RECORD_STYLE_CSV:
+                if (query->group) {
+                    buffer_append_csv(&line, groups[i].name, strlen(groups[i].name), 0);
+                    buffer_append(&line, ",", 1);
+                }
+                buffer_printf(&line, "%s,%lu\n", total, (unsigned long) groups[i].records);
+                break;
+            case RECORD_STYLE_DICT:
+            case RECORD_STYLE_JSONL:
+            case RECORD_STYLE_JSON:
+                buffer_append(&line, out->style == RECORD_STYLE_JSON ? ",\n{" : "{", out->style == RECORD_STYLE_JSON ? 3 : 1);
+                if (query->group) {
+                    buffer_append_json(&line, group, strlen(group));
+                    buffer_append(&line, ": ", 2);
+                    buffer_append_json(&line, groups[i].name, strlen(groups[i].name));
+                    buffer_append(&line, ", ", 2);
+                }
+                buffer_append_json(&line, query->sum, strlen(query->sum));
+                buffer_printf(&line, ": %s, \"records\": %lu}%s", total, (unsigned long) groups[i].records,
+                              out->style == RECORD_STYLE_JSON ? "" : "\n");
+                break;
+            default:
+                if (!i) {
+                    if (query->group) {
+                        buffer_printf(&line, "%-24s ", group);
+                    }
+                    buffer_printf(&line, "%14s %8s\n", query->sum, "records");
+                }
+                if (query->group) {
+                    buffer_printf(&line, "%-24s ", *groups[i].name ? groups[i].name : "-");
+                }
+                buffer_printf(&line, "%14s %8lu\n", total, (unsigned long) groups[i].records);
+                break;
+        }
+        writer_write(out, line.data, line.len);
+    }
+    buffer_free(&line);
+}
+
+// Total the numeric --sum field of the records selected by --where, per
+// value of the --group-by field. Answered from the metadata index alone.
+// Returns the number of records counted.
+long meta_sum(const char *root, const struct MetaQuery *query, const struct DumpFilter *filter, struct Writer *out) {
+    int years[DIR_LIST_MAX];
+    struct MetaGroup *groups;
+    struct Buffer meta;
+    size_t ngroups;
+    long total;
+    int nyears;
+
+    nyears = meta_years(root, filter, years);
+    buffer_init(&meta);
+    groups = NULL;
+    ngroups = 0;
+    total = 0;
+    for (int y = 0; y < nyears; y++) {
+        struct RecordField fields[RECORD_FIELDS_MAX];
+        struct MetaRecord record;
+        const unsigned char *p, *end;
+        size_t nfields;
+
+        meta.len = 0;
+        if (meta_load(root, years[y], &meta) < 0) {
+            meta_scan_year(root, years[y], &meta);
+        }
+        p = (const unsigned char *) meta.data + META_HEADER_SIZE;
+        end = (const unsigned char *) meta.data + meta.len;
+        while ((p = meta_next(p, end, &record, fields, &nfields)) != NULL) {
+            static const struct Slice none = {"", 0};
+            const struct Slice *value;
+            const struct Slice *name;
+            struct MetaGroup *group;
+            char number[64];
+            char *number_end;
+            double amount;
+
+            if (!meta_match(query, filter, &record, fields, nfields)
+                || !(value = meta_find(fields, nfields, query->sum, strlen(query->sum)))) {
+                continue;
+            }
+            // Values that are not numbers are skipped
+            if (!value->len || value->len >= sizeof(number)) {
+                continue;
+            }
+            memcpy(number, value->ptr, value->len);
+            number[value->len] = '\0';
+            amount = strtod(number, &number_end);
+            if (*number_end != '\0') {
+                continue;
+            }
+
+            name = query->group ? meta_find(fields, nfields, query->group, strlen(query->group)) : NULL;
+            if (!(group = meta_group(&groups, &ngroups, name ? name : &none))) {
+                break;
+            }
+            group->total += amount;
+            group->records++;
+            total++;
+        }
+    }
+
+    qsort(groups, ngroups, sizeof(*groups), compare_group);
+    meta_show_sums(query, groups, ngroups, out);
+    for (size_t i = 0; i < ngroups; i++) {
+        free(groups[i].name);
+    }
+    free(groups);
+    buffer_free(&meta);
+    return total;
+}
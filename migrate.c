@@ -0,0 +1,161 @@
+#include "weekly.h"
+
+// Journals written before ISO 8601 weeks were adopted number weeks from
+// Sunday to Saturday, cut at New Year. Every calendar day has exactly one
+// location under either numbering, so the day files are first moved into
+// a staging directory under their new location, then into place. A run
+// that was interrupted picks up where it stopped.
+#define MIGRATE_STAGED ".staged"        // every legacy day file has been staged
+
+static void migrate_path(char *path, const char *root, const char *name) {
+    sprintf(path, "%s%c%s", root, DIRSEP_C, name);
+}
+
+// Move the legacy day files of every year into the staging directory,
+// named YEAR.WEEK.DAY after their ISO location
+static int migrate_stage(const char *root, const char *staging, const int *years, int count) {
+    int moved;
+
+    moved = 0;
+    for (int i = 0; i < count; i++) {
+        for (int week = 0; week <= WEEK_MAX; week++) {
+            char path_week[PATH_MAX];
+
+            // Compacted weeks are moved as day files
+            if (segment_expand(root, years[i], week) < 0) {
+                return -1;
+            }
+            sprintf(path_week, "%s%c%d%c%d", root, DIRSEP_C, years[i], DIRSEP_C, week);
+            for (int day = 0; day < 7; day++) {
+                char path[PATH_MAX];
+                char path_staged[PATH_MAX];
+                long days;
+                int year_iso, week_iso, day_iso;
+
+                sprintf(path, "%s%c%d", path_week, DIRSEP_C, day);
+                if (access(path, F_OK) < 0) {
+                    continue;
+                }
+                calendar_scheme = CALENDAR_LEGACY;
+                if (calendar_find(years[i], week, day, &days) < 0) {
+                    fprintf(stderr, "%s: not a day of %d, left in place\n", path, years[i]);
+                    continue;
+                }
+                calendar_scheme = CALENDAR_ISO;
+                calendar_locate_days(days, &year_iso, &week_iso, &day_iso);
+                sprintf(path_staged, "%s%c%d.%d.%d", staging, DIRSEP_C, year_iso, week_iso, day_iso);
+                if (rename(path, path_staged) < 0) {
+                    fprintf(stderr, "Unable to move %s to %s (%s)\n", path, path_staged, strerror(errno));
+                    return -1;
+                }
+                moved++;
+            }
+            rmdir(path_week);
+        }
+    }
+    calendar_scheme = CALENDAR_ISO;
+    return moved;
+}
+
+// Move the staged day files to their ISO locations
+static int migrate_place(const char *root, const char *staging) {
+    char **names;
+    size_t count;
+    int status;
+
+    if (!(names = dir_list_names(staging, &count))) {
+        fprintf(stderr, "Unable to read %s (%s)\n", staging, strerror(errno));
+        return -1;
+    }
+    status = 0;
+    for (size_t i = 0; i < count && status == 0; i++) {
+        char path[PATH_MAX];
+        char path_staged[PATH_MAX];
+        int year, week, day;
+
+        if (sscanf(names[i], "%d.%d.%d", &year, &week, &day) != 3) {
+            continue;
+        }
+        migrate_path(path_staged, staging, names[i]);
+        if (!make_output_path((char *) root, path, year, week, day)) {
+            fprintf(stderr, "Unable to create output path: %s (%s)\n", path, strerror(errno));
+            status = -1;
+        } else if (access(path, F_OK) == 0) {
+            // Written with the new numbering while the journal was migrated
+            fprintf(stderr, "%s already exists, %s was kept\n", path, path_staged);
+            status = -1;
+        } else if (rename(path_staged, path) < 0) {
+            fprintf(stderr, "Unable to move %s to %s (%s)\n", path_staged, path, strerror(errno));
+            status = -1;
+        }
+    }
+    dir_list_names_free(names, count);
+    return status;
+}
+
+// Drop the sidecars of every year (their weeks and days are out of date)
+// and empty year directories
+static void migrate_clean(const char *root, const int *years, int count) {
+    const char *sidecars[] = {INDEX_FILENAME, META_FILENAME, TERMS_FILENAME, TERMS_LOG_FILENAME, TERMS_MERGE_FILENAME, TERMS_LOCK_FILENAME, SEGMENT_LOCK_FILENAME};
+
+    for (int i = 0; i < count; i++) {
+        char path_year[PATH_MAX];
+
+        sprintf(path_year, "%s%c%d", root, DIRSEP_C, years[i]);
+        for (size_t s = 0; s < sizeof(sidecars) / sizeof(*sidecars); s++) {
+            char path[PATH_MAX];
+            migrate_path(path, path_year, sidecars[s]);
+            remove(path);
+        }
+        rmdir(path_year);
+    }
+}
+
+// Move a journal written with legacy week numbers to ISO 8601 weeks and
+// rebuild its indexes. Returns the number of day files moved, or -1 on
+// error.
+int migrate_run(const char *root) {
+    char staging[PATH_MAX];
+    char marker[PATH_MAX];
+    int years[DIR_LIST_MAX];
+    int count;
+    int moved;
+
+    migrate_path(staging, root, MIGRATE_DIRNAME);
+    migrate_path(marker, staging, MIGRATE_STAGED);
+    if (calendar_detect(root) == CALENDAR_ISO && access(staging, F_OK) < 0) {
+        return calendar_mark(root) < 0 ? -1 : 0;
+    }
+    if ((count = dir_list_numeric(root, years, DIR_LIST_MAX)) < 0) {
+        fprintf(stderr, "Unable to read %s (%s)\n", root, strerror(errno));
+        return -1;
+    }
+    if (mkdir(staging, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create %s (%s)\n", staging, strerror(errno));
+        return -1;
+    }
+
+    moved = 0;
+    if (access(marker, F_OK) < 0) {
+        if ((moved = migrate_stage(root, staging, years, count)) < 0
+            || file_create(marker, "", 0) < 0) {
+            return -1;
+        }
+    }
+    migrate_clean(root, years, count);
+    if (migrate_place(root, staging) < 0) {
+        return -1;
+    }
+
+    calendar_scheme = CALENDAR_ISO;
+    if (calendar_mark(root) < 0) {
+        fprintf(stderr, "Unable to write %s%c%s (%s)\n", root, DIRSEP_C, CALENDAR_FILENAME, strerror(errno));
+        return -1;
+    }
+    remove(marker);
+    rmdir(staging);
+    if (index_rebuild_all(root) < 0) {
+        return -1;
+    }
+    return moved;
+}
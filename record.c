@@ -11,144 +11,397 @@ void record_free(struct Record *record) {
     }
 }
 
-struct Record *record_parse(const char *content) {
-    char *next;
-    struct Record *result;
+// Copy a slice into a NUL terminated string
+static char *slice_dup(const struct Slice *slice) {
+    char *result;
 
-    result = calloc(1, sizeof(*result));
+    result = malloc(slice->len + 1);
     if (!result) {
-        perror("Unable to allocate record");
         return NULL;
     }
+    STATS_ADD(STAT_ALLOCATIONS, 1);
+    if (slice->len) {
+        memcpy(result, slice->ptr, slice->len);
+    }
+    result[slice->len] = '\0';
+    return result;
+}
 
-    char *p = strdup(content);
-    next = strtok(p, "\n");
-    while (next != NULL) {
-        char key[10] = {0};
-        char value[255] = {0};
+// Read "## key: value" header lines in a single pass, stopping at the first
+// line that is not one. The four standard keys are told apart by length and
+// first byte; any other key is kept in view->fields (up to
+// RECORD_FIELDS_MAX). A value runs to the end of its line, less surrounding
+// white space. Returns where the header stops.
+static const char *record_view_lex(struct RecordView *view, const char *p, const char *end) {
+    STATS_START(started);
 
-        sscanf(next, "## %9[^: ]:%254s[^\n]", key, value);
-        if (strncmp(next, "## ", 3) != 0) {
-            break;
+    view->date.ptr = view->time.ptr = view->user.ptr = view->host.ptr = "";
+    view->date.len = view->time.len = view->user.len = view->host.len = 0;
+    view->nfields = 0;
+    while (end - p >= 3 && p[0] == '#' && p[1] == '#' && p[2] == ' ') {
+        const char *key, *key_end;
+        const char *value, *value_end;
+        const char *eol;
+        struct Slice *slot;
+
+        eol = memchr(p, '\n', (size_t) (end - p));
+        if (!eol) {
+            eol = end;
         }
-        if (!strcmp(key, "date"))
-            result->date = strdup(value);
-        else if (!strcmp(key, "time"))
-            result->time = strdup(value);
-        else if (!strcmp(key, "author"))
-            result->user = strdup(value);
-        else if (!strcmp(key, "host"))
-            result->host = strdup(value);
+        key = p + 3;
+        p = eol < end ? eol + 1 : end;
 
-        next = strtok(NULL, "\n");
-    }
+        for (key_end = key; key_end < eol && *key_end != ':' && *key_end != ' '; key_end++);
+        if (key_end == key || key_end == eol || *key_end != ':') {
+            continue;
+        }
+        value = key_end + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        value_end = eol;
+        while (value_end > value && isspace((unsigned char) value_end[-1])) {
+            value_end--;
+        }
 
-    if (next != NULL) {
-        if (memcmp(next, "\x02\x02\x02", 3) == 0) {
-            next += 4;
+        slot = NULL;
+        switch (key_end - key) {
+            case 4:
+                if (key[0] == 'd' && !memcmp(key + 1, "ate", 3))
+                    slot = &view->date;
+                else if (key[0] == 't' && !memcmp(key + 1, "ime", 3))
+                    slot = &view->time;
+                else if (key[0] == 'h' && !memcmp(key + 1, "ost", 3))
+                    slot = &view->host;
+                break;
+            case 6:
+                if (key[0] == 'a' && !memcmp(key + 1, "uthor", 5))
+                    slot = &view->user;
+                break;
+            default:
+                break;
         }
-        result->data = strdup(next);
-    } else {
-        // Empty data record, die
-        record_free(result);
-        result = NULL;
+        if (!slot) {
+            if (view->nfields == RECORD_FIELDS_MAX) {
+                continue;
+            }
+            view->fields[view->nfields].key.ptr = key;
+            view->fields[view->nfields].key.len = (size_t) (key_end - key);
+            slot = &view->fields[view->nfields++].value;
+        }
+        slot->ptr = value;
+        slot->len = (size_t) (value_end - value);
     }
+    STATS_STOP(STAT_TIME_PARSE, started);
+    STATS_ADD(STAT_RECORDS_PARSED, 1);
+    return p;
+}
 
-    free(p);
-    return result;
+int record_view_parse(struct RecordView *view, const char *header, size_t header_len, const char *text, size_t text_len) {
+    record_view_lex(view, header, header + header_len);
+    view->data.ptr = text;
+    view->data.len = text_len;
+    return 0;
 }
 
-struct Record *record_read(FILE **fp) {
-    ssize_t soh, sot, eot;
-    size_t record_size;
-    char task[2] = {0};
-    char *buf;
+int record_view_from_span(struct RecordView *view, const struct RecordSpan *span) {
+    // A record without a start of text marker has no data
+    if (!span->text) {
+        return -1;
+    }
+    return record_view_parse(view, span->header, span->header_len, span->text, span->text_len);
+}
 
-    if (!*fp) {
-        return NULL;
+// Convert the slice to an integer. Returns -1 when it is not a number.
+static int slice_int(const char *s, size_t len) {
+    int value = 0;
+    if (!len) {
+        return -1;
     }
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char) s[i])) {
+            return -1;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
 
-    // Start of header offset
-    soh = 0;
-    // Start of text offset
-    sot = 0;
-    // End of text offset
-    eot = 0;
+time_t record_view_timestamp(const struct RecordView *view) {
+    struct tm tm_;
+    const char *d, *t;
 
-    while (fread(task, sizeof(char), 1, *fp) > 0) {
-        if (task[0] == '\x01' && fread(task, sizeof(char), 2, *fp) > 0) {
-            // start header
-            if (memcmp(task, "\x01\x01", 2) == 0) {
-                soh = ftell(*fp);
-            }
-        } else if (task[0] == '\x02' && fread(task, sizeof(char), 2, *fp) > 0) {
-            if (memcmp(task, "\x02\x02", 2) == 0) {
-                sot = ftell(*fp);
-            }
-            // start of text
-        } else if (task[0] == '\x03' && fread(task, sizeof(char), 2, *fp) > 0) {
-            if (memcmp(task, "\x03\x03", 2) == 0) {
-                eot = ftell(*fp);
-                break;
-            }
-        } else {
-            continue;
-        }
-        memset(task, '\0', sizeof(task));
+    // date: MM/DD/YYYY, time: HH:MM:SS
+    if (view->date.len != 10 || view->time.len != 8) {
+        return (time_t) -1;
+    }
+    d = view->date.ptr;
+    t = view->time.ptr;
+    memset(&tm_, 0, sizeof(tm_));
+    tm_.tm_mon = slice_int(d, 2) - 1;
+    tm_.tm_mday = slice_int(d + 3, 2);
+    tm_.tm_year = slice_int(d + 6, 4) - 1900;
+    tm_.tm_hour = slice_int(t, 2);
+    tm_.tm_min = slice_int(t + 3, 2);
+    tm_.tm_sec = slice_int(t + 6, 2);
+    tm_.tm_isdst = -1;
+    if (tm_.tm_mon < 0 || tm_.tm_mday < 0 || tm_.tm_year < 0
+        || tm_.tm_hour < 0 || tm_.tm_min < 0 || tm_.tm_sec < 0) {
+        return (time_t) -1;
     }
+    return mktime(&tm_);
+}
 
-    // Verify the record is not too small, and contained a start of text marker
-    record_size = eot - soh;
-    if (record_size < 1 && !sot) {
+struct Record *record_from_view(const struct RecordView *view) {
+    struct Record *result;
+
+    result = calloc(1, sizeof(*result));
+    if (!result) {
+        perror("Unable to allocate record");
         return NULL;
     }
+    STATS_ADD(STAT_ALLOCATIONS, 1);
 
-    // Allocate enough space for the record
-    buf = calloc(record_size + 1, sizeof(char));
-    if (!buf) {
+    result->date = slice_dup(&view->date);
+    result->time = slice_dup(&view->time);
+    result->user = slice_dup(&view->user);
+    result->host = slice_dup(&view->host);
+    result->data = slice_dup(&view->data);
+    if (!result->date || !result->time || !result->user || !result->host || !result->data) {
         perror("Unable to allocate record");
-        exit(1);
+        record_free(result);
+        return NULL;
     }
+    return result;
+}
 
-    // Go back to start of header
-    fseek(*fp, soh, SEEK_SET);
-    // Read the entire record
-    fread(buf, sizeof(char), record_size, *fp);
-    // Remove end of text marker
-    memset(buf + (record_size - 4), '\0', 4);
-    // Truncate buffer at end of line
-    buf[strlen(buf) - 1] = '\0';
+struct Record *record_parse(const char *content) {
+    struct RecordView view;
+    const char *end;
+    const char *sot;
+    const char *text;
 
-    // Emit record
+    // The message starts where the header stops
+    end = content + strlen(content);
+    sot = record_view_lex(&view, content, end);
+    if ((size_t) (end - sot) < 3 || memcmp(sot, RECORD_SOT, 3) != 0) {
+        // Empty data record, die
+        if (!(sot = strstr(sot, RECORD_SOT))) {
+            return NULL;
+        }
+    }
+    text = sot + 3;
+    if (*text == '\n') {
+        text++;
+    }
+
+    view.data.ptr = text;
+    view.data.len = (size_t) (end - text);
+    return record_from_view(&view);
+}
+
+struct Record *record_read(FILE **fp) {
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
     struct Record *result;
-    result = record_parse(buf);
 
-    free(buf);
+    if (!*fp) {
+        return NULL;
+    }
+
+    if (scanner_attach(&scanner, *fp) < 0) {
+        return NULL;
+    }
 
+    // Emit record
+    result = NULL;
+    if (scanner_next(&scanner, &span) > 0) {
+        // Lengths come from the scanner, so messages may contain NUL bytes
+        if (record_view_from_span(&view, &span) == 0) {
+            result = record_from_view(&view);
+        }
+        // Leave the stream positioned at the end of the record
+        fseek(*fp, span.offset + (long) span.length, SEEK_SET);
+    }
+
+    scanner_close(&scanner);
     return result;
 }
 
-void record_show(struct Record *record, int style) {
-    const char *fmt;
+#define APPEND_LITERAL(B, S) buffer_append((B), (S), sizeof(S) - 1)
+#define APPEND_SLICE(B, V) buffer_append((B), (V).ptr, (V).len)
+
+// Render the fields as JSON members using the separators given
+static int record_view_format_json(struct Buffer *buffer, const struct RecordView *view, const char *sep, const char *colon) {
+    const char *keys[] = {"date", "time", "user", "host", "data"};
+    const struct Slice *values[] = {&view->date, &view->time, &view->user, &view->host, &view->data};
+
+    if (APPEND_LITERAL(buffer, "{") < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+        if ((i && buffer_append(buffer, sep, strlen(sep)) < 0)
+            || buffer_append_json(buffer, keys[i], strlen(keys[i])) < 0
+            || buffer_append(buffer, colon, strlen(colon)) < 0
+            || buffer_append_json(buffer, values[i]->ptr, values[i]->len) < 0) {
+            return -1;
+        }
+    }
+
+    // Custom header fields are grouped in a nested object
+    if (view->nfields) {
+        if (buffer_append(buffer, sep, strlen(sep)) < 0 || APPEND_LITERAL(buffer, "\"meta\"") < 0
+            || buffer_append(buffer, colon, strlen(colon)) < 0 || APPEND_LITERAL(buffer, "{") < 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < view->nfields; i++) {
+            if ((i && buffer_append(buffer, sep, strlen(sep)) < 0)
+                || buffer_append_json(buffer, view->fields[i].key.ptr, view->fields[i].key.len) < 0
+                || buffer_append(buffer, colon, strlen(colon)) < 0
+                || buffer_append_json(buffer, view->fields[i].value.ptr, view->fields[i].value.len) < 0) {
+                return -1;
+            }
+        }
+        if (APPEND_LITERAL(buffer, "}") < 0) {
+            return -1;
+        }
+    }
+    return APPEND_LITERAL(buffer, "}");
+}
+
+int record_view_format(struct Buffer *buffer, const struct RecordView *view, int style) {
+    size_t start;
+    int status;
+    STATS_START(started);
+
+    start = buffer->len;
+    status = 0;
     switch (style) {
         case RECORD_STYLE_LONG:
-            fmt = "## Date: %s\n## Time: %s\n## User: %s\n## Host: %s\n%s\n";
+            if (APPEND_LITERAL(buffer, "## Date: ") < 0 || APPEND_SLICE(buffer, view->date) < 0
+                || APPEND_LITERAL(buffer, "\n## Time: ") < 0 || APPEND_SLICE(buffer, view->time) < 0
+                || APPEND_LITERAL(buffer, "\n## User: ") < 0 || APPEND_SLICE(buffer, view->user) < 0
+                || APPEND_LITERAL(buffer, "\n## Host: ") < 0 || APPEND_SLICE(buffer, view->host) < 0
+                || APPEND_LITERAL(buffer, "\n") < 0) {
+                status = -1;
+                break;
+            }
+            for (size_t i = 0; i < view->nfields && status == 0; i++) {
+                if (APPEND_LITERAL(buffer, "## ") < 0 || APPEND_SLICE(buffer, view->fields[i].key) < 0
+                    || APPEND_LITERAL(buffer, ": ") < 0 || APPEND_SLICE(buffer, view->fields[i].value) < 0
+                    || APPEND_LITERAL(buffer, "\n") < 0) {
+                    status = -1;
+                }
+            }
+            if (status < 0 || APPEND_SLICE(buffer, view->data) < 0 || APPEND_LITERAL(buffer, "\n\n") < 0) {
+                status = -1;
+            }
             break;
         case RECORD_STYLE_CSV:
-            fmt = "%s,%s,%s,%s,\"%s\"";  // Trailing linefeed omitted for visual clarity
+            // The data field is always quoted
+            if (buffer_append_csv(buffer, view->date.ptr, view->date.len, 0) < 0 || APPEND_LITERAL(buffer, ",") < 0
+                || buffer_append_csv(buffer, view->time.ptr, view->time.len, 0) < 0 || APPEND_LITERAL(buffer, ",") < 0
+                || buffer_append_csv(buffer, view->user.ptr, view->user.len, 0) < 0 || APPEND_LITERAL(buffer, ",") < 0
+                || buffer_append_csv(buffer, view->host.ptr, view->host.len, 0) < 0 || APPEND_LITERAL(buffer, ",") < 0
+                || buffer_append_csv(buffer, view->data.ptr, view->data.len, 1) < 0
+                || APPEND_LITERAL(buffer, "\n") < 0) {
+                status = -1;
+            }
             break;
         case RECORD_STYLE_DICT:
-            fmt = "{"
-                  "\"date\": \"%s\",\n"
-                  "\"time\": \"%s\",\n"
-                  "\"user\": \"%s\",\n"
-                  "\"host\": \"%s\",\n"
-                  "\"data\": \"%s\"}\n";
+            if (record_view_format_json(buffer, view, ",\n", ": ") < 0 || APPEND_LITERAL(buffer, "\n\n") < 0) {
+                status = -1;
+            }
+            break;
+        case RECORD_STYLE_JSONL:
+            if (record_view_format_json(buffer, view, ",", ":") < 0 || APPEND_LITERAL(buffer, "\n") < 0) {
+                status = -1;
+            }
+            break;
+        case RECORD_STYLE_JSON:
+            // Leading separator. See writer_open_array().
+            if (APPEND_LITERAL(buffer, ",\n") < 0 || record_view_format_json(buffer, view, ", ", ": ") < 0) {
+                status = -1;
+            }
+            break;
+        case RECORD_STYLE_RECORD: {
+            // A length prefixed journal record, read back with the scanner
+            unsigned char *frame;
+            size_t header;
+
+            if (APPEND_LITERAL(buffer, RECORD_V2_MAGIC "\0\0\0\0\0\0\0\0") < 0) {
+                status = -1;
+                break;
+            }
+            header = buffer->len;
+            if (APPEND_LITERAL(buffer, "## date:   ") < 0 || APPEND_SLICE(buffer, view->date) < 0
+                || APPEND_LITERAL(buffer, "\n## time:   ") < 0 || APPEND_SLICE(buffer, view->time) < 0
+                || APPEND_LITERAL(buffer, "\n## author: ") < 0 || APPEND_SLICE(buffer, view->user) < 0
+                || APPEND_LITERAL(buffer, "\n## host:   ") < 0 || APPEND_SLICE(buffer, view->host) < 0
+                || APPEND_LITERAL(buffer, "\n") < 0) {
+                status = -1;
+                break;
+            }
+            for (size_t i = 0; i < view->nfields && status == 0; i++) {
+                if (APPEND_LITERAL(buffer, "## ") < 0 || APPEND_SLICE(buffer, view->fields[i].key) < 0
+                    || APPEND_LITERAL(buffer, ": ") < 0 || APPEND_SLICE(buffer, view->fields[i].value) < 0
+                    || APPEND_LITERAL(buffer, "\n") < 0) {
+                    status = -1;
+                }
+            }
+            if (status < 0 || APPEND_SLICE(buffer, view->data) < 0) {
+                status = -1;
+                break;
+            }
+            frame = (unsigned char *) buffer->data + start + RECORD_V2_MAGIC_SIZE;
+            for (int i = 0; i < 4; i++) {
+                frame[i] = (unsigned char) (((buffer->len - header - view->data.len) >> (i * 8)) & 0xff);
+                frame[4 + i] = (unsigned char) ((view->data.len >> (i * 8)) & 0xff);
+            }
             break;
+        }
         case RECORD_STYLE_SHORT:
         default:
-            fmt = "%s - %s - %s (%s):\n%s\n";
+            if (APPEND_SLICE(buffer, view->date) < 0 || APPEND_LITERAL(buffer, " - ") < 0
+                || APPEND_SLICE(buffer, view->time) < 0 || APPEND_LITERAL(buffer, " - ") < 0
+                || APPEND_SLICE(buffer, view->user) < 0 || APPEND_LITERAL(buffer, " (") < 0
+                || APPEND_SLICE(buffer, view->host) < 0 || APPEND_LITERAL(buffer, "):\n") < 0
+                || APPEND_SLICE(buffer, view->data) < 0 || APPEND_LITERAL(buffer, "\n\n") < 0) {
+                status = -1;
+            }
             break;
     }
-    printf(fmt, record->date, record->time, record->user, record->host, record->data);
+
+    if (status < 0) {
+        buffer->len = start;
+    }
+    STATS_STOP(STAT_TIME_OUTPUT, started);
+    return status;
+}
+
+void record_view_show(const struct RecordView *view, int style) {
+    struct Writer writer;
+
+    // A single record is not wrapped in an array
+    writer_init(&writer, stdout, style == RECORD_STYLE_JSON ? RECORD_STYLE_JSONL : style);
+    writer_record(&writer, view);
+    writer_close(&writer);
+}
+
+void record_show(struct Record *record, int style) {
+    struct RecordView view;
+
+    view.date.ptr = record->date ? record->date : "";
+    view.date.len = strlen(view.date.ptr);
+    view.time.ptr = record->time ? record->time : "";
+    view.time.len = strlen(view.time.ptr);
+    view.user.ptr = record->user ? record->user : "";
+    view.user.len = strlen(view.user.ptr);
+    view.host.ptr = record->host ? record->host : "";
+    view.host.len = strlen(view.host.ptr);
+    view.data.ptr = record->data ? record->data : "";
+    view.data.len = strlen(view.data.ptr);
+    view.nfields = 0;
+    record_view_show(&view, style);
 }
@@ -0,0 +1,617 @@
+#include "weekly.h"
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define REPORT_OTHER "(other)"
+
+// Totals of one author or host
+struct ReportName {
+    char name[REPORT_NAME_MAX];
+    uint64_t records;
+    uint64_t words;
+    uint64_t characters;
+};
+
+// Running totals of a --stats-report. Nothing is allocated per record:
+// authors and hosts beyond REPORT_NAMES_MAX are counted together as
+// "(other)".
+struct Report {
+    uint64_t records;
+    uint64_t words;
+    uint64_t characters;
+    uint64_t hours[24];
+    uint64_t weekdays[7];
+    struct ReportName authors[REPORT_NAMES_MAX];
+    size_t nauthors;
+    struct ReportName hosts[REPORT_NAMES_MAX];
+    size_t nhosts;
+};
+
+// The days covered by a report
+struct ReportRange {
+    const char *root;
+    const struct DumpFilter *filter;
+    long first;                 // days since 2000-01-01
+    long last;
+    uint64_t *daily;            // records per day from first to last
+};
+
+// A day file to be read
+struct ReportJob {
+    int year;
+    int week;
+    int day;
+    long days;
+    int edge;                   // first or last day: records are filtered by time
+    int compacted;              // read the day from the week's segment
+};
+
+static struct ReportName *report_name(struct ReportName *names, size_t *count, const char *ptr, size_t len) {
+    struct ReportName *name;
+
+    if (len > REPORT_NAME_MAX - 1) {
+        len = REPORT_NAME_MAX - 1;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        if (!memcmp(names[i].name, ptr, len) && names[i].name[len] == '\0') {
+            return &names[i];
+        }
+    }
+    if (*count < REPORT_NAMES_MAX - 1) {
+        name = &names[(*count)++];
+        memset(name, 0, sizeof(*name));
+        memcpy(name->name, ptr, len);
+        return name;
+    }
+    // The last slot collects every name that does not fit
+    name = &names[REPORT_NAMES_MAX - 1];
+    if (*count < REPORT_NAMES_MAX) {
+        memset(name, 0, sizeof(*name));
+        strcpy(name->name, REPORT_OTHER);
+        *count = REPORT_NAMES_MAX;
+    }
+    return name;
+}
+
+static void report_name_add(struct ReportName *name, uint64_t records, uint64_t words, uint64_t characters) {
+    name->records += records;
+    name->words += words;
+    name->characters += characters;
+}
+
+// Count the words (runs of non-space bytes) and characters (UTF-8 code
+// points) of a message
+static void report_text(const struct Slice *text, uint64_t *words, uint64_t *characters) {
+    uint64_t w, c;
+    int in_word;
+
+    w = 0;
+    c = 0;
+    in_word = 0;
+    for (size_t i = 0; i < text->len; i++) {
+        unsigned char ch = (unsigned char) text->ptr[i];
+        int space = ch == ' ' || (ch >= '\t' && ch <= '\r');
+
+        w += !space && !in_word;
+        in_word = !space;
+        c += (ch & 0xc0) != 0x80;
+    }
+    *words = w;
+    *characters = c;
+}
+
+static void report_add(struct Report *report, const struct RecordView *view, int weekday) {
+    const char *t = view->time.ptr;
+    uint64_t words, characters;
+
+    report_text(&view->data, &words, &characters);
+    report->records++;
+    report->words += words;
+    report->characters += characters;
+    report->weekdays[weekday]++;
+    // time: HH:MM:SS
+    if (view->time.len >= 2 && isdigit((unsigned char) t[0]) && isdigit((unsigned char) t[1])
+        && (t[0] - '0') * 10 + (t[1] - '0') < 24) {
+        report->hours[(t[0] - '0') * 10 + (t[1] - '0')]++;
+    }
+    report_name_add(report_name(report->authors, &report->nauthors, view->user.ptr, view->user.len), 1, words, characters);
+    report_name_add(report_name(report->hosts, &report->nhosts, view->host.ptr, view->host.len), 1, words, characters);
+}
+
+static void report_merge(struct Report *report, const struct Report *partial) {
+    report->records += partial->records;
+    report->words += partial->words;
+    report->characters += partial->characters;
+    for (int i = 0; i < 24; i++) {
+        report->hours[i] += partial->hours[i];
+    }
+    for (int i = 0; i < 7; i++) {
+        report->weekdays[i] += partial->weekdays[i];
+    }
+    for (size_t i = 0; i < partial->nauthors; i++) {
+        const struct ReportName *name = &partial->authors[i];
+        report_name_add(report_name(report->authors, &report->nauthors, name->name, strlen(name->name)),
+                        name->records, name->words, name->characters);
+    }
+    for (size_t i = 0; i < partial->nhosts; i++) {
+        const struct ReportName *name = &partial->hosts[i];
+        report_name_add(report_name(report->hosts, &report->nhosts, name->name, strlen(name->name)),
+                        name->records, name->words, name->characters);
+    }
+}
+
+// Add the records of one day file (or the day of a compacted week)
+static void report_day(const struct ReportRange *range, const struct ReportJob *job, struct Report *report) {
+    char path[PATH_MAX];
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+    uint64_t records;
+
+    sprintf(path, "%s%c%d%c%d%c%d", range->root, DIRSEP_C, job->year, DIRSEP_C, job->week, DIRSEP_C, job->day);
+    if (scanner_open_day(&scanner, path, job->compacted) < 0) {
+        return;
+    }
+    records = 0;
+    while (scanner_next(&scanner, &span) > 0) {
+        if (record_view_from_span(&view, &span) < 0) {
+            continue;
+        }
+        // Only the first and last day can hold records outside the range
+        if (job->edge && !dump_filter_match(range->filter, &view)) {
+            continue;
+        }
+        report_add(report, &view, job->day);
+        records++;
+    }
+    scanner_close(&scanner);
+    // Each day belongs to one job
+    range->daily[job->days - range->first] = records;
+}
+
+#if HAVE_PTHREAD
+struct ReportPool {
+    const struct ReportRange *range;
+    const struct ReportJob *jobs;
+    size_t count;
+    size_t next;                // next job to be claimed by a worker
+    pthread_mutex_t lock;
+};
+
+// A worker thread and the totals of the days it read
+struct ReportWorker {
+    pthread_t thread;
+    struct ReportPool *pool;
+    struct Report report;
+};
+
+static void *report_worker(void *arg) {
+    struct ReportWorker *worker = arg;
+    struct ReportPool *pool = worker->pool;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next < pool->count ? pool->next++ : pool->count;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == pool->count) {
+            break;
+        }
+        report_day(pool->range, &pool->jobs[i], &worker->report);
+    }
+    return NULL;
+}
+#endif
+
+// Read the day files with a pool of worker threads, each adding to its own
+// totals, and merge the totals when every file has been read
+static void report_scan(const struct ReportRange *range, const struct ReportJob *jobs, size_t count, struct Report *report) {
+    int threads = dump_jobs > 0 ? dump_jobs : cpu_count();
+#if HAVE_PTHREAD
+    struct ReportPool pool;
+    struct ReportWorker *workers;
+    int started;
+
+    if (threads > (int) count) {
+        threads = (int) count;
+    }
+    if (threads > 1 && (workers = calloc((size_t) threads, sizeof(*workers))) != NULL) {
+        pool.range = range;
+        pool.jobs = jobs;
+        pool.count = count;
+        pool.next = 0;
+        pthread_mutex_init(&pool.lock, NULL);
+        started = 0;
+        for (int i = 0; i < threads; i++) {
+            workers[i].pool = &pool;
+            if (pthread_create(&workers[i].thread, NULL, report_worker, &workers[i]) != 0) {
+                break;
+            }
+            started++;
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+            report_merge(report, &workers[i].report);
+        }
+        pthread_mutex_destroy(&pool.lock);
+        free(workers);
+        // Workers that did start claimed every job
+        if (started) {
+            return;
+        }
+    }
+#else
+    (void) threads;
+#endif
+
+    // Sequential fallback
+    for (size_t i = 0; i < count; i++) {
+        report_day(range, &jobs[i], report);
+    }
+}
+
+// Local midnight at the start of a day
+static time_t report_midnight(long days) {
+    struct tm tm_;
+    int year, month, mday;
+
+    calendar_date(days, &year, &month, &mday);
+    memset(&tm_, 0, sizeof(tm_));
+    tm_.tm_year = year - 1900;
+    tm_.tm_mon = month - 1;
+    tm_.tm_mday = mday;
+    tm_.tm_isdst = -1;
+    return mktime(&tm_);
+}
+
+// Count the records of a year from its index alone. The index holds the
+// author and time of each record, but not its host or message.
+static void report_index(const struct ReportRange *range, int year, const struct IndexEntry *entries, size_t count, struct Report *report) {
+    long midnight_days;
+    time_t midnight, next;
+    int whole;
+
+    // Hours are counted from the day's midnight, except on days that are
+    // not 24 hours long (daylight saving time changes)
+    midnight_days = range->first - 1;
+    midnight = 0;
+    next = (time_t) -1;
+    whole = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct IndexEntry *entry = &entries[i];
+        const char *end;
+        struct tm *tm_;
+        time_t t;
+        long days;
+
+        t = (time_t) entry->timestamp;
+        if (t < range->filter->since || t > range->filter->until
+            || calendar_find(year, entry->week, entry->day, &days) < 0
+            || days < range->first || days > range->last) {
+            continue;
+        }
+        report->records++;
+        report->weekdays[entry->day]++;
+        if (days != midnight_days) {
+            // Records are mostly in day order: the next day starts where
+            // this one ends
+            midnight = days == midnight_days + 1 && next != (time_t) -1 ? next : report_midnight(days);
+            next = report_midnight(days + 1);
+            midnight_days = days;
+            whole = midnight != (time_t) -1 && next - midnight == 86400;
+        }
+        if (whole && t >= midnight && t - midnight < 86400) {
+            report->hours[(t - midnight) / 3600]++;
+        } else if ((tm_ = localtime(&t)) != NULL) {
+            report->hours[tm_->tm_hour]++;
+        }
+        end = memchr(entry->author, '\0', INDEX_AUTHOR_MAX);
+        report_name_add(report_name(report->authors, &report->nauthors, entry->author,
+                                    end ? (size_t) (end - entry->author) : INDEX_AUTHOR_MAX), 1, 0, 0);
+        range->daily[days - range->first]++;
+    }
+}
+
+static int compare_name(const void *a, const void *b) {
+    const struct ReportName *x = a;
+    const struct ReportName *y = b;
+
+    if (x->records != y->records)
+        return (x->records < y->records) - (x->records > y->records);
+    return strcmp(x->name, y->name);
+}
+
+// A row of the report: CSV "section,name,records[,words,characters]",
+// otherwise aligned columns
+static void report_row(struct Buffer *line, int style, const char *section, const char *name,
+                       uint64_t records, const uint64_t *words, const uint64_t *characters) {
+    if (style == RECORD_STYLE_CSV) {
+        buffer_printf(line, "%s,", section);
+        buffer_append_csv(line, name, strlen(name), 0);
+        buffer_printf(line, ",%llu", (unsigned long long) records);
+        if (words) {
+            buffer_printf(line, ",%llu,%llu", (unsigned long long) *words, (unsigned long long) *characters);
+        }
+        buffer_append(line, "\n", 1);
+        return;
+    }
+    buffer_printf(line, "%-24s %10llu", *name ? name : "-", (unsigned long long) records);
+    if (words) {
+        buffer_printf(line, " %12llu %12llu", (unsigned long long) *words, (unsigned long long) *characters);
+    }
+    buffer_append(line, "\n", 1);
+}
+
+static void report_heading(struct Buffer *line, int style, const char *section, int text) {
+    if (style == RECORD_STYLE_CSV) {
+        return;
+    }
+    buffer_printf(line, "\n%-24s %10s", section, "records");
+    if (text) {
+        buffer_printf(line, " %12s %12s", "words", "characters");
+    }
+    buffer_append(line, "\n", 1);
+}
+
+static void report_json_names(struct Buffer *line, const char *section, const char *key,
+                              const struct ReportName *names, size_t count, int text) {
+    buffer_printf(line, ", \"%s\": [", section);
+    for (size_t i = 0; i < count; i++) {
+        buffer_printf(line, "%s{\"%s\": ", i ? ", " : "", key);
+        buffer_append_json(line, names[i].name, strlen(names[i].name));
+        buffer_printf(line, ", \"records\": %llu", (unsigned long long) names[i].records);
+        if (text) {
+            buffer_printf(line, ", \"words\": %llu, \"characters\": %llu",
+                          (unsigned long long) names[i].words, (unsigned long long) names[i].characters);
+        }
+        buffer_append(line, "}", 1);
+    }
+    buffer_append(line, "]", 1);
+}
+
+// Write the report. Words, characters and hosts are left out when the
+// records were counted from the index ("text" is 0).
+static void report_show(const struct ReportRange *range, struct Report *report, int text, struct Writer *out) {
+    static const char *legacy_days[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+    static const char *iso_days[] = {"Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", "Sunday"};
+    const char **weekdays = calendar_scheme == CALENDAR_ISO ? iso_days : legacy_days;
+    int json = out->style == RECORD_STYLE_DICT || out->style == RECORD_STYLE_JSONL || out->style == RECORD_STYLE_JSON;
+    struct ReportName hours[24];
+    size_t nhours;
+    struct Buffer line;
+    int year, week;
+    int first;
+
+    // Busiest hours first
+    nhours = 0;
+    for (int i = 0; i < 24; i++) {
+        if (report->hours[i]) {
+            memset(&hours[nhours], 0, sizeof(*hours));
+            sprintf(hours[nhours].name, "%02d", i);
+            hours[nhours++].records = report->hours[i];
+        }
+    }
+    qsort(hours, nhours, sizeof(*hours), compare_name);
+    qsort(report->authors, report->nauthors, sizeof(*report->authors), compare_name);
+    qsort(report->hosts, report->nhosts, sizeof(*report->hosts), compare_name);
+
+    buffer_init(&line);
+    if (json) {
+        buffer_printf(&line, "%s{\"records\": %llu", out->style == RECORD_STYLE_JSON ? ",\n" : "",
+                      (unsigned long long) report->records);
+        if (text) {
+            buffer_printf(&line, ", \"words\": %llu, \"characters\": %llu",
+                          (unsigned long long) report->words, (unsigned long long) report->characters);
+        }
+        report_json_names(&line, "authors", "author", report->authors, report->nauthors, text);
+        if (text) {
+            report_json_names(&line, "hosts", "host", report->hosts, report->nhosts, text);
+        }
+        report_json_names(&line, "hours", "hour", hours, nhours, 0);
+        buffer_append(&line, ", \"weekdays\": {", 15);
+        for (int i = 0; i < 7; i++) {
+            buffer_printf(&line, "%s\"%s\": %llu", i ? ", " : "", weekdays[i], (unsigned long long) report->weekdays[i]);
+        }
+        buffer_append(&line, "}", 1);
+    } else {
+        report_row(&line, out->style, "total", "records", report->records, NULL, NULL);
+        if (text) {
+            report_row(&line, out->style, "total", "words", report->words, NULL, NULL);
+            report_row(&line, out->style, "total", "characters", report->characters, NULL, NULL);
+        }
+        report_heading(&line, out->style, "author", text);
+        for (size_t i = 0; i < report->nauthors; i++) {
+            const struct ReportName *name = &report->authors[i];
+            report_row(&line, out->style, "author", name->name, name->records,
+                       text ? &name->words : NULL, text ? &name->characters : NULL);
+        }
+        if (text) {
+            report_heading(&line, out->style, "host", text);
+            for (size_t i = 0; i < report->nhosts; i++) {
+                const struct ReportName *name = &report->hosts[i];
+                report_row(&line, out->style, "host", name->name, name->records, &name->words, &name->characters);
+            }
+        }
+        report_heading(&line, out->style, "hour", 0);
+        for (size_t i = 0; i < nhours; i++) {
+            report_row(&line, out->style, "hour", hours[i].name, hours[i].records, NULL, NULL);
+        }
+        report_heading(&line, out->style, "weekday", 0);
+        for (int i = 0; i < 7; i++) {
+            report_row(&line, out->style, "weekday", weekdays[i], report->weekdays[i], NULL, NULL);
+        }
+    }
+
+    // Records per week, then per day
+    if (json) {
+        buffer_append(&line, ", \"weeks\": [", 12);
+    } else {
+        report_heading(&line, out->style, "week", 0);
+    }
+    first = 1;
+    for (long days = range->first; days <= range->last; ) {
+        char name[32];
+        uint64_t records;
+        int y, w, d;
+
+        calendar_locate_days(days, &year, &week, &d);
+        records = 0;
+        for (; days <= range->last && calendar_locate_days(days, &y, &w, &d) == 0 && y == year && w == week; days++) {
+            records += range->daily[days - range->first];
+        }
+        if (!records) {
+            continue;
+        }
+        sprintf(name, "%04d-W%02d", year, week);
+        if (json) {
+            buffer_printf(&line, "%s{\"week\": \"%s\", \"records\": %llu}", first ? "" : ", ", name, (unsigned long long) records);
+        } else {
+            report_row(&line, out->style, "week", name, records, NULL, NULL);
+        }
+        first = 0;
+    }
+    if (json) {
+        buffer_append(&line, "], \"days\": [", 12);
+    } else {
+        report_heading(&line, out->style, "day", 0);
+    }
+    first = 1;
+    for (long days = range->first; days <= range->last; days++) {
+        char name[32];
+        int month, mday;
+
+        if (!range->daily[days - range->first]) {
+            continue;
+        }
+        calendar_date(days, &year, &month, &mday);
+        sprintf(name, "%04d-%02d-%02d", year, month, mday);
+        if (json) {
+            buffer_printf(&line, "%s{\"date\": \"%s\", \"records\": %llu}", first ? "" : ", ", name,
+                          (unsigned long long) range->daily[days - range->first]);
+        } else {
+            report_row(&line, out->style, "day", name, range->daily[days - range->first], NULL, NULL);
+        }
+        first = 0;
+    }
+    if (json) {
+        buffer_append(&line, "]}", 2);
+        if (out->style != RECORD_STYLE_JSON) {
+            buffer_append(&line, "\n", 1);
+        }
+    }
+    writer_write(out, line.data, line.len);
+    buffer_free(&line);
+}
+
+// Summarize the records of a time range in one pass: records per day and
+// week, words and characters per author and host, and the busiest hours.
+// Day files are read in parallel, and only the days holding data are read.
+// With "index_only" the days the index covers are counted from the index
+// alone. Returns the number of records counted, or -1 on error.
+long report_run(const char *root, const struct DumpFilter *filter, int index_only, struct Writer *out) {
+    struct ReportRange range;
+    struct Report *report;
+    struct ReportJob *jobs;
+    struct ReportJob *job;
+    struct IndexCoverage coverage;
+    struct IndexEntry *entries;
+    struct tm *tm_;
+    size_t count;
+    size_t njobs;
+    size_t size;
+    int index_year;
+    int have_year;
+    int have_index;
+    long total;
+
+    range.root = root;
+    range.filter = filter;
+    if (!(tm_ = localtime(&filter->since))) {
+        return -1;
+    }
+    range.first = calendar_days(tm_->tm_year + 1900, tm_->tm_mon + 1, tm_->tm_mday);
+    if (!(tm_ = localtime(&filter->until))) {
+        return -1;
+    }
+    range.last = calendar_days(tm_->tm_year + 1900, tm_->tm_mon + 1, tm_->tm_mday);
+    range.daily = calloc((size_t) (range.last - range.first + 1), sizeof(*range.daily));
+    report = calloc(1, sizeof(*report));
+    if (!range.daily || !report) {
+        perror("Unable to allocate report");
+        free(range.daily);
+        free(report);
+        return -1;
+    }
+
+    // A day maps to exactly one YEAR/WEEK/DAY file, and only the files
+    // holding data are opened. With "index_only" a day is read only when
+    // its file holds records the index does not cover.
+    jobs = NULL;
+    njobs = 0;
+    size = 0;
+    index_year = -1;
+    have_year = 0;
+    have_index = 0;
+    for (long days = range.first; days <= range.last; days++) {
+        int year, week, day;
+
+        calendar_locate_days(days, &year, &week, &day);
+        if (year != index_year) {
+            index_year = year;
+            have_index = index_only && index_load(root, year, &entries, &count) == 0;
+            if (!have_index) {
+                entries = NULL;
+                count = 0;
+            }
+            have_year = index_coverage(root, year, 0, WEEK_MAX, entries, count, 1, &coverage) == 0;
+            if (have_year && have_index) {
+                size_t n = 0;
+
+                for (size_t i = 0; i < count; i++) {
+                    if (entries[i].week >= 0 && entries[i].week <= WEEK_MAX && entries[i].day >= 0 && entries[i].day < 7
+                        && coverage.covered[entries[i].week] & (1 << entries[i].day)) {
+                        entries[n++] = entries[i];
+                    }
+                }
+                report_index(&range, year, entries, n, report);
+            }
+            free(entries);
+        }
+        if (!have_year || week > WEEK_MAX || !(coverage.present[week] & (1 << day))
+            || (have_index && coverage.covered[week] & (1 << day))) {
+            continue;
+        }
+
+        if (njobs == size) {
+            struct ReportJob *tmp;
+            size = size ? size * 2 : 64;
+            if (!(tmp = realloc(jobs, size * sizeof(*jobs)))) {
+                perror("Unable to allocate report");
+                free(jobs);
+                free(range.daily);
+                free(report);
+                return -1;
+            }
+            jobs = tmp;
+        }
+        job = &jobs[njobs++];
+        job->year = year;
+        job->week = week;
+        job->day = day;
+        job->days = days;
+        job->edge = days == range.first || days == range.last;
+        job->compacted = coverage.compacted[week] != 0;
+    }
+
+    report_scan(&range, jobs, njobs, report);
+    total = (long) report->records;
+    if (total) {
+        report_show(&range, report, !index_only, out);
+    }
+    free(jobs);
+    free(range.daily);
+    free(report);
+    return total;
+}
@@ -0,0 +1,490 @@
+#include "weekly.h"
+
+// Map large journal files instead of reading them (cleared by --no-mmap)
+int scanner_mmap = 1;
+
+// Locate three consecutive marker bytes (i.e. "\x01\x01\x01") in a block
+static char *find_marker(char *data, size_t len, char marker) {
+    char *p;
+    char *end;
+
+    p = data;
+    end = data + len;
+    while (p + 2 < end && (p = memchr(p, marker, (size_t) (end - p) - 2)) != NULL) {
+        if (p[1] == marker && p[2] == marker) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// Locate the start of the next record: a version 2 frame or a version 1
+// start of header marker. Returns NULL when a candidate is cut off by the
+// end of the block.
+static char *find_record(char *data, size_t len) {
+    char *p;
+    char *end;
+
+    p = data;
+    end = data + len;
+    while (p < end && (p = memchr(p, '\x01', (size_t) (end - p))) != NULL) {
+        if (end - p < RECORD_V2_MAGIC_SIZE) {
+            return NULL;
+        }
+        if ((p[1] == '\x01' && p[2] == '\x01') || !memcmp(p, RECORD_V2_MAGIC, RECORD_V2_MAGIC_SIZE)) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// Read more of the file into the block buffer, discarding everything before "keep"
+static int scanner_fill(struct RecordScanner *scanner, size_t keep) {
+    size_t count;
+
+    if (scanner->eof) {
+        return 0;
+    }
+
+    // Discard consumed data
+    if (keep > 0) {
+        memmove(scanner->buf, scanner->buf + keep, scanner->len - keep);
+        scanner->len -= keep;
+        scanner->pos -= keep;
+        scanner->base += (long) keep;
+    }
+
+    // Grow the buffer when a single record does not fit
+    if (scanner->size - scanner->len < SCANNER_BLOCK_SIZE / 2) {
+        size_t size;
+        char *buf;
+
+        size = scanner->size * 2;
+        buf = realloc(scanner->buf, size + 1);
+        if (!buf) {
+            perror("Unable to allocate scanner buffer");
+            return -1;
+        }
+        STATS_ADD(STAT_ALLOCATIONS, 1);
+        scanner->buf = buf;
+        scanner->size = size;
+    }
+
+    STATS_START(started);
+    count = fread(scanner->buf + scanner->len, sizeof(char), scanner->size - scanner->len, scanner->fp);
+    STATS_STOP(STAT_TIME_READ, started);
+    STATS_ADD(STAT_BYTES_READ, count);
+    if (count < scanner->size - scanner->len) {
+        if (ferror(scanner->fp)) {
+            return -1;
+        }
+        scanner->eof = 1;
+    }
+    scanner->len += count;
+    return (int) (count > 0);
+}
+
+#if HAVE_MMAP
+// A mapping of a file on a network or user space filesystem faults (SIGBUS)
+// when another client truncates the file. Those are read with stdio.
+static int scanner_map_safe(int fd) {
+#if defined(__linux__)
+    struct statfs fs;
+
+    if (fstatfs(fd, &fs) < 0) {
+        return 0;
+    }
+    switch ((uint32_t) fs.f_type) {
+        case 0x6969:        // NFS
+        case 0x517b:        // SMB
+        case 0xff534d42:    // CIFS
+        case 0xfe534d42:    // SMB2
+        case 0x65735546:    // FUSE
+        case 0x01021997:    // 9P
+        case 0x564c:        // NCP
+        case 0x00c36400:    // Ceph
+        case 0x0bd00bd0:    // Lustre
+        case 0x47504653:    // GPFS
+            return 0;
+        default:
+            return 1;
+    }
+#else
+    (void) fd;
+    return 1;
+#endif
+}
+
+// Map the whole of an open file. Returns 0 when the file should be read
+// with stdio instead.
+static int scanner_map(struct RecordScanner *scanner, FILE *fp) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = fileno(fp);
+    if (!scanner_mmap || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+        || st.st_size < SCANNER_MMAP_MIN || (uint64_t) st.st_size > SIZE_MAX / 2 || !scanner_map_safe(fd)) {
+        return 0;
+    }
+    STATS_START(started);
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    // Records are scanned front to back
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+    STATS_STOP(STAT_TIME_READ, started);
+    STATS_ADD(STAT_BYTES_READ, (uint64_t) st.st_size);
+
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->buf = map;
+    scanner->size = (size_t) st.st_size;
+    scanner->len = (size_t) st.st_size;
+    scanner->mapped = (size_t) st.st_size;
+    scanner->eof = 1;
+    return 1;
+}
+#endif
+
+int scanner_attach(struct RecordScanner *scanner, FILE *fp) {
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->buf = malloc(SCANNER_BLOCK_SIZE + 1);
+    if (!scanner->buf) {
+        perror("Unable to allocate scanner buffer");
+        return -1;
+    }
+    STATS_ADD(STAT_ALLOCATIONS, 1);
+    scanner->size = SCANNER_BLOCK_SIZE;
+    scanner->fp = fp;
+    scanner->base = ftell(fp);
+    if (scanner->base < 0) {
+        scanner->base = 0;
+    }
+    return 0;
+}
+
+int scanner_open_memory(struct RecordScanner *scanner, char *data, size_t len) {
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->buf = data;
+    scanner->size = len;
+    scanner->len = len;
+    scanner->eof = 1;
+    scanner->borrowed = 1;
+    return 0;
+}
+
+int scanner_open(struct RecordScanner *scanner, const char *filename) {
+    FILE *fp;
+    STATS_START(started);
+
+    fp = fopen(filename, "rb");
+    STATS_STOP(STAT_TIME_OPEN, started);
+    STATS_ADD(fp ? STAT_FILES_OPENED : STAT_FILES_MISSED, 1);
+    if (!fp) {
+        return -1;
+    }
+#if HAVE_MMAP
+    if (scanner_map(scanner, fp)) {
+        fclose(fp);
+        scanner->name = strdup(filename);
+        return 0;
+    }
+#endif
+    if (scanner_attach(scanner, fp) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    scanner->owner = 1;
+    scanner->name = strdup(filename);
+    return 0;
+}
+
+// Open a day file (root/YEAR/WEEK/DAY), or its block of the week's segment
+// when the caller found the week compacted (see segment_exists())
+int scanner_open_day(struct RecordScanner *scanner, const char *filename, int compacted) {
+    struct Buffer block;
+
+    if (!compacted) {
+        return scanner_open(scanner, filename);
+    }
+    buffer_init(&block);
+    if (segment_load(filename, &block) <= 0 || !block.len) {
+        buffer_free(&block);
+        errno = ENOENT;
+        return -1;
+    }
+    scanner_open_memory(scanner, block.data, block.len);
+    scanner->borrowed = 0;
+    scanner->name = strdup(filename);
+    return 0;
+}
+
+void scanner_close(struct RecordScanner *scanner) {
+    if (scanner->owner && scanner->fp) {
+        fclose(scanner->fp);
+    }
+    free(scanner->name);
+#if HAVE_MMAP
+    if (scanner->mapped) {
+        munmap(scanner->buf, scanner->mapped);
+    } else
+#endif
+    if (!scanner->borrowed) {
+        free(scanner->buf);
+    }
+    memset(scanner, 0, sizeof(*scanner));
+}
+
+// Read the rest of the file, making every record resident in buf
+int scanner_load(struct RecordScanner *scanner) {
+    int status;
+
+    while ((status = scanner_fill(scanner, 0)) > 0);
+    return status;
+}
+
+// Ask the kernel to start reading the file before it is scanned
+void scanner_prefetch(struct RecordScanner *scanner) {
+#if HAVE_MMAP
+    if (scanner->mapped) {
+        madvise(scanner->buf, scanner->mapped, MADV_WILLNEED);
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    else if (scanner->fp && !scanner->eof) {
+        posix_fadvise(fileno(scanner->fp), 0, 0, POSIX_FADV_WILLNEED);
+    }
+#endif
+#else
+    (void) scanner;
+#endif
+}
+
+// Make "count" bytes starting at buf[*start] resident. *start is updated
+// when the buffer is compacted.
+static int scanner_require(struct RecordScanner *scanner, size_t *start, size_t count) {
+    while (scanner->len - *start < count) {
+        long base = scanner->base;
+        int status = scanner_fill(scanner, *start);
+
+        // The buffer may have been compacted even when nothing was read
+        *start -= (size_t) (scanner->base - base);
+        if (status <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#define SCAN_RECORD 1
+#define SCAN_END 0
+#define SCAN_DAMAGED 2          // skipped bytes, resume at scanner->pos
+
+// Report a torn or interleaved record that is being skipped
+void scanner_damaged(struct RecordScanner *scanner, size_t start) {
+    if (scanner->name) {
+        fprintf(stderr, "%s: skipped a damaged record at offset %ld\n", scanner->name, scanner->base + (long) start);
+    }
+}
+
+// Whether a record starts at buf[pos]. The end of the file, or the first
+// bytes of a marker at the end of the file (a record still being written),
+// count as well.
+static int scanner_at_record(const struct RecordScanner *scanner, size_t pos) {
+    const char *p = scanner->buf + pos;
+    size_t n;
+
+    n = scanner->len - pos < RECORD_V2_MAGIC_SIZE ? scanner->len - pos : RECORD_V2_MAGIC_SIZE;
+    return !memcmp(p, RECORD_SOH, n < 3 ? n : 3) || !memcmp(p, RECORD_V2_MAGIC, n);
+}
+
+// Find a record that begins inside the "len" bytes at "data", which belong
+// to an earlier record. Messages may hold the marker bytes, so a marker only
+// counts when a header follows it, and outside of a --fsck repair only at
+// the start of a line.
+static char *scanner_find_record(const struct RecordScanner *scanner, char *data, size_t len) {
+    const char *end = scanner->buf + scanner->len;
+    char *p;
+
+    while ((p = find_record(data, len)) != NULL) {
+        size_t marker = p[1] == '\x01' ? 3 : RECORD_V2_FRAME_SIZE;
+
+        if ((scanner->repair || (p > scanner->buf && p[-1] == '\n'))
+            && (size_t) (end - p) > marker && p[marker] == '#') {
+            return p;
+        }
+        len -= (size_t) (p + 1 - data);
+        data = p + 1;
+    }
+    return NULL;
+}
+
+// A record cut off by the end of the file is either still being written
+// or was torn by a crash. Only the latter is followed by another record.
+static int scanner_truncated(struct RecordScanner *scanner, size_t start) {
+    char *next;
+
+    next = scanner_find_record(scanner, scanner->buf + start + 1, scanner->len - start - 1);
+    if (!next) {
+        scanner->pos = scanner->len;
+        return SCAN_END;
+    }
+    scanner_damaged(scanner, start);
+    scanner->pos = (size_t) (next - scanner->buf);
+    return SCAN_DAMAGED;
+}
+
+// Read a length prefixed (version 2) record. The lengths lead directly to
+// the next record, so the header and message are never searched.
+static int scanner_next_v2(struct RecordScanner *scanner, struct RecordSpan *span, size_t start) {
+    const unsigned char *frame;
+    uint64_t header_len;
+    uint64_t text_len;
+    size_t total;
+
+    scanner->pos = start;
+    if (scanner_require(scanner, &start, RECORD_V2_FRAME_SIZE) < 0) {
+        return scanner_truncated(scanner, start);
+    }
+    frame = (const unsigned char *) scanner->buf + start;
+    header_len = get_u32(frame + 4);
+    text_len = get_u32(frame + 8);
+    if (RECORD_V2_FRAME_SIZE + header_len + text_len > (uint64_t) SIZE_MAX / 2) {
+        // Not a usable frame. Resume the search after its first byte.
+        scanner_damaged(scanner, start);
+        scanner->pos = start + 1;
+        return SCAN_DAMAGED;
+    }
+    total = RECORD_V2_FRAME_SIZE + (size_t) header_len + (size_t) text_len;
+    if (scanner_require(scanner, &start, total) < 0) {
+        return scanner_truncated(scanner, start);
+    }
+
+    // The frame of a torn record claims bytes of the records written after
+    // it. A complete record is followed by another one or the end of the file.
+    scanner_require(scanner, &start, total + RECORD_V2_MAGIC_SIZE);
+    if (!scanner_at_record(scanner, start + total)) {
+        scanner_damaged(scanner, start);
+        scanner->pos = start + 1;
+        return SCAN_DAMAGED;
+    }
+
+    span->header = scanner->buf + start + RECORD_V2_FRAME_SIZE;
+    span->header_len = (size_t) header_len;
+    span->text = span->header + header_len;
+    span->text_len = (size_t) text_len;
+    span->offset = scanner->base + (long) start;
+    span->length = total;
+    scanner->pos = start + total;
+    return SCAN_RECORD;
+}
+
+// Read a version 1 record starting at buf[start]
+static int scanner_next_v1(struct RecordScanner *scanner, struct RecordSpan *span, size_t start) {
+    char *soh, *sot, *eot;
+    char *text, *text_end;
+    char *next;
+
+    // Find the end of text. The whole record must be resident in the buffer.
+    scanner->pos = start + 3;
+    while ((eot = find_marker(scanner->buf + scanner->pos, scanner->len - scanner->pos, '\x03')) == NULL) {
+        size_t scanned;
+        long base;
+        int status;
+
+        scanned = scanner->len - scanner->pos;
+        scanner->pos += scanned > 2 ? scanned - 2 : 0;
+        base = scanner->base;
+        status = scanner_fill(scanner, start);
+        start -= (size_t) (scanner->base - base);
+        if (status <= 0) {
+            return scanner_truncated(scanner, start);
+        }
+    }
+    soh = scanner->buf + start;
+
+    // A record torn by a crash has no end of text marker of its own, so the
+    // search above ran into a later record
+    if ((next = scanner_find_record(scanner, soh + 3, (size_t) (eot - soh - 3))) != NULL) {
+        scanner_damaged(scanner, start);
+        scanner->pos = (size_t) (next - scanner->buf);
+        return SCAN_DAMAGED;
+    }
+
+    // Header ends at the start of text marker (when present)
+    sot = find_marker(soh + 3, (size_t) (eot - soh - 3), '\x02');
+    span->header = soh + 3;
+    if (!sot) {
+        span->header_len = (size_t) (eot - span->header);
+        span->text = NULL;
+        span->text_len = 0;
+    } else {
+        span->header_len = (size_t) (sot - span->header);
+        text = sot + 3;
+
+        // Drop the line feeds emitted around the message body
+        text_end = eot;
+        if (text < text_end && *text == '\n') {
+            text++;
+        }
+        for (int i = 0; i < 2 && text_end > text && text_end[-1] == '\n'; i++) {
+            text_end--;
+        }
+        span->text = text;
+        span->text_len = (size_t) (text_end - text);
+    }
+
+    span->offset = scanner->base + (long) start;
+    span->length = (size_t) (eot + 3 - soh);
+    scanner->pos = start + span->length;
+    return SCAN_RECORD;
+}
+
+// Damaged records (torn by a crash, or cut short by a failed write) are
+// skipped, and scanning resumes at the next record header
+static int scanner_next_record(struct RecordScanner *scanner, struct RecordSpan *span) {
+    char *soh;
+    size_t start;
+    int status;
+
+    do {
+        // Find the start of the next record
+        while ((soh = find_record(scanner->buf + scanner->pos, scanner->len - scanner->pos)) == NULL) {
+            // Keep the tail in case a marker straddles the block boundary
+            start = scanner->len > RECORD_V2_MAGIC_SIZE - 1 ? scanner->len - (RECORD_V2_MAGIC_SIZE - 1) : 0;
+            if (start < scanner->pos) {
+                start = scanner->pos;
+            }
+            scanner->pos = start;
+            if (scanner_fill(scanner, start) <= 0) {
+                return 0;
+            }
+        }
+        start = (size_t) (soh - scanner->buf);
+        if (soh[1] != '\x01') {
+            status = scanner_next_v2(scanner, span, start);
+        } else {
+            status = scanner_next_v1(scanner, span, start);
+        }
+    } while (status == SCAN_DAMAGED);
+    return status;
+}
+
+int scanner_next(struct RecordScanner *scanner, struct RecordSpan *span) {
+    int status;
+    STATS_START(started);
+
+    status = scanner_next_record(scanner, span);
+    STATS_STOP(STAT_TIME_SCAN, started);
+    return status;
+}
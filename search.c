@@ -0,0 +1,758 @@
+#include "weekly.h"
+
+#define TERMS_HEADER_SIZE 8
+#define POSTING_SIZE 24
+
+static void put_uint(unsigned char *p, uint64_t value, int width) {
+    for (int i = 0; i < width; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static uint64_t get_uint(const unsigned char *p, int width) {
+    uint64_t value = 0;
+    for (int i = width - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// On-disk layout (little endian):
+//   u64 hash, u16 week, u8 day, u8 reserved, u32 length, u64 offset
+static void posting_encode(unsigned char *p, const struct Posting *posting) {
+    memset(p, 0, POSTING_SIZE);
+    put_uint(p, posting->hash, 8);
+    put_uint(p + 8, (uint64_t) posting->week, 2);
+    p[10] = (unsigned char) posting->day;
+    put_uint(p + 12, posting->length, 4);
+    put_uint(p + 16, posting->offset, 8);
+}
+
+static void posting_decode(const unsigned char *p, struct Posting *posting) {
+    posting->hash = get_uint(p, 8);
+    posting->week = (int) get_uint(p + 8, 2);
+    posting->day = p[10];
+    posting->length = (uint32_t) get_uint(p + 12, 4);
+    posting->offset = get_uint(p + 16, 8);
+}
+
+static void terms_header(unsigned char *p) {
+    memcpy(p, TERMS_MAGIC, 6);
+    put_uint(p + 6, TERMS_VERSION, 2);
+}
+
+static void terms_path(char *path, const char *root, int year, const char *name) {
+    sprintf(path, "%s%c%d%c%s", root, DIRSEP_C, year, DIRSEP_C, name);
+}
+
+static int is_word(unsigned char c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+// Find the next word in s starting at *pos. Returns its length (0 at the end).
+static size_t term_next(const char *s, size_t len, size_t *pos, const char **word) {
+    size_t start;
+
+    while (*pos < len && !is_word((unsigned char) s[*pos])) {
+        (*pos)++;
+    }
+    start = *pos;
+    while (*pos < len && is_word((unsigned char) s[*pos])) {
+        (*pos)++;
+    }
+    *word = s + start;
+    return *pos - start;
+}
+
+// FNV-1a of the lower case word
+static uint64_t term_hash(const char *s, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) tolower((unsigned char) s[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int term_equal(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int compare_hash(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_posting(const void *a, const void *b) {
+    const struct Posting *x = a;
+    const struct Posting *y = b;
+
+    if (x->hash != y->hash)
+        return (x->hash > y->hash) - (x->hash < y->hash);
+    if (x->week != y->week)
+        return x->week - y->week;
+    if (x->day != y->day)
+        return x->day - y->day;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Order by location only (week, day, offset)
+static int compare_location(const void *a, const void *b) {
+    const struct Posting *x = a;
+    const struct Posting *y = b;
+
+    if (x->week != y->week)
+        return x->week - y->week;
+    if (x->day != y->day)
+        return x->day - y->day;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int postings_push(struct Posting **postings, size_t *count, size_t *size, const struct Posting *posting) {
+    if (*count == *size) {
+        struct Posting *tmp;
+        *size = *size ? *size * 2 : 256;
+        tmp = realloc(*postings, *size * sizeof(**postings));
+        if (!tmp) {
+            perror("Unable to allocate postings");
+            return -1;
+        }
+        *postings = tmp;
+    }
+    (*postings)[(*count)++] = *posting;
+    return 0;
+}
+
+// Generate one posting per distinct word of a record
+int search_postings_add(struct Posting **postings, size_t *count, size_t *size,
+                        int week, int day, const struct RecordSpan *span, const struct RecordView *view) {
+    uint64_t *hashes;
+    size_t nhashes;
+    size_t hsize;
+    size_t pos;
+    size_t len;
+    const char *word;
+    int status;
+
+    hashes = NULL;
+    nhashes = 0;
+    hsize = 0;
+    pos = 0;
+    status = 0;
+    while ((len = term_next(view->data.ptr, view->data.len, &pos, &word)) > 0) {
+        if (nhashes == hsize) {
+            uint64_t *tmp;
+            hsize = hsize ? hsize * 2 : 64;
+            tmp = realloc(hashes, hsize * sizeof(*hashes));
+            if (!tmp) {
+                free(hashes);
+                return -1;
+            }
+            hashes = tmp;
+        }
+        hashes[nhashes++] = term_hash(word, len);
+    }
+
+    qsort(hashes, nhashes, sizeof(*hashes), compare_hash);
+    for (size_t i = 0; i < nhashes && status == 0; i++) {
+        struct Posting posting;
+        if (i && hashes[i] == hashes[i - 1]) {
+            continue;
+        }
+        posting.hash = hashes[i];
+        posting.week = week;
+        posting.day = day;
+        posting.length = (uint32_t) span->length;
+        posting.offset = (uint64_t) span->offset;
+        status = postings_push(postings, count, size, &posting);
+    }
+    free(hashes);
+    return status;
+}
+
+static int postings_read(FILE *fp, struct Posting **postings, size_t *count, size_t *size) {
+    unsigned char raw[POSTING_SIZE];
+    struct Posting posting;
+
+    while (fread(raw, sizeof(char), sizeof(raw), fp) == sizeof(raw)) {
+        posting_decode(raw, &posting);
+        if (postings_push(postings, count, size, &posting) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write a sorted term index, replacing the existing one
+static int terms_write(const char *root, int year, struct Posting *postings, size_t count) {
+    char path[PATH_MAX] = {0};
+    char path_tmp[PATH_MAX] = {0};
+    unsigned char raw[POSTING_SIZE];
+    FILE *fp;
+
+    terms_path(path, root, year, TERMS_FILENAME);
+    sprintf(path_tmp, "%s.tmp", path);
+    fp = fopen(path_tmp, "wb");
+    if (!fp) {
+        return -1;
+    }
+
+    qsort(postings, count, sizeof(*postings), compare_posting);
+    terms_header(raw);
+    fwrite(raw, sizeof(char), TERMS_HEADER_SIZE, fp);
+    for (size_t i = 0; i < count; i++) {
+        // A log merged twice (see search_merge()) repeats its postings
+        if (i && compare_posting(&postings[i], &postings[i - 1]) == 0) {
+            continue;
+        }
+        posting_encode(raw, &postings[i]);
+        fwrite(raw, sizeof(char), sizeof(raw), fp);
+    }
+
+    if (fclose(fp) != 0) {
+        unlink(path_tmp);
+        return -1;
+    }
+#if HAVE_WINDOWS
+    unlink(path);
+#endif
+    if (rename(path_tmp, path) < 0) {
+        unlink(path_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Open the sorted term index and verify its header
+static FILE *terms_open(const char *root, int year) {
+    char path[PATH_MAX] = {0};
+    unsigned char header[TERMS_HEADER_SIZE];
+    unsigned char expect[TERMS_HEADER_SIZE];
+    FILE *fp;
+
+    terms_path(path, root, year, TERMS_FILENAME);
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    terms_header(expect);
+    if (fread(header, sizeof(char), sizeof(header), fp) != sizeof(header)
+        || memcmp(header, expect, sizeof(header)) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+int search_rebuild(const char *root, int year) {
+    char path[PATH_MAX] = {0};
+    struct Posting *postings;
+    size_t count;
+    size_t size;
+    int status;
+    int lock;
+
+    // Keep merges and log appends out until the new index replaces the log
+    terms_path(path, root, year, TERMS_LOCK_FILENAME);
+    if ((lock = file_lock(path, 1, 1)) < 0) {
+        return -1;
+    }
+
+    postings = NULL;
+    count = 0;
+    size = 0;
+    status = 0;
+    for (int week = 0; week <= WEEK_MAX && status == 0; week++) {
+        int compacted = segment_exists(root, year, week);
+        for (int day = 0; day < 7 && status == 0; day++) {
+            struct RecordScanner scanner;
+            struct RecordSpan span;
+            struct RecordView view;
+
+            sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+            if (scanner_open_day(&scanner, path, compacted) < 0) {
+                continue;
+            }
+            while (status == 0 && scanner_next(&scanner, &span) > 0) {
+                if (record_view_from_span(&view, &span) == 0) {
+                    status = search_postings_add(&postings, &count, &size, week, day, &span, &view);
+                }
+            }
+            scanner_close(&scanner);
+        }
+    }
+
+    if (status == 0) {
+        status = terms_write(root, year, postings, count);
+    }
+    if (status == 0) {
+        terms_path(path, root, year, TERMS_LOG_FILENAME);
+        unlink(path);
+        terms_path(path, root, year, TERMS_MERGE_FILENAME);
+        unlink(path);
+    }
+    free(postings);
+    file_unlock(lock);
+    return status;
+}
+
+// Fold the append log into the sorted term index. The log is renamed first
+// so records appended while merging start a new log instead of being lost.
+// Writers hold the lock file shared while appending, so the log cannot grow
+// after the rename. A merge holds it exclusively, and a process finding the
+// lock taken leaves the log alone. A log left behind by a merge that failed
+// is folded in instead of the current one, which waits for the next merge.
+static int search_merge(const char *root, int year) {
+    char path_log[PATH_MAX] = {0};
+    char path_merge[PATH_MAX] = {0};
+    char path_lock[PATH_MAX] = {0};
+    struct Posting *postings;
+    size_t count;
+    size_t size;
+    FILE *fp;
+    int status;
+    int lock;
+
+    terms_path(path_log, root, year, TERMS_LOG_FILENAME);
+    terms_path(path_merge, root, year, TERMS_MERGE_FILENAME);
+    terms_path(path_lock, root, year, TERMS_LOCK_FILENAME);
+    if ((lock = file_lock(path_lock, 1, 0)) < 0) {
+        return -1;
+    }
+    if (access(path_merge, F_OK) < 0 && rename(path_log, path_merge) < 0) {
+        file_unlock(lock);
+        return -1;
+    }
+
+    postings = NULL;
+    count = 0;
+    size = 0;
+    status = 0;
+    if ((fp = terms_open(root, year)) != NULL) {
+        status = postings_read(fp, &postings, &count, &size);
+        fclose(fp);
+    }
+    if (status == 0 && (fp = fopen(path_merge, "rb")) != NULL) {
+        status = postings_read(fp, &postings, &count, &size);
+        fclose(fp);
+    }
+    if (status == 0) {
+        status = terms_write(root, year, postings, count);
+    }
+    if (status == 0) {
+        unlink(path_merge);
+    }
+    free(postings);
+    file_unlock(lock);
+    return status;
+}
+
+int search_index_add(const char *root, int year, const struct Posting *postings, size_t count) {
+    char path[PATH_MAX] = {0};
+    char path_log[PATH_MAX] = {0};
+    unsigned char *raw;
+    FILE *fp;
+    int status;
+    int lock;
+
+    // Without a term index the year may hold records written by older
+    // versions. Index all of them, including the ones just appended.
+    terms_path(path, root, year, TERMS_FILENAME);
+    terms_path(path_log, root, year, TERMS_LOG_FILENAME);
+    if (access(path, F_OK) < 0 && access(path_log, F_OK) < 0) {
+        return search_rebuild(root, year);
+    }
+
+    raw = malloc(count * POSTING_SIZE + 1);
+    if (!raw) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        posting_encode(raw + i * POSTING_SIZE, &postings[i]);
+    }
+
+    // Emit the postings with a single write so concurrent appends don't interleave
+    terms_path(path, root, year, TERMS_LOCK_FILENAME);
+    if ((lock = file_lock(path, 0, 1)) < 0) {
+        free(raw);
+        return -1;
+    }
+    status = -1;
+    fp = fopen(path_log, "ab");
+    if (fp) {
+        setvbuf(fp, NULL, _IONBF, 0);
+        status = fwrite(raw, POSTING_SIZE, count, fp) == count ? 0 : -1;
+        if (fclose(fp) != 0) {
+            status = -1;
+        }
+    }
+    file_unlock(lock);
+    free(raw);
+    return status;
+}
+
+// Collect the postings of one term from the sorted index (binary search),
+// the append log and a log being merged. Returns -1 when the year has no
+// term index.
+static int search_lookup(const char *root, int year, uint64_t hash, struct Posting **postings, size_t *count) {
+    char path[PATH_MAX] = {0};
+    unsigned char raw[POSTING_SIZE];
+    struct Posting posting;
+    size_t size;
+    FILE *fp;
+    FILE *fp_log[2];
+    long lo, hi;
+
+    *postings = NULL;
+    *count = 0;
+    size = 0;
+
+    // Opened in the order a merge moves postings along, so none is missed
+    terms_path(path, root, year, TERMS_LOG_FILENAME);
+    fp_log[0] = fopen(path, "rb");
+    terms_path(path, root, year, TERMS_MERGE_FILENAME);
+    fp_log[1] = fopen(path, "rb");
+    fp = terms_open(root, year);
+    if (!fp && !fp_log[0] && !fp_log[1]) {
+        return -1;
+    }
+
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        lo = 0;
+        hi = (ftell(fp) - TERMS_HEADER_SIZE) / POSTING_SIZE;
+        // Find the first posting with a hash >= the term
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            fseek(fp, TERMS_HEADER_SIZE + mid * POSTING_SIZE, SEEK_SET);
+            if (fread(raw, sizeof(char), sizeof(raw), fp) != sizeof(raw)) {
+                break;
+            }
+            posting_decode(raw, &posting);
+            if (posting.hash < hash) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        fseek(fp, TERMS_HEADER_SIZE + lo * POSTING_SIZE, SEEK_SET);
+        while (fread(raw, sizeof(char), sizeof(raw), fp) == sizeof(raw)) {
+            posting_decode(raw, &posting);
+            if (posting.hash != hash || postings_push(postings, count, &size, &posting) < 0) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (!fp_log[i]) {
+            continue;
+        }
+        while (fread(raw, sizeof(char), sizeof(raw), fp_log[i]) == sizeof(raw)) {
+            posting_decode(raw, &posting);
+            if (posting.hash == hash && postings_push(postings, count, &size, &posting) < 0) {
+                break;
+            }
+        }
+        fclose(fp_log[i]);
+    }
+
+    qsort(*postings, *count, sizeof(**postings), compare_location);
+    return 0;
+}
+
+// Verify every term occurs as a word of the message
+int search_match(const struct Slice *message, const struct Term *terms, size_t nterms) {
+    unsigned char found[SEARCH_TERMS_MAX] = {0};
+    size_t remaining;
+    size_t pos;
+    size_t len;
+    const char *word;
+
+    remaining = nterms;
+    pos = 0;
+    while (remaining && (len = term_next(message->ptr, message->len, &pos, &word)) > 0) {
+        for (size_t i = 0; i < nterms; i++) {
+            if (!found[i] && terms[i].len == len && term_equal(terms[i].ptr, word, len)) {
+                found[i] = 1;
+                remaining--;
+            }
+        }
+    }
+    return remaining == 0;
+}
+
+static void search_show(const struct RecordView *view, const struct Term *terms, size_t nterms,
+                        const struct DumpFilter *filter, struct Writer *out, size_t *matches) {
+    if (search_match(&view->data, terms, nterms) && dump_filter_match(filter, view)) {
+        writer_record(out, view);
+        (*matches)++;
+    }
+}
+
+// Linear scan of every record in a day file (or its block of the week's
+// segment)
+static void search_scan_day(const char *root, int year, int week, int day, int compacted, const struct Term *terms, size_t nterms,
+                            const struct DumpFilter *filter, struct Writer *out, size_t *matches) {
+    char path[PATH_MAX] = {0};
+    struct RecordScanner scanner;
+    struct RecordSpan span;
+    struct RecordView view;
+
+    sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+    if (scanner_open_day(&scanner, path, compacted) < 0) {
+        return;
+    }
+    while (scanner_next(&scanner, &span) > 0) {
+        if (record_view_from_span(&view, &span) == 0) {
+            search_show(&view, terms, nterms, filter, out, matches);
+        }
+    }
+    scanner_close(&scanner);
+}
+
+// Linear scan of every record in a year
+static void search_scan_year(const char *root, int year, const struct Term *terms, size_t nterms,
+                             const struct DumpFilter *filter, struct Writer *out, size_t *matches) {
+    for (int week = 0; week <= WEEK_MAX; week++) {
+        int compacted = segment_exists(root, year, week);
+        for (int day = 0; day < 7; day++) {
+            search_scan_day(root, year, week, day, compacted, terms, nterms, filter, out, matches);
+        }
+    }
+}
+
+// Scan the day files before location "until" (WEEK * 7 + DAY) that the
+// index does not cover, starting at *next
+static void search_scan_uncovered(const char *root, int year, const struct IndexCoverage *coverage, int *next, int until,
+                                  const struct Term *terms, size_t nterms,
+                                  const struct DumpFilter *filter, struct Writer *out, size_t *matches) {
+    for (; *next < until && *next < (WEEK_MAX + 1) * 7; (*next)++) {
+        int week = *next / 7;
+        int day = *next % 7;
+
+        if (coverage->present[week] & ~coverage->covered[week] & (1 << day)) {
+            search_scan_day(root, year, week, day, coverage->compacted[week], terms, nterms, filter, out, matches);
+        }
+    }
+}
+
+// Intersect the postings of every term, then read only the candidate records.
+// Day files the record index does not cover are scanned instead, as their
+// records may be missing from the term index too.
+static int search_indexed_year(const char *root, int year, const struct Term *terms, size_t nterms,
+                               const struct DumpFilter *filter, struct Writer *out, size_t *matches) {
+    char path[PATH_MAX] = {0};
+    char path_log[PATH_MAX] = {0};
+    struct IndexCoverage coverage;
+    struct IndexEntry *entries;
+    struct Posting *result;
+    struct Buffer block;
+    size_t nentries;
+    size_t count;
+    FILE *fp;
+    int week, day;
+    int next;
+    char *buf;
+    size_t bufsz;
+
+    // Merge the append log lazily, once it has grown large enough
+    terms_path(path_log, root, year, TERMS_LOG_FILENAME);
+    if ((fp = fopen(path_log, "rb")) != NULL) {
+        long size;
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+        if (size > SEARCH_MERGE_THRESHOLD) {
+            search_merge(root, year);
+        }
+    }
+
+    if (search_lookup(root, year, terms[0].hash, &result, &count) < 0) {
+        return -1;
+    }
+    for (size_t t = 1; t < nterms && count; t++) {
+        struct Posting *other;
+        size_t nother;
+        size_t i, j, n;
+
+        if (search_lookup(root, year, terms[t].hash, &other, &nother) < 0) {
+            nother = 0;
+        }
+        // Both lists are sorted by location
+        i = j = n = 0;
+        while (i < count && j < nother) {
+            int cmp = compare_location(&result[i], &other[j]);
+            if (cmp < 0) {
+                i++;
+            } else if (cmp > 0) {
+                j++;
+            } else {
+                result[n++] = result[i];
+                i++;
+                j++;
+            }
+        }
+        count = n;
+        free(other);
+    }
+
+    index_load(root, year, &entries, &nentries);
+    if (index_coverage(root, year, 0, WEEK_MAX, entries, nentries, 1, &coverage) < 0) {
+        memset(&coverage, 0, sizeof(coverage));
+    }
+    free(entries);
+
+    next = 0;
+    fp = NULL;
+    week = day = -1;
+    buf = NULL;
+    bufsz = 0;
+    buffer_init(&block);
+    for (size_t i = 0; i < count; i++) {
+        const struct Posting *posting = &result[i];
+        struct RecordScanner scanner;
+        struct RecordSpan span;
+        struct RecordView view;
+        char *record;
+
+        if (i && compare_location(posting, &result[i - 1]) == 0) {
+            continue;
+        }
+        if (posting->week < 0 || posting->week > WEEK_MAX || posting->day < 0 || posting->day > 6
+            || !(coverage.covered[posting->week] & (1 << posting->day))) {
+            continue;
+        }
+        search_scan_uncovered(root, year, &coverage, &next, posting->week * 7 + posting->day,
+                              terms, nterms, filter, out, matches);
+        if (posting->week != week || posting->day != day) {
+            if (fp) {
+                fclose(fp);
+            }
+            week = posting->week;
+            day = posting->day;
+            block.len = 0;
+            sprintf(path, "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+            // A compacted day is read from its week's segment
+            if (!(fp = fopen(path, "rb")) && segment_load(path, &block) <= 0) {
+                continue;
+            }
+        }
+
+        if (!fp) {
+            if (posting->offset + posting->length > block.len) {
+                continue;
+            }
+            record = block.data + posting->offset;
+        } else {
+            if (posting->length + 1 > bufsz) {
+                char *tmp;
+                bufsz = posting->length + 1;
+                if (!(tmp = realloc(buf, bufsz))) {
+                    perror("Unable to allocate record");
+                    break;
+                }
+                buf = tmp;
+            }
+            if (fseek(fp, (long) posting->offset, SEEK_SET) < 0
+                || fread(buf, sizeof(char), posting->length, fp) != posting->length) {
+                continue;
+            }
+            record = buf;
+        }
+
+        scanner_open_memory(&scanner, record, posting->length);
+        if (scanner_next(&scanner, &span) > 0 && span.offset == 0 && record_view_from_span(&view, &span) == 0) {
+            search_show(&view, terms, nterms, filter, out, matches);
+        }
+        scanner_close(&scanner);
+    }
+    search_scan_uncovered(root, year, &coverage, &next, (WEEK_MAX + 1) * 7, terms, nterms, filter, out, matches);
+
+    buffer_free(&block);
+    if (fp) {
+        fclose(fp);
+    }
+    free(buf);
+    free(result);
+    return 0;
+}
+
+// Split a pattern into its distinct words (terms point into the pattern)
+int search_terms(const char *pattern, struct Term *terms, size_t *nterms) {
+    size_t pos;
+    size_t len;
+    const char *word;
+
+    *nterms = 0;
+    pos = 0;
+    while ((len = term_next(pattern, strlen(pattern), &pos, &word)) > 0) {
+        uint64_t hash = term_hash(word, len);
+        size_t i;
+
+        for (i = 0; i < *nterms && terms[i].hash != hash; i++);
+        if (i < *nterms) {
+            continue;
+        }
+        if (*nterms == SEARCH_TERMS_MAX) {
+            fprintf(stderr, "Too many search terms (maximum: %d)\n", SEARCH_TERMS_MAX);
+            return -1;
+        }
+        terms[*nterms].ptr = word;
+        terms[*nterms].len = len;
+        terms[*nterms].hash = hash;
+        (*nterms)++;
+    }
+    if (!*nterms) {
+        fprintf(stderr, "Search pattern contains no words\n");
+        return -1;
+    }
+    return 0;
+}
+
+int search_grep(const char *root, const char *pattern, const struct DumpFilter *filter, int use_index, struct Writer *out) {
+    struct Term terms[SEARCH_TERMS_MAX];
+    int years[DIR_LIST_MAX];
+    size_t nterms;
+    size_t matches;
+    int nyears;
+    int first, last;
+    int week, day;
+
+    if (search_terms(pattern, terms, &nterms) < 0) {
+        return -1;
+    }
+
+    // Journal years, not calendar years: with ISO weeks the last days of
+    // December can be filed under the next year and the first days of
+    // January under the previous one
+    first = 0;
+    last = INT_MAX;
+    if (filter) {
+        if (calendar_locate(filter->since, &first, &week, &day) < 0) {
+            first = 0;
+        }
+        if (calendar_locate(filter->until, &last, &week, &day) < 0) {
+            last = INT_MAX;
+        }
+    }
+
+    nyears = dir_list_numeric(root, years, DIR_LIST_MAX);
+    matches = 0;
+    for (int i = 0; i < nyears; i++) {
+        if (years[i] < first || years[i] > last) {
+            continue;
+        }
+        if (!use_index || search_indexed_year(root, years[i], terms, nterms, filter, out, &matches) < 0) {
+            search_scan_year(root, years[i], terms, nterms, filter, out, &matches);
+        }
+    }
+    return matches ? 0 : 1;
+}
@@ -0,0 +1,521 @@
+#include "weekly.h"
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define SEGMENT_HEADER_SIZE 8
+#define SEGMENT_ENTRY_SIZE 32
+#define SEGMENT_DIRECTORY_SIZE (SEGMENT_HEADER_SIZE + 7 * SEGMENT_ENTRY_SIZE)
+
+static void put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char) ((value >> (i * 8)) & 0xff);
+    }
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// On-disk layout (little endian):
+//   char magic[6], u16 version
+//   7 x {u8 method, u8 reserved[7], u64 offset, u64 stored size, u64 size}
+//   blocks (the contents of day files 0-6)
+static void segment_encode(unsigned char *p, const struct Segment *segment) {
+    memset(p, 0, SEGMENT_DIRECTORY_SIZE);
+    memcpy(p, SEGMENT_MAGIC, 6);
+    p[6] = (unsigned char) (SEGMENT_VERSION & 0xff);
+    p[7] = (unsigned char) (SEGMENT_VERSION >> 8);
+    for (int day = 0; day < 7; day++) {
+        unsigned char *entry = p + SEGMENT_HEADER_SIZE + day * SEGMENT_ENTRY_SIZE;
+        entry[0] = (unsigned char) segment->blocks[day].method;
+        put_u64(entry + 8, segment->blocks[day].offset);
+        put_u64(entry + 16, segment->blocks[day].stored);
+        put_u64(entry + 24, segment->blocks[day].length);
+    }
+}
+
+static int segment_decode(const unsigned char *p, struct Segment *segment) {
+    if (memcmp(p, SEGMENT_MAGIC, 6) != 0 || (p[6] | (p[7] << 8)) != SEGMENT_VERSION) {
+        return -1;
+    }
+    for (int day = 0; day < 7; day++) {
+        const unsigned char *entry = p + SEGMENT_HEADER_SIZE + day * SEGMENT_ENTRY_SIZE;
+        segment->blocks[day].method = entry[0];
+        segment->blocks[day].offset = get_u64(entry + 8);
+        segment->blocks[day].stored = get_u64(entry + 16);
+        segment->blocks[day].length = get_u64(entry + 24);
+    }
+    return 0;
+}
+
+void segment_path(char *path, const char *root, int year, int week) {
+    sprintf(path, "%s%c%d%c%d%s", root, DIRSEP_C, year, DIRSEP_C, week, SEGMENT_SUFFIX);
+}
+
+// Whether a week was compacted. Readers looping over days ask once per week
+// and pass the answer to scanner_open_day().
+int segment_exists(const char *root, int year, int week) {
+    char path[PATH_MAX] = {0};
+
+    segment_path(path, root, year, week);
+    return access(path, F_OK) == 0;
+}
+
+int segment_open(struct Segment *segment, const char *filename) {
+    unsigned char raw[SEGMENT_DIRECTORY_SIZE];
+
+    memset(segment, 0, sizeof(*segment));
+    segment->fp = fopen(filename, "rb");
+    if (!segment->fp) {
+        return -1;
+    }
+    if (fread(raw, sizeof(char), sizeof(raw), segment->fp) != sizeof(raw) || segment_decode(raw, segment) < 0) {
+        fprintf(stderr, "Invalid segment: %s\n", filename);
+        segment_close(segment);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void segment_close(struct Segment *segment) {
+    if (segment->fp) {
+        fclose(segment->fp);
+    }
+    memset(segment, 0, sizeof(*segment));
+}
+
+// Append the contents of one day to the buffer
+int segment_read(struct Segment *segment, int day, struct Buffer *output) {
+    const struct SegmentBlock *block;
+    char *stored;
+
+    block = &segment->blocks[day];
+    if (!block->length) {
+        return 0;
+    }
+    STATS_START(started);
+    STATS_ADD(STAT_BYTES_READ, block->stored);
+    if (buffer_reserve(output, (size_t) block->length) < 0
+        || fseek(segment->fp, (long) block->offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    if (block->method == SEGMENT_STORED) {
+        if (fread(output->data + output->len, sizeof(char), (size_t) block->length, segment->fp) != block->length) {
+            return -1;
+        }
+        output->len += (size_t) block->length;
+        output->data[output->len] = '\0';
+        STATS_STOP(STAT_TIME_READ, started);
+        return 0;
+    }
+
+#if HAVE_ZLIB
+    if (block->method == SEGMENT_DEFLATE) {
+        uLongf length;
+        int status;
+
+        stored = malloc((size_t) block->stored + 1);
+        if (!stored) {
+            perror("Unable to allocate segment block");
+            return -1;
+        }
+        status = -1;
+        length = (uLongf) block->length;
+        if (fread(stored, sizeof(char), (size_t) block->stored, segment->fp) == block->stored
+            && uncompress((Bytef *) output->data + output->len, &length, (const Bytef *) stored, (uLong) block->stored) == Z_OK
+            && length == block->length) {
+            output->len += (size_t) length;
+            output->data[output->len] = '\0';
+            status = 0;
+        }
+        free(stored);
+        STATS_STOP(STAT_TIME_READ, started);
+        return status;
+    }
+#else
+    (void) stored;
+#endif
+    fprintf(stderr, "Unsupported segment compression method: %d\n", block->method);
+    errno = ENOTSUP;
+    return -1;
+}
+
+// Load the contents of a day file (root/YEAR/WEEK/DAY) from its week's
+// segment. Returns 1 when the segment exists, 0 when it does not.
+int segment_load(const char *filename, struct Buffer *output) {
+    char path[PATH_MAX] = {0};
+    struct Segment segment;
+    char *sep;
+    int day;
+    int status;
+
+    // root/YEAR/WEEK/DAY -> root/YEAR/WEEK.seg
+    sep = strrchr(filename, DIRSEP_C);
+    if (!sep || !isdigit_s(sep + 1) || (size_t) (sep - filename) + strlen(SEGMENT_SUFFIX) >= sizeof(path)) {
+        return 0;
+    }
+    day = atoi(sep + 1);
+    if (day < 0 || day > 6) {
+        return 0;
+    }
+    memcpy(path, filename, (size_t) (sep - filename));
+    strcat(path, SEGMENT_SUFFIX);
+
+    if (segment_open(&segment, path) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    status = segment_read(&segment, day, output) < 0 ? -1 : 1;
+    segment_close(&segment);
+    return status;
+}
+
+// Lock the day files of a year. Writers hold the shared lock while they
+// append, so a week is never compacted, restored or repaired (which hold
+// the exclusive lock) under them. Returns the descriptor holding the lock
+// (release it with file_unlock()), or -1.
+int segment_lock(const char *root, int year, int exclusive) {
+    char path[PATH_MAX] = {0};
+
+    sprintf(path, "%s%c%d%c%s", root, DIRSEP_C, year, DIRSEP_C, SEGMENT_LOCK_FILENAME);
+    return file_lock(path, exclusive, 1);
+}
+
+// Prepare a week for appending: take the shared lock of its year and
+// restore the week's day files when it was compacted. Returns the lock,
+// held until the records are written, or -1.
+int segment_lock_week(const char *root, int year, int week) {
+    char path[PATH_MAX] = {0};
+    int lock;
+
+    strcpy(path, root);
+    if (make_path(path) < 0) {
+        return -1;
+    }
+    sprintf(path, "%s%c%d", root, DIRSEP_C, year);
+    if (make_path(path) < 0) {
+        return -1;
+    }
+    for (;;) {
+        if ((lock = segment_lock(root, year, 0)) < 0) {
+            return -1;
+        }
+        segment_path(path, root, year, week);
+        if (access(path, F_OK) < 0) {
+            return lock;
+        }
+        // Restoring the week needs the exclusive lock
+        file_unlock(lock);
+        if (segment_expand(root, year, week) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Fold the day files of one week into YEAR/WEEK.seg. The day files are
+// removed once the segment is in place. Returns 1 when the week was
+// compacted and 0 when there was nothing to do.
+static int segment_compact_week_at(struct PathCache *paths, int year, int week, int compress) {
+    const char *root = paths->root;
+    char path_segment[PATH_MAX] = {0};
+    char path_tmp[PATH_MAX] = {0};
+    unsigned char raw[SEGMENT_DIRECTORY_SIZE];
+    struct Segment segment;
+    struct Buffer block;
+    long sizes[7];
+    uint64_t offset;
+    int status;
+    int count;
+    int lock;
+    FILE *fp;
+
+    segment_path(path_segment, root, year, week);
+    if (access(path_segment, F_OK) == 0) {
+        fprintf(stderr, "Segment already exists: %s\n", path_segment);
+        return -1;
+    }
+    if ((lock = segment_lock(root, year, 1)) < 0) {
+        return -1;
+    }
+    sprintf(path_tmp, "%s.tmp", path_segment);
+    fp = fopen(path_tmp, "wb");
+    if (!fp) {
+        file_unlock(lock);
+        return -1;
+    }
+
+    memset(&segment, 0, sizeof(segment));
+    segment_encode(raw, &segment);
+    fwrite(raw, sizeof(char), sizeof(raw), fp);
+    offset = SEGMENT_DIRECTORY_SIZE;
+
+    buffer_init(&block);
+    status = 0;
+    count = 0;
+    for (int day = 0; day < 7 && status == 0; day++) {
+        const char *data;
+        size_t len;
+        FILE *fpi;
+        int fd;
+
+        sizes[day] = -1;
+        if ((fd = path_cache_open(paths, year, week, day, O_RDONLY | O_BINARY, 0, 0)) < 0) {
+            continue;
+        }
+        if (!(fpi = fdopen(fd, "rb"))) {
+            close(fd);
+            status = -1;
+            break;
+        }
+        block.len = 0;
+        status = buffer_read(&block, fpi);
+        fclose(fpi);
+        sizes[day] = (long) block.len;
+        count++;
+        if (status < 0 || !block.len) {
+            continue;
+        }
+
+        data = block.data;
+        len = block.len;
+        segment.blocks[day].method = SEGMENT_STORED;
+#if HAVE_ZLIB
+        char *packed = NULL;
+        if (compress) {
+            uLongf packed_len = compressBound((uLong) block.len);
+            packed = malloc(packed_len);
+            // Keep the block as is when it does not shrink
+            if (packed && compress2((Bytef *) packed, &packed_len, (const Bytef *) block.data, (uLong) block.len, Z_DEFAULT_COMPRESSION) == Z_OK
+                && packed_len < block.len) {
+                segment.blocks[day].method = SEGMENT_DEFLATE;
+                data = packed;
+                len = packed_len;
+            }
+        }
+#else
+        (void) compress;
+#endif
+        segment.blocks[day].offset = offset;
+        segment.blocks[day].stored = len;
+        segment.blocks[day].length = block.len;
+        if (fwrite(data, sizeof(char), len, fp) != len) {
+            status = -1;
+        }
+        offset += len;
+#if HAVE_ZLIB
+        free(packed);
+#endif
+    }
+    buffer_free(&block);
+
+    segment_encode(raw, &segment);
+    if (status == 0 && (fseek(fp, 0, SEEK_SET) < 0 || fwrite(raw, sizeof(char), sizeof(raw), fp) != sizeof(raw))) {
+        status = -1;
+    }
+    if (fclose(fp) != 0) {
+        status = -1;
+    }
+    if (status < 0 || !count) {
+        unlink(path_tmp);
+        file_unlock(lock);
+        return status;
+    }
+
+    // The lock keeps writers out, but not a file edited by other means.
+    // Leave the week alone when any of its files changed.
+    for (int day = 0; day < 7; day++) {
+        struct stat st;
+        long size;
+
+        size = path_cache_stat(paths, year, week, day, &st) == 0 ? (long) st.st_size : -1;
+        if ((sizes[day] < 0 && size >= 0) || (sizes[day] >= 0 && size != sizes[day])) {
+            fprintf(stderr, "Week %d of %d changed while compacting, skipped\n", week, year);
+            unlink(path_tmp);
+            file_unlock(lock);
+            return 0;
+        }
+    }
+
+    if (rename(path_tmp, path_segment) < 0) {
+        unlink(path_tmp);
+        file_unlock(lock);
+        return -1;
+    }
+    for (int day = 0; day < 7; day++) {
+        if (sizes[day] >= 0) {
+            path_cache_unlink(paths, year, week, day);
+        }
+    }
+    // Other files (if any) keep the week directory in place
+    path_cache_rmdir(paths, year, week);
+    file_unlock(lock);
+    return 1;
+}
+
+int segment_compact_week(const char *root, int year, int week, int compress) {
+    struct PathCache paths;
+    int status;
+
+    path_cache_init(&paths, root);
+    status = segment_compact_week_at(&paths, year, week, compress);
+    path_cache_close(&paths);
+    return status;
+}
+
+// Compact every week before (year, week), limited to one year when "only"
+// is not -1. Returns the number of weeks compacted.
+int segment_compact(const char *root, int only, int year, int week, int compress) {
+    struct PathCache paths;
+    int years[DIR_LIST_MAX];
+    int weeks[DIR_LIST_MAX];
+    int nyears;
+    int compacted;
+    int status;
+
+    nyears = dir_list_numeric(root, years, DIR_LIST_MAX);
+    if (nyears < 0) {
+        return -1;
+    }
+    path_cache_init(&paths, root);
+
+    compacted = 0;
+    status = 0;
+    for (int i = 0; i < nyears; i++) {
+        char path_year[PATH_MAX] = {0};
+        int nweeks;
+
+        if ((only != -1 && years[i] != only) || years[i] > year) {
+            continue;
+        }
+        sprintf(path_year, "%s%c%d", root, DIRSEP_C, years[i]);
+        nweeks = dir_list_numeric(path_year, weeks, DIR_LIST_MAX);
+        for (int j = 0; j < nweeks; j++) {
+            int result;
+
+            // The current week is still being written
+            if (years[i] == year && weeks[j] >= week) {
+                continue;
+            }
+            result = segment_compact_week_at(&paths, years[i], weeks[j], compress);
+            if (result < 0) {
+                fprintf(stderr, "Unable to compact week %d of %d: %s\n", weeks[j], years[i], strerror(errno));
+                status = -1;
+            }
+            compacted += result > 0;
+        }
+    }
+    path_cache_close(&paths);
+    return status < 0 ? -1 : compacted;
+}
+
+// Restore the day files of a compacted week so records can be appended to
+// it. Returns 1 when the week was expanded and 0 when it has no segment.
+// The segment stays in place (and is read instead of the day files) until
+// every day has been restored, so readers always find the week's records.
+int segment_expand(const char *root, int year, int week) {
+    char path_segment[PATH_MAX] = {0};
+    char path_week[PATH_MAX] = {0};
+    struct Segment segment;
+    struct Buffer block;
+    struct Buffer current;
+    int status;
+    int lock;
+
+    segment_path(path_segment, root, year, week);
+    if (access(path_segment, F_OK) < 0) {
+        return 0;
+    }
+    if ((lock = segment_lock(root, year, 1)) < 0) {
+        return -1;
+    }
+    // Another writer may have restored the week meanwhile
+    if (segment_open(&segment, path_segment) < 0) {
+        file_unlock(lock);
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    sprintf(path_week, "%s%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week);
+    if (mkdir(path_week, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create %s (%s)\n", path_week, strerror(errno));
+        segment_close(&segment);
+        file_unlock(lock);
+        return -1;
+    }
+    buffer_init(&block);
+    buffer_init(&current);
+    status = 0;
+    for (int day = 0; day < 7 && status == 0; day++) {
+        char path[PATH_MAX];
+        char path_tmp[PATH_MAX];
+        FILE *fp;
+        FILE *fpi;
+
+        if (!segment.blocks[day].length) {
+            continue;
+        }
+        block.len = 0;
+        if (segment_read(&segment, day, &block) < 0) {
+            status = -1;
+            break;
+        }
+
+        // A day restored by an interrupted expansion (or not yet removed by
+        // an interrupted compaction) starts with the block. Anything else
+        // found in the day file follows the restored records.
+        sprintf(path, "%s%c%d", path_week, DIRSEP_C, day);
+        sprintf(path_tmp, "%s.tmp", path);
+        current.len = 0;
+        if ((fpi = fopen(path, "rb")) != NULL) {
+            status = buffer_read(&current, fpi);
+            fclose(fpi);
+        }
+        if (status < 0) {
+            break;
+        }
+        if (current.len >= block.len && !memcmp(current.data, block.data, block.len)) {
+            continue;
+        }
+        if (current.len && buffer_append(&block, current.data, current.len) < 0) {
+            status = -1;
+            break;
+        }
+        if (!(fp = fopen(path_tmp, "wb"))) {
+            status = -1;
+            break;
+        }
+        if (fwrite(block.data, sizeof(char), block.len, fp) != block.len) {
+            status = -1;
+        }
+        if (fclose(fp) != 0 || status < 0) {
+            unlink(path_tmp);
+            status = -1;
+            break;
+        }
+#if HAVE_WINDOWS
+        unlink(path);
+#endif
+        if (rename(path_tmp, path) < 0) {
+            unlink(path_tmp);
+            status = -1;
+        }
+    }
+    buffer_free(&block);
+    buffer_free(&current);
+    segment_close(&segment);
+
+    // The days restored so far hold the same records as the segment, which
+    // is still read instead of them
+    if (status < 0 || unlink(path_segment) < 0) {
+        fprintf(stderr, "Unable to expand segment: %s\n", path_segment);
+        file_unlock(lock);
+        return -1;
+    }
+    file_unlock(lock);
+    return 1;
+}
@@ -0,0 +1,467 @@
+#include "weekly.h"
+
+// Ask a running server before reading journal files (cleared by --no-serve)
+int serve_client = 1;
+
+#if HAVE_SERVE
+// The identity of a journal file when its week was loaded
+struct ServeStamp {
+    int exists;
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+};
+
+// A parsed week: the contents of its day files and the records in them
+struct ServeWeek {
+    int year;
+    int week;
+    unsigned long used;                 // LRU clock of the last lookup (0: free slot)
+    struct ServeStamp stamps[8];        // day files 0-6 and the week segment
+    struct Buffer days[7];
+    struct RecordView *views;
+    size_t first[8];                    // records of day N are first[N] to first[N + 1] - 1
+};
+
+static struct ServeWeek serve_cache[SERVE_CACHE_WEEKS];
+static unsigned long serve_clock;
+static volatile sig_atomic_t serve_stop;
+
+static int serve_address(const char *root, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(root) + 1 + strlen(SERVE_SOCKET) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    sprintf(addr->sun_path, "%s%c%s", root, DIRSEP_C, SERVE_SOCKET);
+    return 0;
+}
+
+static int serve_connect(const char *root) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (serve_address(root, &addr) < 0) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve_write_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t count = write(fd, data, len);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += count;
+        len -= (size_t) count;
+    }
+    return 0;
+}
+
+static void serve_stamp(const char *path, struct ServeStamp *stamp) {
+    struct stat st;
+
+    memset(stamp, 0, sizeof(*stamp));
+    if (stat(path, &st) < 0) {
+        return;
+    }
+    stamp->exists = 1;
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtime;
+    stamp->inode = st.st_ino;
+}
+
+static void serve_week_free(struct ServeWeek *entry) {
+    for (int day = 0; day < 7; day++) {
+        buffer_free(&entry->days[day]);
+    }
+    free(entry->views);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Read and parse the day files of a week. Days that were compacted are
+// read from the week's segment.
+static int serve_week_load(struct ServeWeek *entry, char paths[8][PATH_MAX]) {
+    size_t count;
+    size_t size;
+
+    count = 0;
+    size = 0;
+    for (int day = 0; day < 7; day++) {
+        struct RecordScanner scanner;
+        struct RecordSpan span;
+
+        entry->first[day] = count;
+        if (!entry->stamps[day].exists && !entry->stamps[7].exists) {
+            continue;
+        }
+        if (scanner_open_day(&scanner, paths[day], !entry->stamps[day].exists) < 0) {
+            continue;
+        }
+        if (scanner_load(&scanner) < 0 || buffer_append(&entry->days[day], scanner.buf, scanner.len) < 0) {
+            scanner_close(&scanner);
+            return -1;
+        }
+        scanner_close(&scanner);
+
+        scanner_open_memory(&scanner, entry->days[day].data, entry->days[day].len);
+        while (scanner_next(&scanner, &span) > 0) {
+            if (count == size) {
+                struct RecordView *views;
+                size = size ? size * 2 : 64;
+                views = realloc(entry->views, size * sizeof(*views));
+                if (!views) {
+                    perror("Unable to allocate records");
+                    scanner_close(&scanner);
+                    return -1;
+                }
+                entry->views = views;
+            }
+            if (record_view_from_span(&entry->views[count], &span) == 0) {
+                count++;
+            }
+        }
+        scanner_close(&scanner);
+    }
+    entry->first[7] = count;
+    return 0;
+}
+
+// Look up a week in the cache. A week is parsed again when any of its
+// files changed since it was loaded.
+static struct ServeWeek *serve_week_get(const char *root, int year, int week) {
+    char paths[8][PATH_MAX];
+    struct ServeStamp stamps[8];
+    struct ServeWeek *entry;
+    int exists;
+
+    for (int day = 0; day < 7; day++) {
+        sprintf(paths[day], "%s%c%d%c%d%c%d", root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+        serve_stamp(paths[day], &stamps[day]);
+    }
+    segment_path(paths[7], root, year, week);
+    serve_stamp(paths[7], &stamps[7]);
+
+    entry = NULL;
+    for (size_t i = 0; i < SERVE_CACHE_WEEKS; i++) {
+        struct ServeWeek *slot = &serve_cache[i];
+        if (slot->used && slot->year == year && slot->week == week) {
+            entry = slot;
+            break;
+        }
+        // Otherwise reuse a free slot or the least recently used week
+        if (!entry || (entry->used && slot->used < entry->used)) {
+            entry = slot;
+        }
+    }
+
+    if (entry->used && entry->year == year && entry->week == week
+        && !memcmp(entry->stamps, stamps, sizeof(stamps))) {
+        entry->used = ++serve_clock;
+        return entry;
+    }
+
+    serve_week_free(entry);
+    // Weeks without files are not worth a slot
+    for (exists = 0; exists < 8 && !stamps[exists].exists; exists++);
+    if (exists == 8) {
+        return NULL;
+    }
+    entry->year = year;
+    entry->week = week;
+    memcpy(entry->stamps, stamps, sizeof(stamps));
+    if (serve_week_load(entry, paths) < 0) {
+        serve_week_free(entry);
+        return NULL;
+    }
+    entry->used = ++serve_clock;
+    return entry;
+}
+
+// Write the records of the days in "mask" (bit N: day N)
+static void serve_week_emit(const struct ServeWeek *entry, int mask, const struct DumpFilter *filter, struct Writer *out) {
+    for (int day = 0; day < 7; day++) {
+        if (!(mask & (1 << day))) {
+            continue;
+        }
+        for (size_t i = entry->first[day]; i < entry->first[day + 1]; i++) {
+            if (dump_filter_match(filter, &entry->views[i])) {
+                writer_record(out, &entry->views[i]);
+            }
+        }
+    }
+}
+
+// Answer a query the way dump_query() would, from the cache
+static int serve_answer(const char *root, const struct DumpQuery *query, struct Writer *out) {
+    char path_year[PATH_MAX];
+    struct ServeWeek *entry;
+
+    if (query->filter) {
+        int current_year = -1;
+        int current_week = -1;
+        int mask = 0;
+
+        // Only the day files covering the range are considered
+        for (time_t t = query->filter->since; t != (time_t) -1 && t <= query->filter->until; t = calendar_next_day(t)) {
+            int year, week, day;
+
+            if (calendar_locate(t, &year, &week, &day) < 0) {
+                break;
+            }
+            if (year != current_year || week != current_week) {
+                if (mask && (entry = serve_week_get(root, current_year, current_week)) != NULL) {
+                    serve_week_emit(entry, mask, query->filter, out);
+                }
+                current_year = year;
+                current_week = week;
+                mask = 0;
+            }
+            mask |= 1 << day;
+        }
+        if (mask && (entry = serve_week_get(root, current_year, current_week)) != NULL) {
+            serve_week_emit(entry, mask, query->filter, out);
+        }
+        return 0;
+    }
+
+    sprintf(path_year, "%s%c%d", root, DIRSEP_C, query->year);
+    if (dir_empty(path_year) <= 0) {
+        return -1;
+    }
+    for (int week = query->week; week <= (query->all ? WEEK_MAX - 1 : query->week); week++) {
+        if ((entry = serve_week_get(root, query->year, week)) != NULL) {
+            serve_week_emit(entry, 0x7f, NULL, out);
+        }
+    }
+    return 0;
+}
+
+// Read one request line and reply with "STATUS LENGTH\n" followed by
+// LENGTH bytes of output
+static void serve_handle(int fd, const char *root) {
+    char line[256];
+    char reply[64];
+    size_t len;
+    struct DumpQuery query;
+    struct DumpFilter filter;
+    struct Writer out;
+    long long since, until;
+    int style, ranged;
+    int status;
+
+    len = 0;
+    while (len < sizeof(line) - 1) {
+        ssize_t count = read(fd, line + len, 1);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (line[len] == '\n') {
+            break;
+        }
+        len++;
+    }
+    line[len] = '\0';
+
+    memset(&query, 0, sizeof(query));
+    if (sscanf(line, SERVE_PROTOCOL " %d %d %d %d %d %lld %lld",
+               &style, &query.year, &query.week, &query.all, &ranged, &since, &until) != 7
+        || style < RECORD_STYLE_SHORT || style > RECORD_STYLE_JSON) {
+        fprintf(stderr, "Invalid request: %s\n", line);
+        return;
+    }
+    if (ranged) {
+        filter.since = (time_t) since;
+        filter.until = (time_t) until;
+        query.filter = &filter;
+    }
+
+    // The output is collected so that its length can lead the reply
+    writer_init(&out, NULL, style);
+    status = serve_answer(root, &query, &out);
+    sprintf(reply, "%d %lu\n", status, (unsigned long) out.buffer.len);
+    if (serve_write_all(fd, reply, strlen(reply)) == 0) {
+        serve_write_all(fd, out.buffer.data, out.buffer.len);
+    }
+    buffer_free(&out.buffer);
+}
+
+static void serve_signal(int sig) {
+    (void) sig;
+    serve_stop = 1;
+}
+
+// Answer dump queries for a journal over a UNIX socket until interrupted
+int serve_run(const char *root) {
+    struct sockaddr_un addr;
+    struct sigaction action;
+    struct timeval timeout;
+    mode_t mask;
+    int fd;
+
+    if (serve_address(root, &addr) < 0) {
+        fprintf(stderr, "Journal root is too long for a socket path: %s\n", root);
+        return -1;
+    }
+    // Refuse to replace a running server, but clean up after one that died
+    if ((fd = serve_connect(root)) >= 0) {
+        close(fd);
+        fprintf(stderr, "A server is already running on %s\n", addr.sun_path);
+        return -1;
+    }
+    unlink(addr.sun_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    // Only the journal's owner may connect
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        umask(mask);
+        fprintf(stderr, "Unable to bind %s: %s\n", addr.sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+    if (listen(fd, 16) < 0) {
+        perror("Unable to listen");
+        close(fd);
+        unlink(addr.sun_path);
+        return -1;
+    }
+
+    // Interrupt accept() on SIGINT and SIGTERM so the socket is removed
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Serving %s on %s\n", root, addr.sun_path);
+    timeout.tv_sec = SERVE_TIMEOUT;
+    timeout.tv_usec = 0;
+    while (!serve_stop) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Unable to accept connection");
+            break;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_handle(client, root);
+        close(client);
+    }
+
+    close(fd);
+    unlink(addr.sun_path);
+    for (size_t i = 0; i < SERVE_CACHE_WEEKS; i++) {
+        serve_week_free(&serve_cache[i]);
+    }
+    return 0;
+}
+
+// Answer a dump query through a running server. Returns SERVE_UNAVAILABLE,
+// before anything is written, when no server answers.
+int serve_dump(const char *root, const struct DumpQuery *query, struct Writer *out) {
+    char request[256];
+    char block[SCANNER_BLOCK_SIZE];
+    size_t len;
+    unsigned long remaining;
+    char *body;
+    ssize_t count;
+    int status;
+    int fd;
+
+    if (!serve_client || (fd = serve_connect(root)) < 0) {
+        return SERVE_UNAVAILABLE;
+    }
+    sprintf(request, SERVE_PROTOCOL " %d %d %d %d %d %lld %lld\n", out->style, query->year, query->week, query->all,
+            query->filter != NULL, query->filter ? (long long) query->filter->since : 0LL,
+            query->filter ? (long long) query->filter->until : 0LL);
+    if (serve_write_all(fd, request, strlen(request)) < 0) {
+        close(fd);
+        return SERVE_UNAVAILABLE;
+    }
+
+    // Read up to the end of the status line
+    len = 0;
+    body = NULL;
+    while (!body && len < sizeof(block) - 1) {
+        count = read(fd, block + len, sizeof(block) - 1 - len);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len += (size_t) count;
+        block[len] = '\0';
+        body = strchr(block, '\n');
+    }
+    if (!body || sscanf(block, "%d %lu", &status, &remaining) != 2) {
+        close(fd);
+        return SERVE_UNAVAILABLE;
+    }
+    body++;
+
+    len -= (size_t) (body - block);
+    for (;;) {
+        if (len > remaining) {
+            len = remaining;
+        }
+        writer_write(out, body, len);
+        remaining -= len;
+        if (!remaining) {
+            break;
+        }
+        count = read(fd, block, sizeof(block));
+        if (count < 0 && errno == EINTR) {
+            len = 0;
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        body = block;
+        len = (size_t) count;
+    }
+    close(fd);
+    if (remaining) {
+        fprintf(stderr, "Lost connection to the server of %s\n", root);
+        return SERVE_FAILED;
+    }
+    return status;
+}
+#else
+int serve_run(const char *root) {
+    (void) root;
+    fprintf(stderr, "--serve is not supported on this platform\n");
+    return -1;
+}
+
+int serve_dump(const char *root, const struct DumpQuery *query, struct Writer *out) {
+    (void) root;
+    (void) query;
+    (void) out;
+    return SERVE_UNAVAILABLE;
+}
+#endif
@@ -0,0 +1,75 @@
+#include "weekly.h"
+
+#if WEEKLY_STATS
+static const char *STAT_NAMES[STAT_MAX] = {
+    "files_opened", "files_missed", "bytes_read", "bytes_written", "records_parsed", "allocations",
+    "directory", "open", "read", "scan", "parse", "output",
+};
+static volatile uint64_t stats[STAT_MAX];
+static uint64_t stats_started;
+static int stats_json;
+
+uint64_t stats_clock(void) {
+#if HAVE_WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t) (count.QuadPart / frequency.QuadPart * 1000000000
+                       + count.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+// Counters are shared by the dump engine's workers
+void stats_add(int counter, uint64_t value) {
+#if HAVE_MSVC
+    InterlockedExchangeAdd64((volatile LONG64 *) &stats[counter], (LONG64) value);
+#else
+    __atomic_fetch_add(&stats[counter], value, __ATOMIC_RELAXED);
+#endif
+}
+
+static void stats_report(void) {
+    double total = (double) (stats_clock() - stats_started) / 1e9;
+
+    if (stats_json) {
+        fprintf(stderr, "{");
+        for (int i = 0; i < STAT_TIME_DIRECTORY; i++) {
+            fprintf(stderr, "\"%s\": %llu, ", STAT_NAMES[i], (unsigned long long) stats[i]);
+        }
+        fprintf(stderr, "\"seconds\": {");
+        for (int i = STAT_TIME_DIRECTORY; i < STAT_MAX; i++) {
+            fprintf(stderr, "\"%s\": %.6f, ", STAT_NAMES[i], (double) stats[i] / 1e9);
+        }
+        fprintf(stderr, "\"total\": %.6f}}\n", total);
+        return;
+    }
+
+    fprintf(stderr, "Statistics:\n");
+    for (int i = 0; i < STAT_TIME_DIRECTORY; i++) {
+        fprintf(stderr, "  %-16s %llu\n", STAT_NAMES[i], (unsigned long long) stats[i]);
+    }
+    // Stage times add up across worker threads and may exceed the total
+    fprintf(stderr, "Time (seconds):\n");
+    for (int i = STAT_TIME_DIRECTORY; i < STAT_MAX; i++) {
+        fprintf(stderr, "  %-16s %.6f\n", STAT_NAMES[i], (double) stats[i] / 1e9);
+    }
+    fprintf(stderr, "  %-16s %.6f\n", "total", total);
+}
+#endif
+
+// Report the counters on stderr when the program exits
+int stats_begin(int json) {
+#if WEEKLY_STATS
+    stats_started = stats_clock();
+    stats_json = json;
+    return atexit(stats_report);
+#else
+    (void) json;
+    fprintf(stderr, "Statistics are unavailable (rebuild with -DWEEKLY_STATS=ON)\n");
+    return -1;
+#endif
+}
@@ -24,9 +24,11 @@ int dir_empty(const char *path) {
     DIR *dir;
     struct dirent *dp;
     size_t i;
+    STATS_START(started);
 
     dir = opendir(path);
     if (!dir) {
+        STATS_STOP(STAT_TIME_DIRECTORY, started);
         return -1;
     }
 
@@ -38,10 +40,166 @@ int dir_empty(const char *path) {
         i++;
     }
     closedir(dir);
+    STATS_STOP(STAT_TIME_DIRECTORY, started);
     return i != 0;
 }
 #endif
 
+int isdigit_s(const char *s) {
+    if (!s || !*s) {
+        return 0;
+    }
+    for (; *s != '\0'; s++) {
+        if (!isdigit((unsigned char) *s)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int compare_int(const void *a, const void *b) {
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+#if HAVE_MSVC
+int dir_list_numeric(const char *path, int *values, size_t max) {
+    HANDLE hd;
+    WIN32_FIND_DATA data;
+    size_t i;
+    char winpath[PATH_MAX] = {0};
+
+    i = 0;
+    sprintf(winpath, "%s%c*.*", path, DIRSEP_C);
+    if ((hd = FindFirstFile(winpath, &data)) == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    do {
+        if (i < max && isdigit_s(data.cFileName)) {
+            values[i++] = (int) strtol(data.cFileName, NULL, 10);
+        }
+    } while (FindNextFile(hd, &data) != 0);
+    FindClose(hd);
+    qsort(values, i, sizeof(*values), compare_int);
+    return (int) i;
+}
+#else
+int dir_list_numeric(const char *path, int *values, size_t max) {
+    DIR *dir;
+    struct dirent *dp;
+    size_t i;
+    STATS_START(started);
+
+    dir = opendir(path);
+    if (!dir) {
+        STATS_STOP(STAT_TIME_DIRECTORY, started);
+        return -1;
+    }
+
+    i = 0;
+    while ((dp = readdir(dir)) != NULL) {
+        if (i < max && isdigit_s(dp->d_name)) {
+            values[i++] = (int) strtol(dp->d_name, NULL, 10);
+        }
+    }
+    closedir(dir);
+    qsort(values, i, sizeof(*values), compare_int);
+    STATS_STOP(STAT_TIME_DIRECTORY, started);
+    return (int) i;
+}
+#endif
+
+static int compare_name(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int names_push(char ***names, size_t *count, size_t *size, const char *name) {
+    if (*count == *size) {
+        char **tmp;
+        *size = *size ? *size * 2 : 64;
+        tmp = realloc(*names, *size * sizeof(**names));
+        if (!tmp) {
+            return -1;
+        }
+        *names = tmp;
+    }
+    if (!((*names)[*count] = malloc(strlen(name) + 1))) {
+        return -1;
+    }
+    strcpy((*names)[*count], name);
+    (*count)++;
+    return 0;
+}
+
+void dir_list_names_free(char **names, size_t count) {
+    for (size_t i = 0; names && i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+#if HAVE_MSVC
+char **dir_list_names(const char *path, size_t *count) {
+    HANDLE hd;
+    WIN32_FIND_DATA data;
+    char winpath[PATH_MAX] = {0};
+    char **names;
+    size_t size;
+
+    names = NULL;
+    size = 0;
+    *count = 0;
+    sprintf(winpath, "%s%c*.*", path, DIRSEP_C);
+    if ((hd = FindFirstFile(winpath, &data)) == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    do {
+        if (data.cFileName[0] != '.' && names_push(&names, count, &size, data.cFileName) < 0) {
+            dir_list_names_free(names, *count);
+            FindClose(hd);
+            return NULL;
+        }
+    } while (FindNextFile(hd, &data) != 0);
+    FindClose(hd);
+    if (!names && !(names = calloc(1, sizeof(*names)))) {
+        return NULL;
+    }
+    qsort(names, *count, sizeof(*names), compare_name);
+    return names;
+}
+#else
+// List the entries of a directory (except hidden ones) in sorted order.
+// Release the result with dir_list_names_free().
+char **dir_list_names(const char *path, size_t *count) {
+    DIR *dir;
+    struct dirent *dp;
+    char **names;
+    size_t size;
+
+    names = NULL;
+    size = 0;
+    *count = 0;
+    dir = opendir(path);
+    if (!dir) {
+        return NULL;
+    }
+    while ((dp = readdir(dir)) != NULL) {
+        if (dp->d_name[0] != '.' && names_push(&names, count, &size, dp->d_name) < 0) {
+            dir_list_names_free(names, *count);
+            closedir(dir);
+            return NULL;
+        }
+    }
+    closedir(dir);
+    if (!names && !(names = calloc(1, sizeof(*names)))) {
+        return NULL;
+    }
+    qsort(names, *count, sizeof(*names), compare_name);
+    return names;
+}
+#endif
+
 char *find_program(const char *name) {
 #if HAVE_WINDOWS
     int found_extension;
@@ -108,6 +266,56 @@ char *find_program(const char *name) {
     return NULL;
 }
 
+int cpu_count(void) {
+#if HAVE_WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+#else
+    long count;
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+#endif
+}
+
+// Name of the account running weekly ("unknown" when it can't be read).
+// Looking it up may query a directory service, so only writers ask.
+void get_username(char *username, size_t size) {
+#if HAVE_WINDOWS
+    DWORD len = (DWORD) size;
+    if (!GetUserName(username, &len)) {
+        perror("Unable to read account information");
+        snprintf(username, size, "unknown");
+    }
+#else
+    struct passwd *user;
+
+    user = getpwuid(getuid());
+    if (user == NULL) {
+        perror("Unable to read account information");
+        snprintf(username, size, "unknown");
+    } else {
+        snprintf(username, size, "%s", user->pw_name);
+    }
+#endif
+}
+
+void get_hostname(char *hostname, size_t size) {
+#if HAVE_WINDOWS
+    DWORD len = (DWORD) size;
+    if (!GetComputerName(hostname, &len)) {
+        perror("Unable to get system host name");
+        snprintf(hostname, size, "unknown");
+    }
+#else
+    memset(hostname, 0, size);
+    if (gethostname(hostname, size - 1) < 0) {
+        perror("Unable to get system host name");
+        snprintf(hostname, size, "unknown");
+    }
+#endif
+}
+
 ssize_t get_file_size(const char *filename) {
     ssize_t result;
     FILE *fp;
@@ -121,6 +329,66 @@ ssize_t get_file_size(const char *filename) {
     return result;
 }
 
+// Read exactly "len" bytes at "offset" without moving the file position.
+// Returns -1 on error, or when the file ends first.
+int file_pread(int fd, char *buf, size_t len, uint64_t offset) {
+    while (len) {
+        ssize_t count;
+
+#if HAVE_WINDOWS
+        if (_lseeki64(fd, (__int64) offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        count = read(fd, buf, (unsigned int) len);
+#else
+        count = pread(fd, buf, len, (off_t) offset);
+#endif
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (count == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buf += count;
+        len -= (size_t) count;
+        offset += (uint64_t) count;
+    }
+    return 0;
+}
+
+// Create a uniquely named file from "path", whose name ends in XXXXXX, and
+// open it for writing. "path" receives the name.
+FILE *file_temp(char *path) {
+    FILE *fp;
+    int fd;
+
+#if HAVE_WINDOWS
+    if (!_mktemp(path)) {
+        return NULL;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+#else
+    // mkstemp() leaves the file readable by its owner alone
+    if ((fd = mkstemp(path)) >= 0 && fchmod(fd, 0644) < 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+#endif
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!(fp = fdopen(fd, "wb"))) {
+        close(fd);
+        unlink(path);
+    }
+    return fp;
+}
+
 char *init_tempfile(const char *basepath, const char *ident, char *data) {
     FILE *fp;
     char *filename;
@@ -148,26 +416,352 @@ char *init_tempfile(const char *basepath, const char *ident, char *data) {
     return filename;
 }
 
+// Create a file holding "data" (e.g. the header of an index) unless it
+// exists. The file appears complete, so concurrent writers creating it at
+// the same time never both append a header.
+int file_create(const char *path, const char *data, size_t len) {
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int status;
+
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+    if (strlen(path) + 32 > sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+#if HAVE_WINDOWS
+    sprintf(tmp, "%s.%lu.tmp", path, (unsigned long) GetCurrentProcessId());
+#else
+    sprintf(tmp, "%s.%lu.tmp", path, (unsigned long) getpid());
+#endif
+    if (!(fp = fopen(tmp, "wb"))) {
+        return -1;
+    }
+    status = fwrite(data, sizeof(char), len, fp) == len ? 0 : -1;
+    if (fclose(fp) != 0) {
+        status = -1;
+    }
+    if (status == 0) {
+#if HAVE_WINDOWS
+        // rename() does not replace an existing file here
+        if (rename(tmp, path) < 0 && access(path, F_OK) < 0) {
+            status = -1;
+        }
+#else
+        // Neither does link()
+        if (link(tmp, path) < 0 && errno != EEXIST) {
+            int fd;
+            // Without hard links (e.g. FAT), fall back to an exclusive create
+            fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd >= 0) {
+                status = write(fd, data, len) == (ssize_t) len ? 0 : -1;
+                if (close(fd) < 0) {
+                    status = -1;
+                }
+            } else if (errno != EEXIST) {
+                status = -1;
+            }
+        }
+#endif
+    }
+    unlink(tmp);
+    return status;
+}
+
+// Lock a file (created when missing) for shared or exclusive use. Returns
+// the descriptor holding the lock, or -1 (EWOULDBLOCK when "wait" is zero
+// and another process holds a conflicting lock). The lock is released by
+// file_unlock(), or when the process exits.
+int file_lock(const char *path, int exclusive, int wait) {
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+#if HAVE_WINDOWS
+    {
+        OVERLAPPED overlapped;
+        DWORD flags;
+
+        memset(&overlapped, 0, sizeof(overlapped));
+        flags = (exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0) | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+        if (!LockFileEx((HANDLE) _get_osfhandle(fd), flags, 0, MAXDWORD, MAXDWORD, &overlapped)) {
+            close(fd);
+            errno = GetLastError() == ERROR_LOCK_VIOLATION ? EWOULDBLOCK : EIO;
+            return -1;
+        }
+    }
+#else
+    while (flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB)) < 0) {
+        if (errno != EINTR) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+    }
+#endif
+    return fd;
+}
+
+void file_unlock(int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Create a directory. An existing directory is not an error.
 int make_path(char *basepath) {
-    return mkdir(basepath, 0755);
+    if (mkdir(basepath, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+void path_cache_init(struct PathCache *cache, const char *root) {
+    cache->root = root;
+    cache->root_fd = -1;
+    cache->year = -1;
+    cache->year_fd = -1;
+    cache->week = -1;
+    cache->week_fd = -1;
+}
+
+#if HAVE_WINDOWS
+// Without openat() the levels are verified once and then addressed by path.
+// A descriptor of 0 marks a verified level.
+static int path_dir(const char *path, int create) {
+    struct stat st;
+
+    if (stat(path, &st) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT || !create) {
+        return -1;
+    }
+    return make_path((char *) path);
+}
+
+static void path_cache_forget(struct PathCache *cache, int year) {
+    if (year) {
+        cache->year_fd = -1;
+    }
+    cache->week_fd = -1;
+}
+
+static void path_cache_name(const struct PathCache *cache, int year, int week, int day, char *path) {
+    if (day < 0) {
+        sprintf(path, "%s%c%d%c%d", cache->root, DIRSEP_C, year, DIRSEP_C, week);
+    } else {
+        sprintf(path, "%s%c%d%c%d%c%d", cache->root, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day);
+    }
+}
+
+int path_cache_dir(struct PathCache *cache, int year, int week, int create) {
+    char path[PATH_MAX];
+
+    if (cache->root_fd < 0) {
+        if (path_dir(cache->root, create) < 0) {
+            return -1;
+        }
+        cache->root_fd = 0;
+    }
+    if (cache->year_fd < 0 || cache->year != year) {
+        path_cache_forget(cache, 1);
+        sprintf(path, "%s%c%d", cache->root, DIRSEP_C, year);
+        if (path_dir(path, create) < 0) {
+            return -1;
+        }
+        cache->year = year;
+        cache->year_fd = 0;
+    }
+    if (cache->week_fd < 0 || cache->week != week) {
+        path_cache_forget(cache, 0);
+        path_cache_name(cache, year, week, -1, path);
+        if (path_dir(path, create) < 0) {
+            return -1;
+        }
+        cache->week = week;
+        cache->week_fd = 0;
+    }
+    return 0;
+}
+
+static int path_cache_open_at(struct PathCache *cache, int year, int week, int day, int flags, int mode) {
+    char path[PATH_MAX];
+
+    path_cache_name(cache, year, week, day, path);
+    return open(path, flags, mode);
 }
 
+int path_cache_stat(struct PathCache *cache, int year, int week, int day, struct stat *st) {
+    char path[PATH_MAX];
+
+    if (path_cache_dir(cache, year, week, 0) < 0) {
+        return -1;
+    }
+    path_cache_name(cache, year, week, day, path);
+    return stat(path, st);
+}
+
+int path_cache_unlink(struct PathCache *cache, int year, int week, int day) {
+    char path[PATH_MAX];
+
+    if (path_cache_dir(cache, year, week, 0) < 0) {
+        return -1;
+    }
+    path_cache_name(cache, year, week, day, path);
+    return unlink(path);
+}
+
+int path_cache_rmdir(struct PathCache *cache, int year, int week) {
+    char path[PATH_MAX];
+
+    path_cache_name(cache, year, week, -1, path);
+    path_cache_forget(cache, 0);
+    return rmdir(path);
+}
+
+void path_cache_close(struct PathCache *cache) {
+    path_cache_init(cache, cache->root);
+}
+#else
+static int path_dir_at(int dirfd, const char *name, int create) {
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create) {
+        if (mkdirat(dirfd, name, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+// Close the week (and year) descriptors, e.g. when a directory was removed
+static void path_cache_forget(struct PathCache *cache, int year) {
+    if (cache->week_fd >= 0) {
+        close(cache->week_fd);
+        cache->week_fd = -1;
+    }
+    if (year && cache->year_fd >= 0) {
+        close(cache->year_fd);
+        cache->year_fd = -1;
+    }
+}
+
+// Resolve ROOT/YEAR/WEEK, creating missing levels when "create" is set.
+// Levels resolved by an earlier call are reused without a lookup.
+int path_cache_dir(struct PathCache *cache, int year, int week, int create) {
+    char name[32];
+
+    STATS_START(started);
+    if (cache->root_fd < 0 && (cache->root_fd = path_dir_at(AT_FDCWD, cache->root, create)) < 0) {
+        STATS_STOP(STAT_TIME_DIRECTORY, started);
+        return -1;
+    }
+    if (cache->year_fd < 0 || cache->year != year) {
+        path_cache_forget(cache, 1);
+        sprintf(name, "%d", year);
+        if ((cache->year_fd = path_dir_at(cache->root_fd, name, create)) < 0) {
+            STATS_STOP(STAT_TIME_DIRECTORY, started);
+            return -1;
+        }
+        cache->year = year;
+    }
+    if (cache->week_fd < 0 || cache->week != week) {
+        path_cache_forget(cache, 0);
+        sprintf(name, "%d", week);
+        if ((cache->week_fd = path_dir_at(cache->year_fd, name, create)) < 0) {
+            STATS_STOP(STAT_TIME_DIRECTORY, started);
+            return -1;
+        }
+        cache->week = week;
+    }
+    STATS_STOP(STAT_TIME_DIRECTORY, started);
+    return 0;
+}
+
+static int path_cache_open_at(struct PathCache *cache, int year, int week, int day, int flags, int mode) {
+    char name[32];
+
+    (void) year;
+    (void) week;
+    sprintf(name, "%d", day);
+    return openat(cache->week_fd, name, flags | O_CLOEXEC, mode);
+}
+
+int path_cache_stat(struct PathCache *cache, int year, int week, int day, struct stat *st) {
+    char name[32];
+
+    if (path_cache_dir(cache, year, week, 0) < 0) {
+        return -1;
+    }
+    sprintf(name, "%d", day);
+    return fstatat(cache->week_fd, name, st, 0);
+}
+
+int path_cache_unlink(struct PathCache *cache, int year, int week, int day) {
+    char name[32];
+
+    if (path_cache_dir(cache, year, week, 0) < 0) {
+        return -1;
+    }
+    sprintf(name, "%d", day);
+    return unlinkat(cache->week_fd, name, 0);
+}
+
+int path_cache_rmdir(struct PathCache *cache, int year, int week) {
+    char name[32];
+
+    if (path_cache_dir(cache, year, week, 0) < 0) {
+        return -1;
+    }
+    path_cache_forget(cache, 0);
+    sprintf(name, "%d", week);
+    return unlinkat(cache->year_fd, name, AT_REMOVEDIR);
+}
+
+void path_cache_close(struct PathCache *cache) {
+    path_cache_forget(cache, 1);
+    if (cache->root_fd >= 0) {
+        close(cache->root_fd);
+    }
+    path_cache_init(cache, cache->root);
+}
+#endif
+
+// Open a day file relative to its (cached) week directory
+int path_cache_open(struct PathCache *cache, int year, int week, int day, int flags, int mode, int create) {
+    int fd;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (path_cache_dir(cache, year, week, create) < 0) {
+            return -1;
+        }
+        fd = path_cache_open_at(cache, year, week, day, flags, mode);
+        if (fd >= 0 || errno != ENOENT) {
+            return fd;
+        }
+        // The directory may have been removed (e.g. by --compact) after it
+        // was resolved
+        path_cache_forget(cache, 1);
+    }
+    return -1;
+}
+
+// Create ROOT/YEAR/WEEK and return the name of a day file in it (or NULL)
 char *make_output_path(char *basepath, char *path, int year, int week, int day_of_week) {
-    strcpy(path, basepath);
-    // Add trailing slash if it's not there
-    if (strlen(basepath) > 0 && strlen(basepath) - 1 != DIRSEP_C) {
-        strcat(path, DIRSEP_S);
-    }
-
-    make_path(path);
-    // year
-    sprintf(path + strlen(path), "%d%c", year, DIRSEP_C);
-    make_path(path);
-    // week of year
-    sprintf(path + strlen(path), "%d%c", week, DIRSEP_C);
-    make_path(path);
-    // day of that week
-    sprintf(path + strlen(path), "%d", day_of_week);
-
-    return path;
-}
\ No newline at end of file
+    struct PathCache cache;
+    int status;
+
+    path_cache_init(&cache, basepath);
+    status = path_cache_dir(&cache, year, week, 1);
+    path_cache_close(&cache);
+    sprintf(path, "%s%c%d%c%d%c%d", basepath, DIRSEP_C, year, DIRSEP_C, week, DIRSEP_C, day_of_week);
+    return status < 0 ? NULL : path;
+}
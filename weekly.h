@@ -5,6 +5,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdint.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #define HAVE_WINDOWS 1
@@ -39,6 +40,7 @@
     #endif
 
     #include <direct.h>
+    #include <fcntl.h>
     #include <windows.h>
     #define DIRSEP_C '\\'
     #define DIRSEP_S "\\"
@@ -52,6 +54,13 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include <pwd.h>
 #include <errno.h>
 #define DIRSEP_C '/'
@@ -59,20 +68,139 @@
 #define PATHSEP_C ':'
 #define PATHSEP_S ":"
 #define PATHVAR "PATH"
+#define O_BINARY 0
+#endif
+
+#if HAVE_WINDOWS
+#define HAVE_PTHREAD 0
+#define HAVE_MMAP 0
+#define HAVE_SERVE 0
+#else
+#define HAVE_PTHREAD 1
+#define HAVE_MMAP 1
+#define HAVE_SERVE 1
+#endif
+
+#if defined(__linux__)
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#define HAVE_INOTIFY 1
+#else
+#define HAVE_INOTIFY 0
+#endif
+
+#if !defined(HAVE_ZLIB)
+#define HAVE_ZLIB 0
+#endif
+
+#if !defined(WEEKLY_STATS)
+#define WEEKLY_STATS 0
 #endif
 
 #if !defined(PATH_MAX)
 #define PATH_MAX 1024
 #endif
 
-#define ARG(X) strcmp(argv[i], X) == 0
-#define ARG_NEXT_EXISTS (argv[i+1] != NULL)
-#define ARG_NEXT argv[i+1]
 #define RECORD_STYLE_SHORT 0
 #define RECORD_STYLE_LONG 1
 #define RECORD_STYLE_CSV 2
 #define RECORD_STYLE_DICT 3
+#define RECORD_STYLE_JSONL 4
+#define RECORD_STYLE_JSON 5
+#define RECORD_STYLE_RECORD 6      // length prefixed record (internal)
+#define DUMP_GROUP_NONE 0
+#define DUMP_GROUP_AUTHOR 1
+#define DUMP_GROUP_HOST 2
+#define RECORD_FORMAT_V1 1
+#define RECORD_FORMAT_V2 2
+#define RECORD_SOH "\x01\x01\x01"
+#define RECORD_SOT "\x02\x02\x02"
+#define RECORD_EOT "\x03\x03\x03"
+#define RECORD_V2_MAGIC "\x01WK2"
+#define RECORD_V2_MAGIC_SIZE 4
+#define RECORD_V2_FRAME_SIZE 12
+#define RECORD_FIELDS_MAX 8
 #define WEEK_MAX 54
+#define SCANNER_BLOCK_SIZE 65536
+#define SCANNER_MMAP_MIN (16 * SCANNER_BLOCK_SIZE)     // smaller files are cheaper to read
+#define DIR_LIST_MAX 4096
+#define WRITER_BUFFER_SIZE (256 * 1024)
+#define INDEX_FILENAME ".index"
+#define INDEX_MAGIC "WKIDX\0"
+#define INDEX_VERSION 1
+#define INDEX_AUTHOR_MAX 32
+#define TERMS_FILENAME ".terms"
+#define TERMS_LOG_FILENAME ".terms.log"
+#define TERMS_MERGE_FILENAME ".terms.log.merge"
+#define TERMS_LOCK_FILENAME ".terms.lock"
+#define TERMS_MAGIC "WKTRM\0"
+#define TERMS_VERSION 1
+#define SEARCH_TERMS_MAX 32
+#define SEARCH_MERGE_THRESHOLD (1024 * 1024)
+#define META_FILENAME ".meta"
+#define META_MAGIC "WKMET\0"
+#define META_VERSION 1
+#define SEGMENT_SUFFIX ".seg"
+#define SEGMENT_MAGIC "WKSEG\0"
+#define SEGMENT_VERSION 1
+#define SEGMENT_STORED 0
+#define SEGMENT_DEFLATE 1
+#define SEGMENT_LOCK_FILENAME ".lock"   // YEAR/.lock: writers (shared) vs. compaction (exclusive)
+#define INGEST_DELIMITER "%%"
+#define INGEST_FORMAT_TEXT 0
+#define INGEST_FORMAT_JSONL 1
+#define INGEST_FIELDS_MAX 16
+#define APPEND_CACHE_SIZE 16
+#define CALENDAR_LEGACY 0           // Sunday to Saturday weeks, cut at New Year
+#define CALENDAR_ISO 1              // ISO 8601 weeks (Monday to Sunday)
+#define CALENDAR_FILENAME ".calendar"
+#define CALENDAR_MARKER "iso8601\n"
+#define MIGRATE_DIRNAME ".migrate"
+#define REPORT_NAMES_MAX 64         // authors (or hosts) counted apart in a report
+#define REPORT_NAME_MAX INDEX_AUTHOR_MAX
+#define SERVE_SOCKET ".weekly.sock"
+#define SERVE_PROTOCOL "WKSRV1"
+#define SERVE_CACHE_WEEKS 128
+#define SERVE_TIMEOUT 10            // seconds a client may stall the server
+#define SERVE_UNAVAILABLE (-2)      // no server is running
+#define SERVE_FAILED (-3)           // the connection was lost during a reply
+#define FOLLOW_INTERVAL 1           // seconds between checks without a change notice
+#define EXPORT_MAGIC "WKCOL\0"
+#define EXPORT_VERSION 1
+#define EXPORT_CHUNK_RECORDS 16384
+#define EXPORT_CHUNK_BYTES (4 * 1024 * 1024)   // messages per chunk (u32 offsets)
+#define EXPORT_DATE 0              // columns
+#define EXPORT_TIME 1
+#define EXPORT_AUTHOR 2
+#define EXPORT_HOST 3
+#define EXPORT_MESSAGE 4
+#define EXPORT_COLUMNS 5
+#define EXPORT_ALL ((1u << EXPORT_COLUMNS) - 1)
+#define STAT_FILES_OPENED 0
+#define STAT_FILES_MISSED 1
+#define STAT_BYTES_READ 2
+#define STAT_BYTES_WRITTEN 3
+#define STAT_RECORDS_PARSED 4
+#define STAT_ALLOCATIONS 5
+#define STAT_TIME_DIRECTORY 6      // timers (nanoseconds)
+#define STAT_TIME_OPEN 7
+#define STAT_TIME_READ 8
+#define STAT_TIME_SCAN 9           // includes the scanner's reads
+#define STAT_TIME_PARSE 10
+#define STAT_TIME_OUTPUT 11
+#define STAT_MAX 12
+
+// Instrumentation compiles to nothing unless built with WEEKLY_STATS
+#if WEEKLY_STATS
+#define STATS_ADD(C, N) stats_add((C), (uint64_t) (N))
+#define STATS_START(V) uint64_t V = stats_clock()
+#define STATS_STOP(C, V) stats_add((C), stats_clock() - (V))
+#else
+#define STATS_ADD(C, N) ((void) 0)
+#define STATS_START(V) ((void) 0)
+#define STATS_STOP(C, V) ((void) 0)
+#endif
 
 struct Record {
     char *date;
@@ -82,24 +210,398 @@ struct Record {
     char *data;
 };
 
+// A borrowed (pointer, length) string. Not NUL terminated.
+struct Slice {
+    const char *ptr;
+    size_t len;
+};
+
+// A "## key: value" header line other than date, time, author and host
+struct RecordField {
+    struct Slice key;
+    struct Slice value;
+};
+
+// Zero-copy record fields referring to a scanner buffer or other storage
+// owned by the caller
+struct RecordView {
+    struct Slice date;
+    struct Slice time;
+    struct Slice user;
+    struct Slice host;
+    struct Slice data;
+    struct RecordField fields[RECORD_FIELDS_MAX];   // other header keys, in order
+    size_t nfields;
+};
+
+// A record located by the scanner. Pointers refer to the scanner's buffer and
+// remain valid until the next call to scanner_next(). Neither string is NUL
+// terminated.
+//
+// Version 1 records are delimited by control codes:
+//   RECORD_SOH header RECORD_SOT "\n" text "\n" RECORD_EOT "\n"
+// Version 2 records are length prefixed (little endian) and binary-safe:
+//   RECORD_V2_MAGIC u32 header_len u32 text_len header text
+struct RecordSpan {
+    char *header;           // "## key: value" lines
+    size_t header_len;
+    char *text;             // message body (NULL without a start of text marker)
+    size_t text_len;
+    long offset;            // file offset of the start of header marker
+    size_t length;          // size of the record including markers
+};
+
+struct RecordScanner {
+    FILE *fp;
+    int owner;              // close fp on scanner_close()
+    int borrowed;           // buf is owned by the caller
+    int eof;
+    char *buf;
+    size_t size;            // allocated bytes in buf
+    size_t len;             // valid bytes in buf
+    size_t pos;             // scan position in buf
+    long base;              // file offset of buf[0]
+    size_t mapped;          // bytes of the file mapped at buf (0: not mapped)
+    char *name;             // file named when damaged records are skipped (NULL: quiet)
+    int repair;             // --fsck: a record may begin mid-line after a torn write
+};
+
+// One record in a year's index (journalroot/YEAR/.index)
+struct IndexEntry {
+    int week;
+    int day;
+    uint64_t offset;        // file offset of the record in YEAR/WEEK/DAY
+    uint32_t length;        // size of the record including markers
+    int64_t timestamp;
+    char author[INDEX_AUTHOR_MAX];
+};
+
+// The day files of one year's weeks compared with its index. Bit DAY of each
+// byte describes journalroot/YEAR/WEEK/DAY.
+struct IndexCoverage {
+    unsigned char present[WEEK_MAX + 1];    // the day holds data
+    unsigned char covered[WEEK_MAX + 1];    // ... and ends where its last indexed record does
+    unsigned char compacted[WEEK_MAX + 1];  // the week is stored in a segment
+};
+
+// The contents of one day file inside a week segment (journalroot/YEAR/WEEK.seg)
+struct SegmentBlock {
+    int method;             // SEGMENT_STORED or SEGMENT_DEFLATE
+    uint64_t offset;        // file offset of the block in the segment
+    uint64_t stored;        // size of the block in the segment
+    uint64_t length;        // size of the day file
+};
+
+struct Segment {
+    FILE *fp;
+    struct SegmentBlock blocks[7];
+};
+
+// A growable output buffer
+struct Buffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+// Buffered record output in one of the RECORD_STYLE_* formats
+struct Writer {
+    FILE *fp;
+    int style;
+    int started;            // at least one record has been written
+    size_t records;
+    struct Buffer buffer;
+};
+
+// Records selected by a dump (inclusive time range)
+struct DumpFilter {
+    time_t since;
+    time_t until;
+};
+
+// The records selected by a dump
+struct DumpQuery {
+    int year;
+    int week;
+    int all;                            // weeks from "week" to the end of the year
+    const char *pattern;                // words to search for (or NULL)
+    const struct DumpFilter *filter;    // date range (or NULL)
+};
+
+// A day file to be rendered by the dump engine
+struct DumpJob {
+    char path[PATH_MAX];
+    const struct DumpFilter *filter;
+    // Render something other than a day file (optional)
+    int (*run)(struct DumpJob *job, int style);
+    const void *context;
+    // Read only these records of the day file (optional, sorted by offset)
+    const struct IndexEntry *entries;
+    size_t nentries;
+    struct Buffer output;
+    int status;
+    int done;
+};
+
+extern int dump_jobs;
+extern int scanner_mmap;
+extern int serve_client;
+
+// One occurrence of a word in a year's term index (journalroot/YEAR/.terms)
+struct Posting {
+    uint64_t hash;          // hash of the lower case word
+    int week;
+    int day;
+    uint32_t length;
+    uint64_t offset;
+};
+
+// Index updates for records appended to one year, written together by
+// index_batch_commit()
+struct IndexBatch {
+    int year;
+    struct IndexEntry *entries;
+    size_t count;
+    size_t size;
+    struct Posting *postings;
+    size_t npostings;
+    size_t psize;
+    struct Buffer meta;         // encoded metadata index entries
+};
+
+// Open directories of one journal, so that each level of ROOT/YEAR/WEEK is
+// looked up (or created) once by bulk writers
+struct PathCache {
+    const char *root;
+    int root_fd;            // -1: not resolved
+    int year;
+    int year_fd;
+    int week;
+    int week_fd;
+};
+
+// Append descriptors kept open across records (least recently used is closed)
+struct AppendCache {
+    struct PathCache paths;
+    struct {
+        int year;
+        int week;
+        int day;
+        int fd;
+        int format;         // RECORD_FORMAT_* used by the file
+        unsigned long used;
+    } entries[APPEND_CACHE_SIZE];
+    struct {
+        int year;
+        int fd;             // shared lock of the year (see segment_lock_week())
+    } locks[APPEND_CACHE_SIZE];
+    unsigned long clock;
+};
+
+// Records selected by metadata fields (--where KEY=VALUE, all must match),
+// optionally totalling a numeric field (--sum) per value of another
+// (--group-by)
+struct MetaQuery {
+    struct RecordField where[RECORD_FIELDS_MAX];
+    size_t nwhere;
+    const char *sum;
+    const char *group;
+};
+
+// A search term taken from a pattern
+struct Term {
+    const char *ptr;
+    size_t len;
+    uint64_t hash;
+};
+
+// A columnar export file (see export.c), read one chunk of records at a
+// time. Only the columns asked for with export_load() are read.
+struct ExportReader {
+    FILE *fp;
+    long next;                          // file offset of the next chunk
+    size_t count;                       // records in the current chunk
+    uint64_t first;                     // YYYYMMDDHHMMSS range of the chunk
+    uint64_t last;
+    long offsets[EXPORT_COLUMNS];
+    uint64_t sizes[EXPORT_COLUMNS];
+    unsigned loaded;                    // columns read (1 << EXPORT_*)
+    struct Buffer columns[EXPORT_COLUMNS];
+};
+
+// A member of a flat JSON object. String values are unescaped in place.
+struct JsonField {
+    struct Slice key;
+    struct Slice value;
+    int is_string;
+};
+
+extern const char *FMT_HEADER;
+extern int record_format;
+extern int calendar_scheme;
+
 int edit_file(const char *filename);
 
+uint64_t stats_clock(void);
+void stats_add(int counter, uint64_t value);
+int stats_begin(int json);
+
 void record_free(struct Record *record);
 struct Record *record_parse(const char *content);
 struct Record *record_read(FILE **fp);
 void record_show(struct Record *record, int style);
-int dump_file(const char *filename, int style);
-int dump_week(const char *root, int year, int week, int style);
+int record_view_parse(struct RecordView *view, const char *header, size_t header_len, const char *text, size_t text_len);
+int record_view_from_span(struct RecordView *view, const struct RecordSpan *span);
+struct Record *record_from_view(const struct RecordView *view);
+time_t record_view_timestamp(const struct RecordView *view);
+void record_view_show(const struct RecordView *view, int style);
+int record_view_format(struct Buffer *buffer, const struct RecordView *view, int style);
+int scanner_open(struct RecordScanner *scanner, const char *filename);
+int scanner_open_day(struct RecordScanner *scanner, const char *filename, int compacted);
+int scanner_open_memory(struct RecordScanner *scanner, char *data, size_t len);
+int scanner_attach(struct RecordScanner *scanner, FILE *fp);
+int scanner_next(struct RecordScanner *scanner, struct RecordSpan *span);
+void scanner_damaged(struct RecordScanner *scanner, size_t start);
+int scanner_load(struct RecordScanner *scanner);
+void scanner_prefetch(struct RecordScanner *scanner);
+void scanner_close(struct RecordScanner *scanner);
+int dump_file(const char *filename, struct Writer *out);
+int dump_filter_match(const struct DumpFilter *filter, const struct RecordView *view);
+int dump_file_buffer(const char *filename, int style, const struct DumpFilter *filter, struct Buffer *output);
+int dump_indexed_buffer(const char *filename, const struct IndexEntry *entries, size_t count, int style, const struct DumpFilter *filter, struct Buffer *output);
+int dump_week(const char *root, int year, int week, struct Writer *out);
+int dump_year(const char *root, int year, int week, struct Writer *out);
+int dump_range(const char *root, const struct DumpFilter *filter, struct Writer *out);
+int dump_query(const char *root, const struct DumpQuery *query, struct Writer *out);
+long dump_aggregate(const char *parent, const struct DumpQuery *query, int group, struct Writer *out);
+
+long calendar_days(int year, int month, int mday);
+void calendar_date(long days, int *year, int *month, int *mday);
+int calendar_locate_days(long days, int *year, int *week, int *day);
+int calendar_locate_tm(const struct tm *tm_, int *year, int *week, int *day);
+int calendar_find(int year, int week, int day, long *days);
+int calendar_week_add(int *year, int *week, int weeks);
+int calendar_parse(const char *s, time_t *result, int end_of_day);
+int calendar_locate(time_t t, int *year, int *week, int *day_of_week);
+time_t calendar_next_day(time_t t);
+int calendar_week_range(int year, int week, time_t *since, time_t *until);
+int calendar_year_range(int year, time_t *since, time_t *until);
+int calendar_detect(const char *root);
+int calendar_mark(const char *root);
+
+int engine_dump(struct DumpJob *jobs, size_t count, int threads, struct Writer *out);
+
+void writer_init(struct Writer *writer, FILE *fp, int style);
+int writer_record(struct Writer *writer, const struct RecordView *view);
+int writer_write(struct Writer *writer, const char *data, size_t len);
+int writer_flush(struct Writer *writer);
+int writer_close(struct Writer *writer);
+
+void buffer_init(struct Buffer *buffer);
+void buffer_free(struct Buffer *buffer);
+int buffer_reserve(struct Buffer *buffer, size_t len);
+int buffer_append(struct Buffer *buffer, const char *data, size_t len);
+int buffer_read(struct Buffer *buffer, FILE *fp);
+int buffer_read_line(struct Buffer *buffer, FILE *fp);
+int buffer_printf(struct Buffer *buffer, const char *fmt, ...);
+int buffer_append_csv(struct Buffer *buffer, const char *data, size_t len, int quote);
+int buffer_append_json(struct Buffer *buffer, const char *data, size_t len);
+
+void index_entry_init(struct IndexEntry *entry, int week, int day, const struct RecordSpan *span, const struct RecordView *view);
+int index_load(const char *root, int year, struct IndexEntry **entries, size_t *count);
+int index_coverage(const char *root, int year, int first, int last, const struct IndexEntry *entries, size_t count, int verify, struct IndexCoverage *coverage);
+int index_append(const char *root, int year, const struct IndexEntry *entries, size_t count);
+int index_rebuild(const char *root, int year);
+int index_rebuild_all(const char *root);
+int index_add_record(const char *root, int year, int week, int day, const char *filename, uint64_t offset);
+void index_batch_init(struct IndexBatch *batch, int year);
+int index_batch_add(struct IndexBatch *batch, int week, int day, const struct RecordSpan *span, const struct RecordView *view);
+int index_batch_commit(const char *root, struct IndexBatch *batch);
+void index_batch_free(struct IndexBatch *batch);
+
+void segment_path(char *path, const char *root, int year, int week);
+int segment_exists(const char *root, int year, int week);
+int segment_open(struct Segment *segment, const char *filename);
+int segment_read(struct Segment *segment, int day, struct Buffer *output);
+void segment_close(struct Segment *segment);
+int segment_load(const char *filename, struct Buffer *output);
+int segment_compact_week(const char *root, int year, int week, int compress);
+int segment_compact(const char *root, int only, int year, int week, int compress);
+int segment_expand(const char *root, int year, int week);
+int segment_lock(const char *root, int year, int exclusive);
+int segment_lock_week(const char *root, int year, int week);
+
+int search_postings_add(struct Posting **postings, size_t *count, size_t *size,
+                        int week, int day, const struct RecordSpan *span, const struct RecordView *view);
+int search_index_add(const char *root, int year, const struct Posting *postings, size_t count);
+int search_rebuild(const char *root, int year);
+int meta_field_valid(const struct RecordField *field);
+int meta_field_parse(struct RecordField *field, const char *assignment);
+int meta_header_add(struct Buffer *header, const struct RecordField *field);
+int meta_encode(struct Buffer *out, int week, int day, const struct RecordSpan *span, const struct RecordView *view);
+int meta_append(const char *root, int year, const char *data, size_t len);
+int meta_write(const char *root, int year, const char *data, size_t len);
+long meta_where(const char *root, const struct MetaQuery *query, const struct DumpFilter *filter, struct Writer *out);
+long meta_sum(const char *root, const struct MetaQuery *query, const struct DumpFilter *filter, struct Writer *out);
+int search_terms(const char *pattern, struct Term *terms, size_t *nterms);
+int search_match(const struct Slice *message, const struct Term *terms, size_t nterms);
+int search_grep(const char *root, const char *pattern, const struct DumpFilter *filter, int use_index, struct Writer *out);
+
+long export_write(const char *root, const char *filename);
+int export_open(struct ExportReader *reader, const char *filename);
+int export_next(struct ExportReader *reader);
+int export_load(struct ExportReader *reader, unsigned columns);
+void export_view(const struct ExportReader *reader, size_t row, struct RecordView *view, char *date, char *time_);
+void export_close(struct ExportReader *reader);
+long export_dump(const char *filename, const struct DumpFilter *filter, const char *pattern, struct Writer *out);
+
+int serve_run(const char *root);
+int follow_run(const char *root, int shared, const char *checkpoint, int style);
+long report_run(const char *root, const struct DumpFilter *filter, int index_only, struct Writer *out);
+int fsck_run(const char *root, int only_year);
+int migrate_run(const char *root);
+int serve_dump(const char *root, const struct DumpQuery *query, struct Writer *out);
 
 char *init_tempfile(const char *basepath, const char *ident, char *data);
 ssize_t get_file_size(const char *filename);
+int file_pread(int fd, char *buf, size_t len, uint64_t offset);
 int append_stdin(const char *filename);
 int append_contents(const char *dest, const char *src);
+int append_record(const char *filename, const char *header, const char *data, size_t data_len, uint64_t *offset);
+int append_record_fd(int fd, const char *header, const char *data, size_t data_len, uint64_t *offset);
+int append_encode(struct Buffer *buffer, int format, const char *header, const char *data, size_t data_len);
+int append_write(int fd, const char *data, size_t len, uint64_t *offset);
+void append_cache_init(struct AppendCache *cache, const char *root);
+int append_cache_open(struct AppendCache *cache, int year, int week, int day, int create, int *format);
+int append_cache_close(struct AppendCache *cache);
+
+int ingest_stream(const char *root, FILE *fp, int format, const char *author, const char *host,
+                  const struct RecordField *fields, size_t nfields, size_t *written);
+
+int json_parse_object(char *data, size_t len, struct JsonField *fields, size_t max, size_t *count);
+const struct JsonField *json_field(const struct JsonField *fields, size_t count, const char *key);
 
 int dir_empty(const char *path);
+int dir_list_numeric(const char *path, int *values, size_t max);
+char **dir_list_names(const char *path, size_t *count);
+void dir_list_names_free(char **names, size_t count);
 char *find_program(const char *name);
+int file_create(const char *path, const char *data, size_t len);
+FILE *file_temp(char *path);
+int file_lock(const char *path, int exclusive, int wait);
+void file_unlock(int fd);
 int make_path(char *basepath);
 char *make_output_path(char *basepath, char *path, int year, int week, int day_of_week);
+void path_cache_init(struct PathCache *cache, const char *root);
+int path_cache_dir(struct PathCache *cache, int year, int week, int create);
+int path_cache_open(struct PathCache *cache, int year, int week, int day, int flags, int mode, int create);
+int path_cache_stat(struct PathCache *cache, int year, int week, int day, struct stat *st);
+int path_cache_unlink(struct PathCache *cache, int year, int week, int day);
+int path_cache_rmdir(struct PathCache *cache, int year, int week);
+void path_cache_close(struct PathCache *cache);
 int isdigit_s(const char *s);
+int cpu_count(void);
+void get_username(char *username, size_t size);
+void get_hostname(char *hostname, size_t size);
 
 #endif // WEEKLY_H
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "weekly.h"
+
+void writer_init(struct Writer *writer, FILE *fp, int style) {
+    writer->fp = fp;
+    writer->style = style;
+    writer->started = 0;
+    writer->records = 0;
+    buffer_init(&writer->buffer);
+}
+
+int writer_flush(struct Writer *writer) {
+    int status;
+
+    // Without a stream the records are collected in the buffer
+    if (!writer->fp) {
+        return 0;
+    }
+
+    STATS_START(started);
+    status = 0;
+    if (writer->buffer.len) {
+        if (fwrite(writer->buffer.data, sizeof(char), writer->buffer.len, writer->fp) != writer->buffer.len) {
+            status = -1;
+        }
+        STATS_ADD(STAT_BYTES_WRITTEN, writer->buffer.len);
+        // Keep the allocation for the next batch of records
+        writer->buffer.len = 0;
+    }
+    if (fflush(writer->fp) != 0) {
+        status = -1;
+    }
+    STATS_STOP(STAT_TIME_OUTPUT, started);
+    return status;
+}
+
+// JSON array records are rendered with a leading separator (",\n{...}").
+// The separator of the first record written becomes the opening bracket.
+static void writer_open_array(struct Writer *writer, size_t start) {
+    if (writer->style == RECORD_STYLE_JSON && !writer->started && writer->buffer.len > start) {
+        writer->buffer.data[start] = '[';
+    }
+    writer->started = 1;
+}
+
+static int writer_spill(struct Writer *writer) {
+    if (writer->buffer.len >= WRITER_BUFFER_SIZE) {
+        return writer_flush(writer);
+    }
+    return 0;
+}
+
+int writer_record(struct Writer *writer, const struct RecordView *view) {
+    size_t start;
+
+    start = writer->buffer.len;
+    if (record_view_format(&writer->buffer, view, writer->style) < 0) {
+        return -1;
+    }
+    writer_open_array(writer, start);
+    writer->records++;
+    return writer_spill(writer);
+}
+
+int writer_write(struct Writer *writer, const char *data, size_t len) {
+    size_t start;
+
+    if (!len) {
+        return 0;
+    }
+    start = writer->buffer.len;
+    if (buffer_append(&writer->buffer, data, len) < 0) {
+        return -1;
+    }
+    writer_open_array(writer, start);
+    return writer_spill(writer);
+}
+
+int writer_close(struct Writer *writer) {
+    int status;
+
+    if (writer->style == RECORD_STYLE_JSON) {
+        if (writer->started) {
+            buffer_append(&writer->buffer, "\n]\n", 3);
+        } else {
+            buffer_append(&writer->buffer, "[]\n", 3);
+        }
+    }
+    status = writer_flush(writer);
+    buffer_free(&writer->buffer);
+    return status;
+}